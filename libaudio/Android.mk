@@ -18,7 +18,11 @@ endif
 
 
 LOCAL_SRC_FILES := \
+    AudioBackend.cpp \
     AudioHardware.cpp \
+    EffectChain.cpp \
+    InputResampler.cpp \
+    SoftPostProc.cpp \
     audio_hw_hal.cpp
 
 LOCAL_SHARED_LIBRARIES := \
@@ -46,6 +50,7 @@ LOCAL_C_INCLUDES += hardware/libhardware/include
 LOCAL_C_INCLUDES += hardware/libhardware_legacy/include
 LOCAL_C_INCLUDES += frameworks/base/include
 LOCAL_C_INCLUDES += system/core/include
+LOCAL_C_INCLUDES += system/media/audio_effects/include
 
 include $(BUILD_SHARED_LIBRARY)
 
@@ -85,3 +90,5 @@ LOCAL_C_INCLUDES := hardware/libhardware_legacy/audio
 
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
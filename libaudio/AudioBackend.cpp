@@ -0,0 +1,95 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define LOG_TAG "AudioBackend"
+#include <utils/Log.h>
+#include <cutils/properties.h>
+
+#include "AudioBackend.h"
+
+namespace android_audio_legacy {
+
+static int kernel_open(const char *path, int flags)
+{
+    return ::open(path, flags);
+}
+
+static int kernel_close(int fd)
+{
+    return ::close(fd);
+}
+
+static int kernel_ioctl(int fd, int request, void *arg)
+{
+    return ::ioctl(fd, request, arg);
+}
+
+static ssize_t kernel_read(int fd, void *buf, size_t count)
+{
+    return ::read(fd, buf, count);
+}
+
+static ssize_t kernel_write(int fd, const void *buf, size_t count)
+{
+    return ::write(fd, buf, count);
+}
+
+static int kernel_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    return ::poll(fds, nfds, timeout);
+}
+
+const audio_backend kernel_audio_backend = {
+    "kernel",
+    kernel_open,
+    kernel_close,
+    kernel_ioctl,
+    kernel_read,
+    kernel_write,
+    kernel_poll,
+    NULL,
+};
+
+const audio_backend *audio_backend_select()
+{
+#ifdef AUDIO_FAKE_BACKEND
+    static const audio_backend *const backends[] = {
+        &kernel_audio_backend,
+        &fake_audio_backend,
+    };
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("audio.hal.backend", value, "fake");
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (!strcmp(value, backends[i]->name)) {
+            if (i)
+                LOGW("using the %s device backend", backends[i]->name);
+            return backends[i];
+        }
+    }
+    LOGE("unknown device backend %s, using the kernel drivers", value);
+#endif
+    return &kernel_audio_backend;
+}
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android_audio_legacy
@@ -0,0 +1,58 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_AUDIO_BACKEND_H
+#define ANDROID_AUDIO_BACKEND_H
+
+#include <poll.h>
+#include <sys/types.h>
+
+#include <utils/String8.h>
+
+namespace android_audio_legacy {
+
+// ----------------------------------------------------------------------------
+// Everything the HAL does to /dev/msm_snd and the msm_pcm devices goes
+// through one of these. "kernel" is the drivers themselves. The test build
+// (AUDIO_FAKE_BACKEND, see test/Android.mk) adds "fake", which emulates them
+// in userspace so the HAL can be run and timed without the DSP; there the
+// audio.hal.backend property picks one when the HAL is loaded.
+//
+
+struct audio_backend {
+    const char *name;
+    int         (*open)(const char *path, int flags);
+    int         (*close)(int fd);
+    int         (*ioctl)(int fd, int request, void *arg);
+    ssize_t     (*read)(int fd, void *buf, size_t count);
+    ssize_t     (*write)(int fd, const void *buf, size_t count);
+    int         (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+    // state for dumpsys, may be NULL
+    void        (*dump)(android::String8 &result);
+};
+
+extern const audio_backend kernel_audio_backend;
+#ifdef AUDIO_FAKE_BACKEND
+extern const audio_backend fake_audio_backend;
+#endif
+
+const audio_backend *audio_backend_select();
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android_audio_legacy
+
+#endif // ANDROID_AUDIO_BACKEND_H
@@ -0,0 +1,77 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_AUDIO_DSP_H
+#define ANDROID_AUDIO_DSP_H
+
+#include <stdint.h>
+
+// ----------------------------------------------------------------------------
+// Q15 building blocks shared by the HAL's PCM loops: capture channel
+// conversion, InputResampler and SoftPostProc. HAVE_ARMV6_SIMD selects the
+// ARMv6 media instructions (SMLAD, QADD16, SSAT, ...) the ARM11 in the
+// MSM7227 has; everything else gets the plain C versions.
+//
+
+#if defined(__ARM_ARCH_6__) || defined(__ARM_ARCH_6J__) || defined(__ARM_ARCH_6K__) || \
+    defined(__ARM_ARCH_6Z__) || defined(__ARM_ARCH_6ZK__) || defined(__ARM_ARCH_7A__)
+#define HAVE_ARMV6_SIMD 1
+#endif
+
+namespace android_audio_legacy {
+
+static inline int16_t clamp16(int32_t sample)
+{
+    if ((sample >> 15) ^ (sample >> 31))
+        sample = 0x7FFF ^ (sample >> 31);
+    return sample;
+}
+
+// Q15 dot product over pairs of taps, with the rounding for the final
+// >> 15 already added. x and c must be 32 bit aligned.
+static inline int32_t dot_q15(const int16_t *x, const int16_t *c, int pairs)
+{
+    int32_t acc = 1 << 14;
+#ifdef HAVE_ARMV6_SIMD
+    const int32_t *xp = (const int32_t *)x;
+    const int32_t *cp = (const int32_t *)c;
+    while (pairs >= 2) {
+        int32_t x0 = xp[0], x1 = xp[1];
+        int32_t c0 = cp[0], c1 = cp[1];
+        asm ("smlad %0, %1, %2, %0\n\t"
+             "smlad %0, %3, %4, %0"
+             : "+r" (acc)
+             : "r" (x0), "r" (c0), "r" (x1), "r" (c1));
+        xp += 2;
+        cp += 2;
+        pairs -= 2;
+    }
+    if (pairs) {
+        int32_t x0 = *xp, c0 = *cp;
+        asm ("smlad %0, %1, %2, %0" : "+r" (acc) : "r" (x0), "r" (c0));
+    }
+#else
+    for (int i = 0; i < 2 * pairs; i++)
+        acc += x[i] * c[i];
+#endif
+    return acc;
+}
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android_audio_legacy
+
+#endif // ANDROID_AUDIO_DSP_H
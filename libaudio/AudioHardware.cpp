@@ -29,15 +29,26 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/utsname.h>
+#include <poll.h>
+#include <sched.h>
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <errno.h>
 
 #include <cutils/properties.h> // for property_get
+#include <cutils/atomic.h>
 
 // hardware specific functions
 
 #include "AudioHardware.h"
+#include "AudioBackend.h"
+#include "AudioDsp.h"
+#include "InputResampler.h"
+#include "SoftPostProc.h"
+#include <audio_effects/effect_aec.h>
+#include <audio_effects/effect_agc.h>
+#include <audio_effects/effect_ns.h>
 //#include <media/AudioRecord.h>
 
 #define LOG_SND_RPC 0  // Set to 1 to log sound RPC's
@@ -48,6 +59,7 @@
 #define FM_OFF_KEY "fm_off"
 #endif
 #define DUALMIC_KEY "dualmic_enabled"
+#define OUTPUT_PROFILE_KEY "output_profile"
 #define TTY_MODE_KEY "tty_mode"
 
 
@@ -60,8 +72,11 @@ const uint32_t AudioHardware::inputSamplingRates[] = {
 };
 
 static int get_audpp_filter(void);
-static int msm72xx_enable_postproc(bool state);
-static int msm72xx_enable_preproc(bool state);
+static int msm72xx_enable_postproc_l(bool state);
+static void postproc_set_playback(bool playing);
+static void postproc_close(void);
+static int msm72xx_enable_preproc(bool state, uint16_t effects);
+static void build_route_table(void);
 
 // Post processing paramters
 static struct rx_iir_filter iir_cfg[3];
@@ -81,20 +96,100 @@ static bool mbadrc_filter_exists[3];
 static int post_proc_feature_mask = 0;
 static bool playback_in_progress = false;
 
+// The post processing control device is kept open across playback sessions.
+// The driver keeps the filter tables we send, so remember which device_id
+// each table was last loaded for and only resend on a change.
+enum {
+    POSTPROC_MBADRC = 0,
+    POSTPROC_ADRC,
+    POSTPROC_EQ,
+    POSTPROC_RX_IIR,
+    POSTPROC_NUM_FILTERS
+};
+// Routing, playback start and the standby thread all get here: postproc_lock
+// covers the control device, this cache, snd_device, post_proc_feature_mask
+// and playback_in_progress.
+static Mutex postproc_lock;
+static int pcm_ctl_fd = -1;
+static int postproc_loaded[POSTPROC_NUM_FILTERS] = { -1, -1, -1, -1 };
+static int postproc_enabled_mask = -1;
+static uint32_t postproc_calls = 0;
+static uint32_t postproc_ioctls = 0;
+static uint32_t postproc_skipped = 0;
+static nsecs_t postproc_total_ns = 0;
+static nsecs_t postproc_max_ns = 0;
+
+// Whatever the DSP does not take, or everything with audio.postproc.cpu set,
+// runs on the CPU from the output write path. Streams rebuild their chains
+// when soft_postproc_generation moves.
+static bool postproc_force_cpu = false;
+static Mutex soft_postproc_lock;
+static int soft_postproc_mask = 0;
+static int soft_postproc_device = 0;
+static volatile int32_t soft_postproc_generation = 0;
+
 //Pre processing parameters
 static struct tx_iir tx_iir_cfg[9];
 static struct ns ns_cfg[9];
 static struct tx_agc tx_agc_cfg[9];
 static int enable_preproc_mask[9];
+// blocks with a table for the rate, whether or not the table enables them
+static uint16_t preproc_tuned[9];
 
 static int snd_device = -1;
 
+// the msm_snd and msm_pcm drivers, or the fake in the test build
+static const audio_backend *backend = &kernel_audio_backend;
+
 #define PCM_OUT_DEVICE "/dev/msm_pcm_out"
 #define PCM_IN_DEVICE "/dev/msm_pcm_in"
 #define PCM_CTL_DEVICE "/dev/msm_pcm_ctl"
 #define PREPROC_CTL_DEVICE "/dev/msm_preproc_ctl"
 #define VOICE_MEMO_DEVICE "/dev/msm_voicememo"
 
+// What the DSP encodes for /dev/msm_voicememo. It hands out 20 ms frames
+// with the rate byte in front, frameBytes is the largest of them; with
+// audio.voicememo.vbr set the encoder may go down to minRate.
+struct voicememo_format {
+    int         format;
+    const char *name;
+    uint32_t    capability;
+    uint32_t    maxRate;
+    uint32_t    minRate;
+    uint32_t    frameFormat;
+    size_t      frameBytes;
+};
+
+static const voicememo_format voicememo_formats[] = {
+    { AudioSystem::AMR_NB, "AMR_NB", RPC_VOC_CAP_AMR, RPC_VOC_AMR_RATE_1220,
+      RPC_VOC_AMR_RATE_475, RPC_VOC_PB_AMR, 32 },
+#ifdef QCOM_HARDWARE
+    { AudioSystem::EVRC, "EVRC", RPC_VOC_CAP_IS127, RPC_VOC_1_RATE,
+      RPC_VOC_8_RATE, RPC_VOC_PB_NATIVE_QCP, 23 },
+    { AudioSystem::QCELP, "QCELP", RPC_VOC_CAP_IS733, RPC_VOC_1_RATE,
+      RPC_VOC_8_RATE, RPC_VOC_PB_NATIVE_QCP, 35 },
+#endif
+};
+
+#define VOICEMEMO_FRAMES_PER_BUFFER 10
+
+static const voicememo_format *voicememo_format_for(int format)
+{
+    for (size_t i = 0; i < sizeof(voicememo_formats) / sizeof(voicememo_formats[0]); i++) {
+        if (voicememo_formats[i].format == format)
+            return &voicememo_formats[i];
+    }
+    return NULL;
+}
+
+#define AUDIO_FILTER_CACHE "/data/misc/audio/AudioFilter.bin"
+#define AUDIO_FILTER_CACHE_MAGIC 0x41464331 // "AFC1"
+#define AUDIO_FILTER_CACHE_VERSION 2
+
+#define SND_ENDPOINT_CACHE "/data/misc/audio/snd_endpoints.bin"
+#define SND_ENDPOINT_CACHE_MAGIC 0x534e4445 // "SNDE"
+#define SND_ENDPOINT_CACHE_VERSION 1
+
 static uint32_t SND_DEVICE_CURRENT=-1;
 static uint32_t SND_DEVICE_HANDSET=-1;
 static uint32_t SND_DEVICE_SPEAKER=-1;
@@ -115,58 +210,558 @@ static uint32_t SND_DEVICE_FM_SPEAKER=-1;
 static uint32_t SND_DEVICE_FM_HEADSET=-1;
 #endif
 static uint32_t SND_DEVICE_NO_MIC_HEADSET=-1;
+
+// Route resolution. doRouting() reduces its inputs to a route key and looks
+// the decision up in route_table, which is built once the endpoints are known
+// by running resolve_route() over every key.
+enum {
+    ROUTE_OUT_HANDSET = 0,
+    ROUTE_OUT_SPEAKER_IN_CALL,
+    ROUTE_OUT_SPEAKER,
+    ROUTE_OUT_HEADPHONE,
+    ROUTE_OUT_HEADSET,
+    ROUTE_OUT_CARKIT,
+    ROUTE_OUT_BT_SCO
+};
+
+enum {
+    ROUTE_IN_NONE = 0,
+    ROUTE_IN_BT_SCO,
+    ROUTE_IN_HEADSET,
+    ROUTE_IN_OTHER
+};
+
+#define ROUTE_KEY_OUT_MASK        0x007
+#define ROUTE_KEY_SPEAKER         0x008
+#define ROUTE_KEY_WIRED_HEADSET   0x010
+#define ROUTE_KEY_IN_SHIFT        5
+#define ROUTE_KEY_IN_MASK         0x060
+#define ROUTE_KEY_IN_CALL         0x080
+#define ROUTE_KEY_TTY_SHIFT       8
+#define ROUTE_KEY_TTY_MASK        0x300
+#define ROUTE_KEY_FM              0x400
+#define ROUTE_KEY_DUALMIC         0x800
+#define ROUTE_KEY_COUNT           0x1000
+
+struct route_entry {
+    int16_t  device;
+    uint16_t mask;
+};
+static route_entry route_table[ROUTE_KEY_COUNT];
+static int route_post_proc_mask = 0;
+static uint32_t route_lookups = 0;
+
+// Last SND_SET_DEVICE sent, so identical requests can be dropped.
+static bool route_rpc_valid = false;
+static uint32_t route_rpc_device = -1;
+static bool route_rpc_ear_mute = false;
+static bool route_rpc_mic_mute = false;
+static uint32_t route_rpcs = 0;
+static uint32_t route_rpcs_skipped = 0;
+
+// Last volume sent per endpoint and method, -1 when unknown.
+#define VOLUME_CACHE_DEVICES 64
+#define VOLUME_CACHE_METHODS 2
+static int volume_cache[VOLUME_CACHE_DEVICES][VOLUME_CACHE_METHODS];
+static uint32_t volume_rpcs = 0;
+static uint32_t volume_rpcs_cached = 0;
+static uint32_t volume_undiscovered = 0;
+static uint32_t volume_deferred = 0;
+
+// Endpoints programmed by setMasterVolume(). TTY endpoints use a fixed level.
+struct master_volume_endpoint {
+    uint32_t *device;
+    int fixed_volume;
+};
+static const master_volume_endpoint master_volume_endpoints[] = {
+    { &SND_DEVICE_HANDSET, -1 },
+    { &SND_DEVICE_SPEAKER, -1 },
+    { &SND_DEVICE_SPEAKER_IN_CALL, -1 },
+    { &SND_DEVICE_BT, -1 },
+    { &SND_DEVICE_HEADSET, -1 },
+    { &SND_DEVICE_HEADSET_STEREO, -1 },
+    { &SND_DEVICE_IN_S_SADC_OUT_HANDSET, -1 },
+    { &SND_DEVICE_IN_S_SADC_OUT_SPEAKER_PHONE, -1 },
+    { &SND_DEVICE_TTY_HEADSET, 1 },
+    { &SND_DEVICE_TTY_VCO, 1 },
+};
+
+// Time spent holding mLock, per entry point.
+struct lock_hold_stats {
+    uint32_t count;
+    nsecs_t total;
+    nsecs_t max;
+};
+static lock_hold_stats lock_hold_routing;
+static lock_hold_stats lock_hold_volume;
+// the modem RPCs themselves, timed on the routing thread
+static lock_hold_stats rpc_time_route;
+static lock_hold_stats rpc_time_volume;
+
+class LockHoldTimer {
+public:
+    LockHoldTimer(lock_hold_stats &stats) : mStats(stats), mStart(systemTime()) {}
+    ~LockHoldTimer() {
+        nsecs_t held = systemTime() - mStart;
+        mStats.count++;
+        mStats.total += held;
+        if (held > mStats.max)
+            mStats.max = held;
+    }
+private:
+    lock_hold_stats &mStats;
+    nsecs_t mStart;
+};
+
+// Hot path probes, off unless audio.hal.probes is set. A disabled probe
+// costs a load and a branch.
+static bool probes_enabled = false;
+static latency_histogram probe_routing;
+static latency_histogram probe_set_parameters;
+static latency_histogram probe_postproc;
+
+static void latency_record(latency_histogram &hist, nsecs_t ns)
+{
+    int32_t us = ns < 0 ? 0 : ns / 1000 > 0x7FFFFFFF ? 0x7FFFFFFF : (int32_t)(ns / 1000);
+    int bucket = us ? 32 - __builtin_clz(us) : 0;
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+    android_atomic_inc(&hist.buckets[bucket]);
+
+    int32_t max = android_atomic_acquire_load(&hist.maxUs);
+    while (us > max && android_atomic_cmpxchg(max, us, &hist.maxUs))
+        max = android_atomic_acquire_load(&hist.maxUs);
+}
+
+class LatencyProbe {
+public:
+    LatencyProbe(latency_histogram &hist, nsecs_t *end = NULL) :
+        mHist(hist), mEnd(end), mStart(probes_enabled ? systemTime() : 0) {}
+    ~LatencyProbe() {
+        if (!mStart)
+            return;
+        nsecs_t now = systemTime();
+        latency_record(mHist, now - mStart);
+        if (mEnd)
+            *mEnd = now;
+    }
+    nsecs_t start() const { return mStart; }
+private:
+    latency_histogram &mHist;
+    nsecs_t *mEnd;
+    nsecs_t mStart;
+};
+
+// Percentiles are the upper bound of the bucket they fall in.
+static void latency_dump(String8 &result, const char *name, const latency_histogram &hist)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    uint32_t counts[LATENCY_BUCKETS];
+    uint32_t total = 0;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        counts[i] = android_atomic_acquire_load(&hist.buckets[i]);
+        total += counts[i];
+    }
+    if (!total)
+        return;
+
+    static const int percents[] = { 50, 90, 99 };
+    uint32_t bounds[3];
+    for (int p = 0; p < 3; p++) {
+        uint32_t want = ((uint64_t)total * percents[p] + 99) / 100, seen = 0;
+        int i = 0;
+        while (i < LATENCY_BUCKETS - 1 && (seen += counts[i]) < want)
+            i++;
+        bounds[p] = i < LATENCY_BUCKETS - 1 ? 1u << i : (uint32_t)hist.maxUs;
+    }
+    snprintf(buffer, SIZE, "\t%s: %u calls, p50 %u us, p90 %u us, p99 %u us, "
+             "max %d us\n", name, total, bounds[0], bounds[1], bounds[2], hist.maxUs);
+    result.append(buffer);
+}
+
+// Output profiles. ICS opens the output without flags, so the profile is
+// picked with the audio.out.profile property when the stream is opened.
+static const struct {
+    const char *name;
+    size_t bufferSize;
+    uint32_t bufferCount;
+} out_profiles[] = {
+    { "default", AUDIO_HW_OUT_BUFFERSIZE, AUDIO_HW_NUM_OUT_BUF },
+    { "low_latency", 1920, AUDIO_HW_NUM_OUT_BUF },
+};
+
+// Timeout for waiting on a PCM driver that returned EAGAIN: the time it
+// takes to play or capture bufferCount driver buffers, plus some slack.
+static int pcm_wait_timeout_ms(size_t bufferSize, int bufferCount,
+                               size_t frameSize, uint32_t sampleRate)
+{
+    if (frameSize == 0 || sampleRate == 0)
+        return 100;
+    return (int)((uint64_t)bufferSize * bufferCount * 1000 / frameSize / sampleRate) + 10;
+}
+
+// Blocks until the driver is ready for events instead of retrying the
+// read or write straight away. *woken is set when poll() reported the fd
+// ready; if the next call still gets EAGAIN the wakeup was spurious (or
+// the driver has no poll support) and we sleep a quarter of the timeout
+// rather than spin.
+static void pcm_wait(int fd, short events, int timeoutMs, bool *woken,
+                     pcm_wait_stats *stats)
+{
+    nsecs_t start = systemTime();
+
+    if (*woken) {
+        stats->spurious++;
+        *woken = false;
+        usleep(timeoutMs * 1000 / 4);
+    } else {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = events;
+        pfd.revents = 0;
+        int ret = backend->poll(&pfd, 1, timeoutMs);
+        if (ret > 0)
+            *woken = true;
+        else if (ret == 0)
+            stats->timeouts++;
+    }
+
+    stats->waits++;
+    stats->blocked += systemTime() - start;
+}
+
+// Channel conversion for capture. Mono to stereo works in place, walking
+// back from the end; stereo to mono may write over its source. ARMv6 does
+// two frames per iteration on 32 bit aligned buffers.
+static void channel_mono_to_stereo(int16_t *buf, size_t frames)
+{
+    size_t i = frames;
+#ifdef HAVE_ARMV6_SIMD
+    if (((uintptr_t)buf & 3) == 0) {
+        uint32_t *out = (uint32_t *)buf;
+        if (i & 1) {
+            i--;
+            buf[2 * i + 1] = buf[2 * i] = buf[i];
+        }
+        while (i) {
+            i -= 2;
+            uint32_t pair = *(uint32_t *)(buf + i);
+            uint32_t first, second;
+            asm ("pkhbt %0, %1, %1, lsl #16" : "=r" (first) : "r" (pair));
+            asm ("pkhtb %0, %1, %1, asr #16" : "=r" (second) : "r" (pair));
+            out[i] = first;
+            out[i + 1] = second;
+        }
+        return;
+    }
+#endif
+    while (i--)
+        buf[2 * i + 1] = buf[2 * i] = buf[i];
+}
+
+static void channel_stereo_to_mono(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i = 0;
+#ifdef HAVE_ARMV6_SIMD
+    if ((((uintptr_t)dst | (uintptr_t)src) & 3) == 0) {
+        const uint32_t *in = (const uint32_t *)src;
+        uint32_t *out = (uint32_t *)dst;
+        for (; i + 2 <= frames; i += 2) {
+            uint32_t a = in[i], b = in[i + 1];
+            uint32_t left, right, mono;
+            asm ("pkhbt %0, %1, %2, lsl #16" : "=r" (left) : "r" (a), "r" (b));
+            asm ("pkhtb %0, %1, %2, asr #16" : "=r" (right) : "r" (b), "r" (a));
+            asm ("shadd16 %0, %1, %2" : "=r" (mono) : "r" (left), "r" (right));
+            out[i / 2] = mono;
+        }
+    }
+#endif
+    for (; i < frames; i++)
+        dst[i] = (src[2 * i] + src[2 * i + 1]) >> 1;
+}
+
+static void pcm_wait_dump(String8 &result, const pcm_wait_stats &stats)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    snprintf(buffer, SIZE, "\tEAGAIN waits: %u, blocked %lld us, "
+             "%u spurious wakeups, %u timeouts\n", stats.waits,
+             stats.blocked / 1000, stats.spurious, stats.timeouts);
+    result.append(buffer);
+}
+
+// Sound endpoint registry. The endpoints reported by SND_GET_ENDPOINT are
+// indexed by a perfect hash on their names: the seed is searched when the
+// registry is built so every name gets its own slot, and a lookup is one
+// hash and one strcmp. Duplicate names fall back to a linear scan.
+#define SND_ENDPOINT_MAX_SLOTS 1024
+#define SND_ENDPOINT_MAX_SEEDS 4096
+
+static const struct {
+    const char *name;
+    uint32_t *id;
+} snd_device_names[] = {
+    { "CURRENT", &SND_DEVICE_CURRENT },
+    { "HANDSET", &SND_DEVICE_HANDSET },
+    { "SPEAKER", &SND_DEVICE_SPEAKER },
+    { "SPEAKER_IN_CALL", &SND_DEVICE_SPEAKER_IN_CALL },
+    { "BT", &SND_DEVICE_BT },
+    { "BT_EC_OFF", &SND_DEVICE_BT_EC_OFF },
+    { "HEADSET", &SND_DEVICE_HEADSET },
+    { "HEADSET_STEREO", &SND_DEVICE_HEADSET_STEREO },
+    { "HEADSET_AND_SPEAKER", &SND_DEVICE_HEADSET_AND_SPEAKER },
+    { "IN_S_SADC_OUT_HANDSET", &SND_DEVICE_IN_S_SADC_OUT_HANDSET },
+    { "IN_S_SADC_OUT_SPEAKER_PHONE", &SND_DEVICE_IN_S_SADC_OUT_SPEAKER_PHONE },
+    { "TTY_HEADSET", &SND_DEVICE_TTY_HEADSET },
+    { "TTY_HCO", &SND_DEVICE_TTY_HCO },
+    { "TTY_VCO", &SND_DEVICE_TTY_VCO },
+    { "CARKIT", &SND_DEVICE_CARKIT },
+#ifdef HAVE_FM_RADIO
+    { "FM_SPEAKER", &SND_DEVICE_FM_SPEAKER },
+    { "FM_HEADSET", &SND_DEVICE_FM_HEADSET },
+#endif
+    { "NO_MIC_HEADSET", &SND_DEVICE_NO_MIC_HEADSET },
+};
+
+static const msm_snd_endpoint *snd_endpoints = NULL;
+static int snd_num_endpoints = 0;
+static int16_t snd_endpoint_slots[SND_ENDPOINT_MAX_SLOTS];
+static uint32_t snd_endpoint_mask = 0;     // slot count - 1, 0 when not hashed
+static uint32_t snd_endpoint_seed = 0;
+static bool snd_endpoints_from_cache = false;
+static nsecs_t snd_endpoints_load_ns = 0;
+
+struct snd_endpoint_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    char     kernel[2 * 65];   // uname release and version
+};
+
+static uint32_t snd_endpoint_hash(const char *name, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash ^ (hash >> 16);
+}
+
+static void snd_endpoint_registry_build(const msm_snd_endpoint *epts, int count)
+{
+    snd_endpoints = epts;
+    snd_num_endpoints = count;
+    snd_endpoint_mask = 0;
+
+    // no seed separates two equal names
+    for (int i = 0; i < count; i++) {
+        for (int j = i + 1; j < count; j++) {
+            if (!strcmp(epts[i].name, epts[j].name)) {
+                LOGW("SND endpoint %s is listed twice, using linear lookup", epts[i].name);
+                return;
+            }
+        }
+    }
+
+    for (uint32_t slots = 16; slots <= SND_ENDPOINT_MAX_SLOTS; slots <<= 1) {
+        if (slots < 2 * (uint32_t)count)
+            continue;
+        for (uint32_t seed = 0; seed < SND_ENDPOINT_MAX_SEEDS; seed++) {
+            bool perfect = true;
+            memset(snd_endpoint_slots, 0xff, slots * sizeof(snd_endpoint_slots[0]));
+            for (int i = 0; i < count && perfect; i++) {
+                uint32_t slot = snd_endpoint_hash(epts[i].name, seed) & (slots - 1);
+                if (snd_endpoint_slots[slot] >= 0)
+                    perfect = false;
+                else
+                    snd_endpoint_slots[slot] = i;
+            }
+            if (perfect) {
+                snd_endpoint_mask = slots - 1;
+                snd_endpoint_seed = seed;
+                return;
+            }
+        }
+    }
+    LOGW("no perfect hash for %d SND endpoints, using linear lookup", count);
+}
+
+// Returns the SND device id for an endpoint name, or -1 if it is not present.
+static uint32_t snd_endpoint_lookup(const char *name)
+{
+    if (snd_endpoint_mask) {
+        int i = snd_endpoint_slots[snd_endpoint_hash(name, snd_endpoint_seed) & snd_endpoint_mask];
+        if (i >= 0 && !strcmp(snd_endpoints[i].name, name))
+            return snd_endpoints[i].id;
+        return -1;
+    }
+    // last match wins, as with the per-endpoint name checks this replaced
+    uint32_t id = -1;
+    for (int i = 0; i < snd_num_endpoints; i++) {
+        if (!strcmp(snd_endpoints[i].name, name))
+            id = snd_endpoints[i].id;
+    }
+    return id;
+}
+
+static void snd_endpoint_cache_key(char *key, size_t size)
+{
+    struct utsname uts;
+    memset(key, 0, size);
+    if (uname(&uts) == 0)
+        snprintf(key, size, "%s %s", uts.release, uts.version);
+}
+
+// Replays the cached endpoint list if it was written by this kernel and
+// the driver still reports the same number of endpoints and the same last
+// endpoint. The kernel key covers the table itself; the two RPCs only catch
+// a driver that was swapped without a kernel rebuild.
+static msm_snd_endpoint *snd_endpoint_cache_load(int sndfd, int *count)
+{
+    snd_endpoint_cache_header hdr;
+    char key[sizeof(hdr.kernel)];
+    msm_snd_endpoint *epts = NULL;
+
+    int fd = open(SND_ENDPOINT_CACHE, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    snd_endpoint_cache_key(key, sizeof(key));
+    if (::read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        hdr.magic != SND_ENDPOINT_CACHE_MAGIC ||
+        hdr.version != SND_ENDPOINT_CACHE_VERSION ||
+        hdr.count == 0 || hdr.count > SND_ENDPOINT_MAX_SLOTS / 2 ||
+        memcmp(hdr.kernel, key, sizeof(key))) {
+        close(fd);
+        return NULL;
+    }
+
+    epts = new msm_snd_endpoint[hdr.count];
+    ssize_t size = hdr.count * sizeof(msm_snd_endpoint);
+    if (::read(fd, epts, size) != size) {
+        close(fd);
+        delete [] epts;
+        return NULL;
+    }
+    close(fd);
+
+    int num = 0;
+    bool match = backend->ioctl(sndfd, SND_GET_NUM_ENDPOINTS, &num) >= 0 &&
+                 num == (int)hdr.count;
+    if (match) {
+        struct msm_snd_endpoint check;
+        uint32_t last = hdr.count - 1;
+        memset(&check, 0, sizeof(check));
+        check.id = last;
+        match = backend->ioctl(sndfd, SND_GET_ENDPOINT, &check) >= 0 &&
+                check.id == epts[last].id &&
+                !strncmp(check.name, epts[last].name, sizeof(check.name));
+    }
+    if (!match) {
+        LOGI("%s does not match the driver, enumerating", SND_ENDPOINT_CACHE);
+        delete [] epts;
+        return NULL;
+    }
+
+    *count = hdr.count;
+    return epts;
+}
+
+static void snd_endpoint_cache_store(const msm_snd_endpoint *epts, int count)
+{
+    static const char *const tmp = SND_ENDPOINT_CACHE ".tmp";
+    snd_endpoint_cache_header hdr;
+    bool ok;
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd < 0) {
+        LOGW("cannot create %s: %s", tmp, strerror(errno));
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SND_ENDPOINT_CACHE_MAGIC;
+    hdr.version = SND_ENDPOINT_CACHE_VERSION;
+    hdr.count = count;
+    snd_endpoint_cache_key(hdr.kernel, sizeof(hdr.kernel));
+    ssize_t size = count * sizeof(msm_snd_endpoint);
+    ok = ::write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) &&
+         ::write(fd, epts, size) == size;
+    if (fsync(fd) < 0)
+        ok = false;
+    close(fd);
+
+    if (!ok || rename(tmp, SND_ENDPOINT_CACHE) < 0) {
+        LOGW("cannot write %s: %s", SND_ENDPOINT_CACHE, strerror(errno));
+        unlink(tmp);
+    }
+}
 // ----------------------------------------------------------------------------
 
 AudioHardware::AudioHardware() :
     mInit(false), mMicMute(true), mBluetoothNrec(true), mBluetoothId(0),
     mOutput(0), mSndEndpoints(NULL), mCurSndDevice(-1),
-    mDualMicEnabled(false), mBuiltinMicSelected(false)
+    mDualMicEnabled(false), mTtyMode(TTY_OFF), mBuiltinMicSelected(false),
+    mMasterVolume(-1), mDeferVolume(false)
 #ifdef HAVE_FM_RADIO
     , mFmRadioEnabled(false), mFmPrev(false)
 #endif
+    , mRoutingSubmitted(0), mRoutingCompleted(0), mRoutingStatus(NO_ERROR),
+    mRoutingBatches(0), mRoutingSuperseded(0)
 {
     if (get_audpp_filter() == 0) {
         audpp_filter_inited = true;
     }
 
-    m7xsnddriverfd = open("/dev/msm_snd", O_RDWR);
+    memset(volume_cache, -1, sizeof(volume_cache));
+    memset(&mRoutingRequest, 0, sizeof(mRoutingRequest));
+    char value[PROPERTY_VALUE_MAX];
+    property_get("audio.volume.defer", value, "0");
+    mDeferVolume = atoi(value) != 0;
+    property_get("audio.postproc.cpu", value, "0");
+    postproc_force_cpu = atoi(value) != 0;
+    property_get("audio.hal.probes", value, "0");
+    probes_enabled = atoi(value) != 0;
+    backend = audio_backend_select();
+
+    m7xsnddriverfd = backend->open("/dev/msm_snd", O_RDWR);
     if (m7xsnddriverfd >= 0) {
-        int rc = ioctl(m7xsnddriverfd, SND_GET_NUM_ENDPOINTS, &mNumSndEndpoints);
-        if (rc >= 0) {
+        nsecs_t start = systemTime();
+        // the cache only describes the real driver
+        if (backend == &kernel_audio_backend)
+            mSndEndpoints = snd_endpoint_cache_load(m7xsnddriverfd, &mNumSndEndpoints);
+        if (mSndEndpoints != NULL) {
+            snd_endpoints_from_cache = true;
+            mInit = true;
+        } else if (backend->ioctl(m7xsnddriverfd, SND_GET_NUM_ENDPOINTS, &mNumSndEndpoints) >= 0) {
             mSndEndpoints = new msm_snd_endpoint[mNumSndEndpoints];
             mInit = true;
-            LOGV("constructed (%d SND endpoints)", rc);
             struct msm_snd_endpoint *ept = mSndEndpoints;
             for (int cnt = 0; cnt < mNumSndEndpoints; cnt++, ept++) {
                 ept->id = cnt;
-                ioctl(m7xsnddriverfd, SND_GET_ENDPOINT, ept);
+                backend->ioctl(m7xsnddriverfd, SND_GET_ENDPOINT, ept);
                 LOGV("cnt = %d ept->name = %s ept->id = %d\n", cnt, ept->name, ept->id);
-#define CHECK_FOR(desc) if (!strcmp(ept->name, #desc)) SND_DEVICE_##desc = ept->id;
-                CHECK_FOR(CURRENT);
-                CHECK_FOR(HANDSET);
-                CHECK_FOR(SPEAKER);
-                CHECK_FOR(SPEAKER_IN_CALL);
-                CHECK_FOR(BT);
-                CHECK_FOR(BT_EC_OFF);
-                CHECK_FOR(HEADSET);
-                CHECK_FOR(HEADSET_STEREO);
-                CHECK_FOR(HEADSET_AND_SPEAKER);
-                CHECK_FOR(IN_S_SADC_OUT_HANDSET);
-                CHECK_FOR(IN_S_SADC_OUT_SPEAKER_PHONE);
-                CHECK_FOR(TTY_HEADSET);
-                CHECK_FOR(TTY_HCO);
-                CHECK_FOR(TTY_VCO);
-                CHECK_FOR(CARKIT);
-#ifdef HAVE_FM_RADIO
-                CHECK_FOR(FM_SPEAKER);
-                CHECK_FOR(FM_HEADSET);
-#endif
-                CHECK_FOR(NO_MIC_HEADSET);
-#undef CHECK_FOR
             }
+            if (backend == &kernel_audio_backend)
+                snd_endpoint_cache_store(mSndEndpoints, mNumSndEndpoints);
         }
         else LOGE("Could not retrieve number of MSM SND endpoints.");
 
+        if (mInit) {
+            snd_endpoint_registry_build(mSndEndpoints, mNumSndEndpoints);
+            for (size_t i = 0; i < sizeof(snd_device_names) / sizeof(snd_device_names[0]); i++) {
+                *snd_device_names[i].id = snd_endpoint_lookup(snd_device_names[i].name);
+            }
+            snd_endpoints_load_ns = systemTime() - start;
+            LOGV("constructed (%d SND endpoints, %s)", mNumSndEndpoints,
+                 snd_endpoints_from_cache ? "cached" : "enumerated");
+        }
+
+        build_route_table();
+
         int AUTO_VOLUME_ENABLED = 1; // setting enabled as default
 
         static const char *const path = "/system/etc/AutoVolumeControl.txt";
@@ -204,8 +799,17 @@ AudioHardware::AudioHardware() :
             close(txtfd);
         }
 
-        ioctl(m7xsnddriverfd, SND_AVC_CTL, &AUTO_VOLUME_ENABLED);
-        ioctl(m7xsnddriverfd, SND_AGC_CTL, &AUTO_VOLUME_ENABLED);
+        backend->ioctl(m7xsnddriverfd, SND_AVC_CTL, &AUTO_VOLUME_ENABLED);
+        backend->ioctl(m7xsnddriverfd, SND_AGC_CTL, &AUTO_VOLUME_ENABLED);
+
+        property_get("audio.routing.async", value, "1");
+        if (atoi(value)) {
+            mRoutingThread = new RoutingThread(this);
+            if (mRoutingThread->run("AudioRouting", android::PRIORITY_AUDIO) != NO_ERROR) {
+                LOGE("cannot start the routing thread, RPCs are sent under mLock");
+                mRoutingThread.clear();
+            }
+        }
     }
 	else LOGE("Could not open MSM SND driver.");
 }
@@ -222,11 +826,23 @@ AudioHardware::~AudioHardware()
         ::dlclose(acoustic);
         acoustic = 0;
     }
+    if (mRoutingThread != 0) {
+        // sends whatever is still queued first
+        mRoutingThread->requestExit();
+        mRoutingLock.lock();
+        mRoutingCond.signal();
+        mRoutingLock.unlock();
+        mRoutingThread->requestExitAndWait();
+        mRoutingThread.clear();
+    }
     if (m7xsnddriverfd > 0)
     {
-      close(m7xsnddriverfd);
+      backend->close(m7xsnddriverfd);
       m7xsnddriverfd = -1;
     }
+    postproc_lock.lock();
+    postproc_close();
+    postproc_lock.unlock();
     for (int index = 0; index < 9; index++) {
         enable_preproc_mask[index] = 0;
     }
@@ -267,6 +883,22 @@ AudioStreamOut* AudioHardware::openOutputStream(
     return mOutput;
 }
 
+status_t AudioHardware::addOutputEffect(AudioStreamOut *out, effect_handle_t effect)
+{
+    Mutex::Autolock lock(mLock);
+    if (mOutput == 0 || mOutput != out)
+        return BAD_VALUE;
+    return mOutput->addAudioEffect(effect);
+}
+
+status_t AudioHardware::removeOutputEffect(AudioStreamOut *out, effect_handle_t effect)
+{
+    Mutex::Autolock lock(mLock);
+    if (mOutput == 0 || mOutput != out)
+        return BAD_VALUE;
+    return mOutput->removeAudioEffect(effect);
+}
+
 void AudioHardware::closeOutputStream(AudioStreamOut* out) {
     Mutex::Autolock lock(mLock);
     if (mOutput == 0 || mOutput != out) {
@@ -287,17 +919,6 @@ AudioStreamIn* AudioHardware::openInputStream(
         return 0;
     }
 
-    if ( (mMode == AudioSystem::MODE_IN_CALL) &&
-         (getInputSampleRate(*sampleRate) > AUDIO_HW_IN_SAMPLERATE) &&
-         (*format == AUDIO_HW_IN_FORMAT) )
-    {
-        LOGE("PCM recording, in a voice call, with sample rate more than 8K not supported \
-                re-configure with 8K and try software re-sampler ");
-        *status = BAD_VALUE;
-        *sampleRate = AUDIO_HW_IN_SAMPLERATE;
-        return 0;
-    }
-
     mLock.lock();
 
     AudioStreamInMSM72xx* in = new AudioStreamInMSM72xx();
@@ -334,10 +955,18 @@ void AudioHardware::closeInputStream(AudioStreamIn* in) {
 status_t AudioHardware::setMode(int mode)
 {
     status_t status = AudioHardwareBase::setMode(mode);
+    if (status == NO_ERROR && mode != AudioSystem::MODE_NORMAL && mOutput)
+        mOutput->closeWarmDriver();
     if (status == NO_ERROR) {
         // make sure that doAudioRouteOrMute() is called by doRouting()
         // even if the new device selected is the same as current one.
+        Mutex::Autolock lock(mLock);
+        LockHoldTimer timer(lock_hold_routing);
         clearCurDevice();
+        routing_request req;
+        memset(&req, 0, sizeof(req));
+        req.pending = ROUTING_INVALIDATE;
+        submitRouting(req);
     }
     return status;
 }
@@ -354,6 +983,7 @@ bool AudioHardware::checkOutputStandby()
 status_t AudioHardware::setMicMute(bool state)
 {
     Mutex::Autolock lock(mLock);
+    LockHoldTimer timer(lock_hold_routing);
     return setMicMute_nosync(state);
 }
 
@@ -375,6 +1005,7 @@ status_t AudioHardware::getMicMute(bool* state)
 
 status_t AudioHardware::setParameters(const String8& keyValuePairs)
 {
+    LatencyProbe probe(probe_set_parameters);
     AudioParameter param = AudioParameter(keyValuePairs);
     String8 value;
     String8 key;
@@ -477,10 +1108,40 @@ String8 AudioHardware::getParameters(const String8& keys)
     return param.toString();
 }
 
-int check_and_set_audpp_parameters(char *buf, int size)
+// Reentrant strtok() replacement that leaves the mapped file untouched:
+// each token is copied, truncated if need be, into the tokenizer and NUL
+// terminated there, so strtol() can neither skip whitespace into the next
+// field or line nor run past the end of the buffer.
+struct csv_tokenizer {
+    const char *pos;
+    const char *end;
+    char        token[32];
+};
+
+static const char *csv_next(csv_tokenizer *tok)
+{
+    while (tok->pos < tok->end && *tok->pos == ',')
+        tok->pos++;
+    if (tok->pos >= tok->end)
+        return NULL;
+
+    size_t len = 0;
+    while (tok->pos < tok->end && *tok->pos != ',') {
+        if (len < sizeof(tok->token) - 1)
+            tok->token[len++] = *tok->pos;
+        tok->pos++;
+    }
+    tok->token[len] = '\0';
+    if (tok->pos < tok->end)
+        tok->pos++;
+    return tok->token;
+}
+
+int check_and_set_audpp_parameters(const char *buf, int size)
 {
-    char *p, *ps;
-    static const char *const seps = ",";
+    const char *p;
+    char *ps;
+    csv_tokenizer tok = { buf, buf + size };
     int table_num;
     int i, j;
     int device_id = 0;
@@ -498,24 +1159,24 @@ int check_and_set_audpp_parameters(char *buf, int size)
         if(buf[1] == '1') device_id=0;
         if(buf[1] == '2') device_id=1;
         if(buf[1] == '3') device_id=2;
-        if (!(p = strtok(buf, ",")))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         /* Table header */
         table_num = strtol(p + 1, &ps, 10);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         /* Table description */
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         for (i = 0; i < 48; i++) {
             iir_cfg[device_id].iir_params[i] = (uint16_t)strtol(p, &ps, 16);
-            if (!(p = strtok(NULL, seps)))
+            if (!(p = csv_next(&tok)))
                 goto token_err;
         }
         rx_iir_flag[device_id] = (uint16_t)strtol(p, &ps, 16);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         iir_cfg[device_id].num_bands = (uint16_t)strtol(p, &ps, 16);
 
@@ -525,52 +1186,52 @@ int check_and_set_audpp_parameters(char *buf, int size)
         if(buf[1] == '2') device_id=1;
         if(buf[1] == '3') device_id=2;
         adrc_filter_exists[device_id] = true;
-        if (!(p = strtok(buf, ",")))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         /* Table header */
         table_num = strtol(p + 1, &ps, 10);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         /* Table description */
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         adrc_flag[device_id] = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         adrc_cfg[device_id].adrc_params[0] = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         adrc_cfg[device_id].adrc_params[1] = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         adrc_cfg[device_id].adrc_params[2] = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         adrc_cfg[device_id].adrc_params[3] = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         adrc_cfg[device_id].adrc_params[4] = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         adrc_cfg[device_id].adrc_params[5] = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         adrc_cfg[device_id].adrc_params[6] = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         adrc_cfg[device_id].adrc_params[7] = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
     } else if (buf[0] == 'C' && ((buf[1] == '1') || (buf[1] == '2') || (buf[1] == '3'))) {
@@ -578,19 +1239,19 @@ int check_and_set_audpp_parameters(char *buf, int size)
         if(buf[1] == '1') device_id=0;
         if(buf[1] == '2') device_id=1;
         if(buf[1] == '3') device_id=2;
-        if (!(p = strtok(buf, ",")))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         /* Table header */
         table_num = strtol(p + 1, &ps, 10);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         /* Table description */
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         eq_flag[device_id] = (uint16_t)strtol(p, &ps, 16);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         LOGI("EQ flag = %02x.", eq_flag[device_id]);
 
@@ -600,26 +1261,26 @@ int check_and_set_audpp_parameters(char *buf, int size)
             return -1;
         }
         eq_cal = (void *(*) (int32_t, int32_t, int32_t, uint16_t, int32_t, int32_t *, int32_t *, uint16_t *))::dlsym(audioeq, "audioeq_calccoefs");
-        memset(&eqalizer[device_id], 0, sizeof(eqalizer));
+        memset(&eqalizer[device_id], 0, sizeof(eqalizer[device_id]));
         /* Temp add the bands here */
         eqalizer[device_id].bands = 8;
         for (i = 0; i < eqalizer[device_id].bands; i++) {
 
             eq[i].gain = (uint16_t)strtol(p, &ps, 16);
 
-            if (!(p = strtok(NULL, seps)))
+            if (!(p = csv_next(&tok)))
                 goto token_err;
             eq[i].freq = (uint16_t)strtol(p, &ps, 16);
 
-            if (!(p = strtok(NULL, seps)))
+            if (!(p = csv_next(&tok)))
                 goto token_err;
             eq[i].type = (uint16_t)strtol(p, &ps, 16);
 
-            if (!(p = strtok(NULL, seps)))
+            if (!(p = csv_next(&tok)))
                 goto token_err;
             eq[i].qf = (uint16_t)strtol(p, &ps, 16);
 
-            if (!(p = strtok(NULL, seps)))
+            if (!(p = csv_next(&tok)))
                 goto token_err;
 
             eq_cal(eq[i].gain, eq[i].freq, 48000, eq[i].type, eq[i].qf, (int32_t*)numerator, (int32_t *)denominator, shift);
@@ -639,57 +1300,57 @@ int check_and_set_audpp_parameters(char *buf, int size)
         if(buf[1] == '2') device_id=1;
         if(buf[1] == '3') device_id=2;
         mbadrc_filter_exists[device_id] = true;
-        if (!(p = strtok(buf, ",")))
+        if (!(p = csv_next(&tok)))
             goto token_err;
           /* Table header */
         table_num = strtol(p + 1, &ps, 10);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         /* Table description */
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         mbadrc_cfg[device_id].num_bands = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         mbadrc_cfg[device_id].down_samp_level = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         mbadrc_cfg[device_id].adrc_delay = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         mbadrc_cfg[device_id].ext_buf_size = (uint16_t)strtol(p, &ps, 16);
         int ext_buf_count = mbadrc_cfg[device_id].ext_buf_size / 2;
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         mbadrc_cfg[device_id].ext_partition = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         mbadrc_cfg[device_id].ext_buf_msw = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         mbadrc_cfg[device_id].ext_buf_lsw = (uint16_t)strtol(p, &ps, 16);
 
         for(i = 0;i < mbadrc_cfg[device_id].num_bands; i++) {
             for(j = 0; j < 10; j++) {
-                if (!(p = strtok(NULL, seps)))
+                if (!(p = csv_next(&tok)))
                     goto token_err;
                 mbadrc_cfg[device_id].adrc_band[i].adrc_band_params[j] = (uint16_t)strtol(p, &ps, 16);
             }
         }
 
         for(i = 0;i < mbadrc_cfg[device_id].ext_buf_size/2; i++) {
-            if (!(p = strtok(NULL, seps)))
+            if (!(p = csv_next(&tok)))
                 goto token_err;
             mbadrc_cfg[device_id].ext_buf.buff[i] = (uint16_t)strtol(p, &ps, 16);
         }
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         mbadrc_flag[device_id] = (uint16_t)strtol(p, &ps, 16);
@@ -731,130 +1392,133 @@ int check_and_set_audpp_parameters(char *buf, int size)
 
         if (buf[0] == 'E')  {
         /* TX_IIR filter */
-        if (!(p = strtok(buf, ","))){
+        if (!(p = csv_next(&tok))){
             goto token_err;}
 
         /* Table header */
         table_num = strtol(p + 1, &ps, 10);
-        if (!(p = strtok(NULL, seps))){
+        if (!(p = csv_next(&tok))){
             goto token_err;}
         /* Table description */
-        if (!(p = strtok(NULL, seps))){
+        if (!(p = csv_next(&tok))){
             goto token_err;}
 
         for (i = 0; i < 48; i++) {
             j = (i >= 40)? i : ((i % 2)? (i - 1) : (i + 1));
             tx_iir_cfg[samp_index].iir_params[j] = (uint16_t)strtol(p, &ps, 16);
-            if (!(p = strtok(NULL, seps))){
+            if (!(p = csv_next(&tok))){
                 goto token_err;}
         }
 
         tx_iir_cfg[samp_index].active_flag = (uint16_t)strtol(p, &ps, 16);
-        if (!(p = strtok(NULL, seps))){
+        if (!(p = csv_next(&tok))){
             goto token_err;}
 
         txiir_flag[device_id] = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         tx_iir_cfg[samp_index].num_bands = (uint16_t)strtol(p, &ps, 16);
 
         tx_iir_cfg[samp_index].cmd_id = 0;
 
         LOGV("TX IIR flag = %02x.", txiir_flag[device_id]);
+        preproc_tuned[samp_index] |= TX_IIR_ENABLE;
         if (txiir_flag[device_id] != 0)
              enable_preproc_mask[samp_index] |= TX_IIR_ENABLE;
         } else if(buf[0] == 'F')  {
         /* AGC filter */
-        if (!(p = strtok(buf, ",")))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         /* Table header */
         table_num = strtol(p + 1, &ps, 10);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         /* Table description */
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         tx_agc_cfg[samp_index].cmd_id = (uint16_t)strtol(p, &ps, 16);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         tx_agc_cfg[samp_index].tx_agc_param_mask = (uint16_t)strtol(p, &ps, 16);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         tx_agc_cfg[samp_index].tx_agc_enable_flag = (uint16_t)strtol(p, &ps, 16);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         tx_agc_cfg[samp_index].static_gain = (uint16_t)strtol(p, &ps, 16);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         tx_agc_cfg[samp_index].adaptive_gain_flag = (uint16_t)strtol(p, &ps, 16);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         for (i = 0; i < 19; i++) {
             tx_agc_cfg[samp_index].agc_params[i] = (uint16_t)strtol(p, &ps, 16);
-            if (!(p = strtok(NULL, seps)))
+            if (!(p = csv_next(&tok)))
                 goto token_err;
             }
 
         agc_flag[device_id] = (uint16_t)strtol(p, &ps, 16);
         LOGV("AGC flag = %02x.", agc_flag[device_id]);
+        preproc_tuned[samp_index] |= AGC_ENABLE;
         if (agc_flag[device_id] != 0)
             enable_preproc_mask[samp_index] |= AGC_ENABLE;
         } else if ((buf[0] == 'G')) {
         /* This is the NS record we are looking for.  Tokenize it */
-        if (!(p = strtok(buf, ",")))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         /* Table header */
         table_num = strtol(p + 1, &ps, 10);
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
 
         /* Table description */
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         ns_cfg[samp_index].cmd_id = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         ns_cfg[samp_index].ec_mode_new = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         ns_cfg[samp_index].dens_gamma_n = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         ns_cfg[samp_index].dens_nfe_block_size = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         ns_cfg[samp_index].dens_limit_ns = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         ns_cfg[samp_index].dens_limit_ns_d = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         ns_cfg[samp_index].wb_gamma_e = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         ns_cfg[samp_index].wb_gamma_n = (uint16_t)strtol(p, &ps, 16);
 
-        if (!(p = strtok(NULL, seps)))
+        if (!(p = csv_next(&tok)))
             goto token_err;
         ns_flag[device_id] = (uint16_t)strtol(p, &ps, 16);
 
         LOGV("NS flag = %02x.", ns_flag[device_id]);
+        preproc_tuned[samp_index] |= NS_ENABLE;
         if (ns_flag[device_id] != 0)
             enable_preproc_mask[samp_index] |= NS_ENABLE;
         }
@@ -866,12 +1530,146 @@ token_err:
     return -EINVAL;
 }
 
+// Filter tables compiled from AudioFilter.csv. The blob holds these arrays
+// back to back and is only used when the CSV mtime, size and hash match.
+static const struct {
+    void *data;
+    size_t size;
+} audpp_cache_sections[] = {
+    { iir_cfg, sizeof(iir_cfg) },
+    { adrc_cfg, sizeof(adrc_cfg) },
+    { mbadrc_cfg, sizeof(mbadrc_cfg) },
+    { eqalizer, sizeof(eqalizer) },
+    { adrc_flag, sizeof(adrc_flag) },
+    { mbadrc_flag, sizeof(mbadrc_flag) },
+    { eq_flag, sizeof(eq_flag) },
+    { rx_iir_flag, sizeof(rx_iir_flag) },
+    { agc_flag, sizeof(agc_flag) },
+    { ns_flag, sizeof(ns_flag) },
+    { txiir_flag, sizeof(txiir_flag) },
+    { adrc_filter_exists, sizeof(adrc_filter_exists) },
+    { mbadrc_filter_exists, sizeof(mbadrc_filter_exists) },
+    { tx_iir_cfg, sizeof(tx_iir_cfg) },
+    { ns_cfg, sizeof(ns_cfg) },
+    { tx_agc_cfg, sizeof(tx_agc_cfg) },
+    { enable_preproc_mask, sizeof(enable_preproc_mask) },
+    { preproc_tuned, sizeof(preproc_tuned) },
+};
+
+struct audpp_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t payload_size;
+    uint32_t csv_size;
+    int64_t  csv_mtime;
+    uint32_t csv_hash;
+    uint32_t reserved;
+};
+
+static nsecs_t audpp_filter_load_ns = 0;
+static bool audpp_filter_from_cache = false;
+
+static size_t audpp_cache_payload_size(void)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < sizeof(audpp_cache_sections) / sizeof(audpp_cache_sections[0]); i++)
+        size += audpp_cache_sections[i].size;
+    return size;
+}
+
+// FNV-1a
+static uint32_t audpp_csv_hash(const char *data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int audpp_cache_load(const struct stat *csv_st, uint32_t csv_hash)
+{
+    struct stat st;
+    int fd = open(AUDIO_FILTER_CACHE, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    size_t payload = audpp_cache_payload_size();
+    if (fstat(fd, &st) < 0 ||
+        (size_t)st.st_size != sizeof(audpp_cache_header) + payload) {
+        close(fd);
+        return -1;
+    }
+
+    const uint8_t *blob = (const uint8_t *) mmap(0, st.st_size, PROT_READ,
+                                                 MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (blob == MAP_FAILED)
+        return -1;
+
+    const audpp_cache_header *hdr = (const audpp_cache_header *)blob;
+    int rc = -1;
+    if (hdr->magic == AUDIO_FILTER_CACHE_MAGIC &&
+        hdr->version == AUDIO_FILTER_CACHE_VERSION &&
+        hdr->payload_size == payload &&
+        hdr->csv_size == (uint32_t)csv_st->st_size &&
+        hdr->csv_mtime == (int64_t)csv_st->st_mtime &&
+        hdr->csv_hash == csv_hash) {
+        const uint8_t *src = blob + sizeof(*hdr);
+        for (size_t i = 0; i < sizeof(audpp_cache_sections) / sizeof(audpp_cache_sections[0]); i++) {
+            memcpy(audpp_cache_sections[i].data, src, audpp_cache_sections[i].size);
+            src += audpp_cache_sections[i].size;
+        }
+        rc = 0;
+    } else {
+        LOGI("%s is stale, reparsing filters", AUDIO_FILTER_CACHE);
+    }
+    munmap((void *)blob, st.st_size);
+    return rc;
+}
+
+static void audpp_cache_store(const struct stat *csv_st, uint32_t csv_hash)
+{
+    static const char *const tmp = AUDIO_FILTER_CACHE ".tmp";
+    audpp_cache_header hdr;
+    bool ok;
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd < 0) {
+        LOGW("cannot create %s: %s", tmp, strerror(errno));
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = AUDIO_FILTER_CACHE_MAGIC;
+    hdr.version = AUDIO_FILTER_CACHE_VERSION;
+    hdr.payload_size = audpp_cache_payload_size();
+    hdr.csv_size = csv_st->st_size;
+    hdr.csv_mtime = csv_st->st_mtime;
+    hdr.csv_hash = csv_hash;
+    ok = ::write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr);
+    for (size_t i = 0; ok && i < sizeof(audpp_cache_sections) / sizeof(audpp_cache_sections[0]); i++) {
+        ok = ::write(fd, audpp_cache_sections[i].data, audpp_cache_sections[i].size) ==
+             (ssize_t)audpp_cache_sections[i].size;
+    }
+    if (fsync(fd) < 0)
+        ok = false;
+    close(fd);
+
+    if (!ok || rename(tmp, AUDIO_FILTER_CACHE) < 0) {
+        LOGW("cannot write %s: %s", AUDIO_FILTER_CACHE, strerror(errno));
+        unlink(tmp);
+    }
+}
+
 static int get_audpp_filter(void)
 {
     struct stat st;
-    char *read_buf;
-    char *next_str, *current_str;
+    const char *read_buf;
+    const char *current_str, *next_str, *end;
     int csvfd;
+    nsecs_t start = systemTime();
 
     LOGI("get_audpp_filter");
     static const char *const path =
@@ -891,8 +1689,8 @@ static int get_audpp_filter(void)
         return -1;
     }
 
-    read_buf = (char *) mmap(0, st.st_size,
-                    PROT_READ | PROT_WRITE,
+    read_buf = (const char *) mmap(0, st.st_size,
+                    PROT_READ,
                     MAP_PRIVATE,
                     csvfd, 0);
 
@@ -903,33 +1701,119 @@ static int get_audpp_filter(void)
         return -1;
     }
 
-    current_str = read_buf;
+    uint32_t hash = audpp_csv_hash(read_buf, st.st_size);
+    if (audpp_cache_load(&st, hash) == 0) {
+        audpp_filter_from_cache = true;
+    } else {
+        current_str = read_buf;
+        end = read_buf + st.st_size;
 
-    while (*current_str != (char)EOF)  {
-        int len;
-        next_str = strchr(current_str, '\n');
-        if (!next_str)
-           break;
-        len = next_str - current_str;
-        *next_str++ = '\0';
-        if (check_and_set_audpp_parameters(current_str, len)) {
-            LOGI("failed to set audpp parameters, exiting.");
-            munmap(read_buf, st.st_size);
-            close(csvfd);
-            return -1;
+        while (current_str < end) {
+            next_str = (const char *)memchr(current_str, '\n', end - current_str);
+            if (!next_str)
+               break;
+            if (check_and_set_audpp_parameters(current_str, next_str - current_str)) {
+                LOGI("failed to set audpp parameters, exiting.");
+                munmap((void *)read_buf, st.st_size);
+                close(csvfd);
+                return -1;
+            }
+            current_str = next_str + 1;
         }
-        current_str = next_str;
+        audpp_cache_store(&st, hash);
     }
 
-    munmap(read_buf, st.st_size);
+    munmap((void *)read_buf, st.st_size);
     close(csvfd);
+    audpp_filter_load_ns = systemTime() - start;
+    LOGI("audio filters %s in %lld us", audpp_filter_from_cache ? "loaded from cache" : "parsed",
+         audpp_filter_load_ns / 1000);
     return 0;
 }
 
-static int msm72xx_enable_postproc(bool state)
+static void postproc_invalidate(void)
 {
-    int fd;
+    for (int i = 0; i < POSTPROC_NUM_FILTERS; i++) {
+        postproc_loaded[i] = -1;
+    }
+    postproc_enabled_mask = -1;
+}
+
+static void postproc_close(void)
+{
+    if (pcm_ctl_fd >= 0) {
+        backend->close(pcm_ctl_fd);
+        pcm_ctl_fd = -1;
+    }
+    postproc_invalidate();
+}
+
+// Sends a filter table unless the one for device_id is already loaded.
+// Returns false if the DSP does not have the table.
+static bool postproc_load(int filter, int device_id, int request, void *cfg,
+                          const char *name)
+{
+    if (postproc_loaded[filter] == device_id) {
+        postproc_skipped++;
+        return true;
+    }
+    if (pcm_ctl_fd < 0)
+        return false;
+    postproc_ioctls++;
+    if (backend->ioctl(pcm_ctl_fd, request, cfg) < 0) {
+        LOGE("set %s filter error.", name);
+        postproc_loaded[filter] = -1;
+        return false;
+    }
+    postproc_loaded[filter] = device_id;
+    return true;
+}
+
+static void soft_postproc_publish(int mask, int device_id)
+{
+    Mutex::Autolock _l(soft_postproc_lock);
+    if (mask == soft_postproc_mask && (!mask || device_id == soft_postproc_device))
+        return;
+    if (mask)
+        LOGI("post processing 0x%04x for device_id %d runs on the CPU", mask, device_id);
+    soft_postproc_mask = mask;
+    soft_postproc_device = device_id;
+    android_atomic_inc(&soft_postproc_generation);
+}
+
+static int postproc_set_mask(int mask)
+{
+    if (mask == postproc_enabled_mask) {
+        postproc_skipped++;
+        return 0;
+    }
+    postproc_ioctls++;
+    if (backend->ioctl(pcm_ctl_fd, AUDIO_ENABLE_AUDPP, &mask) < 0) {
+        LOGE("enable audpp error");
+        postproc_enabled_mask = -1;
+        return -EPERM;
+    }
+    postproc_enabled_mask = mask;
+    return 0;
+}
+
+// Playback starting or stopping, post processing follows
+static void postproc_set_playback(bool playing)
+{
+    Mutex::Autolock _l(postproc_lock);
+    if (!playing)
+        msm72xx_enable_postproc_l(false);
+    playback_in_progress = playing;
+    if (playing)
+        msm72xx_enable_postproc_l(true);
+}
+
+// always call with postproc_lock held
+static int msm72xx_enable_postproc_l(bool state)
+{
+    LatencyProbe probe(probe_postproc);
     int device_id=0;
+    int rc;
 
     if (!audpp_filter_inited)
     {
@@ -941,27 +1825,25 @@ static int msm72xx_enable_postproc(bool state)
         return -EINVAL;
     }
 
+    nsecs_t start = systemTime();
+
     if(snd_device == SND_DEVICE_SPEAKER)
-    {
         device_id = 0;
-        LOGI("set device to SND_DEVICE_SPEAKER device_id=0");
-    }
     if(snd_device == SND_DEVICE_HANDSET)
-    {
         device_id = 1;
-        LOGI("set device to SND_DEVICE_HANDSET device_id=1");
-    }
     if(snd_device == SND_DEVICE_HEADSET_STEREO || snd_device == SND_DEVICE_HEADSET)
-    {
         device_id = 2;
-        LOGI("set device to SND_DEVICE_HEADSET_STEREO/SND_DEVICE_HEADSET device_id=2");
-    }
-
-    fd = open(PCM_CTL_DEVICE, O_RDWR);
-    if (fd < 0) {
-        LOGE("Cannot open PCM Ctl device");
-        return -EPERM;
+    LOGV("post proc for snd_device %d device_id=%d", snd_device, device_id);
+
+    // without the control device everything runs on the CPU
+    if (pcm_ctl_fd < 0 && !postproc_force_cpu) {
+        pcm_ctl_fd = backend->open(PCM_CTL_DEVICE, O_RDWR);
+        if (pcm_ctl_fd < 0)
+            LOGE("Cannot open PCM Ctl device");
+        else
+            postproc_invalidate();
     }
+    int soft_mask = 0;
 
     if(mbadrc_filter_exists[device_id] && state)
     {
@@ -975,11 +1857,10 @@ static int msm72xx_enable_postproc(bool state)
         else if(post_proc_feature_mask & MBADRC_ENABLE)
         {
             LOGV("MBADRC Enabled %d", post_proc_feature_mask);
-
-            if (ioctl(fd, AUDIO_SET_MBADRC, &mbadrc_cfg[device_id]) < 0)
-            {
-                LOGE("set mbadrc filter error");
-            }
+            if (postproc_force_cpu ||
+                !postproc_load(POSTPROC_MBADRC, device_id, AUDIO_SET_MBADRC,
+                               &mbadrc_cfg[device_id], "mbadrc"))
+                soft_mask |= MBADRC_ENABLE;
         }
     }
     else if (adrc_filter_exists[device_id] && state)
@@ -991,19 +1872,11 @@ static int msm72xx_enable_postproc(bool state)
             post_proc_feature_mask &= ADRC_DISABLE;
         else if(post_proc_feature_mask & ADRC_ENABLE)
         {
-            LOGI("ADRC Filter ADRC FLAG = %02x.", adrc_flag[device_id]);
-            LOGI("ADRC Filter COMP THRESHOLD = %02x.", adrc_cfg[device_id].adrc_params[0]);
-            LOGI("ADRC Filter COMP SLOPE = %02x.", adrc_cfg[device_id].adrc_params[1]);
-            LOGI("ADRC Filter COMP RMS TIME = %02x.", adrc_cfg[device_id].adrc_params[2]);
-            LOGI("ADRC Filter COMP ATTACK[0] = %02x.", adrc_cfg[device_id].adrc_params[3]);
-            LOGI("ADRC Filter COMP ATTACK[1] = %02x.", adrc_cfg[device_id].adrc_params[4]);
-            LOGI("ADRC Filter COMP RELEASE[0] = %02x.", adrc_cfg[device_id].adrc_params[5]);
-            LOGI("ADRC Filter COMP RELEASE[1] = %02x.", adrc_cfg[device_id].adrc_params[6]);
-            LOGI("ADRC Filter COMP DELAY = %02x.", adrc_cfg[device_id].adrc_params[7]);
-            if (ioctl(fd, AUDIO_SET_ADRC, &adrc_cfg[device_id]) < 0)
-            {
-                LOGE("set adrc filter error.");
-            }
+            LOGV("ADRC Filter ADRC FLAG = %02x.", adrc_flag[device_id]);
+            if (postproc_force_cpu ||
+                !postproc_load(POSTPROC_ADRC, device_id, AUDIO_SET_ADRC,
+                               &adrc_cfg[device_id], "adrc"))
+                soft_mask |= ADRC_ENABLE;
         }
     }
     else
@@ -1016,42 +1889,37 @@ static int msm72xx_enable_postproc(bool state)
         post_proc_feature_mask &= EQ_DISABLE;
     else if ((post_proc_feature_mask & EQ_ENABLE) && state)
     {
-        LOGI("Setting EQ Filter");
-        if (ioctl(fd, AUDIO_SET_EQ, &eqalizer[device_id]) < 0) {
-            LOGE("set Equalizer error.");
-        }
+        LOGV("Setting EQ Filter");
+        if (postproc_force_cpu ||
+            !postproc_load(POSTPROC_EQ, device_id, AUDIO_SET_EQ,
+                           &eqalizer[device_id], "Equalizer"))
+            soft_mask |= EQ_ENABLE;
     }
 
     if (rx_iir_flag[device_id] == 0 && (post_proc_feature_mask & RX_IIR_ENABLE))
         post_proc_feature_mask &= RX_IIR_DISABLE;
     else if ((post_proc_feature_mask & RX_IIR_ENABLE)&& state)
     {
-        LOGI("IIR Filter FLAG = %02x.", rx_iir_flag[device_id]);
-        LOGI("IIR NUMBER OF BANDS = %02x.", iir_cfg[device_id].num_bands);
-        LOGI("IIR Filter N1 = %02x.", iir_cfg[device_id].iir_params[0]);
-        LOGI("IIR Filter N2 = %02x.",  iir_cfg[device_id].iir_params[1]);
-        LOGI("IIR Filter N3 = %02x.",  iir_cfg[device_id].iir_params[2]);
-        LOGI("IIR Filter N4 = %02x.",  iir_cfg[device_id].iir_params[3]);
-        LOGI("IIR FILTER M1 = %02x.",  iir_cfg[device_id].iir_params[24]);
-        LOGI("IIR FILTER M2 = %02x.", iir_cfg[device_id].iir_params[25]);
-        LOGI("IIR FILTER M3 = %02x.",  iir_cfg[device_id].iir_params[26]);
-        LOGI("IIR FILTER M4 = %02x.",  iir_cfg[device_id].iir_params[27]);
-        LOGI("IIR FILTER M16 = %02x.",  iir_cfg[device_id].iir_params[39]);
-        LOGI("IIR FILTER SF1 = %02x.",  iir_cfg[device_id].iir_params[40]);
-         if (ioctl(fd, AUDIO_SET_RX_IIR, &iir_cfg[device_id]) < 0)
-        {
-            LOGE("set rx iir filter error.");
-        }
+        LOGV("IIR Filter FLAG = %02x, bands = %02x.",
+             rx_iir_flag[device_id], iir_cfg[device_id].num_bands);
+        if (postproc_force_cpu ||
+            !postproc_load(POSTPROC_RX_IIR, device_id, AUDIO_SET_RX_IIR,
+                           &iir_cfg[device_id], "rx iir"))
+            soft_mask |= RX_IIR_ENABLE;
     }
 
     if(state){
-        LOGI("Enabling post proc features with mask 0x%04x", post_proc_feature_mask);
-        if (ioctl(fd, AUDIO_ENABLE_AUDPP, &post_proc_feature_mask) < 0) {
-            LOGE("enable audpp error");
-            close(fd);
-            return -EPERM;
-        }
+        int dsp_mask = post_proc_feature_mask & ~soft_mask;
+        LOGV("Enabling post proc features with mask 0x%04x", dsp_mask);
+        if (pcm_ctl_fd >= 0)
+            rc = postproc_set_mask(dsp_mask);
+        else
+            rc = postproc_force_cpu ? 0 : -EPERM;
+        if (rc < 0)
+            soft_mask |= dsp_mask & (MBADRC_ENABLE | ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE);
+        soft_postproc_publish(soft_mask, device_id);
     } else{
+        soft_postproc_publish(0, device_id);
         int disable_mask = 0;
 
         if(post_proc_feature_mask & MBADRC_ENABLE) disable_mask &= MBADRC_DISABLE;
@@ -1059,16 +1927,16 @@ static int msm72xx_enable_postproc(bool state)
         if(post_proc_feature_mask & EQ_ENABLE) disable_mask &= EQ_DISABLE;
         if(post_proc_feature_mask & RX_IIR_ENABLE) disable_mask &= RX_IIR_DISABLE;
 
-        LOGI("disabling post proc features with mask 0x%04x", disable_mask);
-        if (ioctl(fd, AUDIO_ENABLE_AUDPP, &disable_mask) < 0) {
-            LOGE("enable audpp error");
-            close(fd);
-            return -EPERM;
-        }
-   }
+        LOGV("disabling post proc features with mask 0x%04x", disable_mask);
+        rc = pcm_ctl_fd < 0 ? 0 : postproc_set_mask(disable_mask);
+    }
 
-   close(fd);
-   return 0;
+    nsecs_t elapsed = systemTime() - start;
+    postproc_calls++;
+    postproc_total_ns += elapsed;
+    if (elapsed > postproc_max_ns)
+        postproc_max_ns = elapsed;
+    return rc;
 }
 
 static unsigned calculate_audpre_table_index(unsigned index)
@@ -1088,8 +1956,9 @@ static unsigned calculate_audpre_table_index(unsigned index)
 }
 size_t AudioHardware::getInputBufferSize(uint32_t sampleRate, int format, int channelCount)
 {
+    const voicememo_format *vm = voicememo_format_for(format);
     if ( (format != AudioSystem::PCM_16_BIT) &&
-         (format != AudioSystem::AMR_NB)     &&
+         (vm == NULL)     &&
          (format != AudioSystem::AAC)){
         LOGW("getInputBufferSize bad format: 0x%x", format);
         return 0;
@@ -1101,8 +1970,8 @@ size_t AudioHardware::getInputBufferSize(uint32_t sampleRate, int format, int ch
 
     if (format == AudioSystem::AAC)
        return 2048;
-    else if (format == AudioSystem::AMR_NB)
-       return 320*channelCount;
+    else if (vm != NULL)
+       return vm->frameBytes * VOICEMEMO_FRAMES_PER_BUFFER * channelCount;
     else
        return 2048*channelCount;
 }
@@ -1116,12 +1985,27 @@ static status_t set_volume_rpc(uint32_t device,
     LOGD("rpc_snd_set_volume(%d, %d, %d)\n", device, method, volume);
 #endif
 
-    if (device == -1UL) return NO_ERROR;
+    if (device == (uint32_t)-1) {
+        volume_undiscovered++;
+        return NO_ERROR;
+    }
 
     if (m7xsnddriverfd < 0) {
         LOGE("Can not open snd device");
         return -EPERM;
     }
+
+    // SND_DEVICE_CURRENT follows the route, so it is never cached
+    int *cached = NULL;
+    if (device != SND_DEVICE_CURRENT && device < VOLUME_CACHE_DEVICES &&
+        method < VOLUME_CACHE_METHODS) {
+        cached = &volume_cache[device][method];
+        if (*cached == (int)volume) {
+            volume_rpcs_cached++;
+            return NO_ERROR;
+        }
+    }
+    volume_rpcs++;
     /* rpc_snd_set_volume(
      *     device,            # Any hardware device enum, including
      *                        # SND_DEVICE_CURRENT
@@ -1136,10 +2020,25 @@ static status_t set_volume_rpc(uint32_t device,
      args.method = method;
      args.volume = volume;
 
-     if (ioctl(m7xsnddriverfd, SND_SET_VOLUME, &args) < 0) {
+     // SND_DEVICE_CURRENT changes the volume of the routed endpoint: forget
+     // what was cached for it, or for all of them if the route is unknown
+     if (device == SND_DEVICE_CURRENT && method < VOLUME_CACHE_METHODS) {
+         if (route_rpc_device < VOLUME_CACHE_DEVICES) {
+             volume_cache[route_rpc_device][method] = -1;
+         } else {
+             for (int i = 0; i < VOLUME_CACHE_DEVICES; i++)
+                 volume_cache[i][method] = -1;
+         }
+     }
+
+     if (backend->ioctl(m7xsnddriverfd, SND_SET_VOLUME, &args) < 0) {
          LOGE("snd_set_volume error.");
+         if (cached)
+             *cached = -1;
          return -EIO;
      }
+     if (cached)
+         *cached = volume;
      return NO_ERROR;
 }
 
@@ -1164,25 +2063,57 @@ status_t AudioHardware::setVoiceVolume(float v)
     }
 
     Mutex::Autolock lock(mLock);
-    set_volume_rpc(SND_DEVICE_CURRENT, SND_METHOD_VOICE, vol, m7xsnddriverfd);
+    LockHoldTimer timer(lock_hold_volume);
+    routing_request req;
+    memset(&req, 0, sizeof(req));
+    req.pending = ROUTING_VOICE_VOLUME;
+    req.voiceVolume = vol;
+    submitRouting(req);
     return NO_ERROR;
 }
 
+// always call with mutex held
+// Programs the master volume on every known endpoint, or with deferral
+// enabled only on the routed one; the others follow when they are routed.
+void AudioHardware::masterVolumeRequest_l(routing_request *req)
+{
+    if (mMasterVolume < 0)
+        return;
+
+    req->pending |= ROUTING_MASTER_VOLUME;
+    req->numVolumes = 0;
+    for (size_t i = 0; i < sizeof(master_volume_endpoints) / sizeof(master_volume_endpoints[0]); i++) {
+        const master_volume_endpoint &ept = master_volume_endpoints[i];
+        uint32_t device = *ept.device;
+
+        if (mDeferVolume && device != (uint32_t)-1 && (int)device != mCurSndDevice) {
+            volume_deferred++;
+            continue;
+        }
+        req->volumeDevices[req->numVolumes] = device;
+        req->volumes[req->numVolumes] = ept.fixed_volume >= 0 ? ept.fixed_volume : mMasterVolume;
+        req->numVolumes++;
+    }
+}
+
+// always call with mutex held
+void AudioHardware::applyMasterVolume_l()
+{
+    routing_request req;
+    memset(&req, 0, sizeof(req));
+    masterVolumeRequest_l(&req);
+    if (req.pending)
+        submitRouting(req);
+}
+
 status_t AudioHardware::setMasterVolume(float v)
 {
     Mutex::Autolock lock(mLock);
+    LockHoldTimer timer(lock_hold_volume);
     int vol = ceil(v * 7.0);
     LOGI("Set master volume to %d.\n", vol);
-    set_volume_rpc(SND_DEVICE_HANDSET, SND_METHOD_VOICE, vol, m7xsnddriverfd);
-    set_volume_rpc(SND_DEVICE_SPEAKER, SND_METHOD_VOICE, vol, m7xsnddriverfd);
-    set_volume_rpc(SND_DEVICE_SPEAKER_IN_CALL, SND_METHOD_VOICE, vol, m7xsnddriverfd);
-    set_volume_rpc(SND_DEVICE_BT,      SND_METHOD_VOICE, vol, m7xsnddriverfd);
-    set_volume_rpc(SND_DEVICE_HEADSET, SND_METHOD_VOICE, vol, m7xsnddriverfd);
-    set_volume_rpc(SND_DEVICE_HEADSET_STEREO, SND_METHOD_VOICE, vol, m7xsnddriverfd);
-    set_volume_rpc(SND_DEVICE_IN_S_SADC_OUT_HANDSET, SND_METHOD_VOICE, vol, m7xsnddriverfd);
-    set_volume_rpc(SND_DEVICE_IN_S_SADC_OUT_SPEAKER_PHONE, SND_METHOD_VOICE, vol, m7xsnddriverfd);
-    set_volume_rpc(SND_DEVICE_TTY_HEADSET, SND_METHOD_VOICE, 1, m7xsnddriverfd);
-    set_volume_rpc(SND_DEVICE_TTY_VCO, SND_METHOD_VOICE, 1, m7xsnddriverfd);
+    mMasterVolume = vol;
+    applyMasterVolume_l();
     // We return an error code here to let the audioflinger do in-software
     // volume on top of the maximum volume that we set through the SND API.
     // return error - software mixer will handle it
@@ -1205,7 +2136,7 @@ status_t AudioHardware::setFmVolume(float v)
     struct msm_snd_set_fm_radio_vol_param args;
     args.volume = fm_vol;
 
-    if (ioctl(m7xsnddriverfd, SND_SET_FM_RADIO_VOLUME, &args) < 0) {
+    if (backend->ioctl(m7xsnddriverfd, SND_SET_FM_RADIO_VOLUME, &args) < 0) {
         LOGE("snd_set_fm_radio_volume error.");
         return -EIO;
     }
@@ -1245,29 +2176,52 @@ static status_t do_route_audio_rpc(uint32_t device,
      *                        # recording.
      *  )
      */
+    if (route_rpc_valid && ear_mute == route_rpc_ear_mute && mic_mute == route_rpc_mic_mute &&
+        (device == SND_DEVICE_CURRENT || device == route_rpc_device)) {
+        route_rpcs_skipped++;
+        return NO_ERROR;
+    }
+    route_rpcs++;
+    route_rpc_valid = false;
+
     struct msm_snd_device_config args;
     args.device = device;
     args.ear_mute = ear_mute ? SND_MUTE_MUTED : SND_MUTE_UNMUTED;
     if((device != SND_DEVICE_CURRENT) && (!mic_mute)) {
        //Explicitly mute the mic to release DSP resources
         args.mic_mute = SND_MUTE_MUTED;
-        if (ioctl(m7xsnddriverfd, SND_SET_DEVICE, &args) < 0) {
+        if (backend->ioctl(m7xsnddriverfd, SND_SET_DEVICE, &args) < 0) {
             LOGE("snd_set_device error.");
             return -EIO;
         }
     }
     args.mic_mute = mic_mute ? SND_MUTE_MUTED : SND_MUTE_UNMUTED;
 
-    if (ioctl(m7xsnddriverfd, SND_SET_DEVICE, &args) < 0) {
+    if (backend->ioctl(m7xsnddriverfd, SND_SET_DEVICE, &args) < 0) {
         LOGE("snd_set_device error.");
         return -EIO;
     }
 
+    if (device != SND_DEVICE_CURRENT) {
+        route_rpc_device = device;
+    }
+    route_rpc_ear_mute = ear_mute;
+    route_rpc_mic_mute = mic_mute;
+    route_rpc_valid = route_rpc_device != (uint32_t)-1;
     return NO_ERROR;
 }
 
 // always call with mutex held
 status_t AudioHardware::doAudioRouteOrMute(uint32_t device)
+{
+    routing_request req;
+    memset(&req, 0, sizeof(req));
+    routeRequest_l(&req, device);
+    return submitRouting(req);
+}
+
+// always call with mutex held
+void AudioHardware::routeRequest_l(routing_request *req, uint32_t device)
 {
 
 #if 0
@@ -1301,121 +2255,268 @@ status_t AudioHardware::doAudioRouteOrMute(uint32_t device)
     LOGD("doAudioRouteOrMute() device %x, mMode %d, mMicMute %d, mBuiltinMicSelected %d, %s",
         device, mMode, mMicMute, mBuiltinMicSelected, mute ? "muted" : "audio circuit active");
 
-    return do_route_audio_rpc(device, mute, mMicMute, m7xsnddriverfd);
+    req->pending |= ROUTING_DEVICE;
+    req->device = device;
+    req->earMute = mute;
+    req->micMute = mMicMute;
 }
 
-status_t AudioHardware::doRouting(AudioStreamInMSM72xx *input)
+// Queues req for the routing thread, merged into what is still waiting
+// there. Without the thread the RPCs are sent right away and their status
+// is returned; a queued request always returns NO_ERROR.
+status_t AudioHardware::submitRouting(const routing_request &req)
 {
-    /* currently this code doesn't work without the htc libacoustic */
+    if (mRoutingThread == 0)
+        return executeRouting(req);
+
+    Mutex::Autolock _l(mRoutingLock);
+    routing_request &q = mRoutingRequest;
+    uint32_t superseded = q.pending & req.pending & ~ROUTING_INVALIDATE;
+    for (; superseded; superseded &= superseded - 1)
+        mRoutingSuperseded++;
+
+    if (req.pending & ROUTING_DEVICE) {
+        // a mute change keeps the device of a switch still queued
+        if (!(q.pending & ROUTING_DEVICE) || req.device != SND_DEVICE_CURRENT)
+            q.device = req.device;
+        q.earMute = req.earMute;
+        q.micMute = req.micMute;
+    }
+    if (req.pending & ROUTING_POSTPROC) {
+        q.sndDevice = req.sndDevice;
+        q.postProcMask = req.postProcMask;
+    }
+    if (req.pending & ROUTING_MASTER_VOLUME) {
+        q.numVolumes = req.numVolumes;
+        memcpy(q.volumeDevices, req.volumeDevices, sizeof(q.volumeDevices));
+        memcpy(q.volumes, req.volumes, sizeof(q.volumes));
+    }
+    if (req.pending & ROUTING_VOICE_VOLUME)
+        q.voiceVolume = req.voiceVolume;
+    q.pending |= req.pending;
+    mRoutingSubmitted++;
+    mRoutingCond.signal();
+    return NO_ERROR;
+}
 
-    Mutex::Autolock lock(mLock);
-    uint32_t outputDevices = mOutput->devices();
-    status_t ret = NO_ERROR;
+// Sends the RPCs of req: the route first, so volumes set on
+// SND_DEVICE_CURRENT land on the new device.
+status_t AudioHardware::executeRouting(const routing_request &req)
+{
+    status_t status = NO_ERROR;
+
+    if (req.pending & ROUTING_INVALIDATE)
+        route_rpc_valid = false;
+    if (req.pending & ROUTING_DEVICE) {
+        LockHoldTimer timer(rpc_time_route);
+        status = do_route_audio_rpc(req.device, req.earMute, req.micMute, m7xsnddriverfd);
+    }
+    // the post processing setup only depends on the device and mask
+    if (req.pending & ROUTING_POSTPROC) {
+        Mutex::Autolock _l(postproc_lock);
+        if (req.sndDevice != snd_device || req.postProcMask != route_post_proc_mask) {
+            //disable post proc first for previous session
+            if (playback_in_progress)
+                msm72xx_enable_postproc_l(false);
+
+            //enable post proc for new device
+            snd_device = req.sndDevice;
+            post_proc_feature_mask = req.postProcMask;
+            route_post_proc_mask = req.postProcMask;
+
+            if (playback_in_progress)
+                msm72xx_enable_postproc_l(true);
+        }
+    }
+    if (req.pending & (ROUTING_MASTER_VOLUME | ROUTING_VOICE_VOLUME)) {
+        LockHoldTimer timer(rpc_time_volume);
+        if (req.pending & ROUTING_MASTER_VOLUME) {
+            for (int i = 0; i < req.numVolumes; i++)
+                set_volume_rpc(req.volumeDevices[i], SND_METHOD_VOICE, req.volumes[i],
+                               m7xsnddriverfd);
+        }
+        if (req.pending & ROUTING_VOICE_VOLUME)
+            set_volume_rpc(SND_DEVICE_CURRENT, SND_METHOD_VOICE, req.voiceVolume,
+                           m7xsnddriverfd);
+    }
+    return status;
+}
+
+status_t AudioHardware::syncRouting()
+{
+    Mutex::Autolock _l(mRoutingLock);
+    uint32_t seq = mRoutingSubmitted;
+    while (mRoutingThread != 0 && (int32_t)(mRoutingCompleted - seq) < 0)
+        mRoutingDone.wait(mRoutingLock);
+    return mRoutingStatus;
+}
+
+bool AudioHardware::RoutingThread::threadLoop()
+{
+    AudioHardware *hw = mHardware;
+
+    hw->mRoutingLock.lock();
+    while (!hw->mRoutingRequest.pending && !exitPending())
+        hw->mRoutingCond.wait(hw->mRoutingLock);
+    if (!hw->mRoutingRequest.pending) {
+        hw->mRoutingLock.unlock();
+        return false;
+    }
+    routing_request req = hw->mRoutingRequest;
+    uint32_t seq = hw->mRoutingSubmitted;
+    hw->mRoutingRequest.pending = 0;
+    hw->mRoutingLock.unlock();
+
+    status_t status = hw->executeRouting(req);
+
+    hw->mRoutingLock.lock();
+    hw->mRoutingStatus = status;
+    hw->mRoutingCompleted = seq;
+    hw->mRoutingBatches++;
+    hw->mRoutingDone.broadcast();
+    hw->mRoutingLock.unlock();
+    return true;
+}
+
+static int route_out_class(uint32_t outputDevices)
+{
+    if (outputDevices &
+        (AudioSystem::DEVICE_OUT_BLUETOOTH_SCO | AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET))
+        return ROUTE_OUT_BT_SCO;
+    if (outputDevices & AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT)
+        return ROUTE_OUT_CARKIT;
+#ifdef COMBO_DEVICE_SUPPORTED
+    // the combo routes check headset + speaker, then any headphone
+    if ((outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) &&
+        (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER))
+        return ROUTE_OUT_HEADSET;
+    if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE)
+        return ROUTE_OUT_HEADPHONE;
+#endif
+    if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET)
+        return ROUTE_OUT_HEADSET;
+    if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE)
+        return ROUTE_OUT_HEADPHONE;
+    if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER)
+        return ROUTE_OUT_SPEAKER;
+    if (outputDevices & AUDIO_DEVICE_OUT_SPEAKER_IN_CALL) // P500 SPEAKER_IN_CALL fix
+        return ROUTE_OUT_SPEAKER_IN_CALL;
+    return ROUTE_OUT_HANDSET;
+}
+
+static int route_in_class(uint32_t inputDevice)
+{
+    if (inputDevice & AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET)
+        return ROUTE_IN_BT_SCO;
+    if (inputDevice & AudioSystem::DEVICE_IN_WIRED_HEADSET)
+        return ROUTE_IN_HEADSET;
+    if (inputDevice != 0)
+        return ROUTE_IN_OTHER;
+    return ROUTE_IN_NONE;
+}
+
+static int route_key(uint32_t outputDevices, int inClass, bool inCall,
+                     int ttyMode, bool fmOn, bool dualMic)
+{
+    int key = route_out_class(outputDevices);
+
+    if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER)
+        key |= ROUTE_KEY_SPEAKER;
+    if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET)
+        key |= ROUTE_KEY_WIRED_HEADSET;
+    key |= inClass << ROUTE_KEY_IN_SHIFT;
+    if (inCall)
+        key |= ROUTE_KEY_IN_CALL;
+    key |= (ttyMode << ROUTE_KEY_TTY_SHIFT) & ROUTE_KEY_TTY_MASK;
+    if (fmOn)
+        key |= ROUTE_KEY_FM;
+    if (dualMic)
+        key |= ROUTE_KEY_DUALMIC;
+    return key;
+}
+
+// Routing policy for one route key. This is the decision doRouting() used to
+// make inline; it only depends on the key and the endpoint ids.
+static void resolve_route(int key, int *device, int *mask)
+{
+    const int all_features = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+    int out = key & ROUTE_KEY_OUT_MASK;
+    bool speaker = key & ROUTE_KEY_SPEAKER;
+    bool headset = key & ROUTE_KEY_WIRED_HEADSET;
+    bool inCall = key & ROUTE_KEY_IN_CALL;
+    int tty = (key & ROUTE_KEY_TTY_MASK) >> ROUTE_KEY_TTY_SHIFT;
+#ifdef HAVE_FM_RADIO
+    bool fm = key & ROUTE_KEY_FM;
+    const int fm_features = (EQ_ENABLE | RX_IIR_ENABLE);
+#endif
     int new_snd_device = -1;
     int new_post_proc_feature_mask = 0;
 
-    //int (*msm72xx_enable_audpp)(int);
-    //msm72xx_enable_audpp = (int (*)(int))::dlsym(acoustic, "msm72xx_enable_audpp");
-
-    if (input != NULL) {
-        uint32_t inputDevice = input->devices();
-        LOGI("do input routing device %x\n", inputDevice);
-        mBuiltinMicSelected = (inputDevice == AudioSystem::DEVICE_IN_BUILTIN_MIC);
-        // ignore routing device information when we start a recording in voice
-        // call
-        // Recording will happen through currently active tx device
-        if(inputDevice == AudioSystem::DEVICE_IN_VOICE_CALL)
-            return NO_ERROR;
-        if (inputDevice != 0) {
-            if (inputDevice & AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
-                LOGI("Routing audio to Bluetooth PCM\n");
-                new_snd_device = SND_DEVICE_BT;
-            } else if (inputDevice & AudioSystem::DEVICE_IN_WIRED_HEADSET) {
-                    LOGI("Routing audio to Wired Headset\n");
-                    new_snd_device = SND_DEVICE_HEADSET;
-            } else {
-                if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) {
-                    LOGI("Routing audio to Speakerphone\n");
-                    new_snd_device = SND_DEVICE_SPEAKER;
-                    new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
-                } else {
-                    LOGI("Routing audio to Handset\n");
-                    new_snd_device = SND_DEVICE_HANDSET;
-                }
-            }
+    switch ((key & ROUTE_KEY_IN_MASK) >> ROUTE_KEY_IN_SHIFT) {
+    case ROUTE_IN_BT_SCO:
+        new_snd_device = SND_DEVICE_BT;
+        break;
+    case ROUTE_IN_HEADSET:
+        new_snd_device = SND_DEVICE_HEADSET;
+        break;
+    case ROUTE_IN_OTHER:
+        if (speaker) {
+            new_snd_device = SND_DEVICE_SPEAKER;
+            new_post_proc_feature_mask = all_features;
+        } else {
+            new_snd_device = SND_DEVICE_HANDSET;
         }
+        break;
+    default:
+        break;
     }
 
-    // if inputDevice == 0, restore output routing
+    // no input route (or its endpoint is missing), use output routing
     if (new_snd_device == -1) {
-        if (outputDevices & (outputDevices - 1)) {
-            if ((outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) == 0) {
-                LOGW("Hardware does not support requested route combination (%#X),"
-                     " picking closest possible route...", outputDevices);
-            }
-        }
-
-        if ((mTtyMode != TTY_OFF) && (mMode == AudioSystem::MODE_IN_CALL) &&
-                (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET)) {
-            if (mTtyMode == TTY_FULL) {
-                LOGI("Routing audio to TTY FULL Mode\n");
+        if ((tty != TTY_OFF) && inCall && headset) {
+            if (tty == TTY_FULL) {
                 new_snd_device = SND_DEVICE_TTY_HEADSET;
-            } else if (mTtyMode == TTY_VCO) {
-                LOGI("Routing audio to TTY VCO Mode\n");
+            } else if (tty == TTY_VCO) {
                 new_snd_device = SND_DEVICE_TTY_VCO;
-            } else if (mTtyMode == TTY_HCO) {
-                LOGI("Routing audio to TTY HCO Mode\n");
+            } else if (tty == TTY_HCO) {
                 new_snd_device = SND_DEVICE_TTY_HCO;
             }
-        } else if (outputDevices &
-                   (AudioSystem::DEVICE_OUT_BLUETOOTH_SCO | AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET)) {
-            LOGI("Routing audio to Bluetooth PCM\n");
+        } else if (out == ROUTE_OUT_BT_SCO) {
             new_snd_device = SND_DEVICE_BT;
-        } else if (outputDevices & AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT) {
-            LOGI("Routing audio to Bluetooth PCM\n");
+        } else if (out == ROUTE_OUT_CARKIT) {
             new_snd_device = SND_DEVICE_CARKIT;
 #ifdef COMBO_DEVICE_SUPPORTED
-        } else if ((outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) &&
-                   (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER)) {
+        } else if (out == ROUTE_OUT_HEADSET && speaker) {
 #ifdef HAVE_FM_RADIO
-            if (mFmRadioEnabled) {
-                LOGI("Routing audio to FM Speakerphone\n");
+            if (fm) {
                 new_snd_device = SND_DEVICE_FM_SPEAKER;
-                new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
-                new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+                new_post_proc_feature_mask = fm_features;
             } else
 #endif
             {
-                LOGI("Routing audio to Wired Headset and Speaker\n");
                 new_snd_device = SND_DEVICE_HEADSET_AND_SPEAKER;
-                new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+                new_post_proc_feature_mask = all_features;
             }
-        } else if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE) {
-            if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) {
+        } else if (out == ROUTE_OUT_HEADPHONE) {
+            if (speaker) {
 #ifdef HAVE_FM_RADIO
-                if (mFmRadioEnabled) {
-                    LOGI("Routing audio to FM Speakerphone\n");
+                if (fm) {
                     new_snd_device = SND_DEVICE_FM_SPEAKER;
-                    new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
-                    new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+                    new_post_proc_feature_mask = fm_features;
                 } else
 #endif
                 {
-                    LOGI("Routing audio to No microphone Wired Headset and Speaker (%d,%x)\n", mMode, outputDevices);
                     new_snd_device = SND_DEVICE_HEADSET_AND_SPEAKER;
-                    new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+                    new_post_proc_feature_mask = all_features;
                 }
             } else {
 #ifdef HAVE_FM_RADIO
-                if (mFmRadioEnabled) {
-                    LOGI("Routing audio to FM Headset\n");
+                if (fm) {
                     new_snd_device = SND_DEVICE_FM_HEADSET;
-                    new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
-                    new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+                    new_post_proc_feature_mask = fm_features;
                 } else
 #endif
                 {
-                    LOGI("Routing audio to No microphone Wired Headset (%d,%x)\n", mMode, outputDevices);
                     new_snd_device = SND_DEVICE_NO_MIC_HEADSET;
                 }
             }
@@ -1424,106 +2525,130 @@ status_t AudioHardware::doRouting(AudioStreamInMSM72xx *input)
 SND_DEVICE_HEADSET = mono audio + active mic
 SND_DEVICE_HEADSET_STEREO = stereo audio + muted mic
 */
-
-		} else if ((mMode == AudioSystem::MODE_IN_CALL) &&
-					(outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET)) {
+        } else if (inCall && out == ROUTE_OUT_HEADSET) {
 #ifdef HAVE_FM_RADIO
-				 if (mFmRadioEnabled) {
-                LOGI("Routing FM audio to Wired Headset\n");
+            if (fm) {
                 new_snd_device = SND_DEVICE_FM_HEADSET;
-                new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
-                new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
-            } else	
-#endif
-            	{
-                LOGI("Routing audio to Wired Headset 2a (Phone Call Path)\n");
-                new_snd_device = SND_DEVICE_HEADSET; //STEREO
-                new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
-            }
-					
-        } else if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) {
-#ifdef HAVE_FM_RADIO
-            if (mFmRadioEnabled) {
-                LOGI("Routing FM audio to Wired Headset\n");
-                new_snd_device = SND_DEVICE_FM_HEADSET;
-                new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
-                new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+                new_post_proc_feature_mask = fm_features;
             } else
 #endif
             {
-                LOGI("Routing audio to Wired Headset 2b (Media Path)\n");
-                new_snd_device = SND_DEVICE_HEADSET_STEREO; //STEREO
-                new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+                // Phone Call Path
+                new_snd_device = SND_DEVICE_HEADSET;
+                new_post_proc_feature_mask = all_features;
             }
-        } else if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE) {
+        } else if (out == ROUTE_OUT_HEADSET || out == ROUTE_OUT_HEADPHONE) {
 #ifdef HAVE_FM_RADIO
-            if (mFmRadioEnabled) {
-                LOGI("Routing audio to FM Headset\n");
+            if (fm) {
                 new_snd_device = SND_DEVICE_FM_HEADSET;
-                new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
-                new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+                new_post_proc_feature_mask = fm_features;
             } else
 #endif
             {
-                LOGI("Routing audio to Wired Headset\n");
-                new_snd_device = SND_DEVICE_HEADSET_STEREO; //STEREO
-                new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+                // Media Path
+                new_snd_device = SND_DEVICE_HEADSET_STEREO;
+                new_post_proc_feature_mask = all_features;
             }
-        } else if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) {
+        } else if (out == ROUTE_OUT_SPEAKER) {
 #ifdef HAVE_FM_RADIO
-            if (mFmRadioEnabled) {
-                LOGI("Routing audio to FM Speakerphone\n");
+            if (fm) {
                 new_snd_device = SND_DEVICE_FM_SPEAKER;
-                new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
-                new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+                new_post_proc_feature_mask = fm_features;
             } else
 #endif
             {
-                LOGI("Routing audio to Speakerphone\n");
                 new_snd_device = SND_DEVICE_SPEAKER;
-                new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+                new_post_proc_feature_mask = all_features;
             }
-        } else if (outputDevices & AUDIO_DEVICE_OUT_SPEAKER_IN_CALL) { // P500 SPEAKER_IN_CALL fix
-            LOGI("Routing audio to Speaker in call\n");
+        } else if (out == ROUTE_OUT_SPEAKER_IN_CALL) {
             new_snd_device = SND_DEVICE_SPEAKER_IN_CALL;
-            new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+            new_post_proc_feature_mask = all_features;
         } else {
-            LOGI("Routing audio to Handset\n");
             new_snd_device = SND_DEVICE_HANDSET;
-            new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+            new_post_proc_feature_mask = all_features;
         }
     }
 
-    if (mDualMicEnabled && mMode == AudioSystem::MODE_IN_CALL) {
-        if (new_snd_device == SND_DEVICE_HANDSET) {
-            LOGI("Routing audio to handset with DualMike enabled\n");
+    if ((key & ROUTE_KEY_DUALMIC) && inCall) {
+        if (new_snd_device == (int)SND_DEVICE_HANDSET) {
             new_snd_device = SND_DEVICE_IN_S_SADC_OUT_HANDSET;
-        } else if (new_snd_device == SND_DEVICE_SPEAKER) {
-            LOGI("Routing audio to speakerphone with DualMike enabled\n");
+        } else if (new_snd_device == (int)SND_DEVICE_SPEAKER) {
             new_snd_device = SND_DEVICE_IN_S_SADC_OUT_SPEAKER_PHONE;
         }
     }
 
+    *device = new_snd_device;
+    *mask = new_post_proc_feature_mask;
+}
+
+static void build_route_table(void)
+{
+    for (int key = 0; key < ROUTE_KEY_COUNT; key++) {
+        int device, mask;
+        resolve_route(key, &device, &mask);
+        route_table[key].device = device;
+        route_table[key].mask = mask;
+    }
+}
+
+status_t AudioHardware::doRouting(AudioStreamInMSM72xx *input)
+{
+    LatencyProbe probe(probe_routing);
+    /* currently this code doesn't work without the htc libacoustic */
+
+    Mutex::Autolock lock(mLock);
+    LockHoldTimer timer(lock_hold_routing);
+    uint32_t outputDevices = mOutput->devices();
+    status_t ret = NO_ERROR;
+    int inClass = ROUTE_IN_NONE;
+    bool fmOn = false;
+
+    if (input != NULL) {
+        uint32_t inputDevice = input->devices();
+        LOGI("do input routing device %x\n", inputDevice);
+        mBuiltinMicSelected = (inputDevice == AudioSystem::DEVICE_IN_BUILTIN_MIC);
+        // ignore routing device information when we start a recording in voice
+        // call
+        // Recording will happen through currently active tx device
+        if(inputDevice == AudioSystem::DEVICE_IN_VOICE_CALL)
+            return NO_ERROR;
+        inClass = route_in_class(inputDevice);
+    }
+
+    if (inClass == ROUTE_IN_NONE && (outputDevices & (outputDevices - 1)) &&
+            (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) == 0) {
+        LOGW("Hardware does not support requested route combination (%#X),"
+             " picking closest possible route...", outputDevices);
+    }
+
+#ifdef HAVE_FM_RADIO
+    fmOn = mFmRadioEnabled;
+#endif
+    int key = route_key(outputDevices, inClass, mMode == AudioSystem::MODE_IN_CALL,
+                        mTtyMode, fmOn, mDualMicEnabled);
+    int new_snd_device = route_table[key].device;
+    int new_post_proc_feature_mask = route_table[key].mask;
+    route_lookups++;
+
     if ( (new_snd_device != -1 && new_snd_device != mCurSndDevice)
 #ifdef HAVE_FM_RADIO
      ||  (mFmRadioEnabled != mFmPrev)
-#endif     
+#endif
      )
     {
-        ret = doAudioRouteOrMute(new_snd_device);
-
-       //disable post proc first for previous session
-       if (playback_in_progress)
-           msm72xx_enable_postproc(false);
-
-       //enable post proc for new device
-       snd_device = new_snd_device;
-       post_proc_feature_mask = new_post_proc_feature_mask;
-
-       if (playback_in_progress)
-           msm72xx_enable_postproc(true);
-
-       mCurSndDevice = new_snd_device;
+        LOGI("Routing audio to snd device %d (route key %#x, mode %d, outputs %#x)\n",
+             new_snd_device, key, mMode, outputDevices);
+        routing_request req;
+        memset(&req, 0, sizeof(req));
+        routeRequest_l(&req, new_snd_device);
+        req.pending |= ROUTING_POSTPROC;
+        req.sndDevice = new_snd_device;
+        req.postProcMask = new_post_proc_feature_mask;
+
+        mCurSndDevice = new_snd_device;
+        if (mDeferVolume)
+            masterVolumeRequest_l(&req);
+        ret = submitRouting(req);
     }
 
     return ret;
@@ -1532,6 +2657,7 @@ SND_DEVICE_HEADSET_STEREO = stereo audio + muted mic
 status_t AudioHardware::checkMicMute()
 {
     Mutex::Autolock lock(mLock);
+    LockHoldTimer timer(lock_hold_routing);
     if (mMode != AudioSystem::MODE_IN_CALL) {
         setMicMute_nosync(true);
     }
@@ -1553,6 +2679,59 @@ status_t AudioHardware::dumpInternals(int fd, const Vector<String16>& args)
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmBluetoothId: %d\n", mBluetoothId);
     result.append(buffer);
+    snprintf(buffer, SIZE, "\trouting: %u lookups, snd_set_device %u sent, %u skipped\n",
+             route_lookups, route_rpcs, route_rpcs_skipped);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tsnd_set_volume: %u sent, %u cached, %u undiscovered, "
+             "%u deferred (deferral %s)\n", volume_rpcs, volume_rpcs_cached,
+             volume_undiscovered, volume_deferred, mDeferVolume ? "on" : "off");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tmLock hold: routing %u x avg %lld us max %lld us, "
+             "volume %u x avg %lld us max %lld us\n",
+             lock_hold_routing.count,
+             lock_hold_routing.count ? lock_hold_routing.total / lock_hold_routing.count / 1000 : 0,
+             lock_hold_routing.max / 1000,
+             lock_hold_volume.count,
+             lock_hold_volume.count ? lock_hold_volume.total / lock_hold_volume.count / 1000 : 0,
+             lock_hold_volume.max / 1000);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\trouting thread: %s, %u requests in %u batches, "
+             "%u superseded\n", mRoutingThread != 0 ? "running" : "off",
+             mRoutingSubmitted, mRoutingBatches, mRoutingSuperseded);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tmodem RPCs: route %u x avg %lld us max %lld us, "
+             "volume %u x avg %lld us max %lld us\n",
+             rpc_time_route.count,
+             rpc_time_route.count ? rpc_time_route.total / rpc_time_route.count / 1000 : 0,
+             rpc_time_route.max / 1000,
+             rpc_time_volume.count,
+             rpc_time_volume.count ? rpc_time_volume.total / rpc_time_volume.count / 1000 : 0,
+             rpc_time_volume.max / 1000);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tSND endpoints: %d %s in %lld us, %s\n",
+             mNumSndEndpoints, snd_endpoints_from_cache ? "cached" : "enumerated",
+             snd_endpoints_load_ns / 1000,
+             snd_endpoint_mask ? "perfect hash" : "linear lookup");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\taudio filters: %s in %lld us\n",
+             audpp_filter_from_cache ? "loaded from cache" : "parsed",
+             audpp_filter_load_ns / 1000);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tpost proc: %u calls, %u ioctls, %u skipped, "
+             "avg %lld us, max %lld us\n", postproc_calls, postproc_ioctls,
+             postproc_skipped,
+             postproc_calls ? postproc_total_ns / postproc_calls / 1000 : 0,
+             postproc_max_ns / 1000);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tlatency probes: %s\n", probes_enabled ? "on" : "off");
+    result.append(buffer);
+    latency_dump(result, "doRouting", probe_routing);
+    latency_dump(result, "setParameters", probe_set_parameters);
+    latency_dump(result, "enable_postproc", probe_postproc);
+    snprintf(buffer, SIZE, "\tdevice backend: %s\n", backend->name);
+    result.append(buffer);
+    if (backend->dump)
+        backend->dump(result);
     ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
@@ -1600,8 +2779,22 @@ AudioHardware::AudioStreamInMSM72xx *AudioHardware::getActiveInput_l()
 // ----------------------------------------------------------------------------
 
 AudioHardware::AudioStreamOutMSM72xx::AudioStreamOutMSM72xx() :
-    mHardware(0), mFd(-1), mStartCount(0), mRetryCount(0), mStandby(true), mDevices(0)
+    mHardware(0), mFd(-1), mStartCount(0), mRetryCount(0), mStandby(true), mDevices(0),
+    mProfile(out_profiles[0].name), mBufferSize(out_profiles[0].bufferSize),
+    mDriverBufferSize(out_profiles[0].bufferSize), mBufferCount(out_profiles[0].bufferCount),
+    mStandbyExitTime(0), mLastStartupTime(0), mTotalStartupTime(0), mStartups(0),
+    mRingLatencyMs(0), mRingStarved(false), mRingExit(false), mStandbyGrace(0), mWarm(false), mWarmDeadline(0),
+    mWarmHits(0), mWarmMisses(0), mWarmExpired(0), mPositionFd(-1), mStatsSupported(true),
+    mFramesWritten(0), mFramesRendered(0), mDspFrames(0), mDspBytes(0),
+    mLastPosition(0), mDspFramesTime(0), mQueueSamples(0), mQueueFramesMax(0),
+    mQueueFramesTotal(0), mSoftPostProc(NULL), mSoftPostProcGeneration(0),
+    mProcessBuffer(NULL), mProcessBufferSize(0), mLastWriteEnd(0), mWriteGaps(0),
+    mMaxWriteGap(0)
 {
+    memset(&mWaitStats, 0, sizeof(mWaitStats));
+    memset(&mWriteLatency, 0, sizeof(mWriteLatency));
+    memset(&mRing, 0, sizeof(mRing));
+    memset(&mRingStats, 0, sizeof(mRingStats));
 }
 
 status_t AudioHardware::AudioStreamOutMSM72xx::set(
@@ -1613,6 +2806,21 @@ status_t AudioHardware::AudioStreamOutMSM72xx::set(
 
     mHardware = hw;
 
+    char value[PROPERTY_VALUE_MAX];
+    property_get("audio.out.profile", value, out_profiles[0].name);
+    size_t i;
+    for (i = 0; i < sizeof(out_profiles) / sizeof(out_profiles[0]); i++) {
+        if (!strcmp(value, out_profiles[i].name))
+            break;
+    }
+    if (i == sizeof(out_profiles) / sizeof(out_profiles[0])) {
+        LOGW("unknown output profile %s, using %s", value, out_profiles[0].name);
+        i = 0;
+    }
+    mProfile = out_profiles[i].name;
+    mBufferSize = mDriverBufferSize = out_profiles[i].bufferSize;
+    mBufferCount = out_profiles[i].bufferCount;
+
     // fix up defaults
     if (lFormat == 0) lFormat = format();
     if (lChannels == 0) lChannels = channels();
@@ -1634,26 +2842,258 @@ status_t AudioHardware::AudioStreamOutMSM72xx::set(
 
     mDevices = devices;
 
+    property_get("audio.out.standby_grace_ms", value, "0");
+    if (atoi(value) > 0 && mStandbyThread == 0) {
+        mStandbyGrace = ms2ns(atoi(value));
+        mStandbyThread = new StandbyThread(this);
+        if (mStandbyThread->run("AudioOutStandby", android::PRIORITY_AUDIO) != NO_ERROR) {
+            LOGE("Cannot start output standby thread, closing on standby");
+            mStandbyThread.clear();
+            mStandbyGrace = 0;
+        }
+    }
+
+    property_get("audio.out.ring_ms", value, "0");
+    uint32_t ringMs = atoi(value);
+    if (ringMs > 0 && mRing.data == NULL) {
+        // at least two driver buffers, rounded up to a power of two
+        uint32_t bytes = ringMs * sampleRate() / 1000 * frameSize();
+        uint32_t size = 1;
+        while (size < bytes || size < 2 * bufferSize())
+            size <<= 1;
+        // one driver buffer past the end stages what the writer thread sends
+        mRing.data = new uint8_t[size + bufferSize()];
+        mRing.size = size;
+        mRingStats.minFill = size;
+        mRingLatencyMs = (size / frameSize()) * 1000 / sampleRate();
+
+        mRingThread = new RingWriterThread(this);
+        if (mRingThread->run("AudioOutRing", android::PRIORITY_URGENT_AUDIO) != NO_ERROR) {
+            LOGE("Cannot start output ring thread, writing directly");
+            mRingThread.clear();
+            delete [] mRing.data;
+            memset(&mRing, 0, sizeof(mRing));
+            mRingLatencyMs = 0;
+        } else {
+            LOGI("output ring: %u bytes, %u ms", size, mRingLatencyMs);
+        }
+    }
+
     return NO_ERROR;
 }
 
 AudioHardware::AudioStreamOutMSM72xx::~AudioStreamOutMSM72xx()
 {
-    if (mFd >= 0) close(mFd);
+    stopRing();
+    if (mStandbyThread != 0) {
+        // under mDriverLock, the thread checks exitPending() with it held
+        mDriverLock.lock();
+        mStandbyThread->requestExit();
+        mStandbyCond.broadcast();
+        mDriverLock.unlock();
+        mStandbyThread->requestExitAndWait();
+        mStandbyThread.clear();
+    }
+    if (mWarm) {
+        Mutex::Autolock _l(mDriverLock);
+        closeDriver_l();
+    }
+    if (mFd >= 0) backend->close(mFd);
+    delete [] mRing.data;
+    delete mSoftPostProc;
+    delete [] mProcessBuffer;
+}
+
+bool AudioHardware::AudioStreamOutMSM72xx::StandbyThread::threadLoop()
+{
+    Mutex::Autolock _l(mStream->mDriverLock);
+    if (exitPending())
+        return false;
+    return mStream->expireStandby_l();
+}
+
+// Standby thread: closes the driver once the grace period runs out
+// without a write bringing the stream back.
+bool AudioHardware::AudioStreamOutMSM72xx::expireStandby_l()
+{
+    if (!mWarm) {
+        mStandbyCond.wait(mDriverLock);
+        return true;
+    }
+    nsecs_t now = systemTime();
+    if (now < mWarmDeadline) {
+        mStandbyCond.waitRelative(mDriverLock, mWarmDeadline - now);
+        return true;
+    }
+    LOGV("standby grace period expired, closing driver");
+    mWarmExpired++;
+    closeDriver_l();
+    return true;
+}
+
+void AudioHardware::AudioStreamOutMSM72xx::stopRing()
+{
+    if (mRingThread != 0) {
+        mRingLock.lock();
+        mRingExit = true;
+        mRingThread->requestExit();
+        mRingCond.broadcast();
+        mRingLock.unlock();
+        mRingThread->requestExitAndWait();
+        mRingThread.clear();
+    }
+}
+
+status_t AudioHardware::AudioStreamOutMSM72xx::RingWriterThread::readyToRun()
+{
+    struct sched_param param;
+    param.sched_priority = 1;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+        LOGW("output ring thread stays SCHED_OTHER: %s", strerror(errno));
+    return NO_ERROR;
+}
+
+bool AudioHardware::AudioStreamOutMSM72xx::RingWriterThread::threadLoop()
+{
+    return mStream->drainRing();
+}
+
+// Writer thread: sends one driver buffer from the ring, or waits up to a
+// buffer period for write() to supply one. In standby nothing is due, so
+// it sleeps until write() or stopRing() wakes it.
+bool AudioHardware::AudioStreamOutMSM72xx::drainRing()
+{
+    const uint32_t chunk = bufferSize();
+    uint8_t *staging = mRing.data + mRing.size;
+
+    Mutex::Autolock _l(mDriverLock);
+    uint32_t fill = (uint32_t)android_atomic_acquire_load(&mRing.rear) - (uint32_t)mRing.front;
+    if (fill < chunk) {
+        bool standby = mStandby;
+        if (!standby && !mRingStarved) {
+            mRingStats.underruns++;
+            mRingStarved = true;
+        }
+        mDriverLock.unlock();
+        mRingLock.lock();
+        if ((uint32_t)android_atomic_acquire_load(&mRing.rear) - (uint32_t)mRing.front < chunk &&
+                !mRingExit) {
+            if (standby)
+                mRingCond.wait(mRingLock);
+            else
+                mRingCond.waitRelative(mRingLock, ms2ns(chunk / frameSize() * 1000 / sampleRate()));
+        }
+        mRingLock.unlock();
+        mDriverLock.lock();
+        return true;
+    }
+    mRingStarved = false;
+
+    uint32_t offset = (uint32_t)mRing.front & (mRing.size - 1);
+    uint32_t first = mRing.size - offset < chunk ? mRing.size - offset : chunk;
+    memcpy(staging, mRing.data + offset, first);
+    memcpy(staging + first, mRing.data, chunk - first);
+    android_atomic_release_store((int32_t)((uint32_t)mRing.front + chunk), &mRing.front);
+    mRingLock.lock();
+    mRingCond.broadcast();
+    mRingLock.unlock();
+
+    writeDriver(staging, chunk);
+    return true;
+}
+
+// AudioFlinger side: copies into the ring, blocking only while it is full.
+ssize_t AudioHardware::AudioStreamOutMSM72xx::writeRing(const void* buffer, size_t bytes)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(buffer);
+    size_t count = bytes;
+    nsecs_t period = ms2ns(bufferSize() / frameSize() * 1000 / sampleRate());
+    nsecs_t waitStart = 0;
+
+    uint32_t fill = (uint32_t)mRing.rear - (uint32_t)android_atomic_acquire_load(&mRing.front);
+    mRingStats.samples++;
+    mRingStats.totalFill += fill;
+    if (fill < mRingStats.minFill) mRingStats.minFill = fill;
+    if (fill > mRingStats.maxFill) mRingStats.maxFill = fill;
+
+    while (count) {
+        uint32_t space = mRing.size -
+                ((uint32_t)mRing.rear - (uint32_t)android_atomic_acquire_load(&mRing.front));
+        if (space == 0) {
+            // waiting is how write() is paced; waiting longer than a
+            // driver buffer means the DSP side has stalled
+            if (waitStart == 0) {
+                waitStart = systemTime();
+            } else if (waitStart > 0 && systemTime() - waitStart > period) {
+                mRingStats.overruns++;
+                waitStart = -1;
+            }
+            mRingLock.lock();
+            if ((uint32_t)mRing.rear - (uint32_t)android_atomic_acquire_load(&mRing.front) == mRing.size)
+                mRingCond.waitRelative(mRingLock, period);
+            mRingLock.unlock();
+            continue;
+        }
+
+        uint32_t n = count < space ? count : space;
+        uint32_t offset = (uint32_t)mRing.rear & (mRing.size - 1);
+        uint32_t first = mRing.size - offset < n ? mRing.size - offset : n;
+        memcpy(mRing.data + offset, p, first);
+        memcpy(mRing.data, p + first, n - first);
+        android_atomic_release_store((int32_t)((uint32_t)mRing.rear + n), &mRing.rear);
+        mRingLock.lock();
+        mRingCond.broadcast();
+        mRingLock.unlock();
+        p += n;
+        count -= n;
+    }
+    return bytes;
 }
 
 ssize_t AudioHardware::AudioStreamOutMSM72xx::write(const void* buffer, size_t bytes)
+{
+    LatencyProbe probe(mWriteLatency, &mLastWriteEnd);
+    if (probe.start() && mLastWriteEnd) {
+        // nothing reached the driver meanwhile, longer than a buffer
+        // period drains the DSP
+        nsecs_t gap = probe.start() - mLastWriteEnd;
+        nsecs_t period = (nsecs_t)bufferSize() / frameSize() * 1000000000 / sampleRate();
+        if (gap > period) {
+            mWriteGaps++;
+            if (gap > mMaxWriteGap)
+                mMaxWriteGap = gap;
+            LOGW("write() called %lld ms after the last one returned, period %lld ms",
+                 ns2ms(gap), ns2ms(period));
+        }
+    }
+    if (mRing.data != NULL)
+        return writeRing(buffer, bytes);
+    Mutex::Autolock _l(mDriverLock);
+    return writeDriver(buffer, bytes);
+}
+
+ssize_t AudioHardware::AudioStreamOutMSM72xx::writeDriver(const void* buffer, size_t bytes)
 {
     // LOGD("AudioStreamOutMSM72xx::write(%p, %u)", buffer, bytes);
     status_t status = NO_INIT;
     size_t count = bytes;
     const uint8_t* p = static_cast<const uint8_t*>(buffer);
+    bool woken = false;
+
+    if (mStandby && mWarm) {
+        // back within the grace period, the driver is still set up
+        mWarm = false;
+        mStandby = false;
+        mWarmHits++;
+    }
 
     if (mStandby) {
+        mStandbyExitTime = systemTime();
+        mWarmMisses++;
 
         // open driver
         LOGV("open driver");
-        status = ::open("/dev/msm_pcm_out", O_RDWR);
+        status = backend->open("/dev/msm_pcm_out", O_RDWR);
         if (status < 0) {
             LOGE("Cannot open /dev/msm_pcm_out errno: %d", errno);
             goto Error;
@@ -1663,7 +3103,7 @@ ssize_t AudioHardware::AudioStreamOutMSM72xx::write(const void* buffer, size_t b
         // configuration
         LOGV("get config");
         struct msm_audio_config config;
-        status = ioctl(mFd, AUDIO_GET_CONFIG, &config);
+        status = backend->ioctl(mFd, AUDIO_GET_CONFIG, &config);
         if (status < 0) {
             LOGE("Cannot read config");
             goto Error;
@@ -1673,13 +3113,19 @@ ssize_t AudioHardware::AudioStreamOutMSM72xx::write(const void* buffer, size_t b
         config.channel_count = AudioSystem::popCount(channels());
         config.sample_rate = sampleRate();
         config.buffer_size = bufferSize();
-        config.buffer_count = AUDIO_HW_NUM_OUT_BUF;
+        config.buffer_count = mBufferCount;
         config.type = CODEC_TYPE_PCM;
-        status = ioctl(mFd, AUDIO_SET_CONFIG, &config);
+        status = backend->ioctl(mFd, AUDIO_SET_CONFIG, &config);
         if (status < 0) {
             LOGE("Cannot set config");
             goto Error;
         }
+        // latency() follows whatever the driver settled on
+        if (backend->ioctl(mFd, AUDIO_GET_CONFIG, &config) == 0 &&
+            config.buffer_size > 0 && config.buffer_count > 0) {
+            mDriverBufferSize = config.buffer_size;
+            mBufferCount = config.buffer_count;
+        }
 
         LOGV("buffer_size: %u", config.buffer_size);
         LOGV("buffer_count: %u", config.buffer_count);
@@ -1687,36 +3133,83 @@ ssize_t AudioHardware::AudioStreamOutMSM72xx::write(const void* buffer, size_t b
         LOGV("sample_rate: %u", config.sample_rate);
 
         // fill 2 buffers before AUDIO_START
-        mStartCount = AUDIO_HW_NUM_OUT_BUF;
+        mStartCount = mBufferCount;
         mStandby = false;
+
+        mPositionLock.lock();
+        mFramesWritten = 0;
+        mDspFrames = 0;
+        mDspBytes = 0;
+        mPositionLock.unlock();
+    }
+
+    if (android_atomic_acquire_load(&soft_postproc_generation) != mSoftPostProcGeneration)
+        updateSoftPostProc();
+    if (mEffects.hasSoftware() || (mSoftPostProc && mSoftPostProc->mask())) {
+        if (bytes > mProcessBufferSize) {
+            delete [] mProcessBuffer;
+            mProcessBuffer = new int16_t[bytes / sizeof(int16_t)];
+            mProcessBufferSize = bytes;
+        }
+        memcpy(mProcessBuffer, buffer, bytes);
+        if (mEffects.hasSoftware())
+            mEffects.process(mProcessBuffer, bytes / frameSize(),
+                             AudioSystem::popCount(channels()), sampleRate() / 100);
+        if (mSoftPostProc && mSoftPostProc->mask())
+            mSoftPostProc->process(mProcessBuffer, bytes / frameSize());
+        p = reinterpret_cast<const uint8_t*>(mProcessBuffer);
     }
 
     while (count) {
-        ssize_t written = ::write(mFd, p, count);
+        ssize_t written = backend->write(mFd, p, count);
         if (written >= 0) {
             count -= written;
             p += written;
+            woken = false;
         } else {
             if (errno != EAGAIN) return written;
             mRetryCount++;
-            LOGW("EAGAIN - retry");
+            LOGV("EAGAIN - waiting");
+            pcm_wait(mFd, POLLOUT,
+                     pcm_wait_timeout_ms(mDriverBufferSize, mBufferCount,
+                                         frameSize(), sampleRate()),
+                     &woken, &mWaitStats);
         }
     }
 
     // start audio after we fill 2 buffers
     if (mStartCount) {
         if (--mStartCount == 0) {
-            ioctl(mFd, AUDIO_START, 0);
-            playback_in_progress = true;
+            backend->ioctl(mFd, AUDIO_START, 0);
             //enable post processing
-            msm72xx_enable_postproc(true);
+            postproc_set_playback(true);
+
+            mLastStartupTime = systemTime() - mStandbyExitTime;
+            mTotalStartupTime += mLastStartupTime;
+            mStartups++;
+
+            mPositionLock.lock();
+            mPositionFd = mFd;
+            mDspFramesTime = systemTime();
+            mPositionLock.unlock();
         }
     }
+
+    mPositionLock.lock();
+    mFramesWritten += bytes / frameSize();
+    if (!mStatsSupported && mPositionFd >= 0) {
+        // write() returns once a driver buffer is free, so everything but
+        // the driver buffers has been played
+        uint32_t queued = mBufferCount * mDriverBufferSize / frameSize();
+        mDspFrames = mFramesWritten > queued ? mFramesWritten - queued : 0;
+        mDspFramesTime = systemTime();
+    }
+    mPositionLock.unlock();
     return bytes;
 
 Error:
     if (mFd >= 0) {
-        ::close(mFd);
+        backend->close(mFd);
         mFd = -1;
     }
     // Simulate audio output timing in case of error
@@ -1728,15 +3221,83 @@ Error:
 status_t AudioHardware::AudioStreamOutMSM72xx::standby()
 {
     status_t status = NO_ERROR;
-    if (!mStandby && mFd >= 0) {
+    Mutex::Autolock _l(mDriverLock);
+    // the next write starts a new stream of audio, not a late one
+    mLastWriteEnd = 0;
+    // whatever is still queued in the ring belongs to the stopped playback
+    android_atomic_release_store(android_atomic_acquire_load(&mRing.rear), &mRing.front);
+    mRingStarved = false;
+    if (mStandby)
+        return status;
+    mStandby = true;
+
+    // keep the driver and post processing running for a while, a write
+    // within the grace period then skips reopening and reconfiguring
+    if (mStandbyGrace > 0 && mFd >= 0 && mHardware &&
+        mHardware->mMode == AudioSystem::MODE_NORMAL) {
+        mWarm = true;
+        mWarmDeadline = systemTime() + mStandbyGrace;
+        mStandbyCond.signal();
+        return status;
+    }
+
+    closeDriver_l();
+    return status;
+}
+
+// A driver kept open over standby must not run into a call
+void AudioHardware::AudioStreamOutMSM72xx::closeWarmDriver()
+{
+    Mutex::Autolock _l(mDriverLock);
+    if (mWarm) {
+        LOGV("closing the driver kept open over standby");
+        closeDriver_l();
+    }
+}
+
+void AudioHardware::AudioStreamOutMSM72xx::closeDriver_l()
+{
+    // carry the position over so getRenderPosition() keeps counting up
+    mPositionLock.lock();
+    mFramesRendered += renderedFrames_l(systemTime());
+    mPositionFd = -1;
+    mPositionLock.unlock();
+
+    if (mFd >= 0) {
         //disable post processing
-        msm72xx_enable_postproc(false);
-        playback_in_progress = false;
-        ::close(mFd);
+        postproc_set_playback(false);
+        backend->close(mFd);
         mFd = -1;
     }
-    mStandby = true;
-    return status;
+    if (mSoftPostProc)
+        mSoftPostProc->reset();
+    mWarm = false;
+}
+
+status_t AudioHardware::AudioStreamOutMSM72xx::addAudioEffect(effect_handle_t effect)
+{
+    return mEffects.add(effect, 0);
+}
+
+status_t AudioHardware::AudioStreamOutMSM72xx::removeAudioEffect(effect_handle_t effect)
+{
+    return mEffects.remove(effect);
+}
+
+// Picks up the chains published by msm72xx_enable_postproc_l(), called from
+// the driver side of write().
+void AudioHardware::AudioStreamOutMSM72xx::updateSoftPostProc()
+{
+    Mutex::Autolock _l(soft_postproc_lock);
+    mSoftPostProcGeneration = soft_postproc_generation;
+    if (!soft_postproc_mask && mSoftPostProc == NULL)
+        return;
+    if (mSoftPostProc == NULL)
+        mSoftPostProc = new SoftPostProc();
+    int device_id = soft_postproc_device;
+    mSoftPostProc->configure(soft_postproc_mask, &iir_cfg[device_id], &eqalizer[device_id],
+                             &adrc_cfg[device_id], &mbadrc_cfg[device_id],
+                             AudioSystem::popCount(channels()));
 }
 
 status_t AudioHardware::AudioStreamOutMSM72xx::dump(int fd, const Vector<String16>& args)
@@ -1749,6 +3310,24 @@ status_t AudioHardware::AudioStreamOutMSM72xx::dump(int fd, const Vector<String1
     result.append(buffer);
     snprintf(buffer, SIZE, "\tbuffer size: %d\n", bufferSize());
     result.append(buffer);
+    snprintf(buffer, SIZE, "\tprofile: %s, driver %u x %u bytes, latency %u ms\n",
+             mProfile, mBufferCount, mDriverBufferSize, latency());
+    result.append(buffer);
+    if (mQueueSamples) {
+        snprintf(buffer, SIZE, "\twrite to DSP: avg %llu ms, max %u ms (%u samples)\n",
+                 mQueueFramesTotal * 1000 / mQueueSamples / sampleRate(),
+                 mQueueFramesMax * 1000 / sampleRate(), mQueueSamples);
+        result.append(buffer);
+    }
+    if (mSoftPostProc && mSoftPostProc->frames()) {
+        snprintf(buffer, SIZE, "\tCPU post processing: mask 0x%04x, %d biquads, %d bands, "
+                 "%llu ns/frame over %llu frames\n",
+                 mSoftPostProc->mask(), mSoftPostProc->biquads(), mSoftPostProc->bands(),
+                 mSoftPostProc->processTime() / mSoftPostProc->frames(),
+                 mSoftPostProc->frames());
+        result.append(buffer);
+    }
+    mEffects.dump(result);
     snprintf(buffer, SIZE, "\tchannels: %d\n", channels());
     result.append(buffer);
     snprintf(buffer, SIZE, "\tformat: %d\n", format());
@@ -1761,8 +3340,37 @@ status_t AudioHardware::AudioStreamOutMSM72xx::dump(int fd, const Vector<String1
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmRetryCount: %d\n", mRetryCount);
     result.append(buffer);
+    pcm_wait_dump(result, mWaitStats);
+    latency_dump(result, "write", mWriteLatency);
+    if (mWriteGaps) {
+        snprintf(buffer, SIZE, "\twrite gaps over a buffer period: %u, max %lld ms\n",
+                 mWriteGaps, ns2ms(mMaxWriteGap));
+        result.append(buffer);
+    }
+    snprintf(buffer, SIZE, "\trender position: %u frames (%s)\n", mLastPosition,
+             mStatsSupported ? "AUDIO_GET_STATS" : "estimated");
+    result.append(buffer);
+    if (mRing.data != NULL) {
+        uint32_t bytesPerMs = sampleRate() * frameSize() / 1000;
+        snprintf(buffer, SIZE, "\toutput ring: %u ms, fill min/avg/max %u/%llu/%u ms, "
+                 "%u underruns, %u overruns\n", mRingLatencyMs,
+                 mRingStats.minFill / bytesPerMs,
+                 mRingStats.samples ? mRingStats.totalFill / mRingStats.samples / bytesPerMs : 0,
+                 mRingStats.maxFill / bytesPerMs, mRingStats.underruns, mRingStats.overruns);
+        result.append(buffer);
+    }
     snprintf(buffer, SIZE, "\tmStandby: %s\n", mStandby? "true": "false");
     result.append(buffer);
+    if (mStandbyGrace > 0) {
+        snprintf(buffer, SIZE, "\tstandby grace: %lld ms%s, %u warm restarts, "
+                 "%u cold starts, %u expired\n", mStandbyGrace / 1000000,
+                 mWarm ? " (warm)" : "", mWarmHits, mWarmMisses, mWarmExpired);
+        result.append(buffer);
+    }
+    snprintf(buffer, SIZE, "\ttime to first audio: last %lld us, avg %lld us "
+             "(%u starts)\n", mLastStartupTime / 1000,
+             mStartups ? mTotalStartupTime / mStartups / 1000 : 0, mStartups);
+    result.append(buffer);
     ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
@@ -1775,6 +3383,7 @@ bool AudioHardware::AudioStreamOutMSM72xx::checkStandby()
 
 status_t AudioHardware::AudioStreamOutMSM72xx::setParameters(const String8& keyValuePairs)
 {
+    LatencyProbe probe(probe_set_parameters);
     AudioParameter param = AudioParameter(keyValuePairs);
     String8 key = String8(AudioParameter::keyRouting);
     status_t status = NO_ERROR;
@@ -1806,14 +3415,68 @@ String8 AudioHardware::AudioStreamOutMSM72xx::getParameters(const String8& keys)
         param.addInt(key, (int)mDevices);
     }
 
+    key = String8(OUTPUT_PROFILE_KEY);
+    if (param.get(key, value) == NO_ERROR) {
+        param.add(key, String8(mProfile));
+    }
+
     LOGV("AudioStreamOutMSM72xx::getParameters() %s", param.toString().string());
     return param.toString();
 }
 
+// Frames played since AUDIO_START of the current driver session. The DSP
+// byte count only moves once per driver buffer, so the position is
+// interpolated from the last change, bounded by one driver buffer and by
+// what has actually been written.
+uint32_t AudioHardware::AudioStreamOutMSM72xx::renderedFrames_l(nsecs_t now)
+{
+    if (mPositionFd < 0)
+        return 0;
+
+    if (mStatsSupported) {
+        struct msm_audio_stats stats;
+        if (backend->ioctl(mPositionFd, AUDIO_GET_STATS, &stats) == 0) {
+            uint32_t frames = (stats.out_bytes - mDspBytes) / frameSize();
+            if (frames) {
+                mDspBytes += frames * frameSize();
+                mDspFrames += frames;
+                mDspFramesTime = now;
+
+                uint32_t queued = mFramesWritten - mDspFrames;
+                mQueueSamples++;
+                mQueueFramesTotal += queued;
+                if (queued > mQueueFramesMax)
+                    mQueueFramesMax = queued;
+            }
+        } else {
+            LOGW("AUDIO_GET_STATS not supported, estimating render position");
+            mStatsSupported = false;
+        }
+    }
+
+    uint32_t elapsed = (uint32_t)((now - mDspFramesTime) * sampleRate() / 1000000000LL);
+    uint32_t limit = mDriverBufferSize / frameSize();
+    if (elapsed > limit)
+        elapsed = limit;
+    uint32_t frames = mDspFrames + elapsed;
+    if ((int32_t)(frames - mFramesWritten) > 0)
+        frames = mFramesWritten;
+    return frames;
+}
+
 status_t AudioHardware::AudioStreamOutMSM72xx::getRenderPosition(uint32_t *dspFrames)
 {
-    //TODO: enable when supported by driver
-    return INVALID_OPERATION;
+    if (dspFrames == NULL)
+        return BAD_VALUE;
+
+    Mutex::Autolock _l(mPositionLock);
+    uint32_t position = mFramesRendered + renderedFrames_l(systemTime());
+    // never step back, e.g. when standby drops a partly played buffer
+    if ((int32_t)(position - mLastPosition) < 0)
+        position = mLastPosition;
+    mLastPosition = position;
+    *dspFrames = position;
+    return NO_ERROR;
 }
 
 // ----------------------------------------------------------------------------
@@ -1822,8 +3485,15 @@ AudioHardware::AudioStreamInMSM72xx::AudioStreamInMSM72xx() :
     mHardware(0), mFd(-1), mState(AUDIO_INPUT_CLOSED), mRetryCount(0),
     mFormat(AUDIO_HW_IN_FORMAT), mChannels(AUDIO_HW_IN_CHANNELS),
     mSampleRate(AUDIO_HW_IN_SAMPLERATE), mBufferSize(AUDIO_HW_IN_BUFFERSIZE),
-    mAcoustics((AudioSystem::audio_in_acoustics)0), mDevices(0)
+    mAcoustics((AudioSystem::audio_in_acoustics)0), mDevices(0),
+    mResampler(NULL), mDspBuffer(NULL), mDspBufferAlloc(0), mDspBufferSize(0), mDspChannels(0),
+    mDspSampleRate(0), mCaptureStart(0), mLastReadTime(0), mDspFramesRead(0),
+    mFramesLost(0), mTotalFramesLost(0), mOverruns(0),
+    mAacStage(NULL), mAacFrameMax(0), mAacStaged(0), mAacFrames(0), mAacReads(0),
+    mAacCarried(0)
 {
+    memset(&mWaitStats, 0, sizeof(mWaitStats));
+    memset(&mReadLatency, 0, sizeof(mReadLatency));
 }
 
 status_t AudioHardware::AudioStreamInMSM72xx::set(
@@ -1832,7 +3502,7 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
 {
     if ((pFormat == 0) ||
         ((*pFormat != AUDIO_HW_IN_FORMAT) &&
-         (*pFormat != AudioSystem::AMR_NB) &&
+         (voicememo_format_for(*pFormat) == NULL) &&
          (*pFormat != AudioSystem::AAC)))
     {
         *pFormat = AUDIO_HW_IN_FORMAT;
@@ -1845,9 +3515,21 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
     }
     uint32_t rate = hw->getInputSampleRate(*pRate);
     if (rate != *pRate) {
-        *pRate = rate;
-        return BAD_VALUE;
+        if (*pFormat != AUDIO_HW_IN_FORMAT) {
+            *pRate = rate;
+            return BAD_VALUE;
+        }
+        // PCM is resampled from the next native rate up
+        size_t i;
+        for (i = 0; i < sizeof(inputSamplingRates) / sizeof(uint32_t) - 1; i++) {
+            if (inputSamplingRates[i] >= *pRate)
+                break;
+        }
+        rate = inputSamplingRates[i];
     }
+    // the DSP only records at 8kHz during a call
+    if (*pFormat == AUDIO_HW_IN_FORMAT && hw->mMode == AudioSystem::MODE_IN_CALL)
+        rate = AUDIO_HW_IN_SAMPLERATE;
 
     if (pChannels == 0 || (*pChannels & (AudioSystem::CHANNEL_IN_MONO | AudioSystem::CHANNEL_IN_STEREO)) == 0)
     {
@@ -1870,7 +3552,7 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
     if(*pFormat == AUDIO_HW_IN_FORMAT)
     {
     // open audio input device
-        status = ::open(PCM_IN_DEVICE, O_RDWR);
+        status = backend->open(PCM_IN_DEVICE, O_RDWR);
         if (status < 0) {
             LOGE("Cannot open %s errno: %d", PCM_IN_DEVICE, errno);
             goto Error;
@@ -1878,22 +3560,24 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
         mFd = status;
 
         // configuration
-        status = ioctl(mFd, AUDIO_GET_CONFIG, &config);
+        status = backend->ioctl(mFd, AUDIO_GET_CONFIG, &config);
         if (status < 0) {
             LOGE("Cannot read config");
            goto Error;
         }
 
     LOGV("set config");
-    config.channel_count = AudioSystem::popCount(*pChannels);
-    config.sample_rate = *pRate;
-    config.buffer_size = bufferSize();
+    // record at the DSP's own channel count, read() converts to the client's
+    if (config.channel_count != 1 && config.channel_count != 2)
+        config.channel_count = AudioSystem::popCount(*pChannels);
+    config.sample_rate = rate;
+    config.buffer_size = mDspBufferSize ? mDspBufferSize : bufferSize();
     config.buffer_count = 2;
         config.type = CODEC_TYPE_PCM;
-    status = ioctl(mFd, AUDIO_SET_CONFIG, &config);
+    status = backend->ioctl(mFd, AUDIO_SET_CONFIG, &config);
     if (status < 0) {
         LOGE("Cannot set config");
-        if (ioctl(mFd, AUDIO_GET_CONFIG, &config) == 0) {
+        if (backend->ioctl(mFd, AUDIO_GET_CONFIG, &config) == 0) {
             if (config.channel_count == 1) {
                 *pChannels = AudioSystem::CHANNEL_IN_MONO;
             } else {
@@ -1905,7 +3589,7 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
     }
 
     LOGV("confirm config");
-    status = ioctl(mFd, AUDIO_GET_CONFIG, &config);
+    status = backend->ioctl(mFd, AUDIO_GET_CONFIG, &config);
     if (status < 0) {
         LOGE("Cannot read config");
         goto Error;
@@ -1918,22 +3602,70 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
     mDevices = devices;
     mFormat = AUDIO_HW_IN_FORMAT;
     mChannels = *pChannels;
-    mSampleRate = config.sample_rate;
-    mBufferSize = config.buffer_size;
+    mSampleRate = *pRate;
+    mDspChannels = config.channel_count;
+    mDspSampleRate = config.sample_rate;
+    mDspBufferSize = config.buffer_size;
+
+    {
+        size_t clientChannels = AudioSystem::popCount(*pChannels);
+        bool resample = config.sample_rate != *pRate;
+        // stereo to mono needs the DSP buffer staged, mono to stereo and
+        // plain PCM read straight into the caller's buffer
+        bool staging = resample || config.channel_count > clientChannels;
+        size_t dspFrames = config.buffer_size / (config.channel_count * sizeof(int16_t));
+        size_t frames = dspFrames;
+
+        if (mDspBuffer != NULL && (!staging || mDspBufferAlloc != config.buffer_size)) {
+            delete [] mDspBuffer;
+            mDspBuffer = NULL;
+        }
+        if (staging && mDspBuffer == NULL) {
+            mDspBuffer = new int16_t[config.buffer_size / sizeof(int16_t)];
+            mDspBufferAlloc = config.buffer_size;
+        }
+
+        if (resample) {
+            // downmix before resampling, upmix after
+            int channels = config.channel_count < clientChannels ?
+                    config.channel_count : clientChannels;
+            if (mResampler == NULL || mResampler->inRate() != config.sample_rate ||
+                mResampler->outRate() != *pRate || mResampler->channels() != channels) {
+                delete mResampler;
+                mResampler = new InputResampler(config.sample_rate, *pRate, channels, dspFrames);
+            } else {
+                mResampler->reset();
+            }
+            if (!mResampler->initCheck()) {
+                status = BAD_VALUE;
+                goto Error;
+            }
+            // same duration per buffer at the client rate
+            frames = (size_t)((uint64_t)dspFrames * *pRate / config.sample_rate);
+            LOGI("resampling input %u -> %u Hz", config.sample_rate, *pRate);
+        } else if (mResampler != NULL) {
+            delete mResampler;
+            mResampler = NULL;
+        }
+        mBufferSize = frames * clientChannels * sizeof(int16_t);
+    }
     }
-    else if( (*pFormat == AudioSystem::AMR_NB)
-             )
+    else if (voicememo_format_for(*pFormat) != NULL)
            {
+      const voicememo_format *vm = voicememo_format_for(*pFormat);
+      char value[PROPERTY_VALUE_MAX];
+      property_get("audio.voicememo.vbr", value, "0");
+      bool vbr = atoi(value) != 0;
 
       // open vocie memo input device
-      status = ::open(VOICE_MEMO_DEVICE, O_RDWR);
+      status = backend->open(VOICE_MEMO_DEVICE, O_RDWR);
       if (status < 0) {
           LOGE("Cannot open Voice Memo device for read");
           goto Error;
       }
       mFd = status;
       /* Config param */
-      if(ioctl(mFd, AUDIO_GET_CONFIG, &config))
+      if(backend->ioctl(mFd, AUDIO_GET_CONFIG, &config))
       {
         LOGE(" Error getting buf config param AUDIO_GET_CONFIG \n");
         goto  Error;
@@ -1970,35 +3702,26 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
       gcfg.rec_interval_ms = 0; // AV sync
       gcfg.auto_stop_ms = 0;
 
-      switch (*pFormat)
-      {
-        case AudioSystem::AMR_NB:
-        {
-          LOGI("Recording Format: AMR_NB");
-          gcfg.capability = RPC_VOC_CAP_AMR; // RPC_VOC_CAP_AMR (64)
-          gcfg.max_rate = RPC_VOC_AMR_RATE_1220; // Max rate (Fixed frame)
-          gcfg.min_rate = RPC_VOC_AMR_RATE_1220; // Min rate (Fixed frame length)
-          gcfg.frame_format = RPC_VOC_PB_AMR; // RPC_VOC_PB_AMR
-          mFormat = AudioSystem::AMR_NB;
-          mBufferSize = 320;
-          break;
-        }
-
-        default:
-        break;
-      }
+      LOGI("Recording Format: %s, %s rate", vm->name, vbr ? "variable" : "fixed");
+      gcfg.capability = vm->capability;
+      gcfg.max_rate = vm->maxRate;
+      gcfg.min_rate = vbr ? vm->minRate : vm->maxRate;
+      gcfg.frame_format = vm->frameFormat;
+      mFormat = vm->format;
+      // sized for full rate frames, smaller ones fit as well
+      mBufferSize = vm->frameBytes * VOICEMEMO_FRAMES_PER_BUFFER;
 
       gcfg.dtx_enable = 0;
       gcfg.data_req_ms = 20;
 
       /* Set Via  config param */
-      if (ioctl(mFd, AUDIO_SET_VOICEMEMO_CONFIG, &gcfg))
+      if (backend->ioctl(mFd, AUDIO_SET_VOICEMEMO_CONFIG, &gcfg))
       {
         LOGE("Error: AUDIO_SET_VOICEMEMO_CONFIG failed\n");
         goto  Error;
       }
 
-      if (ioctl(mFd, AUDIO_GET_VOICEMEMO_CONFIG, &gcfg))
+      if (backend->ioctl(mFd, AUDIO_GET_VOICEMEMO_CONFIG, &gcfg))
       {
         LOGE("Error: AUDIO_GET_VOICEMEMO_CONFIG failed\n");
         goto  Error;
@@ -2016,7 +3739,7 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
     }
     else if(*pFormat == AudioSystem::AAC) {
       // open AAC input device
-               status = ::open(PCM_IN_DEVICE, O_RDWR);
+               status = backend->open(PCM_IN_DEVICE, O_RDWR);
                if (status < 0) {
                      LOGE("Cannot open AAC input  device for read");
                      goto Error;
@@ -2024,7 +3747,7 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
                mFd = status;
 
       /* Config param */
-               if(ioctl(mFd, AUDIO_GET_CONFIG, &config))
+               if(backend->ioctl(mFd, AUDIO_GET_CONFIG, &config))
                {
                      LOGE(" Error getting buf config param AUDIO_GET_CONFIG \n");
                      goto  Error;
@@ -2035,6 +3758,14 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
       LOGV("The Config Channel count is %d", config.channel_count);
       LOGV("The Config Sample rate is %d", config.sample_rate);
 
+      // the driver hands out one encoded frame per read, at most this big
+      if (mAacStage == NULL || mAacFrameMax < config.buffer_size) {
+          delete [] mAacStage;
+          mAacStage = new uint8_t[config.buffer_size];
+          mAacFrameMax = config.buffer_size;
+      }
+      mAacStaged = 0;
+
       mDevices = devices;
       mChannels = *pChannels;
       mSampleRate = *pRate;
@@ -2045,7 +3776,7 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
       config.sample_rate = *pRate;
       config.type = 1; // Configuring PCM_IN_DEVICE to AAC format
 
-      if (ioctl(mFd, AUDIO_SET_CONFIG, &config)) {
+      if (backend->ioctl(mFd, AUDIO_SET_CONFIG, &config)) {
              LOGE(" Error in setting config of msm_pcm_in device \n");
                    goto Error;
         }
@@ -2057,7 +3788,8 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
     //if (!acoustic)
     //    return NO_ERROR;
 
-    audpre_index = calculate_audpre_table_index(mSampleRate);
+    // pre processing runs in the DSP, at the rate it records at
+    audpre_index = calculate_audpre_table_index(mResampler ? mResampler->inRate() : mSampleRate);
     if(audpre_index < 0) {
         LOGE("wrong sampling rate");
         status = -EINVAL;
@@ -2067,27 +3799,50 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
 
 Error:
     if (mFd >= 0) {
-        ::close(mFd);
+        backend->close(mFd);
         mFd = -1;
     }
     return status;
 }
 
-static int msm72xx_enable_preproc(bool state)
+// The DSP pre processing block that can stand in for a framework effect at
+// the current capture rate, 0 if the effect has to run in the HAL. The echo
+// canceller is part of the NS block and only there if the table enables it.
+static uint16_t preproc_block_for(effect_handle_t effect)
+{
+    effect_descriptor_t desc;
+    if ((*effect)->get_descriptor(effect, &desc) != 0)
+        return 0;
+
+    uint16_t block = 0;
+    if (!memcmp(&desc.type, FX_IID_NS, sizeof(effect_uuid_t)))
+        block = NS_ENABLE;
+    else if (!memcmp(&desc.type, FX_IID_AGC, sizeof(effect_uuid_t)))
+        block = AGC_ENABLE;
+    else if (!memcmp(&desc.type, FX_IID_AEC, sizeof(effect_uuid_t)) &&
+             (ns_cfg[audpre_index].ec_mode_new & NS_EC_MODE_NLMS))
+        block = NS_ENABLE;
+    return preproc_tuned[audpre_index] & block;
+}
+
+// effects: blocks wanted by effects the framework attached to the input,
+// enabled on top of the ones the tuning table enables
+static int msm72xx_enable_preproc(bool state, uint16_t effects)
 {
     uint16_t mask = 0x0000;
+    int enabled = enable_preproc_mask[audpre_index] | effects;
 
     if (audpp_filter_inited)
     {
         int fd;
 
-        fd = open(PREPROC_CTL_DEVICE, O_RDWR);
+        fd = backend->open(PREPROC_CTL_DEVICE, O_RDWR);
         if (fd < 0) {
              LOGE("Cannot open PreProc Ctl device");
              return -EPERM;
         }
 
-        if (enable_preproc_mask[audpre_index] & AGC_ENABLE) {
+        if (enabled & AGC_ENABLE) {
             /* Setting AGC Params */
             LOGI("AGC Filter Param1= %02x.", tx_agc_cfg[audpre_index].cmd_id);
             LOGI("AGC Filter Param2= %02x.", tx_agc_cfg[audpre_index].tx_agc_param_mask);
@@ -2096,14 +3851,14 @@ static int msm72xx_enable_preproc(bool state)
             LOGI("AGC Filter Param5= %02x.", tx_agc_cfg[audpre_index].adaptive_gain_flag);
             LOGI("AGC Filter Param6= %02x.", tx_agc_cfg[audpre_index].agc_params[0]);
             LOGI("AGC Filter Param7= %02x.", tx_agc_cfg[audpre_index].agc_params[18]);
-            if ((enable_preproc_mask[audpre_index] & AGC_ENABLE) &&
-                (ioctl(fd, AUDIO_SET_AGC, &tx_agc_cfg[audpre_index]) < 0))
+            if ((enabled & AGC_ENABLE) &&
+                (backend->ioctl(fd, AUDIO_SET_AGC, &tx_agc_cfg[audpre_index]) < 0))
             {
                 LOGE("set AGC filter error.");
             }
         }
 
-        if (enable_preproc_mask[audpre_index] & NS_ENABLE) {
+        if (enabled & NS_ENABLE) {
             /* Setting NS Params */
             LOGI("NS Filter Param1= %02x.", ns_cfg[audpre_index].cmd_id);
             LOGI("NS Filter Param2= %02x.", ns_cfg[audpre_index].ec_mode_new);
@@ -2113,14 +3868,14 @@ static int msm72xx_enable_preproc(bool state)
             LOGI("NS Filter Param6= %02x.", ns_cfg[audpre_index].dens_limit_ns_d);
             LOGI("NS Filter Param7= %02x.", ns_cfg[audpre_index].wb_gamma_e);
             LOGI("NS Filter Param8= %02x.", ns_cfg[audpre_index].wb_gamma_n);
-            if ((enable_preproc_mask[audpre_index] & NS_ENABLE) &&
-                (ioctl(fd, AUDIO_SET_NS, &ns_cfg[audpre_index]) < 0))
+            if ((enabled & NS_ENABLE) &&
+                (backend->ioctl(fd, AUDIO_SET_NS, &ns_cfg[audpre_index]) < 0))
             {
                 LOGE("set NS filter error.");
             }
         }
 
-        if (enable_preproc_mask[audpre_index] & TX_IIR_ENABLE) {
+        if (enabled & TX_IIR_ENABLE) {
             /* Setting TX_IIR Params */
             LOGI("TX_IIR Filter Param1= %02x.", tx_iir_cfg[audpre_index].cmd_id);
             LOGI("TX_IIR Filter Param2= %02x.", tx_iir_cfg[audpre_index].active_flag);
@@ -2128,8 +3883,8 @@ static int msm72xx_enable_preproc(bool state)
             LOGI("TX_IIR Filter Param4= %02x.", tx_iir_cfg[audpre_index].iir_params[0]);
             LOGI("TX_IIR Filter Param5= %02x.", tx_iir_cfg[audpre_index].iir_params[1]);
             LOGI("TX_IIR Filter Param6 %02x.", tx_iir_cfg[audpre_index].iir_params[47]);
-            if ((enable_preproc_mask[audpre_index] & TX_IIR_ENABLE) &&
-                (ioctl(fd, AUDIO_SET_TX_IIR, &tx_iir_cfg[audpre_index]) < 0))
+            if ((enabled & TX_IIR_ENABLE) &&
+                (backend->ioctl(fd, AUDIO_SET_TX_IIR, &tx_iir_cfg[audpre_index]) < 0))
             {
                LOGE("set TX IIR filter error.");
             }
@@ -2137,16 +3892,16 @@ static int msm72xx_enable_preproc(bool state)
 
         if (state == true) {
             /*Setting AUDPRE_ENABLE*/
-            if (ioctl(fd, AUDIO_ENABLE_AUDPRE, &enable_preproc_mask[audpre_index]) < 0) {
+            if (backend->ioctl(fd, AUDIO_ENABLE_AUDPRE, &enabled) < 0) {
                 LOGE("set AUDPRE_ENABLE error.");
             }
         } else {
             /*Setting AUDPRE_ENABLE*/
-            if (ioctl(fd, AUDIO_ENABLE_AUDPRE, &mask) < 0) {
+            if (backend->ioctl(fd, AUDIO_ENABLE_AUDPRE, &mask) < 0) {
                 LOGE("set AUDPRE_ENABLE error.");
             }
         }
-        close(fd);
+        backend->close(fd);
     }
 
     return NO_ERROR;
@@ -2156,19 +3911,260 @@ AudioHardware::AudioStreamInMSM72xx::~AudioStreamInMSM72xx()
 {
     LOGV("AudioStreamInMSM72xx destructor");
     standby();
+    delete mResampler;
+    delete [] mDspBuffer;
+    delete [] mAacStage;
+}
+
+// Lost input: from the first buffer the DSP delivers, wall clock time says
+// how many frames should have been read by now. Up to one buffer is
+// normally still being filled; a larger shortfall was dropped by the
+// driver, and is reported once in client frames. The timeline starts at
+// the first read so DSP startup is not counted, and starts again after
+// each report so DSP/CPU clock drift cannot add up to a false loss.
+void AudioHardware::AudioStreamInMSM72xx::accountRead(size_t bytes)
+{
+    nsecs_t now = systemTime();
+    size_t dspFrameSize = mDspChannels * sizeof(int16_t);
+    size_t bufferFrames = mDspBufferSize / dspFrameSize;
+
+    mLastReadTime = now;
+    if (mCaptureStart == 0) {
+        mCaptureStart = now;
+        mDspFramesRead = 0;
+        return;
+    }
+    mDspFramesRead += bytes / dspFrameSize;
+    uint64_t expected = (uint64_t)(now - mCaptureStart) * mDspSampleRate / 1000000000LL;
+    if (expected <= mDspFramesRead + 2 * bufferFrames)
+        return;
+
+    uint64_t lost = expected - mDspFramesRead - bufferFrames;
+    mCaptureStart = now;
+    mDspFramesRead = 0;
+    uint32_t clientLost = (uint32_t)(lost * mSampleRate / mDspSampleRate);
+    android_atomic_add(clientLost, &mFramesLost);
+    mTotalFramesLost += clientLost;
+    LOGW("input lost %u frames", clientLost);
+}
+
+unsigned int AudioHardware::AudioStreamInMSM72xx::getInputFramesLost() const
+{
+    // frames lost since the last call
+    return (unsigned int)android_atomic_and(0, &mFramesLost);
+}
+
+status_t AudioHardware::AudioStreamInMSM72xx::addAudioEffect(effect_handle_t effect)
+{
+    uint16_t block = preproc_block_for(effect);
+    status_t status = mEffects.add(effect, block);
+    if (status == NO_ERROR && block && mState == AUDIO_INPUT_STARTED)
+        msm72xx_enable_preproc(true, mEffects.dspMask());
+    return status;
+}
+
+status_t AudioHardware::AudioStreamInMSM72xx::removeAudioEffect(effect_handle_t effect)
+{
+    uint16_t mask = mEffects.dspMask();
+    status_t status = mEffects.remove(effect);
+    if (status == NO_ERROR && mask != mEffects.dspMask() && mState == AUDIO_INPUT_STARTED)
+        msm72xx_enable_preproc(true, mEffects.dspMask());
+    return status;
+}
+
+// PCM captured at the DSP rate and converted to the rate the client opened
+// the stream with. Always fills the whole buffer.
+ssize_t AudioHardware::AudioStreamInMSM72xx::readResampled(void* buffer, ssize_t bytes)
+{
+    int channels = AudioSystem::popCount(mChannels);
+    int rsChannels = mResampler->channels();
+    size_t dspFrameSize = mDspChannels * sizeof(int16_t);
+    int16_t *out = static_cast<int16_t *>(buffer);
+    size_t frames = bytes / (channels * sizeof(int16_t));
+    size_t done = 0;
+    bool woken = false;
+    int timeout = pcm_wait_timeout_ms(mDspBufferSize, 2, dspFrameSize, mResampler->inRate());
+
+    while (done < frames) {
+        done += mResampler->process(NULL, 0, out + done * rsChannels, frames - done);
+        if (done == frames)
+            break;
+
+        ssize_t bytesRead = backend->read(mFd, mDspBuffer, mDspBufferSize);
+        if (bytesRead > 0) {
+            woken = false;
+            accountRead(bytesRead);
+            size_t dspFrames = bytesRead / dspFrameSize;
+            if (mDspChannels > rsChannels)
+                channel_stereo_to_mono(mDspBuffer, mDspBuffer, dspFrames);
+            done += mResampler->process(mDspBuffer, dspFrames,
+                                        out + done * rsChannels, frames - done);
+        } else if (bytesRead == 0) {
+            break;
+        } else {
+            if (errno != EAGAIN) return bytesRead;
+            mRetryCount++;
+            pcm_wait(mFd, POLLIN, timeout, &woken, &mWaitStats);
+        }
+    }
+    if (rsChannels < channels)
+        channel_mono_to_stereo(out, done);
+    return done * channels * sizeof(int16_t);
 }
 
-ssize_t AudioHardware::AudioStreamInMSM72xx::read( void* buffer, ssize_t bytes)
+// PCM captured at the DSP's channel count. Mono is read into the front of
+// the caller's buffer and spread out in place; stereo for a mono client is
+// staged and mixed down.
+ssize_t AudioHardware::AudioStreamInMSM72xx::readConverted(void* buffer, ssize_t bytes)
+{
+    int channels = AudioSystem::popCount(mChannels);
+    size_t frames = bytes / (channels * sizeof(int16_t));
+    size_t dspFrameSize = mDspChannels * sizeof(int16_t);
+    int16_t *out = static_cast<int16_t *>(buffer);
+    size_t done = 0;
+    bool woken = false;
+    int timeout = pcm_wait_timeout_ms(mDspBufferSize, 2, dspFrameSize, mSampleRate);
+
+    while (done < frames) {
+        ssize_t bytesRead;
+        if (mDspChannels < channels) {
+            bytesRead = backend->read(mFd, out + done, (frames - done) * dspFrameSize);
+        } else {
+            bytesRead = backend->read(mFd, mDspBuffer, mDspBufferSize);
+        }
+        if (bytesRead > 0) {
+            woken = false;
+            accountRead(bytesRead);
+            size_t got = bytesRead / dspFrameSize;
+            if (mDspChannels > channels) {
+                if (got > frames - done) {
+                    LOGW("dropping %u frames, read smaller than the DSP buffer", got - (frames - done));
+                    got = frames - done;
+                }
+                channel_stereo_to_mono(out + done, mDspBuffer, got);
+            }
+            done += got;
+        } else if (bytesRead == 0) {
+            break;
+        } else {
+            if (errno != EAGAIN) return bytesRead;
+            mRetryCount++;
+            pcm_wait(mFd, POLLIN, timeout, &woken, &mWaitStats);
+        }
+    }
+    if (mDspChannels < channels)
+        channel_mono_to_stereo(out, done);
+    return done * channels * sizeof(int16_t);
+}
+
+ssize_t AudioHardware::AudioStreamInMSM72xx::read(void* buffer, ssize_t bytes)
+{
+    LatencyProbe probe(mReadLatency);
+    ssize_t n = readDriver(buffer, bytes);
+    if (n > 0 && mFormat == AUDIO_HW_IN_FORMAT && mEffects.hasSoftware()) {
+        int channels = AudioSystem::popCount(mChannels);
+        mEffects.process(static_cast<int16_t*>(buffer), n / (channels * sizeof(int16_t)),
+                         channels, mSampleRate / 100);
+    }
+    return n;
+}
+
+// AAC: the buffer starts with 'QCOM' and a frame count, then each frame
+// follows its 16 bit size. Frames are read straight into place while the
+// largest one the driver can return still fits; past that they go through
+// mAacStage, and one that does not fit any more is kept for the next call
+// instead of being cut short or left in the driver.
+ssize_t AudioHardware::AudioStreamInMSM72xx::readAac(void* buffer, ssize_t bytes)
+{
+    uint8_t *p = static_cast<uint8_t*>(buffer);
+    size_t space = bytes;
+    uint16_t frames = 0;
+    bool woken = false;
+    // compressed formats have no fixed frame size: allow two 20ms packets
+    int readTimeout = 2 * 20 + 10;
+
+    if (space < 3 * sizeof(uint16_t))
+        return -1;
+    *((uint32_t*)p) = 0x51434F4D ;// ('Q','C','O', 'M') Number to identify format as AAC by higher layers
+    uint16_t *frameCountPtr = (uint16_t*)(p + sizeof(uint32_t));
+    p += 3 * sizeof(uint16_t);
+    space -= 3 * sizeof(uint16_t);
+
+    if (mAacStaged) {
+        if (mAacStaged + sizeof(uint16_t) <= space) {
+            uint16_t size = mAacStaged;
+            memcpy(p, &size, sizeof(size));
+            memcpy(p + sizeof(size), mAacStage, mAacStaged);
+            p += sizeof(size) + mAacStaged;
+            space -= sizeof(size) + mAacStaged;
+            frames++;
+        } else {
+            LOGW("dropping a %u byte AAC frame, read() buffer too small", mAacStaged);
+        }
+        mAacStaged = 0;
+    }
+
+    while (space > sizeof(uint16_t)) {
+        size_t room = space - sizeof(uint16_t);
+        bool stage = room < mAacFrameMax;
+        uint8_t *dst = stage ? mAacStage : p + sizeof(uint16_t);
+
+        ssize_t bytesRead = backend->read(mFd, dst, stage ? mAacFrameMax : room);
+        mAacReads++;
+        if (bytesRead > 0) {
+            woken = false;
+            mAacFrames++;
+            if ((size_t)bytesRead > room) {
+                mAacStaged = bytesRead;
+                mAacCarried++;
+                break;
+            }
+            if (stage)
+                memcpy(p + sizeof(uint16_t), mAacStage, bytesRead);
+            uint16_t size = bytesRead;
+            memcpy(p, &size, sizeof(size));
+            p += sizeof(size) + bytesRead;
+            space -= sizeof(size) + bytesRead;
+            frames++;
+
+            if(!mFirstread)
+            {
+               mFirstread = true;
+               break;
+            }
+        }
+        else if (bytesRead == 0)
+        {
+         LOGI("Bytes Read = %d ,Buffer no longer sufficient", bytesRead);
+         break;
+        } else {
+            if (errno != EAGAIN) {
+                if (!frames)
+                    return bytesRead;
+                break;
+            }
+            mRetryCount++;
+            LOGV("EAGAIN - waiting");
+            pcm_wait(mFd, POLLIN, readTimeout, &woken, &mWaitStats);
+        }
+    }
+    *frameCountPtr = frames;
+    return bytes;
+}
+
+ssize_t AudioHardware::AudioStreamInMSM72xx::readDriver(void* buffer, ssize_t bytes)
 {
     LOGV("AudioStreamInMSM72xx::read(%p, %ld)", buffer, bytes);
     if (!mHardware) return -1;
 
     size_t count = bytes;
-    size_t  aac_framesize= bytes;
     uint8_t* p = static_cast<uint8_t*>(buffer);
-    uint32_t* recogPtr = (uint32_t *)p;
-    uint16_t* frameCountPtr = 0;
-    uint16_t* frameSizePtr = 0;
+    bool woken = false;
+    // compressed formats have no fixed frame size: allow two 20ms packets
+    int readTimeout = mFormat == AudioSystem::PCM_16_BIT ?
+            pcm_wait_timeout_ms(mBufferSize, 2, AudioSystem::popCount(mChannels) * sizeof(int16_t),
+                                mSampleRate) :
+            2 * 20 + 10;
 
     if (mState < AUDIO_INPUT_OPENED) {
         AudioHardware *hw = mHardware;
@@ -2186,47 +4182,49 @@ ssize_t AudioHardware::AudioStreamInMSM72xx::read( void* buffer, ssize_t bytes)
         // force routing to input device
         mHardware->clearCurDevice();
         mHardware->doRouting(this);
-        if (ioctl(mFd, AUDIO_START, 0)) {
+        // the mic has to be routed before capture starts
+        mHardware->syncRouting();
+        if (backend->ioctl(mFd, AUDIO_START, 0)) {
             LOGE("Error starting record");
             standby();
             return -1;
         }
-        msm72xx_enable_preproc(true);
+        msm72xx_enable_preproc(true, mEffects.dspMask());
+        // anchored by the first read, see accountRead()
+        mCaptureStart = 0;
+        mLastReadTime = 0;
+    } else if (mLastReadTime && mDspBufferSize) {
+        // the driver only queues two buffers, a longer gap overruns it
+        nsecs_t gap = systemTime() - mLastReadTime;
+        size_t dspFrames = mDspBufferSize / (mDspChannels * sizeof(int16_t));
+        if (gap > (nsecs_t)(2 * dspFrames) * 1000000000LL / mDspSampleRate) {
+            mOverruns++;
+            LOGW("read() called %lld ms after the last one, input overrun", ns2ms(gap));
+        }
     }
 
+    if (mFormat == AudioSystem::AAC)
+        return readAac(buffer, bytes);
+    if (mResampler != NULL)
+        return readResampled(buffer, bytes);
+    if (mFormat == AUDIO_HW_IN_FORMAT && mDspChannels &&
+        mDspChannels != AudioSystem::popCount(mChannels))
+        return readConverted(buffer, bytes);
+
     // Resetting the bytes value, to return the appropriate read value
     bytes = 0;
-    if (mFormat == AudioSystem::AAC)
-    {
-        *((uint32_t*)recogPtr) = 0x51434F4D ;// ('Q','C','O', 'M') Number to identify format as AAC by higher layers
-        recogPtr++;
-        frameCountPtr = (uint16_t*)recogPtr;
-        *frameCountPtr = 0;
-        p += 3*sizeof(uint16_t);
-        count -= 3*sizeof(uint16_t);
-    }
     while (count > 0) {
-
-        if (mFormat == AudioSystem::AAC) {
-            frameSizePtr = (uint16_t *)p;
-            p += sizeof(uint16_t);
-            if(!(count > 2)) break;
-            count -= sizeof(uint16_t);
-        }
-
-        ssize_t bytesRead = ::read(mFd, p, count);
+        ssize_t bytesRead = backend->read(mFd, p, count);
         if (bytesRead > 0) {
+            woken = false;
+            if (mFormat == AUDIO_HW_IN_FORMAT)
+                accountRead(bytesRead);
             LOGV("Number of Bytes read = %d", bytesRead);
             count -= bytesRead;
             p += bytesRead;
             bytes += bytesRead;
             LOGV("Total Number of Bytes read = %d", bytes);
 
-            if (mFormat == AudioSystem::AAC){
-                *frameSizePtr =  bytesRead;
-                (*frameCountPtr)++;
-            }
-
             if(!mFirstread)
             {
                mFirstread = true;
@@ -2241,23 +4239,22 @@ ssize_t AudioHardware::AudioStreamInMSM72xx::read( void* buffer, ssize_t bytes)
         } else {
             if (errno != EAGAIN) return bytesRead;
             mRetryCount++;
-            LOGW("EAGAIN - retrying");
+            LOGV("EAGAIN - waiting");
+            pcm_wait(mFd, POLLIN, readTimeout, &woken, &mWaitStats);
         }
     }
-    if (mFormat == AudioSystem::AAC)
-         return aac_framesize;
-
     return bytes;
 }
 
 status_t AudioHardware::AudioStreamInMSM72xx::standby()
 {
     if (mState > AUDIO_INPUT_CLOSED) {
-        msm72xx_enable_preproc(false);
+        msm72xx_enable_preproc(false, 0);
         if (mFd >= 0) {
-            ::close(mFd);
+            backend->close(mFd);
             mFd = -1;
         }
+        mAacStaged = 0;
         mState = AUDIO_INPUT_CLOSED;
     }
     if (!mHardware) return -1;
@@ -2287,14 +4284,34 @@ status_t AudioHardware::AudioStreamInMSM72xx::dump(int fd, const Vector<String16
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmState: %d\n", mState);
     result.append(buffer);
+    snprintf(buffer, SIZE, "\tDSP channels: %d\n", mDspChannels);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tframes lost: %llu, %u overruns\n", mTotalFramesLost, mOverruns);
+    result.append(buffer);
+    if (mResampler != NULL) {
+        snprintf(buffer, SIZE, "\tresampler: %u -> %u Hz, %d taps x %d phases, "
+                 "%llu frames, %lld ns/frame\n", mResampler->inRate(), mResampler->outRate(),
+                 mResampler->taps(), mResampler->phases(), mResampler->framesOut(),
+                 mResampler->framesOut() ? mResampler->processTime() / (nsecs_t)mResampler->framesOut() : 0);
+        result.append(buffer);
+    }
+    mEffects.dump(result);
+    if (mFormat == AudioSystem::AAC) {
+        snprintf(buffer, SIZE, "\tAAC: %u frames in %u reads, %u carried over\n",
+                 mAacFrames, mAacReads, mAacCarried);
+        result.append(buffer);
+    }
     snprintf(buffer, SIZE, "\tmRetryCount: %d\n", mRetryCount);
     result.append(buffer);
+    pcm_wait_dump(result, mWaitStats);
+    latency_dump(result, "read", mReadLatency);
     ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
 
 status_t AudioHardware::AudioStreamInMSM72xx::setParameters(const String8& keyValuePairs)
 {
+    LatencyProbe probe(probe_set_parameters);
     AudioParameter param = AudioParameter(keyValuePairs);
     String8 key = String8(AudioParameter::keyRouting);
     status_t status = NO_ERROR;
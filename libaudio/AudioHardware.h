@@ -34,9 +34,14 @@ extern "C" {
 #include <linux/msm_audio_qcp.h>
 }
 
+#include "EffectChain.h"
+
 namespace android_audio_legacy {
 using android::SortedVector;
 using android::Mutex;
+using android::Condition;
+using android::Thread;
+using android::sp;
 
 // P500 SPEAKER_IN_CALL fix
 #define AUDIO_DEVICE_OUT_SPEAKER_IN_CALL 0x4000
@@ -71,6 +76,8 @@ using android::Mutex;
 #define NS_ENABLE      0x0002
 #define TX_IIR_ENABLE  0x0004
 
+#define NS_EC_MODE_NLMS 0x0001  // ns ec_mode_new: linear echo canceller
+
 struct eq_filter_type {
     int16_t gain;
     uint16_t freq;
@@ -153,6 +160,7 @@ enum tty_modes {
 
 #define CODEC_TYPE_PCM 0
 #define AUDIO_HW_NUM_OUT_BUF 2  // Number of buffers in audio driver for output
+#define AUDIO_HW_OUT_BUFFERSIZE 4800 // Driver only seems to like 4800 for the default profile
 // TODO: determine actual audio DSP and hardware latency
 #define AUDIO_HW_OUT_LATENCY_MS 0  // Additionnal latency introduced by audio DSP and hardware in ms
 
@@ -160,6 +168,70 @@ enum tty_modes {
 #define AUDIO_HW_IN_CHANNELS (AudioSystem::CHANNEL_IN_MONO) // Default audio input channel mask
 #define AUDIO_HW_IN_BUFFERSIZE 2048                 // Default audio input buffer size
 #define AUDIO_HW_IN_FORMAT (AudioSystem::PCM_16_BIT)  // Default audio input sample format
+
+// Time a stream spent waiting on the PCM driver after EAGAIN
+struct pcm_wait_stats {
+    uint32_t waits;
+    uint32_t spurious;      // poll() reported ready but the retry got EAGAIN
+    uint32_t timeouts;
+    nsecs_t  blocked;
+};
+
+// Call latency in log2 buckets of microseconds: bucket 0 is below 1 us,
+// bucket n from 2^(n-1) us, the last one holds everything longer. Only
+// updated with atomic adds, never under a lock.
+#define LATENCY_BUCKETS 20
+struct latency_histogram {
+    volatile int32_t buckets[LATENCY_BUCKETS];
+    volatile int32_t maxUs;
+};
+
+// Modem RPCs waiting for the routing thread. Each kind keeps only its
+// latest request, an earlier one still queued is superseded.
+enum {
+    ROUTING_INVALIDATE      = 0x01,     // resend the next SND_SET_DEVICE
+    ROUTING_DEVICE          = 0x02,
+    ROUTING_POSTPROC        = 0x04,
+    ROUTING_MASTER_VOLUME   = 0x08,
+    ROUTING_VOICE_VOLUME    = 0x10,
+};
+#define ROUTING_MAX_VOLUMES 16
+
+struct routing_request {
+    uint32_t    pending;
+    // ROUTING_DEVICE, SND_DEVICE_CURRENT only changes the mutes
+    uint32_t    device;
+    bool        earMute;
+    bool        micMute;
+    // ROUTING_POSTPROC
+    int         sndDevice;
+    int         postProcMask;
+    // ROUTING_MASTER_VOLUME
+    int         numVolumes;
+    uint32_t    volumeDevices[ROUTING_MAX_VOLUMES];
+    int         volumes[ROUTING_MAX_VOLUMES];
+    // ROUTING_VOICE_VOLUME
+    int         voiceVolume;
+};
+
+// Optional single producer/single consumer ring between AudioFlinger's
+// write() and a SCHED_FIFO thread feeding the PCM driver. Positions are
+// free-running byte counts; size is a power of two.
+struct pcm_ring {
+    uint8_t          *data;
+    uint32_t          size;
+    volatile int32_t  front;    // advanced by the writer thread
+    volatile int32_t  rear;     // advanced by write()
+};
+
+struct pcm_ring_stats {
+    uint32_t underruns;         // writer thread found less than a driver buffer
+    uint32_t overruns;          // write() found the ring full and had to wait
+    uint32_t samples;
+    uint32_t minFill;
+    uint32_t maxFill;
+    uint64_t totalFill;
+};
 // ----------------------------------------------------------------------------
 
 using android_audio_legacy::AudioHardwareBase;
@@ -167,6 +239,9 @@ using android_audio_legacy::AudioStreamOut;
 using android_audio_legacy::AudioStreamIn;
 using android_audio_legacy::AudioSystem;
 using android_audio_legacy::AudioHardwareInterface;
+class InputResampler;
+class SoftPostProc;
+
 class AudioHardware : public  AudioHardwareBase
 {
     class AudioStreamOutMSM72xx;
@@ -213,6 +288,10 @@ public:
 
     virtual    size_t      getInputBufferSize(uint32_t sampleRate, int format, int channelCount);
                void        clearCurDevice() { mCurSndDevice = -1; }
+    // the legacy AudioStreamOut has no effect hooks, audio_hw_hal.cpp
+    // reaches the output stream through these
+               status_t    addOutputEffect(AudioStreamOut *out, effect_handle_t effect);
+               status_t    removeOutputEffect(AudioStreamOut *out, effect_handle_t effect);
 
 protected:
     virtual status_t    dump(int fd, const Vector<String16>& args);
@@ -226,11 +305,29 @@ private:
     uint32_t    getInputSampleRate(uint32_t sampleRate);
     bool        checkOutputStandby();
     status_t    doRouting(AudioStreamInMSM72xx *input);
+    void        applyMasterVolume_l();
+    void        routeRequest_l(routing_request *req, uint32_t device);
+    void        masterVolumeRequest_l(routing_request *req);
+    status_t    submitRouting(const routing_request &req);
+    status_t    executeRouting(const routing_request &req);
+    // waits for the RPCs submitted so far
+    status_t    syncRouting();
 #ifdef HAVE_FM_RADIO
     status_t    setFmOnOff(bool onoff);
 #endif
     AudioStreamInMSM72xx*   getActiveInput_l();
 
+    // Sends SND_SET_DEVICE and SND_SET_VOLUME to the modem, so callers
+    // only hold mLock to decide what to send.
+    class RoutingThread : public Thread {
+    public:
+                            RoutingThread(AudioHardware *hw)
+                                : Thread(false), mHardware(hw) {}
+    private:
+        virtual bool        threadLoop();
+            AudioHardware  *mHardware;
+    };
+
     class AudioStreamOutMSM72xx : public AudioStreamOut {
     public:
                             AudioStreamOutMSM72xx();
@@ -241,28 +338,120 @@ private:
                                 uint32_t *pChannels,
                                 uint32_t *pRate);
         virtual uint32_t    sampleRate() const { return 44100; }
-        // must be 32-bit aligned - driver only seems to like 4800
-        virtual size_t      bufferSize() const { return 4800; }
+        // set from the output profile, must be 32-bit aligned
+        virtual size_t      bufferSize() const { return mBufferSize; }
         virtual uint32_t    channels() const { return AudioSystem::CHANNEL_OUT_STEREO; }
         virtual int         format() const { return AudioSystem::PCM_16_BIT; }
-        virtual uint32_t    latency() const { return (1000*AUDIO_HW_NUM_OUT_BUF*(bufferSize()/frameSize()))/sampleRate()+AUDIO_HW_OUT_LATENCY_MS; }
+        virtual uint32_t    latency() const { return (1000*mBufferCount*(mDriverBufferSize/frameSize()))/sampleRate()+AUDIO_HW_OUT_LATENCY_MS+mRingLatencyMs; }
         virtual status_t    setVolume(float left, float right) { return INVALID_OPERATION; }
         virtual ssize_t     write(const void* buffer, size_t bytes);
         virtual status_t    standby();
         virtual status_t    dump(int fd, const Vector<String16>& args);
                 bool        checkStandby();
+                void        closeWarmDriver();
         virtual status_t    setParameters(const String8& keyValuePairs);
         virtual String8     getParameters(const String8& keys);
                 uint32_t    devices() { return mDevices; }
         virtual status_t    getRenderPosition(uint32_t *dspFrames);
+                status_t    addAudioEffect(effect_handle_t effect);
+                status_t    removeAudioEffect(effect_handle_t effect);
 
     private:
+        class RingWriterThread : public Thread {
+        public:
+                                RingWriterThread(AudioStreamOutMSM72xx *stream)
+                                    : Thread(false), mStream(stream) {}
+        private:
+            virtual status_t    readyToRun();
+            virtual bool        threadLoop();
+                AudioStreamOutMSM72xx *mStream;
+        };
+
+        class StandbyThread : public Thread {
+        public:
+                                StandbyThread(AudioStreamOutMSM72xx *stream)
+                                    : Thread(false), mStream(stream) {}
+        private:
+            virtual bool        threadLoop();
+                AudioStreamOutMSM72xx *mStream;
+        };
+
+                ssize_t     writeDriver(const void* buffer, size_t bytes);
+                void        closeDriver_l();
+                void        updateSoftPostProc();
+                bool        expireStandby_l();
+                ssize_t     writeRing(const void* buffer, size_t bytes);
+                bool        drainRing();
+                void        stopRing();
+                uint32_t    renderedFrames_l(nsecs_t now);
+
                 AudioHardware* mHardware;
                 int         mFd;
                 int         mStartCount;
                 int         mRetryCount;
                 bool        mStandby;
                 uint32_t    mDevices;
+                const char* mProfile;
+                size_t      mBufferSize;
+                // as negotiated with AUDIO_SET_CONFIG
+                size_t      mDriverBufferSize;
+                uint32_t    mBufferCount;
+                // standby exit to AUDIO_START with post processing enabled
+                nsecs_t     mStandbyExitTime;
+                nsecs_t     mLastStartupTime;
+                nsecs_t     mTotalStartupTime;
+                uint32_t    mStartups;
+                pcm_wait_stats mWaitStats;
+                // driver side of the ring, mFd and mStandby are guarded by
+                // mDriverLock while the writer thread is running
+                pcm_ring    mRing;
+                pcm_ring_stats mRingStats;
+                uint32_t    mRingLatencyMs;
+                bool        mRingStarved;
+                bool        mRingExit;          // guarded by mRingLock
+                Mutex       mDriverLock;
+                Mutex       mRingLock;
+                Condition   mRingCond;
+                sp<RingWriterThread> mRingThread;
+                // standby grace period: the driver stays open, configured
+                // and started until mWarmDeadline
+                nsecs_t     mStandbyGrace;
+                bool        mWarm;
+                nsecs_t     mWarmDeadline;
+                uint32_t    mWarmHits;
+                uint32_t    mWarmMisses;
+                uint32_t    mWarmExpired;
+                Condition   mStandbyCond;
+                sp<StandbyThread> mStandbyThread;
+                // render position, frame counts wrap like the uint32_t
+                // reported by getRenderPosition()
+                Mutex       mPositionLock;
+                int         mPositionFd;        // mFd once started, -1 in standby
+                bool        mStatsSupported;
+                uint32_t    mFramesWritten;     // since the driver was opened
+                uint32_t    mFramesRendered;    // by earlier driver sessions
+                uint32_t    mDspFrames;
+                uint32_t    mDspBytes;
+                uint32_t    mLastPosition;
+                nsecs_t     mDspFramesTime;
+                // written but not yet played, sampled on each DSP update
+                uint32_t    mQueueSamples;
+                uint32_t    mQueueFramesMax;
+                uint64_t    mQueueFramesTotal;
+                // effects and the post processing the DSP did not take,
+                // run from the driver side of write() on a copy of the
+                // client buffer
+                EffectChain mEffects;
+                SoftPostProc *mSoftPostProc;
+                int32_t     mSoftPostProcGeneration;
+                int16_t    *mProcessBuffer;
+                size_t      mProcessBufferSize;
+                // with audio.hal.probes: write() latency, and time spent
+                // outside write() longer than a buffer period
+                latency_histogram mWriteLatency;
+                nsecs_t     mLastWriteEnd;
+                uint32_t    mWriteGaps;
+                nsecs_t     mMaxWriteGap;
     };
 
     class AudioStreamInMSM72xx : public AudioStreamIn {
@@ -291,13 +480,19 @@ private:
         virtual status_t    standby();
         virtual status_t    setParameters(const String8& keyValuePairs);
         virtual String8     getParameters(const String8& keys);
-        virtual unsigned int  getInputFramesLost() const { return 0; }
+        virtual unsigned int  getInputFramesLost() const;
                 uint32_t    devices() { return mDevices; }
                 int         state() const { return mState; }
-        virtual status_t    addAudioEffect(effect_interface_s**) { return 0;}
-        virtual status_t    removeAudioEffect(effect_interface_s**) { return 0;}
+        virtual status_t    addAudioEffect(effect_handle_t effect);
+        virtual status_t    removeAudioEffect(effect_handle_t effect);
 
     private:
+                ssize_t     readDriver(void* buffer, ssize_t bytes);
+                ssize_t     readResampled(void* buffer, ssize_t bytes);
+                ssize_t     readConverted(void* buffer, ssize_t bytes);
+                ssize_t     readAac(void* buffer, ssize_t bytes);
+                void        accountRead(size_t bytes);
+
                 AudioHardware* mHardware;
                 int         mFd;
                 int         mState;
@@ -309,6 +504,33 @@ private:
                 AudioSystem::audio_in_acoustics mAcoustics;
                 uint32_t    mDevices;
                 bool        mFirstread;
+                pcm_wait_stats mWaitStats;
+                // set when the DSP records at another rate than the client's
+                InputResampler *mResampler;
+                // staging for resampling and stereo to mono
+                int16_t    *mDspBuffer;
+                size_t      mDspBufferAlloc;
+                size_t      mDspBufferSize;     // as configured in the driver
+                int         mDspChannels;
+                uint32_t    mDspSampleRate;
+                // PCM frames lost by the driver, see accountRead()
+                nsecs_t     mCaptureStart;
+                nsecs_t     mLastReadTime;
+                uint64_t    mDspFramesRead;
+        mutable volatile int32_t mFramesLost;   // since getInputFramesLost()
+                uint64_t    mTotalFramesLost;
+                uint32_t    mOverruns;
+                // NS, AGC and AEC go to the DSP pre processing when tuned
+                EffectChain mEffects;
+                latency_histogram mReadLatency;
+                // AAC: a frame too big for what is left of the caller's
+                // buffer is read here and handed out by the next read()
+                uint8_t    *mAacStage;
+                size_t      mAacFrameMax;       // the driver's frame buffer
+                size_t      mAacStaged;
+                uint32_t    mAacFrames;
+                uint32_t    mAacReads;
+                uint32_t    mAacCarried;
     };
 
             static const uint32_t inputSamplingRates[];
@@ -326,6 +548,8 @@ private:
             bool mDualMicEnabled;
             int  mTtyMode;
             bool mBuiltinMicSelected;
+            int  mMasterVolume;
+            bool mDeferVolume;
 #ifdef HAVE_FM_RADIO
             int mFmRadioEnabled;
             int mFmPrev;
@@ -333,6 +557,18 @@ private:
 
      friend class AudioStreamInMSM72xx;
             Mutex       mLock;
+
+            // requests for the routing thread, taken after mLock
+            Mutex       mRoutingLock;
+            Condition   mRoutingCond;
+            Condition   mRoutingDone;
+            routing_request mRoutingRequest;
+            uint32_t    mRoutingSubmitted;
+            uint32_t    mRoutingCompleted;
+            status_t    mRoutingStatus;
+            uint32_t    mRoutingBatches;
+            uint32_t    mRoutingSuperseded;
+            sp<RoutingThread> mRoutingThread;
 };
 
 // ----------------------------------------------------------------------------
@@ -0,0 +1,144 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+//#define LOG_NDEBUG 0
+
+#define LOG_TAG "EffectChain"
+#include <utils/Log.h>
+#include <cutils/atomic.h>
+
+#include "EffectChain.h"
+
+namespace android_audio_legacy {
+
+using android::Mutex;
+using android::String8;
+using android::NO_ERROR;
+using android::BAD_VALUE;
+using android::INVALID_OPERATION;
+
+EffectChain::EffectChain() :
+    mSoftware(0)
+{
+}
+
+status_t EffectChain::add(effect_handle_t effect, uint16_t dspBlock)
+{
+    if (effect == NULL)
+        return BAD_VALUE;
+
+    effect_entry e;
+    memset(&e, 0, sizeof(e));
+    e.handle = effect;
+    e.dspBlock = dspBlock;
+    effect_descriptor_t desc;
+    if ((*effect)->get_descriptor(effect, &desc) == 0)
+        snprintf(e.name, sizeof(e.name), "%s", desc.name);
+    else
+        snprintf(e.name, sizeof(e.name), "unknown");
+
+    Mutex::Autolock _l(mLock);
+    for (size_t i = 0; i < mEffects.size(); i++) {
+        if (mEffects[i].handle == effect)
+            return INVALID_OPERATION;
+    }
+    mEffects.add(e);
+    if (!dspBlock)
+        android_atomic_inc(&mSoftware);
+    LOGI("added effect %s, %s", e.name, dspBlock ? "done by the DSP" : "run in the HAL");
+    return NO_ERROR;
+}
+
+status_t EffectChain::remove(effect_handle_t effect)
+{
+    // waits for process(), the framework may release the effect next
+    Mutex::Autolock _l(mLock);
+    for (size_t i = 0; i < mEffects.size(); i++) {
+        if (mEffects[i].handle == effect) {
+            LOGI("removed effect %s", mEffects[i].name);
+            if (!mEffects[i].dspBlock)
+                android_atomic_dec(&mSoftware);
+            mEffects.removeAt(i);
+            return NO_ERROR;
+        }
+    }
+    return BAD_VALUE;
+}
+
+uint16_t EffectChain::dspMask() const
+{
+    Mutex::Autolock _l(mLock);
+    uint16_t mask = 0;
+    for (size_t i = 0; i < mEffects.size(); i++)
+        mask |= mEffects[i].dspBlock;
+    return mask;
+}
+
+bool EffectChain::hasSoftware() const
+{
+    return android_atomic_acquire_load(&mSoftware) > 0;
+}
+
+void EffectChain::process(int16_t *buf, size_t frames, int channels, size_t period)
+{
+    Mutex::Autolock _l(mLock);
+    size_t batch = period && frames > period ? frames - frames % period : frames;
+
+    for (size_t i = 0; i < mEffects.size(); i++) {
+        effect_entry &e = mEffects.editItemAt(i);
+        if (e.dspBlock)
+            continue;
+        nsecs_t start = systemTime();
+        for (size_t done = 0; done < frames; ) {
+            audio_buffer_t ab;
+            ab.frameCount = done ? frames - done : batch;
+            ab.s16 = buf + done * channels;
+            done += ab.frameCount;
+            e.calls++;
+            int32_t rc = (*e.handle)->process(e.handle, &ab, &ab);
+            // -ENODATA: the effect is inactive and left the buffer alone
+            if (rc < 0 && rc != -ENODATA)
+                e.errors++;
+        }
+        e.frames += frames;
+        e.time += systemTime() - start;
+    }
+}
+
+void EffectChain::dump(String8 &result) const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    Mutex::Autolock _l(mLock);
+    for (size_t i = 0; i < mEffects.size(); i++) {
+        const effect_entry &e = mEffects[i];
+        if (e.dspBlock) {
+            snprintf(buffer, SIZE, "\teffect %s: DSP block 0x%04x\n", e.name, e.dspBlock);
+        } else {
+            snprintf(buffer, SIZE, "\teffect %s: %u calls, %u errors, %llu ns/frame\n",
+                     e.name, e.calls, e.errors, e.frames ? e.time / e.frames : 0);
+        }
+        result.append(buffer);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android_audio_legacy
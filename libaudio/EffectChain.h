@@ -0,0 +1,76 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_AUDIO_EFFECT_CHAIN_H
+#define ANDROID_AUDIO_EFFECT_CHAIN_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <utils/Errors.h>
+#include <utils/threads.h>
+#include <utils/String8.h>
+#include <utils/Timers.h>
+#include <utils/Vector.h>
+#include <hardware/audio_effect.h>
+
+namespace android_audio_legacy {
+using android::status_t;
+
+// ----------------------------------------------------------------------------
+// Effects the framework attached to a stream. An effect the DSP does instead
+// is only recorded with its block mask; the others run here, in place on
+// each buffer, in the order they were added.
+//
+
+class EffectChain
+{
+public:
+                        EffectChain();
+
+            status_t    add(effect_handle_t effect, uint16_t dspBlock);
+            status_t    remove(effect_handle_t effect);
+
+    // Runs the software effects over frames, as many whole periods per
+    // call as fit and the remainder in a last call.
+            void        process(int16_t *buf, size_t frames, int channels, size_t period);
+
+    // blocks the attached effects want from the DSP
+            uint16_t    dspMask() const;
+            bool        hasSoftware() const;
+            void        dump(android::String8 &result) const;
+
+private:
+    struct effect_entry {
+        effect_handle_t handle;
+        char        name[32];
+        uint16_t    dspBlock;       // 0 when it runs here
+        uint32_t    calls;
+        uint32_t    errors;
+        uint64_t    frames;
+        nsecs_t     time;
+    };
+
+    mutable android::Mutex mLock;
+    android::Vector<effect_entry> mEffects;
+    volatile int32_t mSoftware;
+};
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android_audio_legacy
+
+#endif // ANDROID_AUDIO_EFFECT_CHAIN_H
@@ -0,0 +1,306 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+//#define LOG_NDEBUG 0
+
+#define LOG_TAG "InputResampler"
+#include <utils/Log.h>
+#include <utils/threads.h>
+
+#include "AudioDsp.h"
+#include "InputResampler.h"
+
+#define RESAMPLER_MAX_PHASES 256   // larger ratios round to the nearest phase
+#define RESAMPLER_BASE_TAPS  16    // per phase when upsampling
+#define RESAMPLER_MAX_TAPS   96
+#define RESAMPLER_MAX_BANKS  8
+#define RESAMPLER_KAISER_BETA 7.0  // about 70dB stop band
+
+namespace android_audio_legacy {
+
+struct resampler_bank {
+    uint32_t inRate;
+    uint32_t outRate;
+    int      phases;
+    int      taps;          // even
+    int      stride;        // taps + 2, one aligned copy of a phase
+    int16_t *coefs;         // [phases][2][stride], even and odd offset copies
+};
+
+static android::Mutex bank_lock;
+static resampler_bank *banks[RESAMPLER_MAX_BANKS];
+static int num_banks;
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// zeroth order modified Bessel function, for the Kaiser window
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+// Windowed sinc low pass at 0.45 of the lower rate, split into phases. The
+// prototype is centred on a tap, so phase p interpolates p/phases of a frame
+// past tap taps/2 - 1. Every phase is normalised to unity DC gain and stored
+// tap reversed, so tap i multiplies history sample start + i.
+static resampler_bank *resampler_build_bank(uint32_t inRate, uint32_t outRate)
+{
+    uint32_t L = outRate / gcd(inRate, outRate);
+    int phases = L < RESAMPLER_MAX_PHASES ? L : RESAMPLER_MAX_PHASES;
+    int taps = RESAMPLER_BASE_TAPS;
+    if (inRate > outRate)
+        taps = (RESAMPLER_BASE_TAPS * inRate / outRate + 1) & ~1;
+    if (taps > RESAMPLER_MAX_TAPS)
+        taps = RESAMPLER_MAX_TAPS;
+
+    int length = phases * taps;
+    double fc = 0.45 * (inRate < outRate ? 1.0 : (double)outRate / inRate) / phases;
+    double *proto = new double[length];
+    double center = length / 2.0;
+    double i0beta = bessel_i0(RESAMPLER_KAISER_BETA);
+    for (int k = 0; k < length; k++) {
+        double t = k - center;
+        double r = t / center;
+        double w = bessel_i0(RESAMPLER_KAISER_BETA * sqrt(1.0 - r * r)) / i0beta;
+        double s = t == 0 ? 1.0 : sin(2 * M_PI * fc * t) / (2 * M_PI * fc * t);
+        proto[k] = s * w;
+    }
+
+    resampler_bank *bank = new resampler_bank;
+    bank->inRate = inRate;
+    bank->outRate = outRate;
+    bank->phases = phases;
+    bank->taps = taps;
+    bank->stride = taps + 2;
+    bank->coefs = new int16_t[phases * 2 * bank->stride];
+    memset(bank->coefs, 0, phases * 2 * bank->stride * sizeof(int16_t));
+
+    for (int p = 0; p < phases; p++) {
+        double sum = 0;
+        for (int i = 0; i < taps; i++)
+            sum += proto[p + (taps - 1 - i) * phases];
+
+        int16_t *even = bank->coefs + p * 2 * bank->stride;
+        int16_t *odd = even + bank->stride;
+        int total = 0, peak = 0;
+        for (int i = 0; i < taps; i++) {
+            double c = proto[p + (taps - 1 - i) * phases] / sum;
+            int q = (int)lrint(c * 32768.0);
+            if (q > 32767) q = 32767;
+            if (q < -32768) q = -32768;
+            even[i] = q;
+            total += q;
+            if (abs(q) > abs(even[peak]))
+                peak = i;
+        }
+        // put the rounding error on the largest tap so DC passes exactly
+        int fixed = even[peak] + 32768 - total;
+        if (fixed <= 32767 && fixed >= -32768)
+            even[peak] = fixed;
+        memcpy(odd + 1, even, taps * sizeof(int16_t));
+    }
+
+    delete [] proto;
+    LOGV("bank %u -> %u Hz: %d phases x %d taps", inRate, outRate, phases, taps);
+    return bank;
+}
+
+// Cached banks live as long as the process. Once the cache is full the
+// bank is private to the caller, which sets *owned and frees it.
+static resampler_bank *resampler_get_bank(uint32_t inRate, uint32_t outRate, bool *owned)
+{
+    android::Mutex::Autolock _l(bank_lock);
+    for (int i = 0; i < num_banks; i++) {
+        if (banks[i]->inRate == inRate && banks[i]->outRate == outRate) {
+            *owned = false;
+            return banks[i];
+        }
+    }
+    resampler_bank *bank = resampler_build_bank(inRate, outRate);
+    *owned = num_banks == RESAMPLER_MAX_BANKS;
+    if (*owned)
+        LOGW("resampler bank cache full, %u -> %u Hz not cached", inRate, outRate);
+    else
+        banks[num_banks++] = bank;
+    return bank;
+}
+
+InputResampler::InputResampler(uint32_t inRate, uint32_t outRate,
+                               int channels, size_t maxInputFrames) :
+    mBank(NULL), mOwnsBank(false), mInRate(inRate), mOutRate(outRate), mChannels(channels),
+    mL(1), mM(1), mPhase(0), mStart(0), mFill(0), mCapacity(0),
+    mFramesOut(0), mProcessTime(0)
+{
+    mHistory[0] = mHistory[1] = NULL;
+    if (inRate == 0 || outRate == 0 || channels < 1 || channels > 2) {
+        LOGE("unsupported conversion %u -> %u Hz, %d channels", inRate, outRate, channels);
+        return;
+    }
+
+    mBank = resampler_get_bank(inRate, outRate, &mOwnsBank);
+    uint32_t g = gcd(inRate, outRate);
+    mL = outRate / g;
+    mM = inRate / g;
+    // room for a window and two pushes, kept even so compaction keeps
+    // the history 32 bit aligned
+    mCapacity = (2 * maxInputFrames + mBank->stride + 4 + 1) & ~1;
+    for (int ch = 0; ch < mChannels; ch++)
+        mHistory[ch] = new int16_t[mCapacity];
+    reset();
+}
+
+InputResampler::~InputResampler()
+{
+    if (mOwnsBank) {
+        delete [] mBank->coefs;
+        delete mBank;
+    }
+    delete [] mHistory[0];
+    delete [] mHistory[1];
+}
+
+int InputResampler::taps() const
+{
+    return mBank ? mBank->taps : 0;
+}
+
+int InputResampler::phases() const
+{
+    return mBank ? mBank->phases : 0;
+}
+
+void InputResampler::reset()
+{
+    if (!mBank)
+        return;
+    // half a filter of silence, and the window placed so the centre tap of
+    // phase 0 is the first input frame
+    mFill = (mBank->taps / 2) & ~1;
+    mStart = mFill - (mBank->taps / 2 - 1);
+    mPhase = 0;
+    for (int ch = 0; ch < mChannels; ch++)
+        memset(mHistory[ch], 0, mFill * sizeof(int16_t));
+}
+
+void InputResampler::compact()
+{
+    size_t shift = mStart & ~1;
+    if (shift == 0)
+        return;
+    for (int ch = 0; ch < mChannels; ch++)
+        memmove(mHistory[ch], mHistory[ch] + shift, (mFill - shift) * sizeof(int16_t));
+    mStart -= shift;
+    mFill -= shift;
+}
+
+// Bank phase for an output mPhase/mL of an input frame past *start. With
+// fewer bank phases than mL the phase is rounded, and rounding up past the
+// last one is phase 0 of the next input frame.
+uint32_t InputResampler::bankPhase(uint32_t phase, uint64_t *start) const
+{
+    uint32_t phases = mBank->phases;
+    if (phases == mL)
+        return phase;
+    uint32_t p = (uint32_t)(((uint64_t)phase * phases + mL / 2) / mL);
+    if (p == phases) {
+        p = 0;
+        (*start)++;
+    }
+    return p;
+}
+
+size_t InputResampler::inputFramesNeeded(size_t outFrames) const
+{
+    if (!mBank || outFrames == 0)
+        return 0;
+    uint64_t steps = (uint64_t)mPhase + (uint64_t)(outFrames - 1) * mM;
+    uint64_t last = mStart + steps / mL;
+    bankPhase((uint32_t)(steps % mL), &last);
+    uint64_t needed = (last & ~1ULL) + mBank->stride;
+    return needed > mFill ? needed - mFill : 0;
+}
+
+size_t InputResampler::process(const int16_t *in, size_t inFrames,
+                               int16_t *out, size_t outFrames)
+{
+    if (!mBank)
+        return 0;
+    nsecs_t start = systemTime();
+
+    if (inFrames) {
+        if (mFill + inFrames > mCapacity)
+            compact();
+        if (mFill + inFrames > mCapacity) {
+            LOGW("resampler overflow, dropping %u frames", inFrames - (mCapacity - mFill));
+            inFrames = mCapacity - mFill;
+        }
+        if (mChannels == 1) {
+            memcpy(mHistory[0] + mFill, in, inFrames * sizeof(int16_t));
+        } else {
+            for (size_t i = 0; i < inFrames; i++) {
+                mHistory[0][mFill + i] = in[2 * i];
+                mHistory[1][mFill + i] = in[2 * i + 1];
+            }
+        }
+        mFill += inFrames;
+    }
+
+    const int stride = mBank->stride;
+    const int pairs = stride / 2;
+    size_t produced = 0;
+    while (produced < outFrames) {
+        uint64_t at = mStart;
+        uint32_t phase = bankPhase(mPhase, &at);
+        size_t base = (size_t)at & ~1;
+        if (base + stride > mFill)
+            break;
+        const int16_t *c = mBank->coefs + (phase * 2 + (at & 1)) * stride;
+        for (int ch = 0; ch < mChannels; ch++)
+            *out++ = clamp16(dot_q15(mHistory[ch] + base, c, pairs) >> 15);
+        produced++;
+
+        mPhase += mM;
+        mStart += mPhase / mL;
+        mPhase %= mL;
+    }
+
+    mFramesOut += produced;
+    mProcessTime += systemTime() - start;
+    return produced;
+}
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android_audio_legacy
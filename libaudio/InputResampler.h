@@ -0,0 +1,87 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_AUDIO_INPUT_RESAMPLER_H
+#define ANDROID_AUDIO_INPUT_RESAMPLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <utils/Timers.h>
+
+namespace android_audio_legacy {
+
+// ----------------------------------------------------------------------------
+// Polyphase FIR resampler for 16 bit PCM capture, so an input stream can be
+// opened at any rate while the DSP records at one of its native rates.
+//
+// The filter bank for a rate pair is built once per process and shared.
+// Each phase is stored twice, aligned for even and for odd sample offsets,
+// so the inner loop always reads 32 bit sample pairs (SMLAD on ARMv6).
+//
+
+struct resampler_bank;
+
+class InputResampler
+{
+public:
+                        InputResampler(uint32_t inRate, uint32_t outRate,
+                                       int channels, size_t maxInputFrames);
+                        ~InputResampler();
+            bool        initCheck() const { return mBank != NULL; }
+
+    // Queues inFrames interleaved frames (at most maxInputFrames) and
+    // writes up to outFrames output frames. Returns the frames written.
+            size_t      process(const int16_t *in, size_t inFrames,
+                                int16_t *out, size_t outFrames);
+    // Input frames that must be queued before outFrames can be produced.
+            size_t      inputFramesNeeded(size_t outFrames) const;
+            void        reset();
+
+            uint32_t    inRate() const { return mInRate; }
+            uint32_t    outRate() const { return mOutRate; }
+            int         channels() const { return mChannels; }
+            int         taps() const;
+            int         phases() const;
+            uint64_t    framesOut() const { return mFramesOut; }
+            nsecs_t     processTime() const { return mProcessTime; }
+
+private:
+            void        compact();
+            uint32_t    bankPhase(uint32_t phase, uint64_t *start) const;
+
+    resampler_bank *mBank;
+    bool        mOwnsBank;
+    uint32_t    mInRate;
+    uint32_t    mOutRate;
+    int         mChannels;
+    uint32_t    mL;             // output steps per M input samples
+    uint32_t    mM;
+    uint32_t    mPhase;         // 0 .. mL - 1
+    size_t      mStart;         // first history frame of the current window
+    size_t      mFill;
+    size_t      mCapacity;
+    int16_t    *mHistory[2];    // deinterleaved input, 32 bit aligned
+    uint64_t    mFramesOut;
+    nsecs_t     mProcessTime;
+};
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android_audio_legacy
+
+#endif // ANDROID_AUDIO_INPUT_RESAMPLER_H
@@ -0,0 +1,470 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+//#define LOG_NDEBUG 0
+
+#define LOG_TAG "SoftPostProc"
+#include <utils/Log.h>
+
+#include "AudioDsp.h"
+#include "AudioHardware.h"
+#include "SoftPostProc.h"
+
+#define SOFTPP_BLOCK        32      // frames per compressor gain update
+#define SOFTPP_GUARD        10      // fractional bits kept between biquads
+#define SOFTPP_MAX_BIQUADS  (4 + EQ_MAX_BAND_NUM)
+#define SOFTPP_MAX_BANDS    2
+#define SOFTPP_MAX_TAPS     196
+#define SOFTPP_FULL_SCALE_DB 90.309 // 16 bit full scale above one LSB
+
+namespace android_audio_legacy {
+
+struct softpp_biquad {
+    int32_t b0, b1, b2;     // Q30, y = b.x - a.y
+    int32_t a1, a2;
+    int32_t x1[2], x2[2];   // Q15 with SOFTPP_GUARD extra bits
+    int32_t y1[2], y2[2];
+};
+
+// Gain computer for one band. Levels are mean squares relative to full
+// scale, smoothing factors are the weight kept per SOFTPP_BLOCK frames.
+struct softpp_compressor {
+    bool    enabled;
+    bool    muted;
+    float   thresholdDb;
+    float   slope;          // 1 - 1 / ratio
+    float   makeupDb;
+    float   rmsKeep;
+    float   attackKeep;
+    float   releaseKeep;
+    float   power;
+    float   gainDb;
+    int32_t gain;           // Q16
+};
+
+// Linear phase low pass from the MBADRC table, the high band is the
+// delayed input minus the low band.
+struct softpp_crossover {
+    int      taps;
+    int      stride;        // even, at least taps + 1
+    int      delay;         // (taps - 1) / 2
+    int16_t *coefs;         // [2][stride], even and odd offset copies
+    int16_t *history[2];    // stride samples of history, then a block
+};
+
+// 32 bit table coefficients are stored low word first
+static inline int32_t softpp_word32(const uint16_t *p)
+{
+    return (int32_t)(((uint32_t)p[1] << 16) | p[0]);
+}
+
+// Loads the biquads of an audpp IIR or EQ record: layout bands numerators
+// (b0, b1, b2), then the denominators (a1, a2), then a shift per band. The
+// shift only gives the DSP headroom and is not needed with 64 bit sums.
+static int softpp_load_biquads(softpp_biquad *bq, const uint16_t *params,
+                               int layout, int bands, const char *name)
+{
+    int loaded = 0;
+    for (int i = 0; i < bands; i++) {
+        softpp_biquad b;
+        memset(&b, 0, sizeof(b));
+        b.b0 = softpp_word32(params + i * 6);
+        b.b1 = softpp_word32(params + i * 6 + 2);
+        b.b2 = softpp_word32(params + i * 6 + 4);
+        b.a1 = softpp_word32(params + layout * 6 + i * 4);
+        b.a2 = softpp_word32(params + layout * 6 + i * 4 + 2);
+
+        if (b.b0 == (1 << 30) && !b.b1 && !b.b2 && !b.a1 && !b.a2)
+            continue;
+        if (!b.b0 && !b.b1 && !b.b2) {
+            LOGW("%s band %d is empty, skipped", name, i);
+            continue;
+        }
+        double a1 = b.a1 / 1073741824.0, a2 = b.a2 / 1073741824.0;
+        if (fabs(a2) >= 1.0 || fabs(a1) >= 1.0 + a2) {
+            LOGW("%s band %d is unstable (a1 %f, a2 %f), skipped", name, i, a1, a2);
+            continue;
+        }
+        bq[loaded++] = b;
+    }
+    return loaded;
+}
+
+static void softpp_biquad_run(softpp_biquad *bq, int32_t *x, size_t frames, int channels)
+{
+    const int32_t limit = 1 << (15 + SOFTPP_GUARD + 5);
+    for (int ch = 0; ch < channels; ch++) {
+        int32_t x1 = bq->x1[ch], x2 = bq->x2[ch];
+        int32_t y1 = bq->y1[ch], y2 = bq->y2[ch];
+        int32_t *p = x + ch;
+        for (size_t i = 0; i < frames; i++, p += channels) {
+            int32_t in = *p;
+            int64_t acc = (int64_t)bq->b0 * in + (int64_t)bq->b1 * x1 +
+                          (int64_t)bq->b2 * x2 - (int64_t)bq->a1 * y1 -
+                          (int64_t)bq->a2 * y2;
+            int32_t out = (int32_t)((acc + (1 << 29)) >> 30);
+            if (out > limit) out = limit;
+            if (out < -limit) out = -limit;
+            x2 = x1;
+            x1 = in;
+            y2 = y1;
+            y1 = out;
+            *p = out;
+        }
+        bq->x1[ch] = x1;
+        bq->x2[ch] = x2;
+        bq->y1[ch] = y1;
+        bq->y2[ch] = y2;
+    }
+}
+
+// The tables give the threshold in Q7 dB above one LSB, the slope as
+// 1 - 1/ratio in Q16 and attack/release as Q31 weights kept per gain update
+// of update samples, high word first. Makeup gain is Q12, or none if < 0.
+static void softpp_compressor_init(softpp_compressor *c, uint16_t threshold,
+                                   uint16_t slope, uint16_t rms, uint32_t attack,
+                                   uint32_t release, int makeup, int update)
+{
+    memset(c, 0, sizeof(*c));
+    c->enabled = true;
+    c->thresholdDb = threshold / 128.0 - SOFTPP_FULL_SCALE_DB;
+    c->slope = slope / 65536.0;
+    if (c->slope > 0.98f)
+        c->slope = 0.98f;
+    c->rmsKeep = exp(-(double)SOFTPP_BLOCK / (rms ? rms : 1));
+
+    double per = (double)SOFTPP_BLOCK / (update > 0 ? update : 1);
+    double a = attack / 2147483648.0, r = release / 2147483648.0;
+    c->attackKeep = pow(a < 0.99999 ? a : 0.99999, per);
+    c->releaseKeep = pow(r < 0.99999 ? r : 0.99999, per);
+
+    if (makeup > 0) {
+        c->makeupDb = 20 * log10(makeup / 4096.0);
+        if (c->makeupDb > 24) c->makeupDb = 24;
+        if (c->makeupDb < -24) c->makeupDb = -24;
+    }
+    c->gain = (int32_t)(pow(10.0, c->makeupDb / 20) * 65536);
+    LOGV("compressor: threshold %.1f dBFS, ratio %.1f, makeup %.1f dB, attack %.4f, release %.4f",
+         c->thresholdDb, 1 / (1 - c->slope), c->makeupDb, c->attackKeep, c->releaseKeep);
+}
+
+// sum of squares, full scale squared is 2^30
+static int64_t softpp_power(const int16_t *buf, size_t samples)
+{
+    size_t i = 0;
+    int64_t sum = 0;
+#ifdef HAVE_ARMV6_SIMD
+    if (((uintptr_t)buf & 3) == 0) {
+        const uint32_t *in = (const uint32_t *)buf;
+        uint32_t lo = 0, hi = 0;
+        for (; i + 2 <= samples; i += 2) {
+            uint32_t pair = in[i / 2];
+            asm ("smlald %0, %1, %2, %2" : "+r" (lo), "+r" (hi) : "r" (pair));
+        }
+        sum = (int64_t)(((uint64_t)hi << 32) | lo);
+    }
+#endif
+    for (; i < samples; i++)
+        sum += buf[i] * buf[i];
+    return sum;
+}
+
+static void softpp_update_gain(softpp_compressor *c, const int16_t *buf, size_t samples)
+{
+    float power = softpp_power(buf, samples) / (1073741824.0f * samples);
+    c->power = c->rmsKeep * c->power + (1 - c->rmsKeep) * power;
+    float level = 10 * log10f(c->power + 1e-10f);
+    float target = level > c->thresholdDb ? (c->thresholdDb - level) * c->slope : 0;
+    float keep = target < c->gainDb ? c->attackKeep : c->releaseKeep;
+    c->gainDb = keep * c->gainDb + (1 - keep) * target;
+    c->gain = (int32_t)(powf(10.0f, (c->gainDb + c->makeupDb) / 20) * 65536);
+}
+
+static void softpp_apply_gain(int16_t *buf, size_t samples, int32_t gain)
+{
+    size_t i = 0;
+#ifdef HAVE_ARMV6_SIMD
+    if (((uintptr_t)buf & 3) == 0) {
+        uint32_t *io = (uint32_t *)buf;
+        for (; i + 2 <= samples; i += 2) {
+            uint32_t pair = io[i / 2];
+            int32_t first, second;
+            asm ("smulwb %0, %2, %3\n\t"
+                 "smulwt %1, %2, %3\n\t"
+                 "ssat %0, #16, %0\n\t"
+                 "ssat %1, #16, %1\n\t"
+                 "pkhbt %0, %0, %1, lsl #16"
+                 : "=&r" (first), "=&r" (second)
+                 : "r" (gain), "r" (pair));
+            io[i / 2] = first;
+        }
+    }
+#endif
+    for (; i < samples; i++)
+        buf[i] = clamp16((int32_t)(((int64_t)gain * buf[i]) >> 16));
+}
+
+static void softpp_mix(int16_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+#ifdef HAVE_ARMV6_SIMD
+    if ((((uintptr_t)dst | (uintptr_t)src) & 3) == 0) {
+        uint32_t *out = (uint32_t *)dst;
+        const uint32_t *in = (const uint32_t *)src;
+        for (; i + 2 <= samples; i += 2) {
+            uint32_t sum;
+            asm ("qadd16 %0, %1, %2" : "=r" (sum) : "r" (out[i / 2]), "r" (in[i / 2]));
+            out[i / 2] = sum;
+        }
+    }
+#endif
+    for (; i < samples; i++)
+        dst[i] = clamp16(dst[i] + src[i]);
+}
+
+static softpp_crossover *softpp_crossover_create(const int16_t *taps, int count)
+{
+    if (count < 3 || count > SOFTPP_MAX_TAPS) {
+        LOGW("MBADRC crossover has %d taps, using one band", count);
+        return NULL;
+    }
+    int sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += taps[i];
+    if (sum < 29491 || sum > 36045) {
+        LOGW("MBADRC crossover DC gain %d/32768 is not a low pass, using one band", sum);
+        return NULL;
+    }
+
+    softpp_crossover *x = new softpp_crossover;
+    x->taps = count;
+    x->stride = (count + 2) & ~1;
+    x->delay = (count - 1) / 2;
+    x->coefs = new int16_t[2 * x->stride];
+    memset(x->coefs, 0, 2 * x->stride * sizeof(int16_t));
+    // tap reversed, so coefficient i multiplies window sample i
+    for (int i = 0; i < count; i++)
+        x->coefs[i] = x->coefs[x->stride + i + 1] = taps[count - 1 - i];
+    for (int ch = 0; ch < 2; ch++) {
+        x->history[ch] = new int16_t[x->stride + SOFTPP_BLOCK + 4];
+        memset(x->history[ch], 0, (x->stride + SOFTPP_BLOCK + 4) * sizeof(int16_t));
+    }
+    return x;
+}
+
+static void softpp_crossover_free(softpp_crossover *x)
+{
+    if (x == NULL)
+        return;
+    delete [] x->coefs;
+    delete [] x->history[0];
+    delete [] x->history[1];
+    delete x;
+}
+
+static void softpp_crossover_split(softpp_crossover *x, const int16_t *in, size_t frames,
+                                   int channels, int16_t *low, int16_t *high)
+{
+    const int pre = x->stride;
+    for (int ch = 0; ch < channels; ch++) {
+        int16_t *h = x->history[ch];
+        for (size_t i = 0; i < frames; i++)
+            h[pre + i] = in[i * channels + ch];
+        for (size_t k = 0; k < frames; k++) {
+            int start = pre + (int)k - (x->taps - 1);
+            const int16_t *c = x->coefs + (start & 1) * x->stride;
+            int16_t lo = clamp16(dot_q15(h + (start & ~1), c, x->stride / 2) >> 15);
+            low[k * channels + ch] = lo;
+            high[k * channels + ch] = clamp16(h[pre + k - x->delay] - lo);
+        }
+        memmove(h, h + frames, pre * sizeof(int16_t));
+    }
+}
+
+SoftPostProc::SoftPostProc() :
+    mMask(0), mChannels(2), mNumBiquads(0), mNumBands(0), mCrossover(NULL),
+    mFrames(0), mProcessTime(0)
+{
+    mBiquads = new softpp_biquad[SOFTPP_MAX_BIQUADS];
+    mBands = new softpp_compressor[SOFTPP_MAX_BANDS];
+    mWork = new int32_t[SOFTPP_BLOCK * 2];
+    mSplit = new int16_t[SOFTPP_BLOCK * 2 * SOFTPP_MAX_BANDS];
+}
+
+SoftPostProc::~SoftPostProc()
+{
+    softpp_crossover_free(mCrossover);
+    delete [] mBiquads;
+    delete [] mBands;
+    delete [] mWork;
+    delete [] mSplit;
+}
+
+void SoftPostProc::clear()
+{
+    mMask = 0;
+    mNumBiquads = 0;
+    mNumBands = 0;
+    softpp_crossover_free(mCrossover);
+    mCrossover = NULL;
+}
+
+void SoftPostProc::configure(int mask, const rx_iir_filter *iir, const eqalizer *eq,
+                             const adrc_filter *adrc, const mbadrc_filter *mbadrc,
+                             int channels)
+{
+    clear();
+    if (channels < 1 || channels > 2) {
+        LOGE("unsupported channel count %d", channels);
+        return;
+    }
+    mChannels = channels;
+
+    if ((mask & RX_IIR_ENABLE) && iir) {
+        int bands = iir->num_bands < 4 ? iir->num_bands : 4;
+        int n = softpp_load_biquads(mBiquads + mNumBiquads, iir->iir_params, 4, bands, "rx iir");
+        if (n) {
+            mNumBiquads += n;
+            mMask |= RX_IIR_ENABLE;
+        }
+    }
+    if ((mask & EQ_ENABLE) && eq) {
+        int bands = eq->bands < EQ_MAX_BAND_NUM ? eq->bands : EQ_MAX_BAND_NUM;
+        int n = softpp_load_biquads(mBiquads + mNumBiquads, eq->params, eq->bands, bands, "eq");
+        if (n) {
+            mNumBiquads += n;
+            mMask |= EQ_ENABLE;
+        }
+    }
+
+    if ((mask & MBADRC_ENABLE) && mbadrc && mbadrc->num_bands > 0) {
+        // subband_enable, mute, rms_time, threshold, slope, attack msw/lsw,
+        // release msw/lsw, makeup gain
+        mNumBands = mbadrc->num_bands < SOFTPP_MAX_BANDS ? mbadrc->num_bands : SOFTPP_MAX_BANDS;
+        if (mbadrc->num_bands > SOFTPP_MAX_BANDS)
+            LOGW("MBADRC has %d bands, running %d", mbadrc->num_bands, SOFTPP_MAX_BANDS);
+        for (int i = 0; i < mNumBands; i++) {
+            const uint16_t *p = mbadrc->adrc_band[i].adrc_band_params;
+            softpp_compressor_init(&mBands[i], p[3], p[4], p[2],
+                                   ((uint32_t)p[5] << 16) | p[6],
+                                   ((uint32_t)p[7] << 16) | p[8],
+                                   p[9], mbadrc->down_samp_level);
+            mBands[i].enabled = p[0] != 0;
+            mBands[i].muted = p[1] != 0;
+        }
+        if (mNumBands > 1) {
+            mCrossover = softpp_crossover_create(mbadrc->ext_buf.buff,
+                                                 mbadrc->ext_buf_size / 2);
+            if (mCrossover == NULL)
+                mNumBands = 1;
+        }
+        mMask |= MBADRC_ENABLE;
+    } else if ((mask & ADRC_ENABLE) && adrc) {
+        // threshold, slope, rms_time, attack lsw/msw, release lsw/msw, delay
+        const uint16_t *p = adrc->adrc_params;
+        softpp_compressor_init(&mBands[0], p[0], p[1], p[2],
+                               ((uint32_t)p[3] << 16) | p[4],
+                               ((uint32_t)p[5] << 16) | p[6], -1, 1);
+        mNumBands = 1;
+        mMask |= ADRC_ENABLE;
+    }
+
+    reset();
+    LOGI("software post processing 0x%04x: %d biquads, %d compressor bands",
+         mMask, mNumBiquads, mNumBands);
+}
+
+void SoftPostProc::reset()
+{
+    for (int i = 0; i < mNumBiquads; i++) {
+        memset(mBiquads[i].x1, 0, sizeof(mBiquads[i].x1));
+        memset(mBiquads[i].x2, 0, sizeof(mBiquads[i].x2));
+        memset(mBiquads[i].y1, 0, sizeof(mBiquads[i].y1));
+        memset(mBiquads[i].y2, 0, sizeof(mBiquads[i].y2));
+    }
+    for (int i = 0; i < mNumBands; i++) {
+        mBands[i].power = 0;
+        mBands[i].gainDb = 0;
+        mBands[i].gain = (int32_t)(pow(10.0, mBands[i].makeupDb / 20) * 65536);
+    }
+    if (mCrossover) {
+        for (int ch = 0; ch < 2; ch++)
+            memset(mCrossover->history[ch], 0, mCrossover->stride * sizeof(int16_t));
+    }
+}
+
+void SoftPostProc::compress(int16_t *buf, size_t frames)
+{
+    size_t samples = frames * mChannels;
+    if (mCrossover == NULL) {
+        if (mBands[0].muted) {
+            memset(buf, 0, samples * sizeof(int16_t));
+        } else if (mBands[0].enabled) {
+            softpp_update_gain(&mBands[0], buf, samples);
+            softpp_apply_gain(buf, samples, mBands[0].gain);
+        }
+        return;
+    }
+
+    int16_t *band[SOFTPP_MAX_BANDS] = { mSplit, mSplit + SOFTPP_BLOCK * 2 };
+    softpp_crossover_split(mCrossover, buf, frames, mChannels, band[0], band[1]);
+    memset(buf, 0, samples * sizeof(int16_t));
+    for (int i = 0; i < mNumBands; i++) {
+        if (mBands[i].muted)
+            continue;
+        if (mBands[i].enabled) {
+            softpp_update_gain(&mBands[i], band[i], samples);
+            softpp_apply_gain(band[i], samples, mBands[i].gain);
+        }
+        softpp_mix(buf, band[i], samples);
+    }
+}
+
+void SoftPostProc::process(int16_t *buf, size_t frames)
+{
+    if (!mMask || !frames)
+        return;
+    nsecs_t start = systemTime();
+
+    for (size_t done = 0; done < frames; ) {
+        size_t n = frames - done < SOFTPP_BLOCK ? frames - done : SOFTPP_BLOCK;
+        int16_t *p = buf + done * mChannels;
+        size_t samples = n * mChannels;
+
+        if (mNumBiquads) {
+            for (size_t i = 0; i < samples; i++)
+                mWork[i] = p[i] << SOFTPP_GUARD;
+            for (int b = 0; b < mNumBiquads; b++)
+                softpp_biquad_run(&mBiquads[b], mWork, n, mChannels);
+            for (size_t i = 0; i < samples; i++)
+                p[i] = clamp16((mWork[i] + (1 << (SOFTPP_GUARD - 1))) >> SOFTPP_GUARD);
+        }
+        if (mNumBands)
+            compress(p, n);
+        done += n;
+    }
+
+    mFrames += frames;
+    mProcessTime += systemTime() - start;
+}
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android_audio_legacy
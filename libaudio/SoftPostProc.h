@@ -0,0 +1,89 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_AUDIO_SOFT_POST_PROC_H
+#define ANDROID_AUDIO_SOFT_POST_PROC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <utils/Timers.h>
+
+namespace android_audio_legacy {
+
+// ----------------------------------------------------------------------------
+// CPU version of the audpp chains tuned in AudioFilter.csv, for when the DSP
+// does not take the tables. Runs in place on 16 bit playback, in the order
+// RX IIR, EQ, then ADRC or MBADRC.
+//
+// The biquads run on Q15 samples with 10 guard bits and 64 bit accumulation
+// of the Q30 table coefficients. The compressors work on packed sample pairs
+// (SMLALD level detection, SMULWB/SMULWT gain, QADD16 band sum on ARMv6).
+//
+
+struct rx_iir_filter;
+struct eqalizer;
+struct adrc_filter;
+struct mbadrc_filter;
+struct softpp_biquad;
+struct softpp_compressor;
+struct softpp_crossover;
+
+class SoftPostProc
+{
+public:
+                        SoftPostProc();
+                        ~SoftPostProc();
+
+    // Builds the chains selected by mask (ADRC_ENABLE, EQ_ENABLE,
+    // RX_IIR_ENABLE, MBADRC_ENABLE) and clears the filter state. Tables
+    // that do not make sense are left out, see mask().
+            void        configure(int mask, const rx_iir_filter *iir,
+                                  const eqalizer *eq, const adrc_filter *adrc,
+                                  const mbadrc_filter *mbadrc, int channels);
+            void        process(int16_t *buf, size_t frames);
+            void        reset();
+
+    // chains actually running
+            int         mask() const { return mMask; }
+            int         biquads() const { return mNumBiquads; }
+            int         bands() const { return mNumBands; }
+            uint64_t    frames() const { return mFrames; }
+            nsecs_t     processTime() const { return mProcessTime; }
+
+private:
+            void        clear();
+            void        compress(int16_t *buf, size_t frames);
+
+    int         mMask;
+    int         mChannels;
+    int         mNumBiquads;
+    softpp_biquad *mBiquads;
+    int         mNumBands;          // compressor bands, 0 if none
+    softpp_compressor *mBands;
+    softpp_crossover *mCrossover;   // MBADRC with two bands
+    int32_t    *mWork;              // one block of Q25 samples
+    int16_t    *mSplit;             // one block per band
+    uint64_t    mFrames;
+    nsecs_t     mProcessTime;
+};
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android_audio_legacy
+
+#endif // ANDROID_AUDIO_SOFT_POST_PROC_H
@@ -45,6 +45,7 @@ struct qcom_stream_out {
     struct audio_stream_out stream;
 
     AudioStreamOut *qcom_out;
+    AudioHardware *qcom_hw;
 };
 
 struct qcom_stream_in {
@@ -165,12 +166,16 @@ static int out_get_render_position(const struct audio_stream_out *stream,
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    return 0;
+    const struct qcom_stream_out *out =
+        reinterpret_cast<const struct qcom_stream_out *>(stream);
+    return out->qcom_hw->addOutputEffect(out->qcom_out, effect);
 }
 
 static int out_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    return 0;
+    const struct qcom_stream_out *out =
+        reinterpret_cast<const struct qcom_stream_out *>(stream);
+    return out->qcom_hw->removeOutputEffect(out->qcom_out, effect);
 }
 
 /** audio_stream_in implementation **/
@@ -427,6 +432,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         ret = status;
         goto err_open;
     }
+    out->qcom_hw = static_cast<AudioHardware *>(qadev->hwif);
 
     out->stream.common.get_sample_rate = out_get_sample_rate;
     out->stream.common.set_sample_rate = out_set_sample_rate;
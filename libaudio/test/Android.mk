@@ -0,0 +1,193 @@
+# Copyright 2012 The CyanogenMod Project
+
+LOCAL_PATH := $(call my-dir)
+
+# -------------------------------------------------------------
+# The HAL built against FakeMsmDriver instead of the msm drivers,
+# with a benchmark driving it. Not part of audio.primary.
+# -------------------------------------------------------------
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    ../AudioBackend.cpp \
+    ../AudioHardware.cpp \
+    ../EffectChain.cpp \
+    ../InputResampler.cpp \
+    ../SoftPostProc.cpp \
+    AudioHalBench.cpp \
+    FakeMsmDriver.cpp
+
+LOCAL_SHARED_LIBRARIES := \
+    libcutils       \
+    libutils        \
+    libmedia
+
+ifneq ($(TARGET_SIMULATOR),true)
+    LOCAL_SHARED_LIBRARIES += libdl
+endif
+
+LOCAL_STATIC_LIBRARIES := \
+    libmedia_helper  \
+    libaudiohw_legacy
+
+LOCAL_MODULE := audio_hal_bench
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_CFLAGS += -fno-short-enums -DAUDIO_FAKE_BACKEND
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_C_INCLUDES += hardware/libhardware/include
+LOCAL_C_INCLUDES += hardware/libhardware_legacy/include
+LOCAL_C_INCLUDES += frameworks/base/include
+LOCAL_C_INCLUDES += system/core/include
+LOCAL_C_INCLUDES += system/media/audio_effects/include
+
+include $(BUILD_EXECUTABLE)
+
+# -------------------------------------------------------------
+# route_table against the if/else routing it replaced, for every
+# input combination. Includes AudioHardware.cpp for its statics.
+# Built for the device and the host; the host build takes
+# AudioParameter and AudioHardwareBase from their sources, whose
+# libraries are target only.
+# -------------------------------------------------------------
+route_table_test_src := \
+    ../AudioBackend.cpp \
+    ../EffectChain.cpp \
+    ../InputResampler.cpp \
+    ../SoftPostProc.cpp \
+    FakeMsmDriver.cpp \
+    RouteTableTest.cpp
+
+route_table_test_cflags := -fno-short-enums -DAUDIO_FAKE_BACKEND
+ifeq ($(BOARD_COMBO_DEVICE_SUPPORTED),true)
+    route_table_test_cflags += -DCOMBO_DEVICE_SUPPORTED
+endif
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(route_table_test_src)
+
+LOCAL_SHARED_LIBRARIES := \
+    libcutils       \
+    libutils        \
+    libmedia
+
+ifneq ($(TARGET_SIMULATOR),true)
+    LOCAL_SHARED_LIBRARIES += libdl
+endif
+
+LOCAL_STATIC_LIBRARIES := \
+    libmedia_helper  \
+    libaudiohw_legacy
+
+LOCAL_MODULE := route_table_test
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_CFLAGS += $(route_table_test_cflags)
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_C_INCLUDES += hardware/libhardware/include
+LOCAL_C_INCLUDES += hardware/libhardware_legacy/include
+LOCAL_C_INCLUDES += frameworks/base/include
+LOCAL_C_INCLUDES += system/core/include
+LOCAL_C_INCLUDES += system/media/audio_effects/include
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# LOCAL_PATH is device/lge/p500/libaudio/test
+LOCAL_SRC_FILES := \
+    $(route_table_test_src) \
+    ../../../../../frameworks/base/media/libmedia/AudioParameter.cpp \
+    ../../../../../hardware/libhardware_legacy/audio/AudioHardwareInterface.cpp
+
+LOCAL_STATIC_LIBRARIES := libutils libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt -ldl -lm
+
+LOCAL_MODULE := route_table_test
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_CFLAGS += $(route_table_test_cflags)
+
+# the msm headers come from TARGET_SPECIFIC_HEADER_PATH on the device
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. $(LOCAL_PATH)/../../include
+LOCAL_C_INCLUDES += hardware/libhardware/include
+LOCAL_C_INCLUDES += hardware/libhardware_legacy/include
+LOCAL_C_INCLUDES += hardware/libhardware_legacy/audio
+LOCAL_C_INCLUDES += frameworks/base/include
+LOCAL_C_INCLUDES += system/core/include
+LOCAL_C_INCLUDES += system/media/audio_effects/include
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# -------------------------------------------------------------
+# AudioDsp.h and SoftPostProc against float references, and their
+# cost per sample. Built for the host (C paths) and the device
+# (ARMv6 paths, cycles from the cpufreq clock).
+# -------------------------------------------------------------
+softpostproc_test_src := \
+    ../SoftPostProc.cpp \
+    SoftPostProcTest.cpp
+
+softpostproc_test_includes := \
+    $(LOCAL_PATH)/.. \
+    hardware/libhardware/include \
+    hardware/libhardware_legacy/include \
+    frameworks/base/include \
+    system/core/include \
+    system/media/audio_effects/include
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := $(softpostproc_test_src)
+LOCAL_C_INCLUDES := $(softpostproc_test_includes)
+LOCAL_SHARED_LIBRARIES := libcutils libutils
+LOCAL_MODULE := softpostproc_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += -fno-short-enums
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := $(softpostproc_test_src)
+# the msm headers come from TARGET_SPECIFIC_HEADER_PATH on the device
+LOCAL_C_INCLUDES := $(softpostproc_test_includes) $(LOCAL_PATH)/../../include
+LOCAL_STATIC_LIBRARIES := libutils libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt -lm
+LOCAL_MODULE := softpostproc_test
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_HOST_EXECUTABLE)
+
+# -------------------------------------------------------------
+# InputResampler quality (SNR, level, delay, aliasing) and cost per
+# output frame. On the device it also runs AudioFlinger's resampler,
+# what capture used before the HAL converted rates itself.
+# -------------------------------------------------------------
+resampler_test_src := \
+    ../InputResampler.cpp \
+    ResamplerTest.cpp
+
+audioflinger_path := frameworks/base/services/audioflinger
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := $(resampler_test_src)
+LOCAL_C_INCLUDES := $(softpostproc_test_includes)
+LOCAL_SHARED_LIBRARIES := libcutils libutils
+ifneq ($(wildcard $(audioflinger_path)/AudioResampler.h),)
+    LOCAL_C_INCLUDES += $(audioflinger_path)
+    LOCAL_SHARED_LIBRARIES += libaudioflinger
+    LOCAL_CFLAGS += -DHAVE_AUDIOFLINGER_RESAMPLER
+endif
+LOCAL_MODULE := resampler_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += -fno-short-enums
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := $(resampler_test_src)
+LOCAL_C_INCLUDES := $(softpostproc_test_includes) $(LOCAL_PATH)/../../include
+LOCAL_STATIC_LIBRARIES := libutils libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt -lm
+LOCAL_MODULE := resampler_test
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,334 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// Runs the HAL against FakeMsmDriver and reports what it costs: hardware
+// and stream open, the first write and read (driver open, config and
+// AUDIO_START), routing changes, standby and resume, the write and read
+// period jitter, and the write to DSP latency of each output profile. The
+// audio.fake.* properties shape the fake driver, see FakeMsmDriver.cpp;
+// periods are checked against audio.fake.speed.
+//
+//   audio_hal_bench [buffers] [routing changes]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/Timers.h>
+#include <cutils/properties.h>
+
+#include <hardware_legacy/AudioHardwareInterface.h>
+
+namespace android_audio_legacy {
+
+extern "C" AudioHardwareInterface* createAudioHardware(void);
+
+struct bench_stat {
+    const char *name;
+    uint32_t    count;
+    double      sum;
+    double      sumsq;
+    nsecs_t     min;
+    nsecs_t     max;
+};
+
+static int bench_failures = 0;
+
+static void bench_add(bench_stat *s, nsecs_t ns)
+{
+    if (!s->count || ns < s->min)
+        s->min = ns;
+    if (!s->count || ns > s->max)
+        s->max = ns;
+    s->count++;
+    s->sum += ns;
+    s->sumsq += (double)ns * ns;
+}
+
+static void bench_print(const bench_stat *s)
+{
+    if (!s->count)
+        return;
+    double mean = s->sum / s->count;
+    double var = s->sumsq / s->count - mean * mean;
+    printf("%-24s %6u x  mean %9.1f us  sd %8.1f us  min %9.1f us  max %9.1f us\n",
+           s->name, s->count, mean / 1000, var > 0 ? sqrt(var) / 1000 : 0,
+           s->min / 1000.0, s->max / 1000.0);
+}
+
+static void bench_once(const char *name, nsecs_t ns)
+{
+    printf("%-24s %9.1f us\n", name, ns / 1000.0);
+}
+
+static void bench_check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        bench_failures++;
+    }
+}
+
+// Period deviations are only meaningful when the fake paces the HAL.
+static double bench_speed()
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get("audio.fake.speed", value, "1");
+    return atof(value);
+}
+
+static void bench_output(AudioHardwareInterface *hw, int buffers, int changes)
+{
+    int format = AudioSystem::PCM_16_BIT;
+    uint32_t channels = AudioSystem::CHANNEL_OUT_STEREO;
+    uint32_t rate = 44100;
+    status_t status;
+
+    nsecs_t start = systemTime();
+    AudioStreamOut *out = hw->openOutputStream(AudioSystem::DEVICE_OUT_SPEAKER,
+                                               &format, &channels, &rate, &status);
+    bench_once("output open", systemTime() - start);
+    bench_check(out != NULL && status == NO_ERROR, "openOutputStream");
+    if (out == NULL)
+        return;
+
+    size_t size = out->bufferSize();
+    char *buf = (char *)calloc(1, size);
+    double speed = bench_speed();
+    nsecs_t period = speed > 0 ?
+            (nsecs_t)(1e9 * (size / out->frameSize()) / out->sampleRate() / speed) : 0;
+
+    start = systemTime();
+    bench_check(out->write(buf, size) == (ssize_t)size, "first write");
+    bench_once("first write", systemTime() - start);
+
+    bench_stat writes = { "write" };
+    bench_stat jitter = { "write period error" };
+    nsecs_t last = systemTime();
+    for (int i = 0; i < buffers; i++) {
+        if (out->write(buf, size) != (ssize_t)size) {
+            bench_check(false, "write");
+            break;
+        }
+        nsecs_t now = systemTime();
+        bench_add(&writes, now - last);
+        // the first driver buffers fill without blocking
+        if (period && i >= 4)
+            bench_add(&jitter, now - last > period ? now - last - period : period - (now - last));
+        last = now;
+    }
+    bench_print(&writes);
+    bench_print(&jitter);
+
+    // alternate two endpoints so every change reaches the driver
+    static const uint32_t devices[] = {
+        AudioSystem::DEVICE_OUT_WIRED_HEADSET,
+        AudioSystem::DEVICE_OUT_SPEAKER,
+    };
+    bench_stat routing = { "routing change" };
+    for (int i = 0; i < changes; i++) {
+        char kv[64];
+        snprintf(kv, sizeof(kv), "%s=%u", AudioParameter::keyRouting, devices[i & 1]);
+        start = systemTime();
+        bench_check(out->setParameters(String8(kv)) == NO_ERROR, "routing");
+        bench_add(&routing, systemTime() - start);
+        out->write(buf, size);
+    }
+    bench_print(&routing);
+
+    start = systemTime();
+    out->standby();
+    bench_once("output standby", systemTime() - start);
+    start = systemTime();
+    bench_check(out->write(buf, size) == (ssize_t)size, "write after standby");
+    bench_once("write after standby", systemTime() - start);
+
+    hw->closeOutputStream(out);
+    free(buf);
+}
+
+// Write to DSP latency of one audio.out.profile: from entering write()
+// until the fake DSP plays the last frame of that write, which is the
+// frames written past getRenderPosition() drained at the fake clock.
+static void bench_profile(AudioHardwareInterface *hw, const char *profile, int buffers)
+{
+    int format = AudioSystem::PCM_16_BIT;
+    uint32_t channels = AudioSystem::CHANNEL_OUT_STEREO;
+    uint32_t rate = 44100;
+    status_t status;
+    char label[64];
+
+    double speed = bench_speed();
+    if (speed <= 0) {
+        printf("%s profile: not paced (audio.fake.speed 0), skipped\n", profile);
+        return;
+    }
+
+    property_set("audio.out.profile", profile);
+    AudioStreamOut *out = hw->openOutputStream(AudioSystem::DEVICE_OUT_SPEAKER,
+                                               &format, &channels, &rate, &status);
+    snprintf(label, sizeof(label), "%s profile open", profile);
+    bench_check(out != NULL && status == NO_ERROR, label);
+    if (out == NULL)
+        return;
+    String8 opened = out->getParameters(String8("output_profile"));
+    snprintf(label, sizeof(label), "%s profile selected", profile);
+    bench_check(strstr(opened.string(), profile) != NULL, label);
+
+    size_t size = out->bufferSize();
+    char *buf = (char *)calloc(1, size);
+    uint32_t written = 0;
+    snprintf(label, sizeof(label), "%s write to DSP", profile);
+    bench_stat latency = { label };
+    for (int i = 0; i < buffers; i++) {
+        nsecs_t start = systemTime();
+        if (out->write(buf, size) != (ssize_t)size) {
+            bench_check(false, "write");
+            break;
+        }
+        nsecs_t now = systemTime();
+        written += size / out->frameSize();
+        uint32_t played;
+        if (out->getRenderPosition(&played) != NO_ERROR) {
+            bench_check(false, "getRenderPosition");
+            break;
+        }
+        // the first writes fill the driver before AUDIO_START
+        if (i >= 4)
+            bench_add(&latency, now - start +
+                      (nsecs_t)((written - played) * 1e9 / out->sampleRate() / speed));
+    }
+    printf("%s profile: %u byte buffers, latency() %u ms\n", profile, (uint32_t)size,
+           out->latency());
+    bench_print(&latency);
+
+    hw->closeOutputStream(out);
+    free(buf);
+}
+
+static void bench_input(AudioHardwareInterface *hw, const char *name, int format,
+                        uint32_t rate, int buffers)
+{
+    uint32_t channels = AudioSystem::CHANNEL_IN_MONO;
+    status_t status;
+    char label[64];
+
+    nsecs_t start = systemTime();
+    AudioStreamIn *in = hw->openInputStream(AudioSystem::DEVICE_IN_BUILTIN_MIC,
+                                            &format, &channels, &rate, &status,
+                                            (AudioSystem::audio_in_acoustics)0);
+    snprintf(label, sizeof(label), "%s open", name);
+    bench_once(label, systemTime() - start);
+    bench_check(in != NULL && status == NO_ERROR, label);
+    if (in == NULL)
+        return;
+
+    size_t size = in->bufferSize();
+    char *buf = (char *)malloc(size);
+
+    start = systemTime();
+    ssize_t got = in->read(buf, size);
+    snprintf(label, sizeof(label), "%s first read", name);
+    bench_once(label, systemTime() - start);
+    bench_check(got > 0, label);
+
+    bench_stat reads = { name };
+    size_t bytes = 0;
+    nsecs_t first = systemTime(), last = first;
+    for (int i = 0; i < buffers; i++) {
+        got = in->read(buf, size);
+        if (got <= 0) {
+            bench_check(false, "read");
+            break;
+        }
+        bytes += got;
+        nsecs_t now = systemTime();
+        bench_add(&reads, now - last);
+        last = now;
+    }
+    bench_print(&reads);
+    if (last > first)
+        printf("%-24s %9.1f kB/s, %u frames lost\n", name,
+               bytes * 1e6 / (last - first), in->getInputFramesLost());
+
+    hw->closeInputStream(in);
+    free(buf);
+}
+
+}; // namespace android_audio_legacy
+
+using namespace android_audio_legacy;
+
+int main(int argc, char **argv)
+{
+    int buffers = argc > 1 ? atoi(argv[1]) : 200;
+    int changes = argc > 2 ? atoi(argv[2]) : 20;
+
+    nsecs_t start = systemTime();
+    AudioHardwareInterface *hw = createAudioHardware();
+    bench_once("hardware open", systemTime() - start);
+    if (hw == NULL || hw->initCheck() != NO_ERROR) {
+        printf("FAIL: the HAL did not initialize\n");
+        return 1;
+    }
+
+    bench_output(hw, buffers, changes);
+
+    // every output profile, then back to what the property said
+    static const char *const profiles[] = { "default", "low_latency" };
+    char profile[PROPERTY_VALUE_MAX];
+    property_get("audio.out.profile", profile, "default");
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+        bench_profile(hw, profiles[i], buffers);
+    property_set("audio.out.profile", profile);
+
+    // AudioFlinger keeps the primary output open while it records, and
+    // input routing goes through it
+    int format = AudioSystem::PCM_16_BIT;
+    uint32_t channels = AudioSystem::CHANNEL_OUT_STEREO, rate = 44100;
+    status_t status;
+    AudioStreamOut *out = hw->openOutputStream(AudioSystem::DEVICE_OUT_SPEAKER,
+                                               &format, &channels, &rate, &status);
+    bench_check(out != NULL && status == NO_ERROR, "openOutputStream for capture");
+    if (out != NULL) {
+        bench_input(hw, "pcm capture", AudioSystem::PCM_16_BIT, 8000, buffers / 4);
+        bench_input(hw, "voicememo AMR_NB", AudioSystem::AMR_NB, 8000, buffers / 8);
+#ifdef QCOM_HARDWARE
+        bench_input(hw, "voicememo EVRC", AudioSystem::EVRC, 8000, buffers / 8);
+        bench_input(hw, "voicememo QCELP", AudioSystem::QCELP, 8000, buffers / 8);
+#endif
+
+        // the encoder down to its lowest rate, then back to what the
+        // property said
+        char vbr[PROPERTY_VALUE_MAX];
+        property_get("audio.voicememo.vbr", vbr, "0");
+        property_set("audio.voicememo.vbr", "1");
+        bench_input(hw, "voicememo AMR_NB vbr", AudioSystem::AMR_NB, 8000, buffers / 8);
+        property_set("audio.voicememo.vbr", vbr);
+        hw->closeOutputStream(out);
+    }
+
+    // the HAL's own probes and the fake driver's ioctl record
+    printf("\n");
+    fflush(stdout);
+    Vector<String16> args;
+    hw->dumpState(1, args);
+
+    delete hw;
+    printf("%s\n", bench_failures ? "FAILED" : "PASSED");
+    return bench_failures ? 1 : 0;
+}
@@ -0,0 +1,881 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// Userspace stand-in for the msm_snd and msm_pcm drivers. Each open node
+// is backed by a /dev/null descriptor so fds stay unique. Playback is
+// consumed and capture produced by a clock running at audio.fake.speed
+// times real time (0: as fast as the HAL goes), AUDIO_START and open are
+// delayed by audio.fake.latency_ms, and audio.fake.eagain_pct percent of
+// reads and writes fail with EAGAIN. Every ioctl is counted and the last
+// ones kept for dumpsys, audio.fake.trace also logs them.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+//#define LOG_NDEBUG 0
+
+#define LOG_TAG "FakeMsmDriver"
+#include <utils/Log.h>
+#include <utils/threads.h>
+#include <utils/Timers.h>
+#include <cutils/properties.h>
+
+#include <linux/msm_audio.h>
+#include <linux/msm_audio_voicememo.h>
+
+#include "AudioBackend.h"
+
+#define FAKE_MAX_FDS        16
+#define FAKE_LOG_SIZE       32
+#define FAKE_TONE_HZ        1000
+#define FAKE_TONE_LEVEL     3277    // -20 dBFS
+
+namespace android_audio_legacy {
+
+using android::Mutex;
+using android::String8;
+
+enum {
+    FAKE_SND = 0,
+    FAKE_PCM_OUT,
+    FAKE_PCM_IN,
+    FAKE_PCM_CTL,
+    FAKE_PREPROC_CTL,
+    FAKE_VOICEMEMO,
+    FAKE_NUM_NODES
+};
+
+static const char *const fake_nodes[FAKE_NUM_NODES] = {
+    "/dev/msm_snd",
+    "/dev/msm_pcm_out",
+    "/dev/msm_pcm_in",
+    "/dev/msm_pcm_ctl",
+    "/dev/msm_preproc_ctl",
+    "/dev/msm_voicememo",
+};
+
+// what msm_snd reports, the names the HAL looks up
+static const char *const fake_endpoints[] = {
+    "HANDSET", "SPEAKER", "HEADSET", "BT", "CARKIT", "TTY_HEADSET",
+    "TTY_VCO", "TTY_HCO", "NO_MIC_HEADSET", "FM_HEADSET",
+    "HEADSET_AND_SPEAKER", "FM_SPEAKER", "BT_EC_OFF", "HEADSET_STEREO",
+    "SPEAKER_IN_CALL", "IN_S_SADC_OUT_HANDSET",
+    "IN_S_SADC_OUT_SPEAKER_PHONE", "CURRENT",
+};
+#define FAKE_NUM_ENDPOINTS  (int)(sizeof(fake_endpoints) / sizeof(fake_endpoints[0]))
+
+#define FAKE_IOCTL(r)   { r, #r }
+static const struct {
+    int request;
+    const char *name;
+} fake_ioctl_names[] = {
+    FAKE_IOCTL(AUDIO_START),
+    FAKE_IOCTL(AUDIO_STOP),
+    FAKE_IOCTL(AUDIO_FLUSH),
+    FAKE_IOCTL(AUDIO_GET_CONFIG),
+    FAKE_IOCTL(AUDIO_SET_CONFIG),
+    FAKE_IOCTL(AUDIO_GET_STATS),
+    FAKE_IOCTL(AUDIO_ENABLE_AUDPP),
+    FAKE_IOCTL(AUDIO_SET_ADRC),
+    FAKE_IOCTL(AUDIO_SET_EQ),
+    FAKE_IOCTL(AUDIO_SET_RX_IIR),
+    FAKE_IOCTL(AUDIO_SET_MBADRC),
+    FAKE_IOCTL(AUDIO_ENABLE_AUDPRE),
+    FAKE_IOCTL(AUDIO_SET_AGC),
+    FAKE_IOCTL(AUDIO_SET_NS),
+    FAKE_IOCTL(AUDIO_SET_TX_IIR),
+    FAKE_IOCTL(AUDIO_GET_VOICEMEMO_CONFIG),
+    FAKE_IOCTL(AUDIO_SET_VOICEMEMO_CONFIG),
+    FAKE_IOCTL(SND_SET_DEVICE),
+    FAKE_IOCTL(SND_SET_VOLUME),
+    FAKE_IOCTL(SND_GET_NUM_ENDPOINTS),
+    FAKE_IOCTL(SND_GET_ENDPOINT),
+    FAKE_IOCTL(SND_AVC_CTL),
+    FAKE_IOCTL(SND_AGC_CTL),
+    FAKE_IOCTL(SND_SET_FM_RADIO_VOLUME),
+};
+#define FAKE_NUM_IOCTLS (sizeof(fake_ioctl_names) / sizeof(fake_ioctl_names[0]))
+
+struct fake_device {
+    int         fd;             // -1 when the slot is free
+    int         node;
+    bool        nonblock;
+    bool        started;
+    struct msm_audio_config config;
+    struct msm_audio_voicememo_config voicememo;
+    nsecs_t     clock;          // the DSP was at base bytes then
+    uint64_t    base;
+    uint64_t    bytes;          // written or read by the HAL
+    double      phase;          // capture tone
+    size_t      frameBytes;     // voicememo: one encoded 20 ms frame
+    uint8_t     frameHeader;    // and its rate byte
+};
+
+// Intervals between the HAL's reads or writes, the jitter is their
+// standard deviation.
+struct fake_node_stats {
+    uint32_t    opens;
+    uint64_t    bytes;
+    uint32_t    underruns;      // playback ran dry, or capture overflowed
+    uint64_t    dropped;
+    uint32_t    calls;
+    uint32_t    intervals;
+    nsecs_t     last;
+    nsecs_t     maxInterval;
+    double      sum;
+    double      sumsq;
+};
+
+struct fake_log_entry {
+    nsecs_t     time;
+    int         node;
+    int         request;
+    uint32_t    value;          // first word of the argument
+    int         rc;
+};
+
+static Mutex fake_lock;
+static bool fake_inited = false;
+static float fake_speed = 1;
+static int fake_eagain_pct = 0;
+static int fake_latency_ms = 0;
+static bool fake_trace = false;
+static uint32_t fake_seed = 1;
+static uint32_t fake_eagain_injected = 0;
+
+static fake_device fake_fds[FAKE_MAX_FDS];
+static fake_node_stats fake_stats[FAKE_NUM_NODES];
+static uint32_t fake_ioctl_calls[FAKE_NUM_IOCTLS + 1];    // last: others
+static uint32_t fake_ioctl_errors[FAKE_NUM_IOCTLS + 1];
+static fake_log_entry fake_log[FAKE_LOG_SIZE];
+static uint32_t fake_log_count = 0;
+
+// what the HAL set up last
+static int fake_snd_device = -1;
+static int fake_snd_volume = -1;
+static int fake_avc = -1, fake_agc = -1;
+static int fake_audpp_mask = 0;
+static int fake_audpre_mask = 0;
+
+static void fake_init_l()
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    if (fake_inited)
+        return;
+    property_get("audio.fake.speed", value, "1");
+    fake_speed = atof(value);
+    if (fake_speed < 0)
+        fake_speed = 0;
+    property_get("audio.fake.eagain_pct", value, "0");
+    fake_eagain_pct = atoi(value);
+    property_get("audio.fake.latency_ms", value, "0");
+    fake_latency_ms = atoi(value);
+    property_get("audio.fake.trace", value, "0");
+    fake_trace = atoi(value) != 0;
+    for (int i = 0; i < FAKE_MAX_FDS; i++)
+        fake_fds[i].fd = -1;
+    fake_inited = true;
+    LOGI("speed %.2f, %d%% EAGAIN, %d ms latency", fake_speed, fake_eagain_pct,
+         fake_latency_ms);
+}
+
+static fake_device *fake_find_l(int fd)
+{
+    if (fd < 0 || !fake_inited)
+        return NULL;
+    for (int i = 0; i < FAKE_MAX_FDS; i++) {
+        if (fake_fds[i].fd == fd)
+            return &fake_fds[i];
+    }
+    return NULL;
+}
+
+static const char *fake_ioctl_name(int request)
+{
+    for (size_t i = 0; i < FAKE_NUM_IOCTLS; i++) {
+        if (fake_ioctl_names[i].request == request)
+            return fake_ioctl_names[i].name;
+    }
+    return "other";
+}
+
+static bool fake_inject_eagain_l()
+{
+    if (fake_eagain_pct <= 0)
+        return false;
+    fake_seed = fake_seed * 1103515245 + 12345;
+    if ((int)((fake_seed >> 16) % 100) >= fake_eagain_pct)
+        return false;
+    fake_eagain_injected++;
+    return true;
+}
+
+static void fake_sleep(nsecs_t ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+static void fake_count_call_l(fake_device *dev, nsecs_t now)
+{
+    fake_node_stats *s = &fake_stats[dev->node];
+    if (s->last) {
+        nsecs_t interval = now - s->last;
+        s->sum += interval;
+        s->sumsq += (double)interval * interval;
+        s->intervals++;
+        if (interval > s->maxInterval)
+            s->maxInterval = interval;
+    }
+    s->calls++;
+    s->last = now;
+}
+
+// bytes per second the DSP moves, 0 when unthrottled
+static double fake_rate(const fake_device *dev)
+{
+    if (dev->frameBytes)
+        return (double)dev->frameBytes * 50 * fake_speed;
+    return (double)dev->config.sample_rate * dev->config.channel_count *
+           sizeof(int16_t) * fake_speed;
+}
+
+// bytes the DSP has played or captured by now
+static uint64_t fake_position(const fake_device *dev, nsecs_t now)
+{
+    if (now <= dev->clock)
+        return dev->base;
+    return dev->base + (uint64_t)((now - dev->clock) * fake_rate(dev) / 1000000000.0);
+}
+
+static nsecs_t fake_delay(const fake_device *dev, uint64_t bytes)
+{
+    return (nsecs_t)(bytes * 1000000000.0 / fake_rate(dev)) + 1;
+}
+
+// How long until a write fits, the driver takes one when a buffer is free.
+// Before AUDIO_START the buffers are only being filled.
+static nsecs_t fake_out_wait_l(fake_device *dev, nsecs_t now)
+{
+    if (!dev->started || fake_rate(dev) <= 0)
+        return 0;
+    uint64_t played = fake_position(dev, now);
+    if (played > dev->bytes) {
+        if (dev->bytes > dev->base)
+            fake_stats[FAKE_PCM_OUT].underruns++;
+        dev->base = dev->bytes;
+        dev->clock = now;
+        played = dev->bytes;
+    }
+    uint64_t queued = dev->bytes - played;
+    uint64_t limit = (uint64_t)(dev->config.buffer_count - 1) * dev->config.buffer_size;
+    return queued <= limit ? 0 : fake_delay(dev, queued - limit);
+}
+
+// How long until want bytes can be read, -1 if capture is not running.
+// What the buffers cannot hold is dropped as the DSP would.
+static nsecs_t fake_in_wait_l(fake_device *dev, nsecs_t now, size_t want)
+{
+    if (!dev->started)
+        return -1;
+    if (fake_rate(dev) <= 0)
+        return 0;
+    uint64_t produced = fake_position(dev, now);
+    uint64_t available = produced > dev->bytes ? produced - dev->bytes : 0;
+    uint64_t limit = (uint64_t)dev->config.buffer_count * dev->config.buffer_size;
+    if (available > limit) {
+        fake_stats[dev->node].underruns++;
+        fake_stats[dev->node].dropped += available - limit;
+        dev->bytes = produced - limit;
+        available = limit;
+    }
+    return available >= want ? 0 : fake_delay(dev, want - available);
+}
+
+static size_t fake_in_available_l(fake_device *dev, nsecs_t now)
+{
+    if (fake_rate(dev) <= 0)
+        return dev->config.buffer_size;
+    uint64_t produced = fake_position(dev, now);
+    return produced > dev->bytes ? produced - dev->bytes : 0;
+}
+
+static void fake_capture_fill(fake_device *dev, void *buf, size_t count)
+{
+    if (dev->node != FAKE_PCM_IN) {
+        memset(buf, 0, count);
+        // silent frames, but with a rate byte a decoder accepts
+        for (size_t i = 0; dev->frameBytes && i < count; i += dev->frameBytes)
+            static_cast<uint8_t *>(buf)[i] = dev->frameHeader;
+        return;
+    }
+    int channels = dev->config.channel_count ? dev->config.channel_count : 1;
+    double step = 2 * M_PI * FAKE_TONE_HZ / (dev->config.sample_rate ? dev->config.sample_rate : 8000);
+    int16_t *out = static_cast<int16_t *>(buf);
+    size_t frames = count / (channels * sizeof(int16_t));
+    for (size_t i = 0; i < frames; i++) {
+        int16_t sample = (int16_t)(FAKE_TONE_LEVEL * sin(dev->phase));
+        for (int ch = 0; ch < channels; ch++)
+            *out++ = sample;
+        dev->phase += step;
+        if (dev->phase > 2 * M_PI)
+            dev->phase -= 2 * M_PI;
+    }
+}
+
+// Full rate frame of what the voicememo encoder was set up for, the
+// variable rates are not emulated. 0 keeps it paced like PCM.
+static size_t fake_voicememo_frame(const struct msm_audio_voicememo_config *cfg,
+                                   uint8_t *header)
+{
+    // AMR-NB storage format: frame type in bits 3-6, quality bit set
+    static const size_t amr_bytes[] = { 13, 14, 16, 18, 20, 21, 27, 32 };
+
+    switch (cfg->capability) {
+    case RPC_VOC_CAP_AMR:
+        if (cfg->max_rate > RPC_VOC_AMR_RATE_1220)
+            return 0;
+        *header = (cfg->max_rate << 3) | 0x04;
+        return amr_bytes[cfg->max_rate];
+    case RPC_VOC_CAP_IS733:
+        *header = RPC_VOC_1_RATE;
+        return 35;
+    case RPC_VOC_CAP_IS127:
+        *header = RPC_VOC_1_RATE;
+        return 23;
+    }
+    return 0;
+}
+
+static void fake_default_config(fake_device *dev)
+{
+    memset(&dev->config, 0, sizeof(dev->config));
+    memset(&dev->voicememo, 0, sizeof(dev->voicememo));
+    dev->frameBytes = 0;
+    switch (dev->node) {
+    case FAKE_PCM_OUT:
+        dev->config.buffer_size = 4800;
+        dev->config.buffer_count = 2;
+        dev->config.channel_count = 2;
+        dev->config.sample_rate = 44100;
+        break;
+    case FAKE_PCM_IN:
+        dev->config.buffer_size = 2048;
+        dev->config.buffer_count = 8;
+        dev->config.channel_count = 1;
+        dev->config.sample_rate = 8000;
+        break;
+    case FAKE_VOICEMEMO:
+        // the payload is silence, paced like 8 kHz mono PCM
+        dev->config.buffer_size = 320;
+        dev->config.buffer_count = 8;
+        dev->config.channel_count = 1;
+        dev->config.sample_rate = 8000;
+        dev->voicememo.rec_interval_ms = 20;
+        break;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+static int fake_snd_ioctl_l(int request, void *arg)
+{
+    switch (request) {
+    case SND_GET_NUM_ENDPOINTS:
+        *(int *)arg = FAKE_NUM_ENDPOINTS;
+        return 0;
+    case SND_GET_ENDPOINT: {
+        struct msm_snd_endpoint *ept = (struct msm_snd_endpoint *)arg;
+        if (ept->id < 0 || ept->id >= FAKE_NUM_ENDPOINTS)
+            return -EINVAL;
+        strncpy(ept->name, fake_endpoints[ept->id], sizeof(ept->name) - 1);
+        ept->name[sizeof(ept->name) - 1] = '\0';
+        return 0;
+    }
+    case SND_SET_DEVICE: {
+        const struct msm_snd_device_config *cfg = (const struct msm_snd_device_config *)arg;
+        if (cfg->device >= (uint32_t)FAKE_NUM_ENDPOINTS)
+            return -EINVAL;
+        fake_snd_device = cfg->device;
+        return 0;
+    }
+    case SND_SET_VOLUME: {
+        const struct msm_snd_volume_config *cfg = (const struct msm_snd_volume_config *)arg;
+        if (cfg->device >= (uint32_t)FAKE_NUM_ENDPOINTS)
+            return -EINVAL;
+        fake_snd_volume = cfg->volume;
+        return 0;
+    }
+    case SND_AVC_CTL:
+        fake_avc = *(int *)arg;
+        return 0;
+    case SND_AGC_CTL:
+        fake_agc = *(int *)arg;
+        return 0;
+    case SND_SET_FM_RADIO_VOLUME:
+        return 0;
+    }
+    return -EINVAL;
+}
+
+static int fake_pcm_ioctl_l(fake_device *dev, int request, void *arg, nsecs_t now)
+{
+    switch (request) {
+    case AUDIO_GET_CONFIG:
+        memcpy(arg, &dev->config, sizeof(dev->config));
+        return 0;
+    case AUDIO_SET_CONFIG: {
+        const struct msm_audio_config *cfg = (const struct msm_audio_config *)arg;
+        if (dev->started)
+            return -EBUSY;
+        if (cfg->channel_count < 1 || cfg->channel_count > 2 || !cfg->sample_rate ||
+            !cfg->buffer_size || cfg->buffer_count < 2)
+            return -EINVAL;
+        dev->config.buffer_size = cfg->buffer_size;
+        dev->config.buffer_count = cfg->buffer_count;
+        dev->config.channel_count = cfg->channel_count;
+        dev->config.sample_rate = cfg->sample_rate;
+        dev->config.type = cfg->type;
+        return 0;
+    }
+    case AUDIO_START:
+        if (dev->started)
+            return 0;
+        dev->started = true;
+        dev->clock = now + ms2ns(fake_latency_ms);
+        dev->base = dev->node == FAKE_PCM_OUT ? 0 : dev->bytes;
+        return 0;
+    case AUDIO_STOP:
+        dev->started = false;
+        return 0;
+    case AUDIO_FLUSH:
+        // queued playback is thrown away
+        if (dev->node == FAKE_PCM_OUT && dev->started) {
+            uint64_t played = fake_position(dev, now);
+            if (played < dev->bytes)
+                dev->bytes = played;
+            dev->base = dev->bytes;
+            dev->clock = now;
+        }
+        return 0;
+    case AUDIO_GET_STATS: {
+        struct msm_audio_stats *stats = (struct msm_audio_stats *)arg;
+        uint64_t bytes = dev->bytes;
+        if (dev->node == FAKE_PCM_OUT) {
+            // settles an underrun first, the DSP does not play past the data
+            fake_out_wait_l(dev, now);
+            uint64_t played = fake_position(dev, now);
+            if (!dev->started)
+                bytes = 0;
+            else if (fake_rate(dev) > 0 && played < bytes)
+                bytes = played;
+        }
+        memset(stats, 0, sizeof(*stats));
+        stats->byte_count = (uint32_t)bytes;
+        stats->sample_count = (uint32_t)(bytes / (dev->config.channel_count * sizeof(int16_t)));
+        return 0;
+    }
+    case AUDIO_GET_VOICEMEMO_CONFIG:
+        if (dev->node != FAKE_VOICEMEMO)
+            return -EINVAL;
+        memcpy(arg, &dev->voicememo, sizeof(dev->voicememo));
+        return 0;
+    case AUDIO_SET_VOICEMEMO_CONFIG:
+        if (dev->node != FAKE_VOICEMEMO)
+            return -EINVAL;
+        if (dev->started)
+            return -EBUSY;
+        memcpy(&dev->voicememo, arg, sizeof(dev->voicememo));
+        dev->frameBytes = fake_voicememo_frame(&dev->voicememo, &dev->frameHeader);
+        if (dev->frameBytes)
+            dev->config.buffer_size = dev->frameBytes * 10;
+        return 0;
+    }
+    // encoder settings on the capture nodes are taken as they are
+    if (dev->node != FAKE_PCM_OUT && _IOC_TYPE(request) == AUDIO_IOCTL_MAGIC)
+        return 0;
+    return -EINVAL;
+}
+
+static int fake_ctl_ioctl_l(fake_device *dev, int request, void *arg)
+{
+    if (dev->node == FAKE_PCM_CTL) {
+        switch (request) {
+        case AUDIO_ENABLE_AUDPP:
+            fake_audpp_mask = *(int *)arg;
+            return 0;
+        case AUDIO_SET_ADRC:
+        case AUDIO_SET_EQ:
+        case AUDIO_SET_RX_IIR:
+        case AUDIO_SET_MBADRC:
+            return 0;
+        }
+    } else {
+        switch (request) {
+        case AUDIO_ENABLE_AUDPRE:
+            fake_audpre_mask = *(uint16_t *)arg;
+            return 0;
+        case AUDIO_SET_AGC:
+        case AUDIO_SET_NS:
+        case AUDIO_SET_TX_IIR:
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+static void fake_record_l(int node, int request, void *arg, int rc, nsecs_t now)
+{
+    size_t i;
+    for (i = 0; i < FAKE_NUM_IOCTLS; i++) {
+        if (fake_ioctl_names[i].request == request)
+            break;
+    }
+    fake_ioctl_calls[i]++;
+    if (rc < 0)
+        fake_ioctl_errors[i]++;
+
+    fake_log_entry *e = &fake_log[fake_log_count++ % FAKE_LOG_SIZE];
+    e->time = now;
+    e->node = node;
+    e->request = request;
+    if (!arg)
+        e->value = 0;
+    else if (request == AUDIO_ENABLE_AUDPRE)
+        e->value = *(uint16_t *)arg;
+    else
+        e->value = *(uint32_t *)arg;
+    e->rc = rc;
+    if (fake_trace)
+        LOGD("%s %s(0x%x) = %d", fake_nodes[node] + 5, fake_ioctl_name(request),
+             e->value, rc);
+}
+
+// ----------------------------------------------------------------------------
+
+static int fake_open(const char *path, int flags)
+{
+    int node;
+    for (node = 0; node < FAKE_NUM_NODES; node++) {
+        if (!strcmp(path, fake_nodes[node]))
+            break;
+    }
+    if (node == FAKE_NUM_NODES)
+        return ::open(path, flags);
+
+    fake_lock.lock();
+    fake_init_l();
+    int latency = fake_latency_ms;
+    fake_lock.unlock();
+    if (node == FAKE_PCM_OUT || node == FAKE_PCM_IN || node == FAKE_VOICEMEMO)
+        fake_sleep(ms2ns(latency));
+
+    Mutex::Autolock _l(fake_lock);
+    fake_device *dev = NULL;
+    for (int i = 0; i < FAKE_MAX_FDS; i++) {
+        if (fake_fds[i].fd < 0) {
+            if (!dev)
+                dev = &fake_fds[i];
+        } else if (fake_fds[i].node == node && node != FAKE_SND) {
+            // one client at a time, like the drivers
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    if (!dev) {
+        errno = EMFILE;
+        return -1;
+    }
+    int fd = ::open("/dev/null", O_RDWR);
+    if (fd < 0)
+        return fd;
+
+    memset(dev, 0, sizeof(*dev));
+    dev->fd = fd;
+    dev->node = node;
+    dev->nonblock = (flags & O_NONBLOCK) != 0;
+    fake_default_config(dev);
+    fake_stats[node].opens++;
+    fake_stats[node].last = 0;
+    LOGV("open %s = %d", path, fd);
+    return fd;
+}
+
+static int fake_close(int fd)
+{
+    fake_lock.lock();
+    fake_device *dev = fake_find_l(fd);
+    if (dev)
+        dev->fd = -1;
+    fake_lock.unlock();
+    return ::close(fd);
+}
+
+static int fake_ioctl(int fd, int request, void *arg)
+{
+    int rc;
+    nsecs_t now = systemTime();
+    fake_lock.lock();
+    fake_device *dev = fake_find_l(fd);
+    if (!dev) {
+        fake_lock.unlock();
+        return ::ioctl(fd, request, arg);
+    }
+
+    if (arg == NULL && request != AUDIO_START && request != AUDIO_STOP &&
+        request != AUDIO_FLUSH) {
+        rc = -EFAULT;
+    } else {
+        switch (dev->node) {
+        case FAKE_SND:
+            rc = fake_snd_ioctl_l(request, arg);
+            break;
+        case FAKE_PCM_CTL:
+        case FAKE_PREPROC_CTL:
+            rc = fake_ctl_ioctl_l(dev, request, arg);
+            break;
+        default:
+            rc = fake_pcm_ioctl_l(dev, request, arg, now);
+            break;
+        }
+    }
+    fake_record_l(dev->node, request, arg, rc, now);
+    bool starting = rc == 0 && request == AUDIO_START && dev->node != FAKE_SND;
+    fake_lock.unlock();
+
+    // AUDIO_START returns once the DSP has the stream, which is when the
+    // clock set above begins to run
+    if (starting)
+        fake_sleep(ms2ns(fake_latency_ms));
+    if (rc < 0) {
+        errno = -rc;
+        return -1;
+    }
+    return rc;
+}
+
+static ssize_t fake_write(int fd, const void *buf, size_t count)
+{
+    bool first = true;
+    for (;;) {
+        nsecs_t now = systemTime();
+        fake_lock.lock();
+        fake_device *dev = fake_find_l(fd);
+        if (!dev) {
+            fake_lock.unlock();
+            return ::write(fd, buf, count);
+        }
+        if (dev->node != FAKE_PCM_OUT) {
+            fake_lock.unlock();
+            errno = EINVAL;
+            return -1;
+        }
+        if (first) {
+            fake_count_call_l(dev, now);
+            first = false;
+            if (fake_inject_eagain_l()) {
+                fake_lock.unlock();
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+        nsecs_t wait = fake_out_wait_l(dev, now);
+        if (!wait) {
+            size_t n = count < dev->config.buffer_size ? count : dev->config.buffer_size;
+            dev->bytes += n;
+            fake_stats[FAKE_PCM_OUT].bytes += n;
+            fake_lock.unlock();
+            return n;
+        }
+        bool nonblock = dev->nonblock;
+        fake_lock.unlock();
+        if (nonblock) {
+            errno = EAGAIN;
+            return -1;
+        }
+        fake_sleep(wait);
+    }
+}
+
+static ssize_t fake_read(int fd, void *buf, size_t count)
+{
+    bool first = true;
+    for (;;) {
+        nsecs_t now = systemTime();
+        fake_lock.lock();
+        fake_device *dev = fake_find_l(fd);
+        if (!dev) {
+            fake_lock.unlock();
+            return ::read(fd, buf, count);
+        }
+        if (dev->node != FAKE_PCM_IN && dev->node != FAKE_VOICEMEMO) {
+            fake_lock.unlock();
+            errno = EINVAL;
+            return -1;
+        }
+        if (first) {
+            fake_count_call_l(dev, now);
+            first = false;
+            if (fake_inject_eagain_l()) {
+                fake_lock.unlock();
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+        size_t frameSize = dev->frameBytes ? dev->frameBytes :
+                           dev->config.channel_count * sizeof(int16_t);
+        size_t want = count < dev->config.buffer_size ? count : dev->config.buffer_size;
+        nsecs_t wait = fake_in_wait_l(dev, now, want);
+        if (wait < 0) {
+            fake_lock.unlock();
+            errno = EINVAL;
+            return -1;
+        }
+        if (!wait) {
+            size_t n = fake_in_available_l(dev, now);
+            if (n > count)
+                n = count;
+            n -= n % frameSize;
+            fake_capture_fill(dev, buf, n);
+            dev->bytes += n;
+            fake_stats[dev->node].bytes += n;
+            fake_lock.unlock();
+            return n;
+        }
+        bool nonblock = dev->nonblock;
+        fake_lock.unlock();
+        if (nonblock) {
+            errno = EAGAIN;
+            return -1;
+        }
+        fake_sleep(wait);
+    }
+}
+
+static int fake_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    nsecs_t deadline = timeout < 0 ? -1 : systemTime() + ms2ns(timeout);
+    for (;;) {
+        nsecs_t now = systemTime();
+        nsecs_t wait = -1;
+        int ready = 0;
+
+        fake_lock.lock();
+        for (nfds_t i = 0; i < nfds; i++) {
+            fake_device *dev = fake_find_l(fds[i].fd);
+            if (!dev) {
+                fake_lock.unlock();
+                return ::poll(fds, nfds, timeout);
+            }
+            nsecs_t w = -1;
+            fds[i].revents = 0;
+            if ((fds[i].events & POLLOUT) && dev->node == FAKE_PCM_OUT) {
+                w = fake_out_wait_l(dev, now);
+                if (!w)
+                    fds[i].revents |= POLLOUT;
+            } else if ((fds[i].events & POLLIN) &&
+                       (dev->node == FAKE_PCM_IN || dev->node == FAKE_VOICEMEMO)) {
+                w = fake_in_wait_l(dev, now, dev->config.buffer_size);
+                if (!w)
+                    fds[i].revents |= POLLIN;
+            }
+            if (fds[i].revents)
+                ready++;
+            else if (w > 0 && (wait < 0 || w < wait))
+                wait = w;
+        }
+        fake_lock.unlock();
+
+        if (ready || timeout == 0)
+            return ready;
+        if (deadline >= 0 && (wait < 0 || now + wait > deadline)) {
+            if (deadline > now)
+                fake_sleep(deadline - now);
+            return 0;
+        }
+        fake_sleep(wait);
+    }
+}
+
+static void fake_dump(String8 &result)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    Mutex::Autolock _l(fake_lock);
+
+    snprintf(buffer, SIZE, "\tfake driver: speed %.2f, %d%% EAGAIN (%u injected), "
+             "%d ms latency\n", fake_speed, fake_eagain_pct, fake_eagain_injected,
+             fake_latency_ms);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tfake msm_snd: device %d, volume %d, avc %d, agc %d, "
+             "audpp 0x%04x, audpre 0x%04x\n", fake_snd_device, fake_snd_volume,
+             fake_avc, fake_agc, fake_audpp_mask, fake_audpre_mask);
+    result.append(buffer);
+    for (int node = FAKE_PCM_OUT; node < FAKE_NUM_NODES; node++) {
+        const fake_node_stats *s = &fake_stats[node];
+        if (!s->opens)
+            continue;
+        double mean = s->intervals ? s->sum / s->intervals : 0;
+        double var = s->intervals ? s->sumsq / s->intervals - mean * mean : 0;
+        snprintf(buffer, SIZE, "\tfake %s: %u opens, %llu bytes, %u %s, %llu dropped, "
+                 "%u calls every %.0f us, jitter %.0f us, max %lld us\n",
+                 fake_nodes[node] + 5, s->opens, s->bytes, s->underruns,
+                 node == FAKE_PCM_OUT ? "underruns" : "overruns", s->dropped,
+                 s->calls, mean / 1000, var > 0 ? sqrt(var) / 1000 : 0,
+                 s->maxInterval / 1000);
+        result.append(buffer);
+    }
+    for (size_t i = 0; i <= FAKE_NUM_IOCTLS; i++) {
+        if (!fake_ioctl_calls[i])
+            continue;
+        snprintf(buffer, SIZE, "\tfake ioctl %s: %u calls, %u errors\n",
+                 i < FAKE_NUM_IOCTLS ? fake_ioctl_names[i].name : "other",
+                 fake_ioctl_calls[i], fake_ioctl_errors[i]);
+        result.append(buffer);
+    }
+    uint32_t first = fake_log_count > FAKE_LOG_SIZE ? fake_log_count - FAKE_LOG_SIZE : 0;
+    nsecs_t now = systemTime();
+    for (uint32_t n = first; n < fake_log_count; n++) {
+        const fake_log_entry *e = &fake_log[n % FAKE_LOG_SIZE];
+        snprintf(buffer, SIZE, "\t  -%lld ms %s %s(0x%x) = %d\n", ns2ms(now - e->time),
+                 fake_nodes[e->node] + 5, fake_ioctl_name(e->request), e->value, e->rc);
+        result.append(buffer);
+    }
+}
+
+const audio_backend fake_audio_backend = {
+    "fake",
+    fake_open,
+    fake_close,
+    fake_ioctl,
+    fake_read,
+    fake_write,
+    fake_poll,
+    fake_dump,
+};
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android_audio_legacy
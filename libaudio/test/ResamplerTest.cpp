@@ -0,0 +1,298 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// Measures InputResampler for the rate pairs capture runs into: SNR of pass
+// band tones against a fitted ideal sine, rejection of a tone that would
+// alias, and CPU time per output frame. The device build also runs
+// AudioFlinger's resampler at each quality on the same input, which is the
+// path capture took before the HAL resampled.
+//
+//   resampler_test [cpu MHz]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/Timers.h>
+
+#include "InputResampler.h"
+
+#ifdef HAVE_AUDIOFLINGER_RESAMPLER
+#include <AudioBufferProvider.h>
+#include <AudioResampler.h>
+#endif
+
+#define TEST_SECONDS    1
+#define TEST_AMPLITUDE  16384   // -6 dBFS
+#define TEST_BLOCK      256     // input frames per push, as from the driver
+
+namespace android_audio_legacy {
+
+struct test_pair {
+    uint32_t inRate;
+    uint32_t outRate;
+};
+
+static const test_pair test_pairs[] = {
+    { 8000, 11025 },    // 441 output phases, rounded into the bank
+    { 8000, 44100 },
+    { 16000, 12345 },
+    { 16000, 22050 },
+    { 44100, 8000 },
+    { 48000, 22050 },
+    { 48000, 22051 },
+};
+
+static int test_failures = 0;
+
+static void test_check(bool ok, const char *what, double value)
+{
+    printf("  %-40s %10.2f  %s\n", what, value, ok ? "ok" : "FAIL");
+    if (!ok)
+        test_failures++;
+}
+
+static uint32_t test_gcd(uint32_t a, uint32_t b)
+{
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Passing SNR for a tone. When the bank has fewer phases than the rate
+// pair has output steps, each output lands up to half a phase off; rounded,
+// that is a timing error uniform over +-1/(2 phases) of an input frame and
+// caps the SNR at 20 log10(2 sqrt(3) phases / w).
+static double test_min_snr(uint32_t inRate, uint32_t outRate, int phases, double hz)
+{
+    uint32_t steps = outRate / test_gcd(inRate, outRate);
+    if ((uint32_t)phases >= steps)
+        return 55;
+    double w = 2 * M_PI * hz / inRate;
+    double bound = 20 * log10(2 * sqrt(3.0) * phases / w);
+    return bound - 1 < 55 ? bound - 1 : 55;
+}
+
+static void test_tone(int16_t *buf, size_t frames, double hz, uint32_t rate)
+{
+    for (size_t i = 0; i < frames; i++)
+        buf[i] = (int16_t)lrint(TEST_AMPLITUDE * sin(2 * M_PI * hz * i / rate));
+}
+
+// Least squares fit of a sine at hz over the second half of out; returns
+// the fitted level against the input in dB, the SNR of the residue and the
+// delay of the fitted sine in output frames.
+static double test_fit(const int16_t *out, size_t frames, double hz, uint32_t rate,
+                       double *snrDb, double *delay = NULL)
+{
+    double ss = 0, cc = 0, sc = 0, ys = 0, yc = 0, yy = 0;
+    size_t first = frames / 2;
+    for (size_t i = first; i < frames; i++) {
+        double s = sin(2 * M_PI * hz * i / rate), c = cos(2 * M_PI * hz * i / rate);
+        double y = out[i];
+        ss += s * s;
+        cc += c * c;
+        sc += s * c;
+        ys += y * s;
+        yc += y * c;
+        yy += y * y;
+    }
+    double det = ss * cc - sc * sc;
+    double a = (ys * cc - yc * sc) / det, b = (yc * ss - ys * sc) / det;
+    double fit = a * a * ss + 2 * a * b * sc + b * b * cc;
+    double residue = yy - fit;
+    *snrDb = residue > 0 ? 10 * log10(fit / residue) : 200;
+    if (delay)
+        *delay = -atan2(b, a) * rate / (2 * M_PI * hz);
+    double n = frames - first;
+    return 10 * log10((yy / n) / (TEST_AMPLITUDE * TEST_AMPLITUDE / 2.0) + 1e-20);
+}
+
+static size_t test_run(InputResampler *rs, const int16_t *in, size_t inFrames,
+                       int16_t *out, size_t outFrames)
+{
+    size_t done = 0;
+    for (size_t pos = 0; pos < inFrames && done < outFrames; pos += TEST_BLOCK) {
+        size_t n = inFrames - pos < TEST_BLOCK ? inFrames - pos : TEST_BLOCK;
+        done += rs->process(in + pos, n, out + done, outFrames - done);
+        done += rs->process(NULL, 0, out + done, outFrames - done);
+    }
+    return done;
+}
+
+#ifdef HAVE_AUDIOFLINGER_RESAMPLER
+// Feeds a mono buffer to AudioResampler the way RecordThread does.
+class TestProvider : public android::AudioBufferProvider
+{
+public:
+    TestProvider(const int16_t *data, size_t frames) :
+        mData(data), mFrames(frames), mPos(0) { }
+    virtual android::status_t getNextBuffer(Buffer* buffer) {
+        size_t left = mFrames - mPos;
+        if (left == 0) {
+            buffer->raw = NULL;
+            buffer->frameCount = 0;
+            return android::NOT_ENOUGH_DATA;
+        }
+        if (buffer->frameCount > left)
+            buffer->frameCount = left;
+        buffer->i16 = const_cast<int16_t *>(mData) + mPos;
+        return android::NO_ERROR;
+    }
+    virtual void releaseBuffer(Buffer* buffer) {
+        mPos += buffer->frameCount;
+        buffer->frameCount = 0;
+    }
+private:
+    const int16_t *mData;
+    size_t mFrames;
+    size_t mPos;
+};
+
+// Runs one AudioFlinger quality over in and keeps the left channel,
+// returns the ns spent.
+static nsecs_t test_audioflinger(int quality, const test_pair *pair, const int16_t *in,
+                                 size_t inFrames, int16_t *out, size_t outFrames)
+{
+    android::AudioResampler *rs = android::AudioResampler::create(16, 1, pair->outRate,
+            (android::AudioResampler::src_quality)quality);
+    int32_t *mix = new int32_t[outFrames * 2];
+    memset(mix, 0, outFrames * 2 * sizeof(int32_t));
+    TestProvider provider(in, inFrames);
+    rs->setSampleRate(pair->inRate);
+    rs->setVolume(android::AudioResampler::UNITY_GAIN, android::AudioResampler::UNITY_GAIN);
+
+    nsecs_t start = systemTime();
+    rs->resample(mix, outFrames, &provider);
+    nsecs_t spent = systemTime() - start;
+    for (size_t i = 0; i < outFrames; i++) {
+        int32_t s = mix[2 * i] >> 12;
+        out[i] = s > 32767 ? 32767 : s < -32768 ? -32768 : s;
+    }
+    delete [] mix;
+    delete rs;
+    return spent;
+}
+#endif
+
+static void test_pair_run(const test_pair *pair, double mhz)
+{
+    size_t inFrames = pair->inRate * TEST_SECONDS;
+    size_t outFrames = (size_t)((uint64_t)inFrames * pair->outRate / pair->inRate) - 64;
+    uint32_t low = pair->inRate < pair->outRate ? pair->inRate : pair->outRate;
+    int16_t *in = new int16_t[inFrames];
+    int16_t *out = new int16_t[outFrames];
+    char what[64];
+
+    InputResampler rs(pair->inRate, pair->outRate, 1, TEST_BLOCK);
+    printf("%u -> %u Hz: %d taps, %d phases\n", pair->inRate, pair->outRate,
+           rs.taps(), rs.phases());
+
+    // pass band: clean, and at the input level
+    static const double tones[] = { 0.05, 0.2, 0.35 };
+    for (size_t t = 0; t < sizeof(tones) / sizeof(tones[0]); t++) {
+        double hz = tones[t] * low, snr;
+        test_tone(in, inFrames, hz, pair->inRate);
+        rs.reset();
+        size_t got = test_run(&rs, in, inFrames, out, outFrames);
+        double delay;
+        double level = test_fit(out, got, hz, pair->outRate, &snr, &delay);
+        double minSnr = test_min_snr(pair->inRate, pair->outRate, rs.phases(), hz);
+        snprintf(what, sizeof(what), "%.0f Hz SNR (dB, > %.1f)", hz, minSnr);
+        test_check(got == outFrames && snr > minSnr, what, snr);
+        snprintf(what, sizeof(what), "%.0f Hz level (dB)", hz);
+        test_check(fabs(level) < 0.5, what, level);
+        // output frame n is input time n * M / L; a phase off by a constant
+        // shows here, well under the half phase a truncated phase would add
+        delay *= (double)pair->inRate / pair->outRate;
+        snprintf(what, sizeof(what), "%.0f Hz delay (in frames x 1000)", hz);
+        test_check(fabs(delay) < 0.25 / rs.phases(), what, delay * 1000);
+    }
+
+    // stop band: a tone between the two Nyquist rates must not alias back
+    if (pair->inRate > pair->outRate) {
+        double hz = 0.62 * pair->outRate, snr;
+        test_tone(in, inFrames, hz, pair->inRate);
+        rs.reset();
+        size_t got = test_run(&rs, in, inFrames, out, outFrames);
+        double level = test_fit(out, got, pair->outRate - hz, pair->outRate, &snr);
+        snprintf(what, sizeof(what), "%.0f Hz alias (dB)", hz);
+        test_check(level < -55, what, level);
+    }
+
+    // CPU: 1 kHz, in driver sized pushes
+    test_tone(in, inFrames, 1000, pair->inRate);
+    rs.reset();
+    nsecs_t start = systemTime();
+    test_run(&rs, in, inFrames, out, outFrames);
+    double ns = (double)(systemTime() - start) / outFrames;
+    if (mhz > 0)
+        printf("  %-40s %10.1f ns %8.1f cycles per frame\n", "InputResampler", ns,
+               ns * mhz / 1000);
+    else
+        printf("  %-40s %10.1f ns per frame\n", "InputResampler", ns);
+
+#ifdef HAVE_AUDIOFLINGER_RESAMPLER
+    static const struct { int quality; const char *name; } af[] = {
+        { android::AudioResampler::LOW_QUALITY, "AudioFlinger low (linear)" },
+        { android::AudioResampler::MED_QUALITY, "AudioFlinger medium (cubic)" },
+        { android::AudioResampler::HIGH_QUALITY, "AudioFlinger high (sinc)" },
+    };
+    for (size_t q = 0; q < sizeof(af) / sizeof(af[0]); q++) {
+        double hz = 0.35 * low, snr;
+        test_tone(in, inFrames, hz, pair->inRate);
+        test_audioflinger(af[q].quality, pair, in, inFrames, out, outFrames);
+        test_fit(out, outFrames, hz, pair->outRate, &snr);
+        test_tone(in, inFrames, 1000, pair->inRate);
+        ns = (double)test_audioflinger(af[q].quality, pair, in, inFrames, out, outFrames) /
+             outFrames;
+        printf("  %-40s %10.1f ns %8.1f cycles per frame, %.0f Hz SNR %.1f dB\n",
+               af[q].name, ns, ns * mhz / 1000, hz, snr);
+    }
+#endif
+
+    delete [] in;
+    delete [] out;
+}
+
+}; // namespace android_audio_legacy
+
+using namespace android_audio_legacy;
+
+int main(int argc, char **argv)
+{
+    double mhz = 0;
+    if (argc > 1) {
+        mhz = atof(argv[1]);
+    } else {
+        FILE *f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r");
+        if (f != NULL) {
+            if (fscanf(f, "%lf", &mhz) == 1)
+                mhz /= 1000;
+            fclose(f);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(test_pairs) / sizeof(test_pairs[0]); i++)
+        test_pair_run(&test_pairs[i], mhz);
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+    return test_failures ? 1 : 0;
+}
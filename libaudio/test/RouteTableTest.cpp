@@ -0,0 +1,291 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// Checks route_table against the if/else chain doRouting() used before the
+// table. Every combination of output devices, input device, call state, TTY
+// mode, FM and dual mic goes through route_in_class(), route_key() and the
+// table, and through the old chain, once with every endpoint known and once
+// with each endpoint missing. Built with the same COMBO_DEVICE_SUPPORTED and
+// HAVE_FM_RADIO as the HAL.
+//
+//   route_table_test
+
+#include <stdio.h>
+
+// the route functions and endpoint ids are static to the HAL
+#include "../AudioHardware.cpp"
+
+namespace android_audio_legacy {
+
+static int test_failures = 0;
+
+// doRouting() before route_table, logging dropped. inputDevice 0 is no
+// input stream.
+static void legacy_route(uint32_t outputDevices, uint32_t inputDevice, bool inCall,
+                         int ttyMode, bool fmOn, bool dualMic, int *device, int *mask)
+{
+    int new_snd_device = -1;
+    int new_post_proc_feature_mask = 0;
+
+    if (inputDevice != 0) {
+        if (inputDevice & AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
+            new_snd_device = SND_DEVICE_BT;
+        } else if (inputDevice & AudioSystem::DEVICE_IN_WIRED_HEADSET) {
+            new_snd_device = SND_DEVICE_HEADSET;
+        } else {
+            if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) {
+                new_snd_device = SND_DEVICE_SPEAKER;
+                new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+            } else {
+                new_snd_device = SND_DEVICE_HANDSET;
+            }
+        }
+    }
+
+    if (new_snd_device == -1) {
+        if ((ttyMode != TTY_OFF) && inCall &&
+                (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET)) {
+            if (ttyMode == TTY_FULL) {
+                new_snd_device = SND_DEVICE_TTY_HEADSET;
+            } else if (ttyMode == TTY_VCO) {
+                new_snd_device = SND_DEVICE_TTY_VCO;
+            } else if (ttyMode == TTY_HCO) {
+                new_snd_device = SND_DEVICE_TTY_HCO;
+            }
+        } else if (outputDevices &
+                   (AudioSystem::DEVICE_OUT_BLUETOOTH_SCO | AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET)) {
+            new_snd_device = SND_DEVICE_BT;
+        } else if (outputDevices & AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT) {
+            new_snd_device = SND_DEVICE_CARKIT;
+#ifdef COMBO_DEVICE_SUPPORTED
+        } else if ((outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) &&
+                   (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER)) {
+#ifdef HAVE_FM_RADIO
+            if (fmOn) {
+                new_snd_device = SND_DEVICE_FM_SPEAKER;
+                new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
+                new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+            } else
+#endif
+            {
+                new_snd_device = SND_DEVICE_HEADSET_AND_SPEAKER;
+                new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+            }
+        } else if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE) {
+            if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) {
+#ifdef HAVE_FM_RADIO
+                if (fmOn) {
+                    new_snd_device = SND_DEVICE_FM_SPEAKER;
+                    new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
+                    new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+                } else
+#endif
+                {
+                    new_snd_device = SND_DEVICE_HEADSET_AND_SPEAKER;
+                    new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+                }
+            } else {
+#ifdef HAVE_FM_RADIO
+                if (fmOn) {
+                    new_snd_device = SND_DEVICE_FM_HEADSET;
+                    new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
+                    new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+                } else
+#endif
+                {
+                    new_snd_device = SND_DEVICE_NO_MIC_HEADSET;
+                }
+            }
+#endif // COMBO_DEVICE_SUPPORTED
+        } else if (inCall && (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET)) {
+#ifdef HAVE_FM_RADIO
+            if (fmOn) {
+                new_snd_device = SND_DEVICE_FM_HEADSET;
+                new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
+                new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+            } else
+#endif
+            {
+                new_snd_device = SND_DEVICE_HEADSET;
+                new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+            }
+        } else if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) {
+#ifdef HAVE_FM_RADIO
+            if (fmOn) {
+                new_snd_device = SND_DEVICE_FM_HEADSET;
+                new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
+                new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+            } else
+#endif
+            {
+                new_snd_device = SND_DEVICE_HEADSET_STEREO;
+                new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+            }
+        } else if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE) {
+#ifdef HAVE_FM_RADIO
+            if (fmOn) {
+                new_snd_device = SND_DEVICE_FM_HEADSET;
+                new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
+                new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+            } else
+#endif
+            {
+                new_snd_device = SND_DEVICE_HEADSET_STEREO;
+                new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+            }
+        } else if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) {
+#ifdef HAVE_FM_RADIO
+            if (fmOn) {
+                new_snd_device = SND_DEVICE_FM_SPEAKER;
+                new_post_proc_feature_mask = (EQ_ENABLE | RX_IIR_ENABLE);
+                new_post_proc_feature_mask &= (MBADRC_DISABLE | ADRC_DISABLE);
+            } else
+#endif
+            {
+                new_snd_device = SND_DEVICE_SPEAKER;
+                new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+            }
+        } else if (outputDevices & AUDIO_DEVICE_OUT_SPEAKER_IN_CALL) {
+            new_snd_device = SND_DEVICE_SPEAKER_IN_CALL;
+            new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+        } else {
+            new_snd_device = SND_DEVICE_HANDSET;
+            new_post_proc_feature_mask = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE | MBADRC_ENABLE);
+        }
+    }
+
+    if (dualMic && inCall) {
+        if (new_snd_device == SND_DEVICE_HANDSET) {
+            new_snd_device = SND_DEVICE_IN_S_SADC_OUT_HANDSET;
+        } else if (new_snd_device == SND_DEVICE_SPEAKER) {
+            new_snd_device = SND_DEVICE_IN_S_SADC_OUT_SPEAKER_PHONE;
+        }
+    }
+
+    *device = new_snd_device;
+    *mask = new_post_proc_feature_mask;
+}
+
+// The endpoints the routing policy can pick.
+static uint32_t *const test_endpoints[] = {
+    &SND_DEVICE_HANDSET,
+    &SND_DEVICE_SPEAKER,
+    &SND_DEVICE_SPEAKER_IN_CALL,
+    &SND_DEVICE_BT,
+    &SND_DEVICE_HEADSET,
+    &SND_DEVICE_HEADSET_STEREO,
+    &SND_DEVICE_HEADSET_AND_SPEAKER,
+    &SND_DEVICE_IN_S_SADC_OUT_HANDSET,
+    &SND_DEVICE_IN_S_SADC_OUT_SPEAKER_PHONE,
+    &SND_DEVICE_TTY_HEADSET,
+    &SND_DEVICE_TTY_HCO,
+    &SND_DEVICE_TTY_VCO,
+    &SND_DEVICE_CARKIT,
+#ifdef HAVE_FM_RADIO
+    &SND_DEVICE_FM_SPEAKER,
+    &SND_DEVICE_FM_HEADSET,
+#endif
+    &SND_DEVICE_NO_MIC_HEADSET,
+};
+
+#define TEST_NUM_ENDPOINTS (sizeof(test_endpoints) / sizeof(test_endpoints[0]))
+
+// The output bits doRouting() looks at, every subset of them is tried.
+static const uint32_t test_outputs[] = {
+    AudioSystem::DEVICE_OUT_EARPIECE,
+    AudioSystem::DEVICE_OUT_SPEAKER,
+    AudioSystem::DEVICE_OUT_WIRED_HEADSET,
+    AudioSystem::DEVICE_OUT_WIRED_HEADPHONE,
+    AudioSystem::DEVICE_OUT_BLUETOOTH_SCO,
+    AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET,
+    AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT,
+    AUDIO_DEVICE_OUT_SPEAKER_IN_CALL,
+};
+
+#define TEST_NUM_OUTPUTS (sizeof(test_outputs) / sizeof(test_outputs[0]))
+
+static const uint32_t test_inputs[] = {
+    0,
+    AudioSystem::DEVICE_IN_BUILTIN_MIC,
+    AudioSystem::DEVICE_IN_BACK_MIC,
+    AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET,
+    AudioSystem::DEVICE_IN_WIRED_HEADSET,
+    AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET | AudioSystem::DEVICE_IN_WIRED_HEADSET,
+    AudioSystem::DEVICE_IN_WIRED_HEADSET | AudioSystem::DEVICE_IN_BUILTIN_MIC,
+};
+
+#define TEST_NUM_INPUTS (sizeof(test_inputs) / sizeof(test_inputs[0]))
+
+// Runs every combination through both; missing is the endpoint left
+// undiscovered, or -1 for none. Returns the combinations checked.
+static uint32_t test_pass(int missing, bool *keysSeen)
+{
+    for (size_t i = 0; i < TEST_NUM_ENDPOINTS; i++)
+        *test_endpoints[i] = (int)i == missing ? -1 : 10 + i;
+    build_route_table();
+
+    uint32_t checked = 0;
+    for (uint32_t set = 0; set < (1 << TEST_NUM_OUTPUTS); set++) {
+        uint32_t outputDevices = 0;
+        for (size_t b = 0; b < TEST_NUM_OUTPUTS; b++) {
+            if (set & (1 << b))
+                outputDevices |= test_outputs[b];
+        }
+        for (size_t in = 0; in < TEST_NUM_INPUTS; in++)
+        for (int inCall = 0; inCall < 2; inCall++)
+        for (int tty = TTY_OFF; tty <= TTY_FULL; tty++)
+        for (int fm = 0; fm < 2; fm++)
+        for (int dualMic = 0; dualMic < 2; dualMic++) {
+            int key = route_key(outputDevices, route_in_class(test_inputs[in]), inCall,
+                                tty, fm, dualMic);
+            int device, mask;
+            legacy_route(outputDevices, test_inputs[in], inCall, tty, fm, dualMic,
+                         &device, &mask);
+            keysSeen[key] = true;
+            checked++;
+            if (route_table[key].device == device && route_table[key].mask == mask)
+                continue;
+            if (test_failures++ < 20)
+                printf("FAIL: missing %d outputs %#x input %#x call %d tty %d fm %d "
+                       "dualmic %d: key %#x gives %d/%#x, if/else %d/%#x\n",
+                       missing, outputDevices, test_inputs[in], inCall, tty, fm, dualMic,
+                       key, route_table[key].device, route_table[key].mask, device, mask);
+        }
+    }
+    return checked;
+}
+
+}; // namespace android_audio_legacy
+
+using namespace android_audio_legacy;
+
+int main(int argc, char **argv)
+{
+    static bool keysSeen[ROUTE_KEY_COUNT];
+    uint32_t checked = 0;
+
+    for (int missing = -1; missing < (int)TEST_NUM_ENDPOINTS; missing++)
+        checked += test_pass(missing, keysSeen);
+
+    int keys = 0;
+    for (int key = 0; key < ROUTE_KEY_COUNT; key++)
+        keys += keysSeen[key];
+    printf("%u combinations over %d endpoint sets, %d of %d route keys reached\n",
+           checked, (int)TEST_NUM_ENDPOINTS + 1, keys, ROUTE_KEY_COUNT);
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+    return test_failures ? 1 : 0;
+}
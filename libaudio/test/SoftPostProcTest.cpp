@@ -0,0 +1,482 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// Checks the AudioDsp.h primitives and SoftPostProc against straightforward
+// double precision versions of the same filters, then reports the cost of
+// each chain in ns and, when the CPU clock is known, cycles per sample.
+//
+//   softpostproc_test [cpu MHz]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/Timers.h>
+
+#include "AudioDsp.h"
+#include "AudioHardware.h"
+#include "SoftPostProc.h"
+
+#define TEST_RATE       44100
+#define TEST_FRAMES     4096
+#define TEST_CHANNELS   2
+
+namespace android_audio_legacy {
+
+struct test_biquad {
+    double b0, b1, b2, a1, a2;
+};
+
+static int test_failures = 0;
+
+static void test_check(bool ok, const char *what, double value)
+{
+    printf("%-44s %12.4f  %s\n", what, value, ok ? "ok" : "FAIL");
+    if (!ok)
+        test_failures++;
+}
+
+static int32_t test_q30(double v)
+{
+    return (int32_t)floor(v * 1073741824.0 + 0.5);
+}
+
+// tables hold 32 bit values low word first
+static void test_put32(uint16_t *p, int32_t v)
+{
+    p[0] = (uint16_t)(v & 0xffff);
+    p[1] = (uint16_t)((uint32_t)v >> 16);
+}
+
+// RBJ cookbook peaking, shelving and low pass sections, a0 normalized
+static test_biquad test_peaking(double f0, double gainDb, double q)
+{
+    double A = pow(10.0, gainDb / 40), w = 2 * M_PI * f0 / TEST_RATE;
+    double alpha = sin(w) / (2 * q), a0 = 1 + alpha / A;
+    test_biquad b = { (1 + alpha * A) / a0, -2 * cos(w) / a0, (1 - alpha * A) / a0,
+                      -2 * cos(w) / a0, (1 - alpha / A) / a0 };
+    return b;
+}
+
+static test_biquad test_shelf(double f0, double gainDb, bool high)
+{
+    double A = pow(10.0, gainDb / 40), w = 2 * M_PI * f0 / TEST_RATE;
+    double s = high ? -1 : 1, c = cos(w);
+    double alpha = sin(w) / 2 * sqrt(2.0), r = 2 * sqrt(A) * alpha;
+    double a0 = (A + 1) + s * (A - 1) * c + r;
+    test_biquad b = { A * ((A + 1) - s * (A - 1) * c + r) / a0,
+                      s * 2 * A * ((A - 1) - s * (A + 1) * c) / a0,
+                      A * ((A + 1) - s * (A - 1) * c - r) / a0,
+                      -s * 2 * ((A - 1) + s * (A + 1) * c) / a0,
+                      ((A + 1) + s * (A - 1) * c - r) / a0 };
+    return b;
+}
+
+static test_biquad test_lowpass(double f0)
+{
+    double w = 2 * M_PI * f0 / TEST_RATE, c = cos(w);
+    double alpha = sin(w) / sqrt(2.0), a0 = 1 + alpha;
+    test_biquad b = { (1 - c) / 2 / a0, (1 - c) / a0, (1 - c) / 2 / a0,
+                      -2 * c / a0, (1 - alpha) / a0 };
+    return b;
+}
+
+// audpp layout: layout numerator triples, then the denominator pairs.
+// The reference uses the coefficients as quantized in the table.
+static void test_pack_biquads(uint16_t *params, int layout, test_biquad *bq, int count)
+{
+    for (int i = 0; i < count; i++) {
+        int32_t q[5] = { test_q30(bq[i].b0), test_q30(bq[i].b1), test_q30(bq[i].b2),
+                         test_q30(bq[i].a1), test_q30(bq[i].a2) };
+        test_put32(params + i * 6, q[0]);
+        test_put32(params + i * 6 + 2, q[1]);
+        test_put32(params + i * 6 + 4, q[2]);
+        test_put32(params + layout * 6 + i * 4, q[3]);
+        test_put32(params + layout * 6 + i * 4 + 2, q[4]);
+        test_biquad r = { q[0] / 1073741824.0, q[1] / 1073741824.0, q[2] / 1073741824.0,
+                          q[3] / 1073741824.0, q[4] / 1073741824.0 };
+        bq[i] = r;
+    }
+}
+
+static int16_t test_round16(double v)
+{
+    return clamp16((int32_t)floor(v + 0.5));
+}
+
+// -12 dBFS white noise plus a tone, the same for every run
+static void test_signal(int16_t *buf, size_t frames, double toneHz)
+{
+    srand(1);
+    for (size_t i = 0; i < frames; i++) {
+        double tone = 4096 * sin(2 * M_PI * toneHz * i / TEST_RATE);
+        for (int ch = 0; ch < TEST_CHANNELS; ch++)
+            buf[i * TEST_CHANNELS + ch] =
+                    (int16_t)(tone + (rand() % 8192) - 4096 + ch * 100);
+    }
+}
+
+static void test_reference_biquads(const int16_t *in, int16_t *out, size_t frames,
+                                   const test_biquad *bq, int count)
+{
+    for (int ch = 0; ch < TEST_CHANNELS; ch++) {
+        double x1[EQ_MAX_BAND_NUM] = { 0 }, x2[EQ_MAX_BAND_NUM] = { 0 };
+        double y1[EQ_MAX_BAND_NUM] = { 0 }, y2[EQ_MAX_BAND_NUM] = { 0 };
+        for (size_t i = 0; i < frames; i++) {
+            double v = in[i * TEST_CHANNELS + ch];
+            for (int b = 0; b < count; b++) {
+                double y = bq[b].b0 * v + bq[b].b1 * x1[b] + bq[b].b2 * x2[b] -
+                           bq[b].a1 * y1[b] - bq[b].a2 * y2[b];
+                x2[b] = x1[b];
+                x1[b] = v;
+                y2[b] = y1[b];
+                y1[b] = y;
+                v = y;
+            }
+            out[i * TEST_CHANNELS + ch] = test_round16(v);
+        }
+    }
+}
+
+static void test_compare(const char *name, const int16_t *got, const int16_t *want,
+                         size_t samples, int tolerance, double minSnr)
+{
+    int maxErr = 0;
+    double err = 0, sig = 0;
+    for (size_t i = 0; i < samples; i++) {
+        int e = abs(got[i] - want[i]);
+        if (e > maxErr)
+            maxErr = e;
+        err += (double)e * e;
+        sig += (double)want[i] * want[i];
+    }
+    char what[64];
+    snprintf(what, sizeof(what), "%s max error (LSB)", name);
+    test_check(maxErr <= tolerance, what, maxErr);
+    snprintf(what, sizeof(what), "%s SNR (dB)", name);
+    double snr = err > 0 ? 10 * log10(sig / err) : 200;
+    test_check(snr > minSnr, what, snr);
+}
+
+static void test_clamp16()
+{
+    bool ok = true;
+    for (int32_t v = -(1 << 20); v <= (1 << 20) && ok; v++) {
+        int32_t want = v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+        ok = clamp16(v) == want;
+    }
+    ok = ok && clamp16(INT32_MAX) == 32767 && clamp16(INT32_MIN) == -32768;
+    test_check(ok, "clamp16 saturation", 0);
+}
+
+static void test_dot_q15()
+{
+    int16_t x[64] __attribute__((aligned(4)));
+    int16_t c[64] __attribute__((aligned(4)));
+    bool ok = true;
+    srand(2);
+    for (int round = 0; round < 1000 && ok; round++) {
+        int pairs = 1 + round % 32;
+        int64_t want = 1 << 14;
+        for (int i = 0; i < 2 * pairs; i++) {
+            x[i] = (int16_t)(rand() % 65536 - 32768);
+            c[i] = (int16_t)(rand() % 16384 - 8192);
+            want += x[i] * c[i];
+        }
+        ok = dot_q15(x, c, pairs) == (int32_t)want;
+    }
+    test_check(ok, "dot_q15 exact against int64 sum", 0);
+}
+
+static void test_rx_iir(int16_t *in, int16_t *got, int16_t *want)
+{
+    test_biquad bq[4] = {
+        test_shelf(200, 4, false),
+        test_peaking(1000, 6, 1.0),
+        test_shelf(8000, -3, true),
+        test_lowpass(15000),
+    };
+    rx_iir_filter iir;
+    memset(&iir, 0, sizeof(iir));
+    iir.num_bands = 4;
+    test_pack_biquads(iir.iir_params, 4, bq, 4);
+
+    SoftPostProc pp;
+    pp.configure(RX_IIR_ENABLE, &iir, NULL, NULL, NULL, TEST_CHANNELS);
+    test_check(pp.biquads() == 4, "rx iir biquads loaded", pp.biquads());
+    test_signal(in, TEST_FRAMES, 1000);
+    memcpy(got, in, TEST_FRAMES * TEST_CHANNELS * sizeof(int16_t));
+    pp.process(got, TEST_FRAMES);
+    test_reference_biquads(in, want, TEST_FRAMES, bq, 4);
+    test_compare("rx iir", got, want, TEST_FRAMES * TEST_CHANNELS, 2, 80);
+}
+
+static void test_eq(int16_t *in, int16_t *got, int16_t *want)
+{
+    test_biquad bq[EQ_MAX_BAND_NUM];
+    for (int i = 0; i < EQ_MAX_BAND_NUM; i++)
+        bq[i] = test_peaking(30 * pow(2.0, i * 9.0 / 11), (i & 1) ? 3 : -3, 1.4);
+    eqalizer eq;
+    memset(&eq, 0, sizeof(eq));
+    eq.bands = EQ_MAX_BAND_NUM;
+    test_pack_biquads(eq.params, EQ_MAX_BAND_NUM, bq, EQ_MAX_BAND_NUM);
+
+    SoftPostProc pp;
+    pp.configure(EQ_ENABLE, NULL, &eq, NULL, NULL, TEST_CHANNELS);
+    test_check(pp.biquads() == EQ_MAX_BAND_NUM, "eq biquads loaded", pp.biquads());
+    test_signal(in, TEST_FRAMES, 440);
+    memcpy(got, in, TEST_FRAMES * TEST_CHANNELS * sizeof(int16_t));
+    pp.process(got, TEST_FRAMES);
+    test_reference_biquads(in, want, TEST_FRAMES, bq, EQ_MAX_BAND_NUM);
+    // the sections at 30 and 53 Hz amplify the rounding between stages
+    test_compare("eq", got, want, TEST_FRAMES * TEST_CHANNELS, 4, 70);
+}
+
+// The same block gain computer as SoftPostProc, in double, with the gain
+// applied as a real factor.
+static void test_reference_compressor(const int16_t *in, int16_t *out, size_t frames,
+                                      double thresholdDb, double slope, double rmsKeep,
+                                      double attackKeep, double releaseKeep)
+{
+    const size_t block = 32;
+    double power = 0, gainDb = 0;
+    for (size_t done = 0; done < frames; done += block) {
+        size_t samples = (frames - done < block ? frames - done : block) * TEST_CHANNELS;
+        const int16_t *p = in + done * TEST_CHANNELS;
+        double sum = 0;
+        for (size_t i = 0; i < samples; i++)
+            sum += (double)p[i] * p[i];
+        power = rmsKeep * power + (1 - rmsKeep) * sum / (1073741824.0 * samples);
+        double level = 10 * log10(power + 1e-10);
+        double target = level > thresholdDb ? (thresholdDb - level) * slope : 0;
+        double keep = target < gainDb ? attackKeep : releaseKeep;
+        gainDb = keep * gainDb + (1 - keep) * target;
+        double gain = pow(10.0, gainDb / 20);
+        for (size_t i = 0; i < samples; i++)
+            out[done * TEST_CHANNELS + i] = test_round16(p[i] * gain);
+    }
+}
+
+static void test_adrc(int16_t *in, int16_t *got, int16_t *want)
+{
+    // -30 dBFS threshold, 4:1, 256 sample rms window, per sample attack
+    // (0.99) and release (0.9999) weights
+    const double thresholdDb = -30, slope = 0.75;
+    const uint32_t attack = 0x7eb851eb, release = 0x7ffcb923;
+    adrc_filter adrc;
+    adrc.adrc_params[0] = (uint16_t)((thresholdDb + 90.309) * 128);
+    adrc.adrc_params[1] = (uint16_t)(slope * 65536);
+    adrc.adrc_params[2] = 256;
+    adrc.adrc_params[3] = attack >> 16;
+    adrc.adrc_params[4] = attack & 0xffff;
+    adrc.adrc_params[5] = release >> 16;
+    adrc.adrc_params[6] = release & 0xffff;
+    adrc.adrc_params[7] = 0;
+
+    SoftPostProc pp;
+    pp.configure(ADRC_ENABLE, NULL, NULL, &adrc, NULL, TEST_CHANNELS);
+    test_check(pp.bands() == 1, "adrc bands", pp.bands());
+
+    // a -6 dBFS tone settles to (threshold - level) * slope of gain
+    for (size_t i = 0; i < TEST_FRAMES; i++)
+        in[i * 2] = in[i * 2 + 1] = (int16_t)(16384 * sin(2 * M_PI * 1000.0 * i / TEST_RATE));
+    memcpy(got, in, TEST_FRAMES * TEST_CHANNELS * sizeof(int16_t));
+    pp.process(got, TEST_FRAMES);
+    double thr = (uint16_t)((thresholdDb + 90.309) * 128) / 128.0 - 90.309;
+    test_reference_compressor(in, want, TEST_FRAMES, thr, (uint16_t)(slope * 65536) / 65536.0,
+                              exp(-32.0 / 256), pow(attack / 2147483648.0, 32),
+                              pow(release / 2147483648.0, 32));
+    // truncating Q16 gain against an exact one, on a -25 dBFS result
+    test_compare("adrc", got, want, TEST_FRAMES * TEST_CHANNELS, 2, 60);
+
+    double in2 = 0, out2 = 0;
+    // the attack time constant is 100 samples, long settled by now
+    for (size_t i = TEST_FRAMES / 2; i < TEST_FRAMES; i++) {
+        in2 += (double)in[i * 2] * in[i * 2];
+        out2 += (double)got[i * 2] * got[i * 2];
+    }
+    double levelDb = 10 * log10(in2 / (TEST_FRAMES / 2) / 1073741824.0);
+    double gainDb = 10 * log10(out2 / in2);
+    double expected = (thresholdDb - levelDb) * slope;
+    test_check(fabs(gainDb - expected) < 0.5, "adrc steady gain error (dB)", gainDb - expected);
+}
+
+// Two bands from a windowed sinc crossover; with the compressors off the
+// bands add back up to the input, delayed by half the filter.
+static void test_mbadrc(int16_t *in, int16_t *got, int16_t *want)
+{
+    const int taps = 63;
+    mbadrc_filter mb;
+    memset(&mb, 0, sizeof(mb));
+    mb.num_bands = 2;
+    mb.down_samp_level = 1;
+    mb.ext_buf_size = taps * 2;
+    double h[taps], sum = 0;
+    for (int i = 0; i < taps; i++) {
+        double t = i - (taps - 1) / 2.0, fc = 1000.0 / TEST_RATE;
+        h[i] = (t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t)) *
+               (0.54 - 0.46 * cos(2 * M_PI * i / (taps - 1)));
+        sum += h[i];
+    }
+    int total = 0;
+    for (int i = 0; i < taps; i++) {
+        mb.ext_buf.buff[i] = (int16_t)floor(h[i] / sum * 32768 + 0.5);
+        total += mb.ext_buf.buff[i];
+    }
+    mb.ext_buf.buff[taps / 2] += 32768 - total;
+
+    SoftPostProc pp;
+    pp.configure(MBADRC_ENABLE, NULL, NULL, NULL, &mb, TEST_CHANNELS);
+    test_check(pp.bands() == 2, "mbadrc bands", pp.bands());
+    test_signal(in, TEST_FRAMES, 300);
+    memcpy(got, in, TEST_FRAMES * TEST_CHANNELS * sizeof(int16_t));
+    pp.process(got, TEST_FRAMES);
+    const int delay = (taps - 1) / 2;
+    for (size_t i = 0; i < TEST_FRAMES * TEST_CHANNELS; i++)
+        want[i] = i < delay * TEST_CHANNELS ? 0 : in[i - delay * TEST_CHANNELS];
+    test_compare("mbadrc band sum", got, want, TEST_FRAMES * TEST_CHANNELS, 0, 100);
+
+    // high band muted: what is left is the low pass against a float FIR
+    mb.adrc_band[1].adrc_band_params[1] = 1;
+    pp.configure(MBADRC_ENABLE, NULL, NULL, NULL, &mb, TEST_CHANNELS);
+    memcpy(got, in, TEST_FRAMES * TEST_CHANNELS * sizeof(int16_t));
+    pp.process(got, TEST_FRAMES);
+    for (size_t i = 0; i < TEST_FRAMES; i++) {
+        for (int ch = 0; ch < TEST_CHANNELS; ch++) {
+            double acc = 0;
+            for (int k = 0; k < taps && k <= (int)i; k++)
+                acc += mb.ext_buf.buff[k] / 32768.0 * in[(i - k) * TEST_CHANNELS + ch];
+            want[i * TEST_CHANNELS + ch] = test_round16(acc);
+        }
+    }
+    test_compare("mbadrc low band", got, want, TEST_FRAMES * TEST_CHANNELS, 1, 80);
+}
+
+static double test_cpu_mhz(int argc, char **argv)
+{
+    if (argc > 1)
+        return atof(argv[1]);
+    FILE *f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r");
+    double khz = 0;
+    if (f != NULL) {
+        if (fscanf(f, "%lf", &khz) != 1)
+            khz = 0;
+        fclose(f);
+    }
+    return khz / 1000;
+}
+
+static void test_bench(const char *name, SoftPostProc *pp, int16_t *buf, double mhz)
+{
+    const int rounds = 50;
+    test_signal(buf, TEST_FRAMES, 1000);
+    pp->reset();
+    nsecs_t start = systemTime();
+    for (int i = 0; i < rounds; i++)
+        pp->process(buf, TEST_FRAMES);
+    double ns = (double)(systemTime() - start) / ((double)rounds * TEST_FRAMES * TEST_CHANNELS);
+    if (mhz > 0)
+        printf("%-28s %8.2f ns/sample %8.1f cycles/sample\n", name, ns, ns * mhz / 1000);
+    else
+        printf("%-28s %8.2f ns/sample\n", name, ns);
+}
+
+static void test_benchmarks(int16_t *buf, double mhz)
+{
+    test_biquad bq[EQ_MAX_BAND_NUM];
+    rx_iir_filter iir;
+    eqalizer eq;
+    adrc_filter adrc;
+    mbadrc_filter mb;
+
+    memset(&iir, 0, sizeof(iir));
+    for (int i = 0; i < 4; i++)
+        bq[i] = test_peaking(100.0 * (i + 1), 3, 1.0);
+    iir.num_bands = 4;
+    test_pack_biquads(iir.iir_params, 4, bq, 4);
+    memset(&eq, 0, sizeof(eq));
+    for (int i = 0; i < EQ_MAX_BAND_NUM; i++)
+        bq[i] = test_peaking(30 * pow(2.0, i * 9.0 / 11), 3, 1.4);
+    eq.bands = EQ_MAX_BAND_NUM;
+    test_pack_biquads(eq.params, EQ_MAX_BAND_NUM, bq, EQ_MAX_BAND_NUM);
+    memset(&adrc, 0, sizeof(adrc));
+    adrc.adrc_params[0] = 7720;
+    adrc.adrc_params[1] = 49152;
+    adrc.adrc_params[2] = 256;
+    adrc.adrc_params[3] = 0x7fdf;
+    adrc.adrc_params[5] = 0x7ffc;
+    memset(&mb, 0, sizeof(mb));
+    mb.num_bands = 2;
+    mb.down_samp_level = 1;
+    mb.ext_buf_size = 2 * 63;
+    for (int i = 0; i < 63; i++)
+        mb.ext_buf.buff[i] = i == 31 ? 32768 - 62 * 8 : 8;
+    for (int b = 0; b < 2; b++) {
+        uint16_t *p = mb.adrc_band[b].adrc_band_params;
+        p[0] = 1;
+        p[2] = 256;
+        p[3] = 7720;
+        p[4] = 49152;
+        p[5] = 0x7fdf;
+        p[7] = 0x7ffc;
+    }
+
+    SoftPostProc pp;
+    pp.configure(RX_IIR_ENABLE, &iir, NULL, NULL, NULL, TEST_CHANNELS);
+    test_bench("rx iir, 4 biquads", &pp, buf, mhz);
+    pp.configure(EQ_ENABLE, NULL, &eq, NULL, NULL, TEST_CHANNELS);
+    test_bench("eq, 12 biquads", &pp, buf, mhz);
+    pp.configure(ADRC_ENABLE, NULL, NULL, &adrc, NULL, TEST_CHANNELS);
+    test_bench("adrc", &pp, buf, mhz);
+    pp.configure(MBADRC_ENABLE, NULL, NULL, NULL, &mb, TEST_CHANNELS);
+    test_bench("mbadrc, 2 bands, 63 taps", &pp, buf, mhz);
+    pp.configure(RX_IIR_ENABLE | EQ_ENABLE | MBADRC_ENABLE, &iir, &eq, NULL, &mb,
+                 TEST_CHANNELS);
+    test_bench("iir + eq + mbadrc", &pp, buf, mhz);
+}
+
+}; // namespace android_audio_legacy
+
+using namespace android_audio_legacy;
+
+int main(int argc, char **argv)
+{
+    size_t samples = TEST_FRAMES * TEST_CHANNELS;
+    int16_t *in = new int16_t[samples];
+    int16_t *got = new int16_t[samples];
+    int16_t *want = new int16_t[samples];
+
+#ifdef HAVE_ARMV6_SIMD
+    printf("ARMv6 SIMD paths\n");
+#else
+    printf("C paths\n");
+#endif
+    test_clamp16();
+    test_dot_q15();
+    test_rx_iir(in, got, want);
+    test_eq(in, got, want);
+    test_adrc(in, got, want);
+    test_mbadrc(in, got, want);
+    printf("\n");
+    test_benchmarks(got, test_cpu_mhz(argc, argv));
+
+    delete [] in;
+    delete [] got;
+    delete [] want;
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+    return test_failures ? 1 : 0;
+}
@@ -1,5 +1,4 @@
 LOCAL_PATH := $(call my-dir)
-include $(call all-subdir-makefiles)
 
 include $(CLEAR_VARS)
 
@@ -7,7 +6,7 @@ LOCAL_C_FLAGS        += -O3
 LOCAL_MODULE_TAGS    := optional
 LOCAL_MODULE_PATH    := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 LOCAL_MODULE         := camera.$(TARGET_BOARD_PLATFORM)
-LOCAL_SRC_FILES      := cameraHal.cpp
+LOCAL_SRC_FILES      := cameraHal.cpp cameraVenc.cpp
 LOCAL_PRELINK_MODULE := false
 
 LOCAL_SHARED_LIBRARIES := liblog libdl libutils libcamera_client libbinder libcutils libhardware libcamera libui
@@ -15,3 +14,5 @@ LOCAL_C_INCLUDES       := frameworks/base/services/ frameworks/base/include
 LOCAL_C_INCLUDES       += hardware/libhardware/include/ hardware
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
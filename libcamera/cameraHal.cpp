@@ -19,14 +19,25 @@
 #include <CameraHardwareInterface.h>
 #include <hardware/hardware.h>
 #include <hardware/camera.h>
+#include <hardware/copybit.h>
 #include <binder/IMemory.h>
+#include <binder/MemoryBase.h>
+#include <binder/MemoryHeapBase.h>
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
+#include <utils/threads.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <linux/ioctl.h>
 #include <linux/msm_mdp.h>
+#include <linux/msm_vidc_enc.h>
 #include <ui/Rect.h>
 #include <ui/GraphicBufferMapper.h>
 #include <dlfcn.h>
 
+#include "cameraVenc.h"
+
 #define NO_ERROR 0
 #define GRALLOC_USAGE_PMEM_PRIVATE_ADSP GRALLOC_USAGE_PRIVATE_0
 #define MSM_COPY_HW 1
@@ -44,6 +55,129 @@ struct blitreq {
    struct mdp_blit_req req;
 };
 
+/*
+ * Frame capture file layout: a capture_file_header, followed by records
+ * (capture_record + payload, each 4 byte aligned), followed by an index of
+ * record offsets written when the capture is closed.  The records can still
+ * be walked sequentially if the index is missing.
+ */
+#define CAPTURE_MAGIC        0x50414348 /* "HCAP" */
+#define CAPTURE_VERSION      1
+#define CAPTURE_CHUNK_SIZE   (8 * 1024 * 1024)
+#define CAPTURE_PROP         "debug.camera.capture"
+#define REPLAY_PROP          "debug.camera.replay"
+#define REPLAY_SPEED_PROP    "debug.camera.replay.speed"
+#define REPLAY_PMEM_DEVICE   "/dev/pmem_adsp"
+
+/*
+ * Luma-only preview: the data callback gets just the Y plane and the
+ * window shows it as grayscale, skipping the chroma copy and conversion.
+ * The MDP and copybit tiers blit the Y plane from a pmem frame whose CbCr
+ * plane is a constant 0x80.
+ */
+#define KEY_PREVIEW_LUMA_ONLY            "preview-luma-only"
+#define KEY_PREVIEW_LUMA_ONLY_SUPPORTED  "preview-luma-only-supported"
+#define LUMA_PMEM_DEVICE                 "/dev/pmem_adsp"
+
+/*
+ * In-HAL video encoding: recording frames go to msm_vidc_enc directly and
+ * the client receives the bitstream instead of raw NV21 frames.
+ */
+#define KEY_HAL_VIDEO_ENCODER             "hal-video-encoder"
+#define KEY_HAL_VIDEO_ENCODER_VALUES      "hal-video-encoder-values"
+#define KEY_HAL_VIDEO_ENCODER_BITRATE     "hal-video-encoder-bitrate"
+#define VENC_MOCK_PROP                    "debug.camera.venc.mock"
+#define VENC_DEFAULT_BITRATE              (2 * 1000 * 1000)
+
+/*
+ * Preview conversion tiers, tried in order.  Once a tier fails it is not
+ * retried for the rest of the preview session.
+ */
+enum {
+   CONV_TIER_MDP_BLIT = 0,
+   CONV_TIER_COPYBIT,
+   CONV_TIER_SOFTWARE,
+   CONV_TIER_COUNT
+};
+
+static const char *conv_tier_names[CONV_TIER_COUNT] = {
+   "mdp-blit", "copybit", "software"
+};
+
+/*
+ * Frame descriptors.  The vendor library hands out the same few IMemory
+ * buffers for every frame, so offset, size and the heap's fd, base and size
+ * are looked up once per buffer instead of through getMemory() on every
+ * callback.  Entries are matched on the object's weakref block, which the
+ * cached wp<> keeps alive, so a new object at a recycled address never
+ * matches a stale entry.  Hits take no lock: a writer moves
+ * gFrameDescGen to odd while it changes the table.
+ */
+#define FRAME_DESC_SLOTS 16
+#define FRAME_HEAP_SLOTS 8
+
+struct frame_desc {
+   int         heapId;
+   uint8_t    *base;
+   size_t      heapSize;
+};
+
+struct frame_ref {
+   frame_desc  desc;       /* copy of the slot, stable if it is recycled */
+   ssize_t     offset;
+   size_t      size;
+};
+
+struct frame_slot {
+   const void                     *refs;  /* identity, never dereferenced */
+   frame_ref                       ref;
+   android::wp<android::IMemory>   mem;
+};
+
+/* The heaps behind the buffers, dropped once the heap is gone. */
+struct frame_heap {
+   frame_desc                         desc;
+   android::wp<android::IMemoryHeap>  heap;
+};
+
+/* Gray frame for the hardware tiers, fd < 0 if it could not be had. */
+struct luma_stage {
+   int         fd;
+   uint8_t    *base;
+   size_t      size;
+   int32_t     width;
+   int32_t     height;
+};
+
+struct capture_file_header {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t num_records;
+   uint32_t data_end;      /* offset of the first byte past the records */
+   uint32_t index_offset;  /* 0 if the capture was not closed cleanly */
+   uint32_t reserved[3];
+};
+
+struct capture_record {
+   int64_t  timestamp;     /* ns, frame timestamp or arrival time */
+   uint32_t msg_type;
+   uint32_t size;
+   uint16_t width;
+   uint16_t height;
+   uint32_t is_ts_cb;      /* 1 if delivered through CameraHAL_DataTSCb */
+};
+
+struct capture_state {
+   android::Mutex   lock;
+   int              fd;
+   uint8_t         *map;
+   size_t           mapSize;
+   uint32_t         writePos;
+   android::Vector<uint32_t> index;
+
+   capture_state() : fd(-1), map(NULL), mapSize(0), writePos(0) {}
+};
+
 /* Prototypes and extern functions. */
 android::sp<android::CameraHardwareInterface> (*LINK_openCameraHardware)(int id);
 int (*LINK_getNumberofCameras)(void);
@@ -64,6 +198,46 @@ android::CameraParameters camSettings;
 preview_stream_ops_t      *mWindow = NULL;
 android::sp<android::CameraHardwareInterface> qCamera;
 
+static capture_state   gCapture;      /* capturing while map != NULL */
+static pthread_t       gReplayThread;
+static bool            gReplayJoinable = false;  /* gReplayThread not joined */
+static volatile bool   gReplayActive  = false;
+static volatile bool   gReplayStop    = false;
+static bool            gReplaySession = false;  /* preview never reached qCamera */
+static int32_t         gReplayWidth   = 0;
+static int32_t         gReplayHeight  = 0;
+static void           *gCallbackUser  = NULL;
+
+static bool            gLumaOnly      = false;
+static unsigned int    gLumaToGray[256];
+static bool            gLumaToGrayInited = false;
+static luma_stage      gLumaStage = { -1, NULL, 0, 0, 0 };
+
+static int               gConvTier = CONV_TIER_MDP_BLIT;
+static uint32_t          gConvTierFrames[CONV_TIER_COUNT];
+static copybit_device_t *gCopybit = NULL;
+static bool              gCopybitProbed = false;
+
+static android::Mutex    gFrameDescLock;
+static volatile int32_t  gFrameDescGen = 0;
+static frame_slot        gFrameDescs[FRAME_DESC_SLOTS];
+static int               gFrameDescsUsed = 0;
+static frame_heap        gFrameHeaps[FRAME_HEAP_SLOTS];
+static int               gFrameHeapsUsed = 0;
+static volatile int32_t  gFrameDescHits   = 0;
+static uint32_t          gFrameDescMisses = 0;
+
+static android::Mutex    gVencLock;
+static venc_session     *gVenc = NULL;
+static int               gVencCodec = 0;     /* VEN_CODEC_*, 0 when off */
+static uint32_t          gVencBitrate = VENC_DEFAULT_BITRATE;
+static venc_stats        gVencLastStats;
+
+/* Per-frame cost of the preview path, reported by qcamera_dump. */
+static uint32_t        gPreviewFrames    = 0;
+static nsecs_t         gPreviewDisplayNs = 0;
+static nsecs_t         gPreviewCopyNs    = 0;
+
 static hw_module_methods_t camera_module_methods = {
    open: qcamera_device_open
 };
@@ -153,12 +327,158 @@ CameraHAL_CopyBuffers_Hw(int srcFd, int destFd,
     return success;
 }
 
+struct copybit_single_region : public copybit_region_t {
+   copybit_rect_t rect;
+   mutable bool   done;
+};
+
+static int
+CameraHAL_CopybitRegionNext(copybit_region_t const *region,
+                            copybit_rect_t *rect)
+{
+   copybit_single_region const *r =
+      static_cast<copybit_single_region const *>(region);
+   if (r->done) {
+      return 0;
+   }
+   *rect   = r->rect;
+   r->done = true;
+   return 1;
+}
+
+bool
+CameraHAL_CopyBuffers_Copybit(int srcFd, void *srcBase, size_t srcSize,
+                              size_t srcOffset,
+                              private_handle_t const *dest, int destStride,
+                              int w, int h)
+{
+   if (!gCopybitProbed) {
+      hw_module_t const *module;
+      gCopybitProbed = true;
+      if (hw_get_module(COPYBIT_HARDWARE_MODULE_ID, &module) == 0) {
+         copybit_open(module, &gCopybit);
+      }
+      LOGI("CameraHAL_CopyBuffers_Copybit: copybit device %p\n", gCopybit);
+   }
+   if (gCopybit == NULL) {
+      return false;
+   }
+
+   private_handle_t src(srcFd, srcSize,
+                        private_handle_t::PRIV_FLAGS_USES_PMEM,
+                        BUFFER_TYPE_VIDEO, HAL_PIXEL_FORMAT_YCrCb_420_SP,
+                        w, h);
+   src.offset = srcOffset;
+   src.base   = (int)srcBase;
+
+   copybit_image_t srcImg, dstImg;
+   memset(&srcImg, 0, sizeof(srcImg));
+   memset(&dstImg, 0, sizeof(dstImg));
+   srcImg.w      = w;
+   srcImg.h      = h;
+   srcImg.format = COPYBIT_FORMAT_YCrCb_420_SP;
+   srcImg.base   = (char *)srcBase + srcOffset;
+   srcImg.handle = (native_handle_t *)&src;
+
+   dstImg.w      = w;
+   dstImg.h      = h;
+   /* The gralloc buffer lines are destStride pixels apart. */
+   dstImg.horiz_padding = destStride > w ? destStride - w : 0;
+#ifdef HWA
+   dstImg.format = COPYBIT_FORMAT_RGBX_8888;
+#else
+   dstImg.format = COPYBIT_FORMAT_RGBA_8888;
+#endif
+   dstImg.base   = (void *)dest->base;
+   dstImg.handle = (native_handle_t *)dest;
+
+   copybit_rect_t rect = { 0, 0, w, h };
+   copybit_single_region region;
+   region.next = CameraHAL_CopybitRegionNext;
+   region.rect = rect;
+   region.done = false;
+
+   gCopybit->set_parameter(gCopybit, COPYBIT_TRANSFORM, 0);
+   gCopybit->set_parameter(gCopybit, COPYBIT_PLANE_ALPHA, 0xff);
+   gCopybit->set_parameter(gCopybit, COPYBIT_DITHER, COPYBIT_DISABLE);
+
+   int err = gCopybit->stretch(gCopybit, &dstImg, &srcImg, &rect, &rect,
+                               &region);
+   if (err) {
+      LOGV("CameraHAL_CopyBuffers_Copybit: stretch failed = %d\n", err);
+      return false;
+   }
+   return true;
+}
+
+static void
+CameraHAL_LumaStageFree(void)
+{
+   if (gLumaStage.fd >= 0) {
+      munmap(gLumaStage.base, gLumaStage.size);
+      close(gLumaStage.fd);
+   }
+   gLumaStage.fd     = -1;
+   gLumaStage.base   = NULL;
+   gLumaStage.size   = 0;
+   gLumaStage.width  = 0;
+   gLumaStage.height = 0;
+}
+
+/*
+ * Copies the Y plane into the gray frame, allocating it for a new preview
+ * size.  Returns false if there is no pmem for it, which is remembered
+ * until the size changes.
+ */
+static bool
+CameraHAL_LumaStage(const uint8_t *luma, int32_t w, int32_t h)
+{
+   size_t lumaSize = w * h;
+
+   if (gLumaStage.width != w || gLumaStage.height != h) {
+      CameraHAL_LumaStageFree();
+      gLumaStage.width  = w;
+      gLumaStage.height = h;
+
+      int fd = open(LUMA_PMEM_DEVICE, O_RDWR);
+      if (fd < 0) {
+         LOGW("CameraHAL_LumaStage: cannot open %s: %s\n", LUMA_PMEM_DEVICE,
+              strerror(errno));
+         return false;
+      }
+      size_t size = lumaSize * 3 / 2;
+      void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (base == MAP_FAILED) {
+         LOGW("CameraHAL_LumaStage: mmap of %u bytes failed: %s\n", size,
+              strerror(errno));
+         close(fd);
+         return false;
+      }
+      memset((uint8_t *)base + lumaSize, 0x80, size - lumaSize);
+      gLumaStage.fd   = fd;
+      gLumaStage.base = (uint8_t *)base;
+      gLumaStage.size = size;
+   }
+   if (gLumaStage.fd < 0) {
+      return false;
+   }
+   memcpy(gLumaStage.base, luma, lumaSize);
+   return true;
+}
+
+void
+CameraHAL_ResetConvTier(void)
+{
+   gConvTier = CONV_TIER_MDP_BLIT;
+   memset(gConvTierFrames, 0, sizeof(gConvTierFrames));
+}
+
 void
 CameraHal_Decode_Sw(unsigned int* rgb, char* yuv420sp, int width, int height)
 {
    int frameSize = width * height;
 
-   if (!qCamera->previewEnabled()) return;
+   if (!gReplayActive && !qCamera->previewEnabled()) return;
 
    for (int j = 0, yp = 0; j < height; j++) {
       int uvp = frameSize + (j >> 1) * width, u = 0, v = 0;
@@ -187,6 +507,37 @@ CameraHal_Decode_Sw(unsigned int* rgb, char* yuv420sp, int width, int height)
 
 
 
+void
+CameraHal_Decode_Luma_Sw(unsigned int* rgb, char* yuv420sp, int width,
+                         int height)
+{
+   int frameSize = width * height;
+   const unsigned char *y = (const unsigned char *)yuv420sp;
+
+   if (!gReplayActive && !qCamera->previewEnabled()) return;
+
+   if (!gLumaToGrayInited) {
+      /* Same 16..235 expansion as CameraHal_Decode_Sw, with u = v = 0. */
+      for (int i = 0; i < 256; i++) {
+         int l = ((i < 16 ? 0 : i - 16) * 1192) >> 10;
+         if (l > 255) l = 255;
+         gLumaToGray[i] = 0xff000000 | (l << 16) | (l << 8) | l;
+      }
+      gLumaToGrayInited = true;
+   }
+
+   int i = 0;
+   for (; i + 4 <= frameSize; i += 4) {
+      rgb[i]     = gLumaToGray[y[i]];
+      rgb[i + 1] = gLumaToGray[y[i + 1]];
+      rgb[i + 2] = gLumaToGray[y[i + 2]];
+      rgb[i + 3] = gLumaToGray[y[i + 3]];
+   }
+   for (; i < frameSize; i++) {
+      rgb[i] = gLumaToGray[y[i]];
+   }
+}
+
 void
 CameraHAL_CopyBuffers_Sw(char *dest, char *src, int size)
 {
@@ -213,14 +564,122 @@ CameraHAL_CopyBuffers_Sw(char *dest, char *src, int size)
 }
 
 void
-CameraHAL_HandlePreviewData(const android::sp<android::IMemory>& dataPtr,
+CameraHAL_ResetFrameDescs(void)
+{
+   android::Mutex::Autolock lock(gFrameDescLock);
+   android_atomic_inc(&gFrameDescGen);
+   for (int i = 0; i < FRAME_DESC_SLOTS; i++) {
+      gFrameDescs[i].refs = NULL;
+      gFrameDescs[i].mem.clear();
+   }
+   for (int i = 0; i < FRAME_HEAP_SLOTS; i++) {
+      gFrameHeaps[i].heap.clear();
+   }
+   gFrameDescsUsed  = 0;
+   gFrameHeapsUsed  = 0;
+   gFrameDescHits   = 0;
+   gFrameDescMisses = 0;
+   android_atomic_inc(&gFrameDescGen);
+}
+
+/*
+ * Heap descriptor for a new buffer, keyed on heap id and base with the
+ * size compared.  Call with gFrameDescLock held.
+ */
+static frame_desc
+CameraHAL_LookupHeap(const android::sp<android::IMemoryHeap>& heap)
+{
+   frame_desc desc;
+   desc.heapId   = heap->getHeapID();
+   desc.base     = (uint8_t *)heap->getBase();
+   desc.heapSize = heap->getSize();
+
+   int free = -1;
+   for (int i = 0; i < gFrameHeapsUsed; i++) {
+      frame_heap &h = gFrameHeaps[i];
+      if (h.heap.promote() == NULL) {
+         h.heap.clear();
+         free = i;
+         continue;
+      }
+      if (h.desc.heapId == desc.heapId && h.desc.base == desc.base &&
+          h.desc.heapSize == desc.heapSize) {
+         return h.desc;
+      }
+   }
+   if (free < 0) {
+      free = gFrameHeapsUsed < FRAME_HEAP_SLOTS ? gFrameHeapsUsed++ :
+             (int)(gFrameDescMisses % FRAME_HEAP_SLOTS);
+   }
+   gFrameHeaps[free].desc = desc;
+   gFrameHeaps[free].heap = heap;
+   LOGV("CameraHAL_LookupHeap: slot:%d heapId:%d base:%p size:%#x\n", free,
+        desc.heapId, desc.base, desc.heapSize);
+   return desc;
+}
+
+/*
+ * Resolves dataPtr to a cached frame descriptor; getMemory() is only called
+ * the first time a buffer is seen.  Returns false if the frame has no
+ * backing heap.
+ */
+bool
+CameraHAL_LookupFrame(const android::sp<android::IMemory>& dataPtr,
+                      frame_ref *ref)
+{
+   const void *refs = dataPtr->getWeakRefs();
+
+   int32_t gen = android_atomic_acquire_load(&gFrameDescGen);
+   if (!(gen & 1)) {
+      int used = gFrameDescsUsed;
+      for (int i = 0; i < used; i++) {
+         if (gFrameDescs[i].refs == refs) {
+            *ref = gFrameDescs[i].ref;
+            if (android_atomic_release_load(&gFrameDescGen) == gen) {
+               android_atomic_inc(&gFrameDescHits);
+               return true;
+            }
+            break;
+         }
+      }
+   }
+
+   frame_ref fresh;
+   android::sp<android::IMemoryHeap> heap = dataPtr->getMemory(&fresh.offset,
+                                                               &fresh.size);
+   if (heap == NULL) {
+      return false;
+   }
+
+   android::Mutex::Autolock lock(gFrameDescLock);
+   fresh.desc = CameraHAL_LookupHeap(heap);
+
+   /* New buffer: fill a free slot, or recycle the oldest one. */
+   int slot = gFrameDescsUsed < FRAME_DESC_SLOTS ? gFrameDescsUsed :
+              (int)(gFrameDescMisses % FRAME_DESC_SLOTS);
+   android_atomic_inc(&gFrameDescGen);
+   gFrameDescs[slot].refs = refs;
+   gFrameDescs[slot].ref  = fresh;
+   gFrameDescs[slot].mem  = dataPtr;
+   if (slot == gFrameDescsUsed) {
+      gFrameDescsUsed++;
+   }
+   android_atomic_inc(&gFrameDescGen);
+   gFrameDescMisses++;
+
+   *ref = fresh;
+   return true;
+}
+
+void
+CameraHAL_HandlePreviewData(const frame_ref &frame,
                             preview_stream_ops_t *mWindow,
                             camera_request_memory getMemory,
                             int32_t previewWidth, int32_t previewHeight)
 {
    if (mWindow != NULL && getMemory != NULL) {
-      ssize_t  offset;
-      size_t   size;
+      frame_desc desc = frame.desc;
+      ssize_t  offset = frame.offset;
       int32_t  previewFormat = MDP_Y_CBCR_H2V2;
 #ifdef HWA
       int32_t  destFormat    = MDP_RGBX_8888;
@@ -229,12 +688,10 @@ CameraHAL_HandlePreviewData(const android::sp<android::IMemory>& dataPtr,
 #endif
 
       android::status_t retVal;
-      android::sp<android::IMemoryHeap> mHeap = dataPtr->getMemory(&offset,
-                                                                   &size);
 
       LOGV("CameraHAL_HandlePreviewData: previewWidth:%d previewHeight:%d "
            "offset:%#x size:%#x base:%p\n", previewWidth, previewHeight,
-           (unsigned)offset, size, mHeap != NULL ? mHeap->base() : 0);
+           (unsigned)offset, frame.size, desc.base);
 
       mWindow->set_usage(mWindow,
 #ifndef HWA
@@ -260,11 +717,51 @@ CameraHAL_HandlePreviewData(const android::sp<android::IMemory>& dataPtr,
             if (retVal == NO_ERROR) {
                private_handle_t const *privHandle =
                   reinterpret_cast<private_handle_t const *>(*bufHandle);
-               if (!CameraHAL_CopyBuffers_Hw(mHeap->getHeapID(), privHandle->fd,
+               int tier = gConvTier;
+
+               /* The hardware tiers convert the gray frame instead. */
+               if (gLumaOnly && tier != CONV_TIER_SOFTWARE) {
+                  if (CameraHAL_LumaStage(desc.base + offset, previewWidth,
+                                          previewHeight)) {
+                     desc.heapId   = gLumaStage.fd;
+                     desc.base     = gLumaStage.base;
+                     desc.heapSize = gLumaStage.size;
+                     offset        = 0;
+                  } else {
+                     tier = CONV_TIER_SOFTWARE;
+                  }
+               }
+
+               if (tier == CONV_TIER_MDP_BLIT &&
+                   !CameraHAL_CopyBuffers_Hw(desc.heapId, privHandle->fd,
                                              offset, privHandle->offset,
                                              previewFormat, destFormat,
                                              0, 0, previewWidth,
                                              previewHeight)) {
+                  /* A replayed frame says nothing about the camera heaps. */
+                  tier = CONV_TIER_COPYBIT;
+                  if (!gReplayActive) {
+                     LOGI("CameraHAL_HandlePreviewData: MSMFB_BLIT failed, "
+                          "falling back to copybit for this session\n");
+                     gConvTier = tier;
+                  }
+               }
+               if (tier == CONV_TIER_COPYBIT &&
+                   !CameraHAL_CopyBuffers_Copybit(desc.heapId, desc.base,
+                                                  desc.heapSize, offset,
+                                                  privHandle, stride,
+                                                  previewWidth,
+                                                  previewHeight)) {
+                  tier = CONV_TIER_SOFTWARE;
+                  if (!gReplayActive) {
+                     LOGI("CameraHAL_HandlePreviewData: copybit failed, "
+                          "falling back to software for this session\n");
+                     gConvTier = tier;
+                  }
+               }
+               gConvTierFrames[tier]++;
+
+               if (tier == CONV_TIER_SOFTWARE) {
                   void *bits;
                   android::Rect bounds;
                   android::GraphicBufferMapper &mapper =
@@ -279,8 +776,14 @@ CameraHAL_HandlePreviewData(const android::sp<android::IMemory>& dataPtr,
                               &bits);
                   LOGV("CameraHAL_HPD: w:%d h:%d bits:%p",
                        previewWidth, previewHeight, bits);
-                  CameraHal_Decode_Sw((unsigned int *)bits, (char *)mHeap->base() + offset,
-                                      previewWidth, previewHeight);
+                  if (gLumaOnly) {
+                     CameraHal_Decode_Luma_Sw((unsigned int *)bits,
+                                              (char *)desc.base + offset,
+                                              previewWidth, previewHeight);
+                  } else {
+                     CameraHal_Decode_Sw((unsigned int *)bits, (char *)desc.base + offset,
+                                         previewWidth, previewHeight);
+                  }
 
                   // unlock buffer before sending to display
                   mapper.unlock(*bufHandle);
@@ -300,44 +803,386 @@ CameraHAL_HandlePreviewData(const android::sp<android::IMemory>& dataPtr,
 }
 
 camera_memory_t *
-CameraHAL_GenClientData(const android::sp<android::IMemory> &dataPtr,
+CameraHAL_GenClientData(const frame_ref &frame,
                         camera_request_memory reqClientMemory,
-                        void *user)
+                        void *user, size_t maxSize = 0)
 {
-   ssize_t          offset;
-   size_t           size;
+   size_t           size = frame.size;
    camera_memory_t *clientData = NULL;
-   android::sp<android::IMemoryHeap> mHeap = dataPtr->getMemory(&offset, &size);
+   uint8_t         *base = frame.desc.base;
 
    LOGV("CameraHAL_GenClientData: offset:%#x size:%#x base:%p\n",
-        (unsigned)offset, size, mHeap != NULL ? mHeap->base() : 0);
+        (unsigned)frame.offset, size, base);
+
+   if (maxSize != 0 && maxSize < size) {
+      size = maxSize;
+   }
 
    clientData = reqClientMemory(-1, size, 1, user);
    if (clientData != NULL) {
       CameraHAL_CopyBuffers_Sw((char *)clientData->data,
-                               (char *)(mHeap->base()) + offset, size);
+                               (char *)base + frame.offset, size);
    } else {
       LOGV("CameraHAL_GenClientData: ERROR allocating memory from client\n");
    }
    return clientData;
 }
 
+/* Frame capture, always called with gCapture.lock held. */
+static bool
+CameraHAL_CaptureReserve_l(size_t needed)
+{
+   size_t newSize = gCapture.mapSize;
+
+   while (newSize < needed) {
+      newSize += CAPTURE_CHUNK_SIZE;
+   }
+   if (newSize == gCapture.mapSize) {
+      return true;
+   }
+
+   munmap(gCapture.map, gCapture.mapSize);
+   gCapture.map     = NULL;
+   gCapture.mapSize = 0;
+   if (ftruncate(gCapture.fd, newSize) < 0) {
+      LOGE("CameraHAL_CaptureReserve: ftruncate(%u) failed: %s\n",
+           newSize, strerror(errno));
+      return false;
+   }
+
+   void *map = mmap(NULL, newSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    gCapture.fd, 0);
+   if (map == MAP_FAILED) {
+      LOGE("CameraHAL_CaptureReserve: mmap(%u) failed: %s\n",
+           newSize, strerror(errno));
+      return false;
+   }
+   gCapture.map     = (uint8_t *)map;
+   gCapture.mapSize = newSize;
+   return true;
+}
+
+static void
+CameraHAL_CaptureClose_l(void)
+{
+   if (gCapture.fd < 0) {
+      return;
+   }
+
+   if (gCapture.map != NULL) {
+      size_t indexSize = gCapture.index.size() * sizeof(uint32_t);
+      uint32_t indexOffset = gCapture.writePos;
+
+      if (CameraHAL_CaptureReserve_l(indexOffset + indexSize)) {
+         capture_file_header *hdr = (capture_file_header *)gCapture.map;
+         if (indexSize > 0) {
+            memcpy(gCapture.map + indexOffset, gCapture.index.array(),
+                   indexSize);
+         }
+         hdr->index_offset = indexOffset;
+         gCapture.writePos += indexSize;
+         LOGI("CameraHAL_CaptureClose: %u records, %u bytes\n",
+              hdr->num_records, gCapture.writePos);
+         munmap(gCapture.map, gCapture.mapSize);
+      }
+   }
+   ftruncate(gCapture.fd, gCapture.writePos);
+   close(gCapture.fd);
+
+   gCapture.fd       = -1;
+   gCapture.map      = NULL;
+   gCapture.mapSize  = 0;
+   gCapture.writePos = 0;
+   gCapture.index.clear();
+}
+
+void
+CameraHAL_CaptureOpen(void)
+{
+   char path[PROPERTY_VALUE_MAX];
+   android::Mutex::Autolock lock(gCapture.lock);
+
+   if (gCapture.map != NULL || property_get(CAPTURE_PROP, path, NULL) <= 0) {
+      return;
+   }
+
+   gCapture.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (gCapture.fd < 0) {
+      LOGE("CameraHAL_CaptureOpen: cannot open %s: %s\n",
+           path, strerror(errno));
+      return;
+   }
+   gCapture.writePos = sizeof(capture_file_header);
+   if (!CameraHAL_CaptureReserve_l(CAPTURE_CHUNK_SIZE)) {
+      CameraHAL_CaptureClose_l();
+      return;
+   }
+
+   capture_file_header *hdr = (capture_file_header *)gCapture.map;
+   memset(hdr, 0, sizeof(*hdr));
+   hdr->magic    = CAPTURE_MAGIC;
+   hdr->version  = CAPTURE_VERSION;
+   hdr->data_end = gCapture.writePos;
+   LOGI("CameraHAL_CaptureOpen: capturing frames to %s\n", path);
+}
+
+void
+CameraHAL_CaptureClose(void)
+{
+   android::Mutex::Autolock lock(gCapture.lock);
+   CameraHAL_CaptureClose_l();
+}
+
+void
+CameraHAL_CaptureFrame(int32_t msg_type, nsecs_t timestamp, bool tsCb,
+                       const void *data, size_t size,
+                       int32_t width, int32_t height)
+{
+   if (gCapture.map == NULL || gReplayActive) {
+      return;
+   }
+
+   android::Mutex::Autolock lock(gCapture.lock);
+   size_t recSize = (sizeof(capture_record) + size + 3) & ~3;
+
+   if (gCapture.map == NULL) {
+      return;
+   }
+   if (!CameraHAL_CaptureReserve_l(gCapture.writePos + recSize)) {
+      CameraHAL_CaptureClose_l();
+      return;
+   }
+
+   capture_file_header *hdr = (capture_file_header *)gCapture.map;
+   capture_record      *rec =
+      (capture_record *)(gCapture.map + gCapture.writePos);
+
+   rec->timestamp = timestamp;
+   rec->msg_type  = msg_type;
+   rec->size      = size;
+   rec->width     = width;
+   rec->height    = height;
+   rec->is_ts_cb  = tsCb ? 1 : 0;
+   memcpy(rec + 1, data, size);
+
+   gCapture.index.add(gCapture.writePos);
+   gCapture.writePos += recSize;
+   hdr->num_records++;
+   hdr->data_end = gCapture.writePos;
+}
+
+void CameraHAL_DataCb(int32_t msg_type,
+                      const android::sp<android::IMemory>& dataPtr,
+                      void *user);
+void CameraHAL_DataTSCb(nsecs_t timestamp, int32_t msg_type,
+                        const android::sp<android::IMemory>& dataPtr,
+                        void *user);
+
+/*
+ * Feeds a capture file back through CameraHAL_DataCb/CameraHAL_DataTSCb,
+ * either paced by the recorded timestamps or as fast as possible, and logs
+ * the time spent in the callbacks so that two HAL builds can be compared.
+ */
+static void *
+CameraHAL_ReplayThread(void *arg)
+{
+   char   *path = (char *)arg;
+   char    speed[PROPERTY_VALUE_MAX];
+   struct  stat st;
+   uint8_t *map;
+   int     fd;
+
+   property_get(REPLAY_SPEED_PROP, speed, "recorded");
+   bool maxSpeed = !strcmp(speed, "max");
+
+   fd = open(path, O_RDONLY);
+   if (fd < 0 || fstat(fd, &st) < 0) {
+      LOGE("CameraHAL_ReplayThread: cannot open %s: %s\n",
+           path, strerror(errno));
+      if (fd >= 0) close(fd);
+      free(path);
+      gReplayActive = false;
+      return NULL;
+   }
+   map = (uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      LOGE("CameraHAL_ReplayThread: mmap failed: %s\n", strerror(errno));
+      free(path);
+      gReplayActive = false;
+      return NULL;
+   }
+
+   const capture_file_header *hdr = (const capture_file_header *)map;
+   if ((size_t)st.st_size < sizeof(*hdr) || hdr->magic != CAPTURE_MAGIC ||
+       hdr->version != CAPTURE_VERSION || hdr->data_end > (size_t)st.st_size) {
+      LOGE("CameraHAL_ReplayThread: %s is not a capture file\n", path);
+      munmap(map, st.st_size);
+      free(path);
+      gReplayActive = false;
+      return NULL;
+   }
+
+   /*
+    * One heap sized for the largest frame is reused for every record.  It
+    * is pmem like the camera's, so the preview takes the same MDP path;
+    * ashmem only when pmem is short, and then the blits fail per frame.
+    */
+   size_t maxSize = 0;
+   for (uint32_t pos = sizeof(*hdr); pos + sizeof(capture_record) <= hdr->data_end; ) {
+      const capture_record *rec = (const capture_record *)(map + pos);
+      if (rec->size > hdr->data_end - pos - sizeof(capture_record)) {
+         LOGE("CameraHAL_ReplayThread: %s: record at %u overruns the data\n",
+              path, pos);
+         munmap(map, st.st_size);
+         free(path);
+         gReplayActive = false;
+         return NULL;
+      }
+      if (rec->size > maxSize) maxSize = rec->size;
+      pos += (sizeof(capture_record) + rec->size + 3) & ~3;
+   }
+
+   android::sp<android::MemoryHeapBase> heap =
+      new android::MemoryHeapBase(REPLAY_PMEM_DEVICE,
+                                  maxSize > 0 ? maxSize : 1);
+   if (heap->getHeapID() < 0) {
+      LOGW("CameraHAL_ReplayThread: no %s heap, replaying from ashmem\n",
+           REPLAY_PMEM_DEVICE);
+      heap = new android::MemoryHeapBase(maxSize > 0 ? maxSize : 1);
+   }
+   nsecs_t  firstTs   = -1;
+   nsecs_t  startTime = systemTime();
+   nsecs_t  cbTime    = 0;
+   uint32_t frames    = 0;
+
+   LOGI("CameraHAL_ReplayThread: replaying %u records from %s at %s speed\n",
+        hdr->num_records, path, maxSpeed ? "max" : "recorded");
+
+   for (uint32_t pos = sizeof(*hdr);
+        !gReplayStop && pos + sizeof(capture_record) <= hdr->data_end; ) {
+      const capture_record *rec = (const capture_record *)(map + pos);
+      pos += (sizeof(capture_record) + rec->size + 3) & ~3;
+      if (pos > hdr->data_end) break;
+
+      if (!maxSpeed) {
+         if (firstTs < 0) firstTs = rec->timestamp;
+         nsecs_t due = startTime + (rec->timestamp - firstTs);
+         nsecs_t now = systemTime();
+         if (due > now) usleep((due - now) / 1000);
+      }
+
+      memcpy(heap->base(), rec + 1, rec->size);
+      android::sp<android::MemoryBase> frame =
+         new android::MemoryBase(heap, 0, rec->size);
+      gReplayWidth  = rec->width;
+      gReplayHeight = rec->height;
+
+      nsecs_t before = systemTime();
+      if (rec->is_ts_cb) {
+         CameraHAL_DataTSCb(rec->timestamp, rec->msg_type, frame,
+                            gCallbackUser);
+      } else {
+         CameraHAL_DataCb(rec->msg_type, frame, gCallbackUser);
+      }
+      cbTime += systemTime() - before;
+      frames++;
+   }
+
+   nsecs_t wallTime = systemTime() - startTime;
+   LOGI("CameraHAL_ReplayThread: %u frames in %lld ms, callbacks %lld ms "
+        "(%lld us/frame)\n", frames, wallTime / 1000000, cbTime / 1000000,
+        frames ? cbTime / frames / 1000 : 0);
+
+   munmap(map, st.st_size);
+   free(path);
+   gReplayActive = false;
+   return NULL;
+}
+
+void
+CameraHAL_ReplayStop(void)
+{
+   if (gReplayJoinable) {
+      gReplayStop = true;
+      pthread_join(gReplayThread, NULL);
+      gReplayJoinable = false;
+      gReplayActive = false;
+   }
+}
+
+bool
+CameraHAL_ReplayStart(void)
+{
+   char path[PROPERTY_VALUE_MAX];
+
+   if (gReplayActive || property_get(REPLAY_PROP, path, NULL) <= 0) {
+      return gReplayActive;
+   }
+
+   /* A replay that ran to its end still has to be joined. */
+   CameraHAL_ReplayStop();
+
+   gReplayStop   = false;
+   gReplayActive = true;
+   char *arg = strdup(path);
+   if (pthread_create(&gReplayThread, NULL, CameraHAL_ReplayThread, arg)) {
+      LOGE("CameraHAL_ReplayStart: cannot create replay thread\n");
+      free(arg);
+      gReplayActive = false;
+   } else {
+      gReplayJoinable = true;
+   }
+   return gReplayActive;
+}
+
 void
 CameraHAL_DataCb(int32_t msg_type, const android::sp<android::IMemory>& dataPtr,
                  void *user)
 {
+   int32_t   previewWidth = 0, previewHeight = 0;
+   frame_ref frame;
+
    LOGV("CameraHAL_DataCb: msg_type:%d user:%p\n", msg_type, user);
+   if (!CameraHAL_LookupFrame(dataPtr, &frame)) {
+      LOGE("CameraHAL_DataCb: frame without memory heap\n");
+      return;
+   }
+
    if (msg_type == CAMERA_MSG_PREVIEW_FRAME) {
-      int32_t previewWidth, previewHeight;
-      android::CameraParameters hwParameters = qCamera->getParameters();
-      hwParameters.getPreviewSize(&previewWidth, &previewHeight);
-      CameraHAL_HandlePreviewData(dataPtr, mWindow, origCamReqMemory,
+      if (gReplayActive) {
+         previewWidth  = gReplayWidth;
+         previewHeight = gReplayHeight;
+      } else {
+         android::CameraParameters hwParameters = qCamera->getParameters();
+         hwParameters.getPreviewSize(&previewWidth, &previewHeight);
+      }
+      nsecs_t before = systemTime();
+      CameraHAL_HandlePreviewData(frame, mWindow, origCamReqMemory,
                                   previewWidth, previewHeight);
+      gPreviewDisplayNs += systemTime() - before;
+      gPreviewFrames++;
+   }
+
+   if (gCapture.map != NULL) {
+      CameraHAL_CaptureFrame(msg_type, systemTime(), false,
+                             frame.desc.base + frame.offset, frame.size,
+                             previewWidth, previewHeight);
    }
 
    if (origData_cb != NULL && origCamReqMemory != NULL) {
-      camera_memory_t *clientData = CameraHAL_GenClientData(dataPtr,
-                                       origCamReqMemory, user);
+      /* In luma-only mode preview frames carry just the Y plane. */
+      size_t maxSize = 0;
+      if (gLumaOnly && msg_type == CAMERA_MSG_PREVIEW_FRAME) {
+         maxSize = previewWidth * previewHeight;
+      }
+
+      nsecs_t before = systemTime();
+      camera_memory_t *clientData = CameraHAL_GenClientData(frame,
+                                       origCamReqMemory, user, maxSize);
+      if (msg_type == CAMERA_MSG_PREVIEW_FRAME) {
+         gPreviewCopyNs += systemTime() - before;
+      }
       if (clientData != NULL) {
          LOGV("CameraHAL_DataCb: Posting data to client\n");
          origData_cb(msg_type, clientData, 0, NULL, user);
@@ -346,21 +1191,130 @@ CameraHAL_DataCb(int32_t msg_type, const android::sp<android::IMemory>& dataPtr,
    }
 }
 
+static void
+CameraHAL_VencRelease(void *cookie, void *frameCookie)
+{
+   android::sp<android::IMemory> *frame =
+      (android::sp<android::IMemory> *)frameCookie;
+
+   if (!gReplayActive) {
+      qCamera->releaseRecordingFrame(*frame);
+   }
+   delete frame;
+}
+
+static void
+CameraHAL_VencDeliver(void *cookie, const uint8_t *data, size_t len,
+                      int64_t timestampNs, uint32_t flags)
+{
+   if (origDataTS_cb == NULL || origCamReqMemory == NULL) {
+      return;
+   }
+   camera_memory_t *clientData = origCamReqMemory(-1, len, 1, gCallbackUser);
+   if (clientData == NULL) {
+      LOGD("CameraHAL_VencDeliver: ERROR allocating memory from client\n");
+      return;
+   }
+   memcpy(clientData->data, data, len);
+   origDataTS_cb(timestampNs, CAMERA_MSG_VIDEO_FRAME, clientData, 0,
+                 gCallbackUser);
+   clientData->release(clientData);
+}
+
+static void
+CameraHAL_VencStart(void)
+{
+   android::CameraParameters params;
+   venc_config    config;
+   venc_callbacks callbacks;
+   char           value[PROPERTY_VALUE_MAX];
+   int            width, height;
+
+   if (gVencCodec == 0) {
+      return;
+   }
+
+   params = qCamera->getParameters();
+   params.getVideoSize(&width, &height);
+   if (width <= 0 || height <= 0) {
+      params.getPreviewSize(&width, &height);
+   }
+   config.codec   = gVencCodec;
+   config.width   = width;
+   config.height  = height;
+   config.fps     = params.getPreviewFrameRate() > 0 ?
+                    params.getPreviewFrameRate() : 30;
+   config.bitrate = gVencBitrate;
+
+   callbacks.deliver = CameraHAL_VencDeliver;
+   callbacks.release = CameraHAL_VencRelease;
+   callbacks.cookie  = NULL;
+
+   property_get(VENC_MOCK_PROP, value, "0");
+   android::Mutex::Autolock lock(gVencLock);
+   gVenc = CameraVenc_Create(atoi(value) ? &venc_mock_backend :
+                                           &venc_kernel_backend,
+                             &config, &callbacks);
+   if (gVenc == NULL) {
+      LOGE("CameraHAL_VencStart: encoder unavailable, sending raw frames\n");
+   }
+}
+
+static void
+CameraHAL_VencStop(void)
+{
+   android::Mutex::Autolock lock(gVencLock);
+   if (gVenc != NULL) {
+      CameraVenc_GetStats(gVenc, &gVencLastStats);
+      CameraVenc_Destroy(gVenc);
+      gVenc = NULL;
+   }
+}
+
 void
 CameraHAL_DataTSCb(nsecs_t timestamp, int32_t msg_type,
                    const android::sp<android::IMemory>& dataPtr, void *user)
 {
+   frame_ref frame;
+
    LOGV("CameraHAL_DataTSCb: timestamp:%lld msg_type:%d user:%p\n",
         timestamp /1000, msg_type, user);
 
+   if (!CameraHAL_LookupFrame(dataPtr, &frame)) {
+      LOGE("CameraHAL_DataTSCb: frame without memory heap\n");
+      return;
+   }
+
+   if (gCapture.map != NULL) {
+      CameraHAL_CaptureFrame(msg_type, timestamp, true,
+                             frame.desc.base + frame.offset, frame.size, 0, 0);
+   }
+
+   if (msg_type == CAMERA_MSG_VIDEO_FRAME) {
+      android::Mutex::Autolock lock(gVencLock);
+      if (gVenc != NULL) {
+         /* Held until the encoder signals INPUT_BUFFER_DONE for the frame. */
+         android::sp<android::IMemory> *cookie =
+            new android::sp<android::IMemory>(dataPtr);
+         if (CameraVenc_EncodeFrame(gVenc, frame.desc.heapId, frame.desc.base,
+                                    frame.desc.heapSize, frame.offset,
+                                    frame.size, timestamp, cookie) < 0) {
+            CameraHAL_VencRelease(NULL, cookie);
+         }
+         return;
+      }
+   }
+
    if (origDataTS_cb != NULL && origCamReqMemory != NULL) {
-      camera_memory_t *clientData = CameraHAL_GenClientData(dataPtr,
+      camera_memory_t *clientData = CameraHAL_GenClientData(frame,
                                        origCamReqMemory, user);
       if (clientData != NULL) {
          LOGV("CameraHAL_DataTSCb: Posting data to client timestamp:%lld\n",
               systemTime());
          origDataTS_cb(timestamp, msg_type, clientData, 0, user);
-         qCamera->releaseRecordingFrame(dataPtr);
+         if (!gReplayActive) {
+            qCamera->releaseRecordingFrame(dataPtr);
+         }
          clientData->release(clientData);
       } else {
          LOGD("CameraHAL_DataTSCb: ERROR allocating memory from client\n");
@@ -433,6 +1387,15 @@ CameraHAL_FixupParams(android::CameraParameters &settings)
    settings.set(android::CameraParameters::KEY_VIDEO_FRAME_FORMAT,
                 android::CameraParameters::PIXEL_FORMAT_YUV420SP);
 
+   settings.set(KEY_PREVIEW_LUMA_ONLY_SUPPORTED, "true");
+   settings.set(KEY_PREVIEW_LUMA_ONLY, gLumaOnly ? "true" : "false");
+   settings.set(KEY_HAL_VIDEO_ENCODER_VALUES, "off,h264,mpeg4,h263");
+   settings.set(KEY_HAL_VIDEO_ENCODER,
+                gVencCodec == VEN_CODEC_H264  ? "h264"  :
+                gVencCodec == VEN_CODEC_MPEG4 ? "mpeg4" :
+                gVencCodec == VEN_CODEC_H263  ? "h263"  : "off");
+   settings.set(KEY_HAL_VIDEO_ENCODER_BITRATE, (int)gVencBitrate);
+
 #if 0
    if (!settings.get(android::CameraParameters::KEY_SUPPORTED_PREVIEW_SIZES)) {
       settings.set(android::CameraParameters::KEY_SUPPORTED_PREVIEW_SIZES,
@@ -502,6 +1465,7 @@ qcamera_set_callbacks(struct camera_device * device,
    origData_cb      = data_cb;
    origDataTS_cb    = data_cb_timestamp;
    origCamReqMemory = get_memory;
+   gCallbackUser    = user;
    qCamera->setCallbacks(CameraHAL_NotifyCb, CameraHAL_DataCb,
                          CameraHAL_DataTSCb, user);
 }
@@ -548,6 +1512,15 @@ qcamera_start_preview(struct camera_device * device)
        qCamera->enableMsgType(CAMERA_MSG_PREVIEW_FRAME);
    }
 
+   CameraHAL_ResetConvTier();
+   CameraHAL_ResetFrameDescs();
+   gReplaySession = CameraHAL_ReplayStart();
+   if (gReplaySession) {
+      LOGI("qcamera_start_preview: replaying captured frames\n");
+      return NO_ERROR;
+   }
+   CameraHAL_CaptureOpen();
+
    return qCamera->startPreview();
 }
 
@@ -561,6 +1534,14 @@ qcamera_stop_preview(struct camera_device * device)
       qCamera->disableMsgType(CAMERA_MSG_PREVIEW_FRAME);
    }
 
+   /* A replay may have run to its end, qCamera was never started. */
+   if (gReplaySession) {
+      CameraHAL_ReplayStop();
+      gReplaySession = false;
+      return;
+   }
+   CameraHAL_CaptureClose();
+
    return qCamera->stopPreview();
 }
 
@@ -568,7 +1549,7 @@ int
 qcamera_preview_enabled(struct camera_device * device)
 {
    LOGV("qcamera_preview_enabled:\n");
-   return qCamera->previewEnabled() ? 1 : 0;
+   return (gReplayActive || qCamera->previewEnabled()) ? 1 : 0;
 }
 
 int
@@ -588,6 +1569,7 @@ qcamera_start_recording(struct camera_device * device)
        qcamera_stop_preview(device);
    }
 */
+   CameraHAL_VencStart();
    qCamera->enableMsgType(CAMERA_MSG_VIDEO_FRAME);
    qCamera->startRecording();
 
@@ -600,6 +1582,7 @@ qcamera_stop_recording(struct camera_device * device)
    LOGV("qcamera_stop_recording:\n");
 
    qCamera->disableMsgType(CAMERA_MSG_VIDEO_FRAME);
+   CameraHAL_VencStop();
    qCamera->stopRecording();
 /*
    qcamera_start_preview(device);
@@ -669,6 +1652,36 @@ qcamera_set_parameters(struct camera_device * device, const char *params)
    LOGV("qcamera_set_parameters: %s\n", params);
    g_str = android::String8(params);
    camSettings.unflatten(g_str);
+
+   /* Handled here, libcamera does not know about the luma-only mode. */
+   const char *lumaOnly = camSettings.get(KEY_PREVIEW_LUMA_ONLY);
+   if (lumaOnly != NULL) {
+      if (gLumaOnly != !strcmp(lumaOnly, "true")) {
+         gLumaOnly         = !gLumaOnly;
+         gPreviewFrames    = 0;
+         gPreviewDisplayNs = 0;
+         gPreviewCopyNs    = 0;
+         LOGI("qcamera_set_parameters: luma-only preview %s\n",
+              gLumaOnly ? "enabled" : "disabled");
+      }
+      camSettings.remove(KEY_PREVIEW_LUMA_ONLY);
+   }
+   camSettings.remove(KEY_PREVIEW_LUMA_ONLY_SUPPORTED);
+
+   /* Takes effect at the next start_recording. */
+   const char *encoder = camSettings.get(KEY_HAL_VIDEO_ENCODER);
+   if (encoder != NULL) {
+      gVencCodec = !strcmp(encoder, "h264")  ? VEN_CODEC_H264  :
+                   !strcmp(encoder, "mpeg4") ? VEN_CODEC_MPEG4 :
+                   !strcmp(encoder, "h263")  ? VEN_CODEC_H263  : 0;
+      camSettings.remove(KEY_HAL_VIDEO_ENCODER);
+   }
+   int bitrate = camSettings.getInt(KEY_HAL_VIDEO_ENCODER_BITRATE);
+   if (bitrate > 0) {
+      gVencBitrate = bitrate;
+   }
+   camSettings.remove(KEY_HAL_VIDEO_ENCODER_BITRATE);
+   camSettings.remove(KEY_HAL_VIDEO_ENCODER_VALUES);
    qCamera->setParameters(camSettings);
    return NO_ERROR;
 }
@@ -715,7 +1728,53 @@ qcamera_release(struct camera_device * device)
 int
 qcamera_dump(struct camera_device * device, int fd)
 {
+   char buffer[256];
    LOGV("qcamera_dump:\n");
+
+   snprintf(buffer, sizeof(buffer),
+            "CameraHAL preview path (%s): frames %u, display %lld us/frame, "
+            "client copy %lld us/frame\n",
+            gLumaOnly ? "luma-only" : "full color", gPreviewFrames,
+            gPreviewFrames ? gPreviewDisplayNs / gPreviewFrames / 1000 : 0,
+            gPreviewFrames ? gPreviewCopyNs / gPreviewFrames / 1000 : 0);
+   write(fd, buffer, strlen(buffer));
+   snprintf(buffer, sizeof(buffer),
+            "CameraHAL conversion tier: %s (%s %u, %s %u, %s %u frames)\n",
+            conv_tier_names[gConvTier],
+            conv_tier_names[CONV_TIER_MDP_BLIT],
+            gConvTierFrames[CONV_TIER_MDP_BLIT],
+            conv_tier_names[CONV_TIER_COPYBIT],
+            gConvTierFrames[CONV_TIER_COPYBIT],
+            conv_tier_names[CONV_TIER_SOFTWARE],
+            gConvTierFrames[CONV_TIER_SOFTWARE]);
+   write(fd, buffer, strlen(buffer));
+   snprintf(buffer, sizeof(buffer),
+            "CameraHAL frame descriptors: %d buffers, %d heaps, %d hits, "
+            "%u misses\n", gFrameDescsUsed, gFrameHeapsUsed, gFrameDescHits,
+            gFrameDescMisses);
+   write(fd, buffer, strlen(buffer));
+
+   venc_stats vs;
+   bool       vencActive;
+   {
+      android::Mutex::Autolock lock(gVencLock);
+      vencActive = gVenc != NULL;
+      if (vencActive) {
+         CameraVenc_GetStats(gVenc, &vs);
+      } else {
+         vs = gVencLastStats;
+      }
+   }
+   nsecs_t elapsed = vs.lastNs - vs.startNs;
+   snprintf(buffer, sizeof(buffer),
+            "CameraHAL video encoder (%s): in %u, out %u, dropped %u, "
+            "%llu bytes, %lld kbps, encode %lld us/frame\n",
+            vencActive ? "active" : "last session",
+            vs.framesIn, vs.framesOut, vs.framesDropped, vs.bytesOut,
+            elapsed > 0 ? (int64_t)(vs.bytesOut * 8 * 1000000 / elapsed) : 0,
+            vs.framesIn ? vs.encodeNs / vs.framesIn / 1000 : 0);
+   write(fd, buffer, strlen(buffer));
+
    android::Vector<android::String16> args;
    return qCamera->dump(fd, args);
 }
@@ -729,6 +1788,16 @@ camera_device_close(hw_device_t* device)
    if (cameraDev) {
       camera_device_ops_t *camera_ops = cameraDev->ops;
       if (camera_ops) {
+         CameraHAL_ReplayStop();
+         gReplaySession = false;
+         CameraHAL_VencStop();
+         CameraHAL_CaptureClose();
+         if (gCopybit != NULL) {
+            copybit_close(gCopybit);
+            gCopybit = NULL;
+         }
+         gCopybitProbed = false;
+         CameraHAL_LumaStageFree();
          if (qCamera != NULL) {
             qCamera.clear();
          }
@@ -0,0 +1,731 @@
+/*
+ * Copyright (C) 2012, The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "CameraVenc"
+
+#include <utils/Log.h>
+#include <utils/Timers.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/msm_vidc_enc.h>
+
+#include "cameraVenc.h"
+
+#define VENC_DEVICE           "/dev/msm_vidc_enc"
+#define VENC_PMEM_DEVICE      "/dev/pmem_adsp"
+#define VENC_MAX_INPUT_BUFS   16
+#define VENC_MAX_OUTPUT_BUFS  8
+#define VENC_MAX_PENDING      16
+#define VENC_MSG_TIMEOUT_MS   100
+
+struct venc_input_buf {
+   int      fd;
+   uint8_t *ptr;           /* frame address, the driver's buffer key */
+   size_t   size;
+   size_t   offset;        /* offset of the frame inside the pmem heap */
+};
+
+struct venc_output_buf {
+   uint8_t *base;
+   int      fd;
+   size_t   size;
+};
+
+struct venc_pending {
+   bool     used;
+   void    *cookie;
+   int64_t  submitNs;
+};
+
+struct venc_session {
+   const venc_backend *be;
+   venc_callbacks      cb;
+   venc_config         config;
+   int                 fd;
+
+   pthread_t           msgThread;
+   bool                msgThreadStarted;
+   volatile bool       running;
+   bool                startTried;
+   bool                started;
+   pthread_mutex_t     lock;
+
+   venc_input_buf      inputs[VENC_MAX_INPUT_BUFS];
+   int                 numInputs;
+   int                 maxInputs;
+   venc_output_buf     outputs[VENC_MAX_OUTPUT_BUFS];
+   int                 numOutputs;
+   venc_pending        pending[VENC_MAX_PENDING];
+   venc_stats          stats;
+};
+
+static int
+CameraVenc_Ioctl(venc_session *s, unsigned int request, void *in, void *out)
+{
+   struct venc_ioctl_msg msg;
+
+   msg.in  = in;
+   msg.out = out;
+   return s->be->ioctl(s->fd, request, &msg);
+}
+
+static int
+CameraVenc_FillOutput(venc_session *s, int idx)
+{
+   struct venc_buffer buf;
+
+   memset(&buf, 0, sizeof(buf));
+   buf.ptrbuffer  = s->outputs[idx].base;
+   buf.sz         = s->outputs[idx].size;
+   buf.clientdata = (void *)(intptr_t)idx;
+   if (CameraVenc_Ioctl(s, VEN_IOCTL_CMD_FILL_OUTPUT_BUFFER, &buf, NULL) < 0) {
+      LOGE("CameraVenc_FillOutput: FILL_OUTPUT_BUFFER(%d) failed: %s\n",
+           idx, strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+static void *
+CameraVenc_MsgThread(void *arg)
+{
+   venc_session *s = (venc_session *)arg;
+
+   while (s->running) {
+      struct venc_timeout timeout;
+      struct venc_msg     msg;
+
+      timeout.millisec = VENC_MSG_TIMEOUT_MS;
+      memset(&msg, 0, sizeof(msg));
+      if (CameraVenc_Ioctl(s, VEN_IOCTL_CMD_READ_NEXT_MSG, &timeout, &msg) < 0) {
+         if (errno == ETIMEDOUT || errno == EAGAIN || errno == EINTR) {
+            continue;
+         }
+         LOGE("CameraVenc_MsgThread: READ_NEXT_MSG failed: %s\n",
+              strerror(errno));
+         break;
+      }
+
+      switch (msg.msgcode) {
+      case VEN_MSG_INPUT_BUFFER_DONE: {
+         int   slot = (intptr_t)msg.buf.clientdata;
+         void *cookie = NULL;
+
+         pthread_mutex_lock(&s->lock);
+         if (slot >= 0 && slot < VENC_MAX_PENDING && s->pending[slot].used) {
+            cookie = s->pending[slot].cookie;
+            s->stats.encodeNs += systemTime() - s->pending[slot].submitNs;
+            s->pending[slot].used = false;
+         }
+         pthread_mutex_unlock(&s->lock);
+         if (cookie != NULL) {
+            s->cb.release(s->cb.cookie, cookie);
+         }
+         break;
+      }
+      case VEN_MSG_OUTPUT_BUFFER_DONE: {
+         int idx = (intptr_t)msg.buf.clientdata;
+
+         if (idx < 0 || idx >= s->numOutputs) {
+            LOGE("CameraVenc_MsgThread: unknown output buffer %d\n", idx);
+            break;
+         }
+         if (msg.statuscode == VEN_S_SUCCESS && msg.buf.len > 0) {
+            s->cb.deliver(s->cb.cookie,
+                          s->outputs[idx].base + msg.buf.offset, msg.buf.len,
+                          msg.buf.timestamp * 1000LL, msg.buf.flags);
+            pthread_mutex_lock(&s->lock);
+            s->stats.framesOut++;
+            s->stats.bytesOut += msg.buf.len;
+            s->stats.lastNs    = systemTime();
+            pthread_mutex_unlock(&s->lock);
+         }
+         if (s->running) {
+            CameraVenc_FillOutput(s, idx);
+         }
+         break;
+      }
+      case VEN_MSG_STOP:
+         LOGV("CameraVenc_MsgThread: encoder stopped\n");
+         s->running = false;
+         break;
+      default:
+         LOGV("CameraVenc_MsgThread: msgcode:%lu status:%lu\n",
+              msg.msgcode, msg.statuscode);
+         break;
+      }
+   }
+   return NULL;
+}
+
+venc_session *
+CameraVenc_Create(const venc_backend *backend, const venc_config *config,
+                  const venc_callbacks *callbacks)
+{
+   struct venc_basecfg            base;
+   struct venc_ratectrlcfg        rc;
+   struct venc_allocatorproperty  req;
+   venc_session                  *s;
+
+   s = (venc_session *)calloc(1, sizeof(*s));
+   if (s == NULL) {
+      return NULL;
+   }
+   s->be     = backend;
+   s->cb     = *callbacks;
+   s->config = *config;
+   pthread_mutex_init(&s->lock, NULL);
+
+   s->fd = s->be->open();
+   if (s->fd < 0) {
+      LOGE("CameraVenc_Create: %s backend open failed: %s\n",
+           s->be->name, strerror(errno));
+      goto Error;
+   }
+
+   memset(&base, 0, sizeof(base));
+   base.input_width   = base.dvs_width  = config->width;
+   base.input_height  = base.dvs_height = config->height;
+   base.codectype     = config->codec;
+   base.fps_num       = config->fps;
+   base.fps_den       = 1;
+   base.targetbitrate = config->bitrate;
+   base.inputformat   = VEN_INPUTFMT_NV21;
+   if (CameraVenc_Ioctl(s, VEN_IOCTL_SET_BASE_CFG, &base, NULL) < 0) {
+      LOGE("CameraVenc_Create: SET_BASE_CFG failed: %s\n", strerror(errno));
+      goto Error;
+   }
+
+   rc.rcmode = VEN_RC_VBR_CFR;
+   if (CameraVenc_Ioctl(s, VEN_IOCTL_SET_RATE_CTRL_CFG, &rc, NULL) < 0) {
+      LOGW("CameraVenc_Create: SET_RATE_CTRL_CFG failed: %s\n",
+           strerror(errno));
+   }
+
+   /*
+    * Input frames come from the vendor heap, which is only known once the
+    * first frame arrives; CameraVenc_Start() registers them then.
+    */
+   if (CameraVenc_Ioctl(s, VEN_IOCTL_GET_INPUT_BUFFER_REQ, NULL, &req) < 0) {
+      LOGE("CameraVenc_Create: GET_INPUT_BUFFER_REQ failed: %s\n",
+           strerror(errno));
+      goto Error;
+   }
+   s->maxInputs = req.maxcount < VENC_MAX_INPUT_BUFS ?
+                  req.maxcount : VENC_MAX_INPUT_BUFS;
+   req.actualcount = s->maxInputs;
+   CameraVenc_Ioctl(s, VEN_IOCTL_SET_INPUT_BUFFER_REQ, &req, NULL);
+
+   if (CameraVenc_Ioctl(s, VEN_IOCTL_GET_OUTPUT_BUFFER_REQ, NULL, &req) < 0) {
+      LOGE("CameraVenc_Create: GET_OUTPUT_BUFFER_REQ failed: %s\n",
+           strerror(errno));
+      goto Error;
+   }
+   s->numOutputs = req.actualcount < VENC_MAX_OUTPUT_BUFS ?
+                   req.actualcount : VENC_MAX_OUTPUT_BUFS;
+   for (int i = 0; i < s->numOutputs; i++) {
+      struct venc_bufferpayload payload;
+      venc_output_buf *out = &s->outputs[i];
+
+      out->size = req.datasize;
+      out->base = (uint8_t *)s->be->alloc(out->size, &out->fd);
+      if (out->base == NULL) {
+         LOGE("CameraVenc_Create: cannot allocate output buffer %d\n", i);
+         s->numOutputs = i;
+         goto Error;
+      }
+      memset(&payload, 0, sizeof(payload));
+      payload.pbuffer    = out->base;
+      payload.sz         = out->size;
+      payload.fd         = out->fd;
+      payload.maped_size = out->size;
+      if (CameraVenc_Ioctl(s, VEN_IOCTL_SET_OUTPUT_BUFFER, &payload, NULL) < 0) {
+         LOGE("CameraVenc_Create: SET_OUTPUT_BUFFER(%d) failed: %s\n",
+              i, strerror(errno));
+         s->numOutputs = i + 1;
+         goto Error;
+      }
+   }
+
+   LOGI("CameraVenc_Create: %s backend, codec:%d %ux%u@%u %u bps, "
+        "%d output buffers of %u bytes\n", s->be->name, config->codec,
+        config->width, config->height, config->fps, config->bitrate,
+        s->numOutputs, req.datasize);
+   return s;
+
+Error:
+   CameraVenc_Destroy(s);
+   return NULL;
+}
+
+/*
+ * Registers every frame of the heap the first recording frame came from,
+ * then starts the encoder.  The vendor record pool places its frames page
+ * aligned, or back to back when the first offset says so.  Called with
+ * s->lock held.
+ */
+static int
+CameraVenc_Start(venc_session *s, int heapFd, uint8_t *heapBase,
+                 size_t heapSize, size_t offset, size_t size)
+{
+   size_t stride = (size + 4095) & ~4095;
+   if ((offset % stride) != 0 && (offset % size) == 0) {
+      stride = size;
+   }
+
+   for (size_t pos = offset % stride;
+        pos + size <= heapSize && s->numInputs < s->maxInputs; pos += stride) {
+      struct venc_bufferpayload payload;
+      venc_input_buf *in = &s->inputs[s->numInputs];
+
+      memset(&payload, 0, sizeof(payload));
+      payload.pbuffer    = heapBase + pos;
+      payload.sz         = size;
+      payload.fd         = heapFd;
+      payload.offset     = pos;
+      payload.maped_size = heapSize;
+      if (CameraVenc_Ioctl(s, VEN_IOCTL_SET_INPUT_BUFFER, &payload, NULL) < 0) {
+         LOGE("CameraVenc_Start: SET_INPUT_BUFFER at %#x failed: %s\n",
+              (unsigned)pos, strerror(errno));
+         return -1;
+      }
+      in->fd     = heapFd;
+      in->ptr    = heapBase + pos;
+      in->size   = size;
+      in->offset = pos;
+      s->numInputs++;
+   }
+
+   if (CameraVenc_Ioctl(s, VEN_IOCTL_CMD_START, NULL, NULL) < 0) {
+      LOGE("CameraVenc_Start: CMD_START failed: %s\n", strerror(errno));
+      return -1;
+   }
+
+   s->running = true;
+   if (pthread_create(&s->msgThread, NULL, CameraVenc_MsgThread, s)) {
+      LOGE("CameraVenc_Start: cannot create message thread\n");
+      s->running = false;
+      return -1;
+   }
+   s->msgThreadStarted = true;
+   s->started = true;
+
+   for (int i = 0; i < s->numOutputs; i++) {
+      CameraVenc_FillOutput(s, i);
+   }
+
+   s->stats.startNs = systemTime();
+   LOGI("CameraVenc_Start: %d input frames of %u bytes, stride %u\n",
+        s->numInputs, size, stride);
+   return 0;
+}
+
+int
+CameraVenc_EncodeFrame(venc_session *s, int heapFd, void *heapBase,
+                       size_t heapSize, size_t offset, size_t size,
+                       int64_t timestampNs, void *frameCookie)
+{
+   uint8_t *ptr = (uint8_t *)heapBase + offset;
+   int      input = -1, slot = -1;
+
+   pthread_mutex_lock(&s->lock);
+   if (!s->startTried) {
+      /* A failed start is not retried; every frame is then dropped. */
+      s->startTried = true;
+      CameraVenc_Start(s, heapFd, (uint8_t *)heapBase, heapSize, offset, size);
+   }
+   for (int i = 0; i < s->numInputs; i++) {
+      if (s->inputs[i].ptr == ptr && s->inputs[i].fd == heapFd) {
+         input = i;
+         break;
+      }
+   }
+   if (input < 0 || !s->started) {
+      /* Not started, or a frame outside the registered heap. */
+      s->stats.framesDropped++;
+      pthread_mutex_unlock(&s->lock);
+      return -1;
+   }
+   for (int i = 0; input >= 0 && i < VENC_MAX_PENDING; i++) {
+      if (!s->pending[i].used) {
+         slot = i;
+         s->pending[i].used     = true;
+         s->pending[i].cookie   = frameCookie;
+         s->pending[i].submitNs = systemTime();
+         break;
+      }
+   }
+   if (slot < 0) {
+      s->stats.framesDropped++;
+      pthread_mutex_unlock(&s->lock);
+      return -1;
+   }
+   s->stats.framesIn++;
+   pthread_mutex_unlock(&s->lock);
+
+   struct venc_buffer buf;
+   memset(&buf, 0, sizeof(buf));
+   buf.ptrbuffer  = ptr;
+   buf.sz         = size;
+   buf.len        = size;
+   buf.timestamp  = timestampNs / 1000;
+   buf.clientdata = (void *)(intptr_t)slot;
+   if (CameraVenc_Ioctl(s, VEN_IOCTL_CMD_ENCODE_FRAME, &buf, NULL) < 0) {
+      LOGE("CameraVenc_EncodeFrame: ENCODE_FRAME failed: %s\n",
+           strerror(errno));
+      pthread_mutex_lock(&s->lock);
+      s->pending[slot].used = false;
+      s->stats.framesIn--;
+      s->stats.framesDropped++;
+      pthread_mutex_unlock(&s->lock);
+      return -1;
+   }
+   return 0;
+}
+
+void
+CameraVenc_GetStats(venc_session *s, venc_stats *stats)
+{
+   pthread_mutex_lock(&s->lock);
+   *stats = s->stats;
+   pthread_mutex_unlock(&s->lock);
+}
+
+void
+CameraVenc_Destroy(venc_session *s)
+{
+   if (s == NULL) {
+      return;
+   }
+
+   if (s->fd >= 0) {
+      if (s->msgThreadStarted) {
+         CameraVenc_Ioctl(s, VEN_IOCTL_CMD_STOP, NULL, NULL);
+         s->running = false;
+         s->be->ioctl(s->fd, VEN_IOCTL_CMD_STOP_READ_MSG, NULL);
+         pthread_join(s->msgThread, NULL);
+      }
+
+      for (int i = 0; i < s->numInputs; i++) {
+         struct venc_bufferpayload payload;
+         memset(&payload, 0, sizeof(payload));
+         payload.pbuffer = s->inputs[i].ptr;
+         payload.fd      = s->inputs[i].fd;
+         payload.offset  = s->inputs[i].offset;
+         CameraVenc_Ioctl(s, VEN_IOCTL_CMD_FREE_INPUT_BUFFER, &payload, NULL);
+      }
+      for (int i = 0; i < s->numOutputs; i++) {
+         struct venc_bufferpayload payload;
+         memset(&payload, 0, sizeof(payload));
+         payload.pbuffer = s->outputs[i].base;
+         payload.fd      = s->outputs[i].fd;
+         CameraVenc_Ioctl(s, VEN_IOCTL_CMD_FREE_OUTPUT_BUFFER, &payload, NULL);
+      }
+      s->be->close(s->fd);
+   }
+
+   /* Hand back any frames the encoder never returned. */
+   for (int i = 0; i < VENC_MAX_PENDING; i++) {
+      if (s->pending[i].used) {
+         s->cb.release(s->cb.cookie, s->pending[i].cookie);
+      }
+   }
+   for (int i = 0; i < s->numOutputs; i++) {
+      if (s->outputs[i].base != NULL) {
+         s->be->free(s->outputs[i].base, s->outputs[i].size, s->outputs[i].fd);
+      }
+   }
+
+   pthread_mutex_destroy(&s->lock);
+   free(s);
+}
+
+/* Kernel backend. */
+static int
+CameraVenc_KernelOpen(void)
+{
+   return open(VENC_DEVICE, O_RDWR);
+}
+
+static int
+CameraVenc_KernelIoctl(int fd, unsigned int request, void *arg)
+{
+   return ioctl(fd, request, arg);
+}
+
+static void
+CameraVenc_KernelClose(int fd)
+{
+   close(fd);
+}
+
+static void *
+CameraVenc_KernelAlloc(size_t size, int *fd)
+{
+   void *base;
+
+   size = (size + 4095) & ~4095;
+   *fd = open(VENC_PMEM_DEVICE, O_RDWR);
+   if (*fd < 0) {
+      return NULL;
+   }
+   base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+   if (base == MAP_FAILED) {
+      close(*fd);
+      *fd = -1;
+      return NULL;
+   }
+   return base;
+}
+
+static void
+CameraVenc_KernelFree(void *base, size_t size, int fd)
+{
+   munmap(base, (size + 4095) & ~4095);
+   close(fd);
+}
+
+const venc_backend venc_kernel_backend = {
+   "kernel",
+   CameraVenc_KernelOpen,
+   CameraVenc_KernelIoctl,
+   CameraVenc_KernelClose,
+   CameraVenc_KernelAlloc,
+   CameraVenc_KernelFree,
+};
+
+/*
+ * Mock backend: emulates the msm_vidc_enc ioctl protocol in process.  Every
+ * ENCODE_FRAME is answered with INPUT_BUFFER_DONE and, when an output buffer
+ * is queued, an OUTPUT_BUFFER_DONE carrying a synthetic bitstream of about
+ * 1/16th of the input size, so session setup, buffer cycling and throughput
+ * accounting can be exercised without the hardware.  Like the driver, it
+ * refuses input registration once started and frames before the start.
+ */
+#define MOCK_FD         0x7fff
+#define MOCK_MSG_SLOTS  64
+
+static struct {
+   pthread_mutex_t     lock;
+   pthread_cond_t      cond;
+   bool                stopRead;
+   bool                started;
+   struct venc_basecfg base;
+   struct venc_msg     msgs[MOCK_MSG_SLOTS];
+   int                 msgHead, msgCount;
+   struct venc_buffer  fills[VENC_MAX_OUTPUT_BUFS];
+   int                 fillHead, fillCount;
+   uint32_t            frames;
+} gMock = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void
+CameraVenc_MockPost_l(unsigned long code, const struct venc_buffer *buf)
+{
+   if (gMock.msgCount == MOCK_MSG_SLOTS) {
+      LOGW("CameraVenc_MockPost: message queue full, dropping %lu\n", code);
+      return;
+   }
+   struct venc_msg *msg =
+      &gMock.msgs[(gMock.msgHead + gMock.msgCount++) % MOCK_MSG_SLOTS];
+   memset(msg, 0, sizeof(*msg));
+   msg->statuscode = VEN_S_SUCCESS;
+   msg->msgcode    = code;
+   if (buf != NULL) {
+      msg->buf = *buf;
+   }
+   pthread_cond_broadcast(&gMock.cond);
+}
+
+static int
+CameraVenc_MockOpen(void)
+{
+   pthread_mutex_lock(&gMock.lock);
+   gMock.stopRead  = false;
+   gMock.started   = false;
+   gMock.msgHead   = gMock.msgCount  = 0;
+   gMock.fillHead  = gMock.fillCount = 0;
+   gMock.frames    = 0;
+   memset(&gMock.base, 0, sizeof(gMock.base));
+   pthread_mutex_unlock(&gMock.lock);
+   return MOCK_FD;
+}
+
+static int
+CameraVenc_MockReadMsg_l(struct venc_ioctl_msg *m)
+{
+   struct venc_timeout *timeout = (struct venc_timeout *)m->in;
+   struct timespec      ts;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   ts.tv_sec  += timeout->millisec / 1000;
+   ts.tv_nsec += (timeout->millisec % 1000) * 1000000;
+   if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+   }
+   while (gMock.msgCount == 0 && !gMock.stopRead) {
+      if (pthread_cond_timedwait(&gMock.cond, &gMock.lock, &ts) == ETIMEDOUT) {
+         errno = ETIMEDOUT;
+         return -1;
+      }
+   }
+   if (gMock.msgCount == 0) {
+      errno = EIO;
+      return -1;
+   }
+   *(struct venc_msg *)m->out = gMock.msgs[gMock.msgHead];
+   gMock.msgHead = (gMock.msgHead + 1) % MOCK_MSG_SLOTS;
+   gMock.msgCount--;
+   return 0;
+}
+
+static int
+CameraVenc_MockIoctl(int fd, unsigned int request, void *arg)
+{
+   struct venc_ioctl_msg *m = (struct venc_ioctl_msg *)arg;
+   int ret = 0;
+
+   pthread_mutex_lock(&gMock.lock);
+   switch (request) {
+   case VEN_IOCTL_SET_BASE_CFG:
+      gMock.base = *(struct venc_basecfg *)m->in;
+      break;
+   case VEN_IOCTL_GET_BASE_CFG:
+      *(struct venc_basecfg *)m->out = gMock.base;
+      break;
+   case VEN_IOCTL_GET_INPUT_BUFFER_REQ:
+   case VEN_IOCTL_GET_OUTPUT_BUFFER_REQ: {
+      struct venc_allocatorproperty *req =
+         (struct venc_allocatorproperty *)m->out;
+      size_t frame = gMock.base.input_width * gMock.base.input_height;
+      memset(req, 0, sizeof(*req));
+      req->mincount    = 2;
+      req->maxcount    = VENC_MAX_OUTPUT_BUFS;
+      req->actualcount = 4;
+      req->alignment   = 4096;
+      req->datasize    = request == VEN_IOCTL_GET_INPUT_BUFFER_REQ ?
+                         frame * 3 / 2 : frame / 2;
+      break;
+   }
+   case VEN_IOCTL_CMD_FILL_OUTPUT_BUFFER:
+      if (gMock.fillCount == VENC_MAX_OUTPUT_BUFS) {
+         errno = ENOSPC;
+         ret = -1;
+      } else {
+         gMock.fills[(gMock.fillHead + gMock.fillCount++) %
+                     VENC_MAX_OUTPUT_BUFS] = *(struct venc_buffer *)m->in;
+      }
+      break;
+   case VEN_IOCTL_SET_INPUT_BUFFER:
+      if (gMock.started) {
+         errno = EBUSY;
+         ret = -1;
+      }
+      break;
+   case VEN_IOCTL_CMD_ENCODE_FRAME: {
+      struct venc_buffer *in = (struct venc_buffer *)m->in;
+      if (!gMock.started) {
+         errno = EINVAL;
+         ret = -1;
+         break;
+      }
+      CameraVenc_MockPost_l(VEN_MSG_INPUT_BUFFER_DONE, in);
+      if (gMock.fillCount > 0) {
+         struct venc_buffer out = gMock.fills[gMock.fillHead];
+         gMock.fillHead = (gMock.fillHead + 1) % VENC_MAX_OUTPUT_BUFS;
+         gMock.fillCount--;
+
+         out.offset    = 0;
+         out.len       = in->len / 16 < out.sz ? in->len / 16 : out.sz;
+         out.timestamp = in->timestamp;
+         out.flags     = VEN_BUFFLAG_ENDOFFRAME;
+         if ((gMock.frames % 30) == 0) {
+            out.flags |= VEN_BUFFLAG_SYNCFRAME;
+         }
+         memset(out.ptrbuffer, 0, out.len);
+         if (out.len >= 4) {
+            out.ptrbuffer[3] = 1; /* Annex B start code */
+         }
+         CameraVenc_MockPost_l(VEN_MSG_OUTPUT_BUFFER_DONE, &out);
+      }
+      gMock.frames++;
+      break;
+   }
+   case VEN_IOCTL_CMD_READ_NEXT_MSG:
+      ret = CameraVenc_MockReadMsg_l(m);
+      break;
+   case VEN_IOCTL_CMD_STOP_READ_MSG:
+      gMock.stopRead = true;
+      pthread_cond_broadcast(&gMock.cond);
+      break;
+   case VEN_IOCTL_CMD_START:
+      gMock.started = true;
+      CameraVenc_MockPost_l(VEN_MSG_START, NULL);
+      break;
+   case VEN_IOCTL_CMD_STOP:
+      /* Outstanding output buffers are returned empty, as on flush. */
+      while (gMock.fillCount > 0) {
+         struct venc_buffer out = gMock.fills[gMock.fillHead];
+         gMock.fillHead = (gMock.fillHead + 1) % VENC_MAX_OUTPUT_BUFS;
+         gMock.fillCount--;
+         out.len = 0;
+         CameraVenc_MockPost_l(VEN_MSG_OUTPUT_BUFFER_DONE, &out);
+      }
+      gMock.started = false;
+      CameraVenc_MockPost_l(VEN_MSG_STOP, NULL);
+      break;
+   default:
+      /* Configuration and buffer registration are accepted as is. */
+      break;
+   }
+   pthread_mutex_unlock(&gMock.lock);
+   return ret;
+}
+
+static void
+CameraVenc_MockClose(int fd)
+{
+}
+
+static void *
+CameraVenc_MockAlloc(size_t size, int *fd)
+{
+   void *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   *fd = -1;
+   return base == MAP_FAILED ? NULL : base;
+}
+
+static void
+CameraVenc_MockFree(void *base, size_t size, int fd)
+{
+   munmap(base, size);
+}
+
+const venc_backend venc_mock_backend = {
+   "mock",
+   CameraVenc_MockOpen,
+   CameraVenc_MockIoctl,
+   CameraVenc_MockClose,
+   CameraVenc_MockAlloc,
+   CameraVenc_MockFree,
+};
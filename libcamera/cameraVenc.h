@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2012, The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CAMERA_VENC_H
+#define CAMERA_VENC_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * In-HAL video encoder session on top of the msm_vidc_enc driver.  Recording
+ * frames are handed to the encoder straight from the vendor pmem heaps and
+ * the encoded bitstream is returned through the deliver callback.
+ */
+
+/* Driver access, so the session can run against a mock without hardware. */
+struct venc_backend {
+   const char *name;
+   int   (*open)(void);
+   int   (*ioctl)(int fd, unsigned int request, void *arg);
+   void  (*close)(int fd);
+   /* Allocates a buffer the encoder can DMA into, returns its base. */
+   void *(*alloc)(size_t size, int *fd);
+   void  (*free)(void *base, size_t size, int fd);
+};
+
+extern const venc_backend venc_kernel_backend;
+extern const venc_backend venc_mock_backend;
+
+struct venc_callbacks {
+   /* Encoded data for one output buffer; data is only valid during the call. */
+   void (*deliver)(void *cookie, const uint8_t *data, size_t len,
+                   int64_t timestampNs, uint32_t flags);
+   /* The encoder no longer needs the input frame tagged with frameCookie. */
+   void (*release)(void *cookie, void *frameCookie);
+   void *cookie;
+};
+
+struct venc_config {
+   int      codec;          /* VEN_CODEC_* */
+   uint32_t width;
+   uint32_t height;
+   uint32_t fps;
+   uint32_t bitrate;        /* bits per second */
+};
+
+struct venc_stats {
+   uint32_t framesIn;
+   uint32_t framesOut;
+   uint32_t framesDropped;
+   uint64_t bytesOut;
+   int64_t  encodeNs;       /* sum of ENCODE_FRAME to INPUT_BUFFER_DONE */
+   int64_t  startNs;
+   int64_t  lastNs;
+};
+
+struct venc_session;
+
+venc_session *CameraVenc_Create(const venc_backend *backend,
+                                const venc_config *config,
+                                const venc_callbacks *callbacks);
+int  CameraVenc_EncodeFrame(venc_session *session, int heapFd, void *heapBase,
+                            size_t heapSize, size_t offset, size_t size,
+                            int64_t timestampNs, void *frameCookie);
+void CameraVenc_GetStats(venc_session *session, venc_stats *stats);
+void CameraVenc_Destroy(venc_session *session);
+
+#endif /* CAMERA_VENC_H */
@@ -0,0 +1,52 @@
+# Copyright 2012 The CyanogenMod Project
+
+LOCAL_PATH := $(call my-dir)
+
+# -------------------------------------------------------------
+# The preview path of the HAL driven with pmem frames instead of
+# the camera, and its cost per frame. Includes cameraHal.cpp for
+# its statics. Not part of camera.$(TARGET_BOARD_PLATFORM).
+# -------------------------------------------------------------
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    ../cameraVenc.cpp \
+    CameraHalBench.cpp
+
+LOCAL_SHARED_LIBRARIES := liblog libdl libutils libcamera_client libbinder libcutils libhardware libui
+
+LOCAL_MODULE := camera_hal_bench
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_C_INCLUDES += frameworks/base/services/ frameworks/base/include
+LOCAL_C_INCLUDES += hardware/libhardware/include/ hardware
+
+include $(BUILD_EXECUTABLE)
+
+# -------------------------------------------------------------
+# Encoder sessions against venc_mock_backend: buffer cycling,
+# release callbacks and venc_stats. Built for the device and the
+# host, the mock needs no driver.
+# -------------------------------------------------------------
+venc_test_src := \
+    ../cameraVenc.cpp \
+    VencTest.cpp
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := $(venc_test_src)
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. frameworks/base/include
+LOCAL_SHARED_LIBRARIES := liblog libutils libcutils
+LOCAL_MODULE := venc_test
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := $(venc_test_src)
+# the msm headers come from TARGET_SPECIFIC_HEADER_PATH on the device
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. $(LOCAL_PATH)/../../include frameworks/base/include
+LOCAL_STATIC_LIBRARIES := libutils libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt
+LOCAL_MODULE := venc_test
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2012, The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Feeds pmem NV21 frames through CameraHAL_DataCb the way a replay does,
+ * into a window of gralloc buffers, and reports what the preview path
+ * costs per frame: the display conversion and the client copy, full color
+ * against luma-only, on the tier the HAL picks and on the software tier.
+ * Before that, what resolving a frame to its heap costs through the
+ * descriptor cache against the getMemory() round trips it replaced.
+ *
+ *   camera_hal_bench [frames]
+ */
+
+#include "../cameraHal.cpp"
+
+#include <ui/GraphicBuffer.h>
+
+#define BENCH_PMEM_DEVICE  "/dev/pmem_adsp"
+#define BENCH_SRC_FRAMES   4    /* preview buffers the camera cycles */
+#define BENCH_WIN_BUFFERS  3
+#define BENCH_LOOKUPS      10000
+
+struct bench_size {
+   int32_t width;
+   int32_t height;
+};
+
+static const bench_size bench_sizes[] = {
+   { 640, 480 },
+   { 1280, 720 },
+};
+
+struct bench_window {
+   preview_stream_ops_t                 ops;   /* first, the HAL's handle */
+   android::sp<android::GraphicBuffer>  bufs[BENCH_WIN_BUFFERS];
+   buffer_handle_t                      handles[BENCH_WIN_BUFFERS];
+   int                                  usage;
+   int                                  width;
+   int                                  height;
+   int                                  format;
+   int                                  next;
+};
+
+static int bench_failures = 0;
+
+static int
+bench_set_usage(preview_stream_ops_t *w, int usage)
+{
+   ((bench_window *)w)->usage = usage;
+   return NO_ERROR;
+}
+
+static int
+bench_set_buffers_geometry(preview_stream_ops_t *w, int width, int height,
+                           int format)
+{
+   bench_window *win = (bench_window *)w;
+
+   if (win->width == width && win->height == height &&
+       win->format == format && win->bufs[0] != NULL) {
+      return NO_ERROR;
+   }
+   for (int i = 0; i < BENCH_WIN_BUFFERS; i++) {
+      win->bufs[i] = new android::GraphicBuffer(width, height, format,
+                                                win->usage);
+      if (win->bufs[i]->initCheck() != NO_ERROR) {
+         win->bufs[i].clear();
+         return android::NO_MEMORY;
+      }
+      win->handles[i] = win->bufs[i]->handle;
+   }
+   win->width  = width;
+   win->height = height;
+   win->format = format;
+   return NO_ERROR;
+}
+
+static int
+bench_dequeue_buffer(preview_stream_ops_t *w, buffer_handle_t **buffer,
+                     int *stride)
+{
+   bench_window *win = (bench_window *)w;
+   int i = win->next++ % BENCH_WIN_BUFFERS;
+
+   *buffer = &win->handles[i];
+   *stride = win->bufs[i]->getStride();
+   return NO_ERROR;
+}
+
+static int
+bench_buffer_op(preview_stream_ops_t *w, buffer_handle_t *buffer)
+{
+   return NO_ERROR;
+}
+
+static void
+bench_release_memory(camera_memory_t *mem)
+{
+   free(mem->data);
+   free(mem);
+}
+
+static camera_memory_t *
+bench_request_memory(int fd, size_t size, unsigned int count, void *user)
+{
+   camera_memory_t *mem = (camera_memory_t *)calloc(1, sizeof(*mem));
+
+   mem->data    = malloc(size * count);
+   mem->size    = size * count;
+   mem->release = bench_release_memory;
+   return mem;
+}
+
+static void
+bench_data_cb(int32_t msg_type, const camera_memory_t *data,
+              unsigned int index, camera_frame_metadata_t *metadata,
+              void *user)
+{
+   *(size_t *)user = data->size;
+}
+
+/* Preview frames as the camera hands them out: a ring in one heap. */
+static bool
+bench_frames(int32_t w, int32_t h,
+             android::sp<android::MemoryBase> frames[BENCH_SRC_FRAMES],
+             const char **heapName)
+{
+   size_t frameSize = w * h * 3 / 2;
+   android::sp<android::MemoryHeapBase> heap =
+      new android::MemoryHeapBase(BENCH_PMEM_DEVICE,
+                                  frameSize * BENCH_SRC_FRAMES);
+
+   *heapName = "pmem";
+   if (heap->getHeapID() < 0) {
+      /* The hardware tiers will fail, the software numbers still hold. */
+      heap = new android::MemoryHeapBase(frameSize * BENCH_SRC_FRAMES);
+      *heapName = "ashmem";
+   }
+   if (heap->getHeapID() < 0) {
+      return false;
+   }
+
+   /* A luma ramp over gently varying chroma, so no tier short-cuts. */
+   uint8_t *base = (uint8_t *)heap->getBase();
+   for (int f = 0; f < BENCH_SRC_FRAMES; f++) {
+      uint8_t *y  = base + f * frameSize;
+      uint8_t *uv = y + w * h;
+      for (int i = 0; i < w * h; i++) {
+         y[i] = 16 + (i + f) % 220;
+      }
+      for (int i = 0; i < w * h / 2; i++) {
+         uv[i] = 96 + (i >> 4) % 64;
+      }
+      frames[f] = new android::MemoryBase(heap, f * frameSize, frameSize);
+   }
+   return true;
+}
+
+/*
+ * CameraHAL_LookupFrame over the ring against what the callbacks did per
+ * frame before: getMemory(), then the heap's id, base and size.
+ */
+static void
+bench_lookup(const char *name,
+             android::sp<android::MemoryBase> frames[BENCH_SRC_FRAMES])
+{
+   volatile uintptr_t sink = 0;
+   frame_ref ref;
+
+   CameraHAL_ResetFrameDescs();
+   for (int f = 0; f < BENCH_SRC_FRAMES; f++) {
+      ssize_t offset;
+      size_t  size;
+      android::sp<android::IMemoryHeap> heap = frames[f]->getMemory(&offset,
+                                                                    &size);
+      if (!CameraHAL_LookupFrame(frames[f], &ref) ||
+          ref.desc.heapId != heap->getHeapID() ||
+          ref.desc.base != heap->getBase() || ref.offset != offset ||
+          ref.size != size) {
+         printf("FAIL: %s frame %d resolved to the wrong heap or range\n",
+                name, f);
+         bench_failures++;
+      }
+   }
+
+   nsecs_t start = systemTime();
+   for (int i = 0; i < BENCH_LOOKUPS; i++) {
+      ssize_t offset;
+      size_t  size;
+      android::sp<android::IMemoryHeap> heap =
+         frames[i % BENCH_SRC_FRAMES]->getMemory(&offset, &size);
+      sink += heap->getHeapID() + (uintptr_t)heap->getBase() +
+              heap->getSize() + offset + size;
+   }
+   nsecs_t memoryNs = systemTime() - start;
+
+   start = systemTime();
+   for (int i = 0; i < BENCH_LOOKUPS; i++) {
+      CameraHAL_LookupFrame(frames[i % BENCH_SRC_FRAMES], &ref);
+      sink += ref.desc.heapId + (uintptr_t)ref.desc.base +
+              ref.desc.heapSize + ref.offset + ref.size;
+   }
+   nsecs_t lookupNs = systemTime() - start;
+
+   printf("%-10s getMemory() %6lld ns/frame, LookupFrame %6lld ns/frame "
+          "(%d hits, %u misses)\n", name, memoryNs / BENCH_LOOKUPS,
+          lookupNs / BENCH_LOOKUPS, gFrameDescHits, gFrameDescMisses);
+   if (gFrameDescMisses != BENCH_SRC_FRAMES) {
+      printf("FAIL: %u misses for %d buffers\n", gFrameDescMisses,
+             BENCH_SRC_FRAMES);
+      bench_failures++;
+   }
+}
+
+static void
+bench_pass(const char *name, int32_t w, int32_t h, bool luma, int tier,
+           android::sp<android::MemoryBase> frames[BENCH_SRC_FRAMES],
+           int count)
+{
+   size_t clientBytes = 0;
+
+   gLumaOnly = luma;
+   CameraHAL_ResetConvTier();
+   if (tier >= 0) {
+      gConvTier = tier;
+   }
+
+   /*
+    * One frame to allocate the window and the gray frame.  A replay only
+    * falls back per frame, so settle on the tier it reached the way a
+    * camera session would.
+    */
+   CameraHAL_DataCb(CAMERA_MSG_PREVIEW_FRAME, frames[0], &clientBytes);
+   for (int t = 0; t < CONV_TIER_COUNT; t++) {
+      if (gConvTierFrames[t]) {
+         gConvTier = t;
+      }
+   }
+   memset(gConvTierFrames, 0, sizeof(gConvTierFrames));
+   gPreviewFrames    = 0;
+   gPreviewDisplayNs = 0;
+   gPreviewCopyNs    = 0;
+
+   for (int i = 0; i < count; i++) {
+      CameraHAL_DataCb(CAMERA_MSG_PREVIEW_FRAME, frames[i % BENCH_SRC_FRAMES],
+                       &clientBytes);
+   }
+
+   printf("%-10s %-11s %-8s %8lld us display %8lld us copy %7u bytes "
+          "(%s %u, %s %u, %s %u)\n", name, luma ? "luma-only" : "full color",
+          tier >= 0 ? conv_tier_names[tier] : "hal",
+          gPreviewFrames ? gPreviewDisplayNs / gPreviewFrames / 1000 : 0,
+          gPreviewFrames ? gPreviewCopyNs / gPreviewFrames / 1000 : 0,
+          clientBytes,
+          conv_tier_names[CONV_TIER_MDP_BLIT],
+          gConvTierFrames[CONV_TIER_MDP_BLIT],
+          conv_tier_names[CONV_TIER_COPYBIT],
+          gConvTierFrames[CONV_TIER_COPYBIT],
+          conv_tier_names[CONV_TIER_SOFTWARE],
+          gConvTierFrames[CONV_TIER_SOFTWARE]);
+
+   size_t expected = luma ? w * h : w * h * 3 / 2;
+   if (gPreviewFrames != (uint32_t)count || clientBytes != expected) {
+      printf("FAIL: %u frames displayed, %u client bytes, expected %u\n",
+             gPreviewFrames, clientBytes, expected);
+      bench_failures++;
+   }
+}
+
+int
+main(int argc, char **argv)
+{
+   int          count = argc > 1 ? atoi(argv[1]) : 100;
+   bench_window win;
+
+   memset(&win.ops, 0, sizeof(win.ops));
+   win.ops.set_usage            = bench_set_usage;
+   win.ops.set_buffers_geometry = bench_set_buffers_geometry;
+   win.ops.dequeue_buffer       = bench_dequeue_buffer;
+   win.ops.lock_buffer          = bench_buffer_op;
+   win.ops.enqueue_buffer       = bench_buffer_op;
+   win.ops.cancel_buffer        = bench_buffer_op;
+   win.usage  = 0;
+   win.width  = 0;
+   win.height = 0;
+   win.format = 0;
+   win.next   = 0;
+
+   /* The frames arrive like a replay's, there is no qCamera behind them. */
+   mWindow          = &win.ops;
+   origData_cb      = bench_data_cb;
+   origCamReqMemory = bench_request_memory;
+   gReplayActive    = true;
+
+   for (size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+      int32_t w = bench_sizes[s].width, h = bench_sizes[s].height;
+      android::sp<android::MemoryBase> frames[BENCH_SRC_FRAMES];
+      const char *heapName;
+      char name[32];
+
+      if (!bench_frames(w, h, frames, &heapName)) {
+         printf("FAIL: no heap for %dx%d frames\n", w, h);
+         bench_failures++;
+         continue;
+      }
+      gReplayWidth  = w;
+      gReplayHeight = h;
+      snprintf(name, sizeof(name), "%dx%d", w, h);
+      printf("%s frames from %s\n", name, heapName);
+
+      bench_lookup(name, frames);
+      bench_pass(name, w, h, false, -1, frames, count);
+      bench_pass(name, w, h, true, -1, frames, count);
+      bench_pass(name, w, h, false, CONV_TIER_SOFTWARE, frames, count);
+      bench_pass(name, w, h, true, CONV_TIER_SOFTWARE, frames, count);
+      CameraHAL_ResetFrameDescs();
+   }
+
+   gReplayActive = false;
+   mWindow       = NULL;
+   CameraHAL_LumaStageFree();
+   if (gCopybit != NULL) {
+      copybit_close(gCopybit);
+      gCopybit = NULL;
+   }
+
+   printf("%s\n", bench_failures ? "FAILED" : "PASSED");
+   return bench_failures ? 1 : 0;
+}
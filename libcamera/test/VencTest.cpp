@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2012, The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs encoder sessions against venc_mock_backend: create, a recording
+ * heap cycled frame by frame the way the camera returns its buffers,
+ * frames the session must drop, and destroy with frames still queued.
+ * Checks that every frame is released exactly once, what is delivered,
+ * and the venc_stats counts.
+ *
+ *   venc_test [frames]
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/msm_vidc_enc.h>
+
+#include "cameraVenc.h"
+
+#define TEST_WIDTH       320
+#define TEST_HEIGHT      240
+#define TEST_HEAP_FRAMES 8      /* recording buffers, page aligned */
+#define TEST_HEAP_FD     42     /* the mock never looks at it */
+#define TEST_TIMEOUT_MS  2000
+
+/* Frame cookies are never NULL in the HAL; buffer f is f + 1. */
+#define TEST_COOKIE(f)   ((void *)(intptr_t)((f) + 1))
+
+struct test_state {
+   pthread_mutex_t lock;
+   pthread_cond_t  cond;
+   int             released[TEST_HEAP_FRAMES + 1];
+   int             releases;
+   int             deliveries;
+   int             syncFrames;
+   uint64_t        bytes;
+   int64_t         lastTimestampNs;
+   bool            badPayload;
+   bool            badTimestamp;
+};
+
+static int test_failures = 0;
+
+static void
+test_check(bool ok, const char *what, double value)
+{
+   printf("  %-40s %10.0f  %s\n", what, value, ok ? "ok" : "FAIL");
+   if (!ok) {
+      test_failures++;
+   }
+}
+
+static void
+test_release(void *cookie, void *frameCookie)
+{
+   test_state *t = (test_state *)cookie;
+
+   pthread_mutex_lock(&t->lock);
+   t->released[(intptr_t)frameCookie - 1]++;
+   t->releases++;
+   pthread_cond_broadcast(&t->cond);
+   pthread_mutex_unlock(&t->lock);
+}
+
+static void
+test_deliver(void *cookie, const uint8_t *data, size_t len,
+             int64_t timestampNs, uint32_t flags)
+{
+   test_state *t = (test_state *)cookie;
+
+   pthread_mutex_lock(&t->lock);
+   if (len < 4 || data[0] || data[1] || data[2] || data[3] != 1 ||
+       !(flags & VEN_BUFFLAG_ENDOFFRAME)) {
+      t->badPayload = true;
+   }
+   if (timestampNs <= t->lastTimestampNs) {
+      t->badTimestamp = true;
+   }
+   t->lastTimestampNs = timestampNs;
+   if (flags & VEN_BUFFLAG_SYNCFRAME) {
+      t->syncFrames++;
+   }
+   t->deliveries++;
+   t->bytes += len;
+   pthread_cond_broadcast(&t->cond);
+   pthread_mutex_unlock(&t->lock);
+}
+
+/* Waits until the encoder returned releases frames, false on timeout. */
+static bool
+test_wait_releases(test_state *t, int releases)
+{
+   struct timespec ts;
+   bool ok = true;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   ts.tv_sec += TEST_TIMEOUT_MS / 1000;
+   pthread_mutex_lock(&t->lock);
+   while (t->releases < releases && ok) {
+      ok = pthread_cond_timedwait(&t->cond, &t->lock, &ts) != ETIMEDOUT;
+   }
+   pthread_mutex_unlock(&t->lock);
+   return ok;
+}
+
+/* The output side trails the release, poll the session until it is in. */
+static void
+test_wait_stats(venc_session *s, venc_stats *vs, uint32_t framesOut)
+{
+   for (int i = 0; i < TEST_TIMEOUT_MS; i++) {
+      CameraVenc_GetStats(s, vs);
+      if (vs->framesOut >= framesOut) {
+         return;
+      }
+      usleep(1000);
+   }
+}
+
+static void
+test_init(test_state *t)
+{
+   memset(t, 0, sizeof(*t));
+   pthread_mutex_init(&t->lock, NULL);
+   pthread_cond_init(&t->cond, NULL);
+   t->lastTimestampNs = -1;
+}
+
+static void
+test_session(int frames)
+{
+   venc_config    config = { VEN_CODEC_H264, TEST_WIDTH, TEST_HEIGHT, 30,
+                             384000 };
+   venc_callbacks cb;
+   test_state     t;
+   venc_stats     vs;
+
+   size_t frameSize = TEST_WIDTH * TEST_HEIGHT * 3 / 2;
+   size_t stride    = (frameSize + 4095) & ~4095;
+   size_t heapSize  = stride * TEST_HEAP_FRAMES;
+   uint8_t *heap = (uint8_t *)mmap(NULL, heapSize, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+   printf("session, %d frames of %ux%u from %d buffers\n", frames,
+          TEST_WIDTH, TEST_HEIGHT, TEST_HEAP_FRAMES);
+   test_init(&t);
+   cb.deliver = test_deliver;
+   cb.release = test_release;
+   cb.cookie  = &t;
+
+   venc_session *s = CameraVenc_Create(&venc_mock_backend, &config, &cb);
+   test_check(s != NULL, "CameraVenc_Create", 0);
+   if (s == NULL) {
+      munmap(heap, heapSize);
+      return;
+   }
+
+   /* Each buffer goes back to the camera before it is filled again. */
+   int encoded = 0;
+   for (int i = 0; i < frames; i++) {
+      int f = i % TEST_HEAP_FRAMES;
+      if (CameraVenc_EncodeFrame(s, TEST_HEAP_FD, heap, heapSize,
+                                 f * stride, frameSize,
+                                 (int64_t)(i + 1) * 33333333,
+                                 TEST_COOKIE(f)) == 0) {
+         encoded++;
+      }
+      if (!test_wait_releases(&t, encoded)) {
+         break;
+      }
+   }
+   test_check(encoded == frames, "frames accepted", encoded);
+
+   /* Not in the registered heap, and not at a frame start: dropped. */
+   int rc1 = CameraVenc_EncodeFrame(s, TEST_HEAP_FD + 1, heap, heapSize, 0,
+                                    frameSize, (int64_t)(frames + 1) * 33333333,
+                                    TEST_COOKIE(TEST_HEAP_FRAMES));
+   int rc2 = CameraVenc_EncodeFrame(s, TEST_HEAP_FD, heap, heapSize, 64,
+                                    frameSize, (int64_t)(frames + 2) * 33333333,
+                                    TEST_COOKIE(TEST_HEAP_FRAMES));
+   test_check(rc1 < 0 && rc2 < 0, "foreign frames refused", 2);
+
+   test_wait_stats(s, &vs, encoded);
+   test_check(vs.framesIn == (uint32_t)encoded, "venc_stats framesIn",
+              vs.framesIn);
+   test_check(vs.framesOut == (uint32_t)encoded, "venc_stats framesOut",
+              vs.framesOut);
+   test_check(vs.framesDropped == 2, "venc_stats framesDropped",
+              vs.framesDropped);
+   test_check(vs.bytesOut == encoded * (frameSize / 16),
+              "venc_stats bytesOut", (double)vs.bytesOut);
+   test_check(vs.startNs > 0 && vs.lastNs >= vs.startNs,
+              "venc_stats start and last", 0);
+
+   pthread_mutex_lock(&t.lock);
+   test_check(t.deliveries == encoded, "frames delivered", t.deliveries);
+   test_check(t.bytes == vs.bytesOut, "bytes delivered", (double)t.bytes);
+   test_check(t.syncFrames == (encoded + 29) / 30, "sync frames",
+              t.syncFrames);
+   test_check(!t.badPayload, "start code and end of frame", 0);
+   test_check(!t.badTimestamp, "timestamps increase", 0);
+   pthread_mutex_unlock(&t.lock);
+
+   /* Queue the whole heap and tear down before the encoder returns it. */
+   for (int f = 0; f < TEST_HEAP_FRAMES; f++) {
+      CameraVenc_EncodeFrame(s, TEST_HEAP_FD, heap, heapSize, f * stride,
+                             frameSize, (int64_t)(frames + 3 + f) * 33333333,
+                             TEST_COOKIE(f));
+   }
+   CameraVenc_Destroy(s);
+
+   /* Every buffer once per encode, the dropped ones never. */
+   int wrong = 0;
+   for (int f = 0; f < TEST_HEAP_FRAMES; f++) {
+      int expected = encoded / TEST_HEAP_FRAMES +
+                     (f < encoded % TEST_HEAP_FRAMES ? 1 : 0) + 1;
+      if (t.released[f] != expected) {
+         wrong++;
+      }
+   }
+   test_check(wrong == 0, "buffers released once per encode", wrong);
+   test_check(t.released[TEST_HEAP_FRAMES] == 0, "dropped frames not released",
+              t.released[TEST_HEAP_FRAMES]);
+
+   pthread_mutex_destroy(&t.lock);
+   pthread_cond_destroy(&t.cond);
+   munmap(heap, heapSize);
+}
+
+/* A session that never saw a frame, then a second one on the same mock. */
+static void
+test_idle_sessions(void)
+{
+   venc_config    config = { VEN_CODEC_MPEG4, TEST_WIDTH, TEST_HEIGHT, 15,
+                             192000 };
+   venc_callbacks cb;
+   test_state     t;
+   venc_stats     vs;
+
+   printf("idle sessions\n");
+   test_init(&t);
+   cb.deliver = test_deliver;
+   cb.release = test_release;
+   cb.cookie  = &t;
+
+   for (int i = 0; i < 2; i++) {
+      venc_session *s = CameraVenc_Create(&venc_mock_backend, &config, &cb);
+      test_check(s != NULL, "CameraVenc_Create", i);
+      if (s == NULL) {
+         continue;
+      }
+      CameraVenc_GetStats(s, &vs);
+      test_check(vs.framesIn == 0 && vs.framesOut == 0 &&
+                 vs.framesDropped == 0 && vs.startNs == 0,
+                 "venc_stats before the first frame", i);
+      CameraVenc_Destroy(s);
+   }
+   test_check(t.releases == 0 && t.deliveries == 0,
+              "no callbacks without frames", t.releases + t.deliveries);
+
+   pthread_mutex_destroy(&t.lock);
+   pthread_cond_destroy(&t.cond);
+}
+
+int
+main(int argc, char **argv)
+{
+   int frames = argc > 1 ? atoi(argv[1]) : 100;
+
+   test_session(frames);
+   test_idle_sessions();
+
+   printf("%s\n", test_failures ? "FAILED" : "PASSED");
+   return test_failures ? 1 : 0;
+}